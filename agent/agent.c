@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/futex.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent_shm.h"
+#include "match.h"
+#include "match_kernel.h"
+
+/**
+ * @file agent.c
+ *
+ * In-process search agent.
+ *
+ * This library is loaded into the target with a remote dlopen() (see
+ * src/agent.c).  Its constructor creates the shared memory described
+ * in agent_shm.h and starts one thread which waits for requests and
+ * runs the match kernels directly on the process's own memory, so a
+ * search costs a memory scan instead of a read through the kernel
+ * for every byte.
+ *
+ * Before a region is scanned it is checked against /proc/self/maps
+ * at the time of the request: only readable mappings are touched,
+ * file mappings are clipped to the end of the file (reading past it
+ * raises SIGBUS) and [vvar], [vsyscall] and the agent's own memory
+ * are skipped.  A mapping removed by another thread in the middle of
+ * a scan can still fault; the agent makes no attempt to catch that.
+ *
+ * The agent thread keeps running while the tracer has the rest of the
+ * process stopped, so it avoids anything that takes a libc lock
+ * (malloc, stdio) once it is started.
+ */
+
+#define AGENT_PUBLISH_EVERY  (1024)
+#define AGENT_MAX_MAPS       (16384)
+
+struct map_range {
+    unsigned long start;
+    unsigned long end;
+};
+
+/* Only the agent thread touches these. */
+static struct map_range agent_maps[AGENT_MAX_MAPS];
+static size_t agent_nmaps;
+static char agent_maps_buf[8192];
+
+static struct agent_shm *agent_shm;
+
+
+static inline long
+futex(uint32_t *uaddr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static inline void
+event_signal(uint32_t *word)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    (void)futex(word, FUTEX_WAKE, INT32_MAX);
+}
+
+
+/* Parse one line of /proc/self/maps into agent_maps. */
+static void
+maps_add_line(char *line)
+{
+    int pathpos = 0;
+    char perms[8];
+    unsigned long start;
+    unsigned long end;
+    unsigned long offset;
+    unsigned long inode;
+    const char *path;
+    const unsigned long psize = (unsigned long)sysconf(_SC_PAGESIZE);
+
+    if (agent_nmaps == AGENT_MAX_MAPS)
+        return;
+
+    if (sscanf(line, "%lx-%lx %7s %lx %*s %lu %n",
+                &start, &end, perms, &offset, &inode, &pathpos) < 5)
+        return;
+
+    if (perms[0] != 'r')
+        return;
+
+    path = line + pathpos;
+
+    if (strncmp(path, "[vvar]", 6) == 0
+            || strncmp(path, "[vsyscall]", 10) == 0
+            || strstr(path, AGENT_MEMFD_NAME) != NULL)
+        return;
+
+    /* File mapping; do not read past the end of the file. */
+    if (inode != 0 && path[0] == '/') {
+        struct stat st;
+
+        if (stat(path, &st) != 0)
+            return;
+
+        if ((unsigned long)st.st_size <= offset)
+            return;
+
+        if ((unsigned long)st.st_size - offset < end - start) {
+            end = start + (((unsigned long)st.st_size - offset
+                            + psize - 1) & ~(psize - 1));
+        }
+    }
+
+    agent_maps[agent_nmaps].start = start;
+    agent_maps[agent_nmaps].end = end;
+    agent_nmaps++;
+}
+
+/* Collect the ranges which are safe to read right now.
+ *
+ * Plain read(2) and no stdio: another thread of the process may be
+ * stopped by the tracer while holding the malloc or stdio locks. */
+static int
+maps_load(void)
+{
+    int fd;
+    size_t used = 0;
+
+    agent_nmaps = 0;
+
+    fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    for (;;) {
+        char *line;
+        char *nl;
+        ssize_t n;
+
+        n = read(fd, agent_maps_buf + used,
+                sizeof(agent_maps_buf) - used - 1);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            break;
+
+        used += (size_t)n;
+        agent_maps_buf[used] = '\0';
+
+        line = agent_maps_buf;
+
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            maps_add_line(line);
+            line = nl + 1;
+        }
+
+        used -= (size_t)(line - agent_maps_buf);
+        memmove(agent_maps_buf, line, used);
+
+        /* A line longer than the buffer; drop it. */
+        if (used == sizeof(agent_maps_buf) - 1)
+            used = 0;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+
+/* Wait for the daemon to make room in the ring. */
+static void
+ring_wait_space(struct agent_shm *shm, uint64_t head)
+{
+    for (;;) {
+        uint32_t ev = __atomic_load_n(&(shm->daemon_event), __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&(shm->tail), __ATOMIC_ACQUIRE);
+
+        if (head - tail < AGENT_RING_SIZE)
+            return;
+
+        /* Let the daemon know there is something to drain. */
+        __atomic_store_n(&(shm->head), head, __ATOMIC_RELEASE);
+        event_signal(&(shm->agent_event));
+
+        (void)futex(&(shm->daemon_event), FUTEX_WAIT, ev);
+    }
+}
+
+static void
+scan_range(struct agent_shm *shm, const struct agent_request *req,
+    search_match_fn match, unsigned long start, unsigned long end,
+    uint64_t *phead)
+{
+    unsigned long addr;
+    uint64_t head = *phead;
+    const unsigned long step = req->aligned ? sizeof(unsigned long) : 1;
+
+    for (addr = start; addr < end; addr += step) {
+        struct match_object obj;
+        size_t len = end - addr;
+
+        if (len > sizeof(obj.v.bytes))
+            len = sizeof(obj.v.bytes);
+
+        memset(&obj, 0, sizeof(obj));
+        memcpy(obj.v.bytes, (const void *)addr, len);
+        match_kernel_set_flags(&obj, len);
+        obj.addr = addr;
+
+        if (!match(&obj, &(req->needle_1), &(req->needle_2)))
+            continue;
+
+        if (head - __atomic_load_n(&(shm->tail), __ATOMIC_ACQUIRE)
+                >= AGENT_RING_SIZE)
+            ring_wait_space(shm, head);
+
+        shm->ring[ head & (AGENT_RING_SIZE - 1) ] = obj;
+        head++;
+
+        if ((head % AGENT_PUBLISH_EVERY) == 0) {
+            __atomic_store_n(&(shm->head), head, __ATOMIC_RELEASE);
+            event_signal(&(shm->agent_event));
+        }
+    }
+
+    shm->scanned += end - start;
+    *phead = head;
+}
+
+static int
+handle_search(struct agent_shm *shm)
+{
+    size_t i;
+    size_t j;
+    uint64_t head;
+    search_match_fn match;
+    const struct agent_request *req = &(shm->req);
+
+    match = match_kernel_get((enum match_kernel_id)req->kernel);
+
+    if (match == NULL || req->nregions > AGENT_MAX_REGIONS)
+        return EINVAL;
+
+    if (maps_load() != 0)
+        return errno;
+
+    head = __atomic_load_n(&(shm->head), __ATOMIC_RELAXED);
+
+    for (i = 0; i < req->nregions; ++i) {
+        unsigned long start = (unsigned long)req->regions[i].start;
+        unsigned long end = (unsigned long)req->regions[i].end;
+
+        /* Scan only the readable parts of the region. */
+        for (j = 0; j < agent_nmaps; ++j) {
+            unsigned long s = agent_maps[j].start;
+            unsigned long e = agent_maps[j].end;
+
+            if (s < start)
+                s = start;
+
+            if (e > end)
+                e = end;
+
+            if (s < e)
+                scan_range(shm, req, match, s, e, &head);
+        }
+    }
+
+    __atomic_store_n(&(shm->head), head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void *
+agent_thread(void *arg)
+{
+    uint32_t seen = 0;
+    struct agent_shm *shm = arg;
+
+    for (;;) {
+        int err;
+        uint32_t seq;
+
+        seq = __atomic_load_n(&(shm->req_seq), __ATOMIC_ACQUIRE);
+
+        if (seq == seen) {
+            (void)futex(&(shm->req_seq), FUTEX_WAIT, seq);
+            continue;
+        }
+
+        seen = seq;
+        shm->scanned = 0;
+
+        switch (shm->req.op) {
+        case AGENT_OP_SEARCH:
+            err = handle_search(shm);
+            break;
+
+        default:
+            err = EINVAL;
+            break;
+        }
+
+        shm->error = err;
+        __atomic_store_n(&(shm->done_seq), seq, __ATOMIC_RELEASE);
+        event_signal(&(shm->agent_event));
+    }
+
+    return NULL;
+}
+
+
+__attribute__((constructor))
+static void
+agent_init(void)
+{
+    int fd;
+    size_t size;
+    pthread_t tid;
+    sigset_t all;
+    sigset_t old;
+    pthread_attr_t attr;
+    struct agent_shm *shm;
+    const size_t psize = (size_t)sysconf(_SC_PAGESIZE);
+
+    size = (sizeof(*shm) + psize - 1) & ~(psize - 1);
+
+    fd = memfd_create(AGENT_MEMFD_NAME, MFD_CLOEXEC);
+
+    if (fd < 0)
+        return;
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return;
+    }
+
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    /* The fd stays open; the daemon finds the agent through it. */
+    if (shm == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    shm->size = size;
+    shm->version = AGENT_VERSION;
+
+    /* The agent thread must never take the process's signals. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&tid, &attr, agent_thread, shm) == 0) {
+        agent_shm = shm;
+        __atomic_store_n(&(shm->magic), AGENT_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
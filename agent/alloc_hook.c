@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc_shm.h"
+
+/**
+ * @file alloc_hook.c
+ *
+ * Allocation tracking hook library.
+ *
+ * Loaded into the target with a remote dlopen() (see alloc_index.c).
+ * The constructor creates the shared memory described in alloc_shm.h
+ * and then rewrites the GOT entries for malloc, calloc, realloc and
+ * free in every loaded object, except libc, the dynamic loader and
+ * this library, to point at the hooks below.
+ *
+ * A hook calls the real function and writes one event into the ring
+ * of the calling thread: a few stores and two atomics, no system call
+ * and no lock, so tracking costs the process very little.
+ *
+ * @note
+ *  Objects loaded after the hook library are not patched, and calls
+ *  made inside libc itself (e.g. by strdup or fopen) are not seen.
+ *  The hooks are never removed.
+ */
+
+#if defined(__x86_64__)
+typedef ElfW(Rela) reloc_t;
+#define DT_RELOC         DT_RELA
+#define DT_RELOCSZ       DT_RELASZ
+#define RELOC_SYM(i)     ELF64_R_SYM(i)
+#define RELOC_TYPE(i)    ELF64_R_TYPE(i)
+#define RELOC_JUMP_SLOT  R_X86_64_JUMP_SLOT
+#define RELOC_GLOB_DAT   R_X86_64_GLOB_DAT
+#elif defined(__i386__)
+typedef ElfW(Rel) reloc_t;
+#define DT_RELOC         DT_REL
+#define DT_RELOCSZ       DT_RELSZ
+#define RELOC_SYM(i)     ELF32_R_SYM(i)
+#define RELOC_TYPE(i)    ELF32_R_TYPE(i)
+#define RELOC_JUMP_SLOT  R_386_JMP_SLOT
+#define RELOC_GLOB_DAT   R_386_GLOB_DAT
+#endif
+
+/* Thread has not looked for a ring yet / found none. */
+#define RING_UNCLAIMED  (-1)
+#define RING_NONE       (-2)
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static struct alloc_shm *alloc_shm;
+static pthread_key_t ring_key;
+
+/* initial-exec: a dynamic TLS access could itself call malloc. */
+static __thread int ring_idx __attribute__((tls_model("initial-exec")))
+    = RING_UNCLAIMED;
+
+
+static void
+ring_release(void *arg)
+{
+    int idx = (int)((uintptr_t)arg - 1);
+
+    /* Frees from later destructors claim a ring again. */
+    ring_idx = RING_UNCLAIMED;
+    __atomic_store_n(&(alloc_shm->rings[idx].owner), 0, __ATOMIC_RELEASE);
+}
+
+static int
+ring_claim(struct alloc_shm *shm)
+{
+    int i;
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+
+    for (i = 0; i < ALLOC_MAX_THREADS; ++i) {
+        uint32_t expected = 0;
+
+        if (__atomic_compare_exchange_n(&(shm->rings[i].owner),
+                    &expected, tid, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            ring_idx = i;
+            (void)pthread_setspecific(ring_key, (void *)(uintptr_t)(i + 1));
+            return i;
+        }
+    }
+
+    ring_idx = RING_NONE;
+
+    return -1;
+}
+
+static inline void
+record(enum alloc_op op, void *site, size_t size, void *ptr)
+{
+    int idx;
+    uint64_t head;
+    struct alloc_ring *ring;
+    struct alloc_event *ev;
+    struct alloc_shm *shm = alloc_shm;
+
+    idx = ring_idx;
+
+    if (idx == RING_UNCLAIMED)
+        idx = ring_claim(shm);
+
+    if (idx < 0) {
+        __atomic_add_fetch(&(shm->unringed), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring = &(shm->rings[idx]);
+    head = ring->head;
+
+    if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE)
+            >= ALLOC_RING_SIZE) {
+        __atomic_store_n(&(ring->dropped), ring->dropped + 1,
+            __ATOMIC_RELAXED);
+        return;
+    }
+
+    ev = &(ring->events[ head & (ALLOC_RING_SIZE - 1) ]);
+    ev->seq = __atomic_fetch_add(&(shm->seq), 1, __ATOMIC_RELAXED);
+    ev->site = (uint64_t)(uintptr_t)site;
+    ev->size = size;
+    ev->ptr = (uint64_t)(uintptr_t)ptr;
+    ev->op = op;
+    ev->tid = __atomic_load_n(&(ring->owner), __ATOMIC_RELAXED);
+
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void *
+hook_malloc(size_t size)
+{
+    void *ptr = real_malloc(size);
+
+    if (ptr != NULL)
+        record(ALLOC_OP_MALLOC, __builtin_return_address(0), size, ptr);
+
+    return ptr;
+}
+
+static void *
+hook_calloc(size_t nmemb, size_t size)
+{
+    void *ptr = real_calloc(nmemb, size);
+
+    if (ptr != NULL) {
+        record(ALLOC_OP_CALLOC, __builtin_return_address(0),
+            nmemb * size, ptr);
+    }
+
+    return ptr;
+}
+
+static void *
+hook_realloc(void *old, size_t size)
+{
+    void *ptr;
+    void *site = __builtin_return_address(0);
+
+    /* Before the old block can be handed out again. */
+    if (old != NULL)
+        record(ALLOC_OP_FREE, site, 0, old);
+
+    ptr = real_realloc(old, size);
+
+    if (ptr != NULL)
+        record(ALLOC_OP_REALLOC, site, size, ptr);
+
+    return ptr;
+}
+
+static void
+hook_free(void *ptr)
+{
+    if (ptr != NULL)
+        record(ALLOC_OP_FREE, __builtin_return_address(0), 0, ptr);
+
+    real_free(ptr);
+}
+
+
+struct hook {
+    const char *name;
+    void *func;
+};
+
+static const struct hook hooks[] = {
+    { "malloc",  (void *)hook_malloc  },
+    { "calloc",  (void *)hook_calloc  },
+    { "realloc", (void *)hook_realloc },
+    { "free",    (void *)hook_free    }
+};
+
+static void
+patch_slot(void **slot, void *func, uintptr_t relro_start, uintptr_t relro_end)
+{
+    const uintptr_t psize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t page = (uintptr_t)slot & ~(psize - 1);
+
+    if ((uintptr_t)slot >= relro_start && (uintptr_t)slot < relro_end) {
+        if (mprotect((void *)page, psize, PROT_READ | PROT_WRITE) != 0)
+            return;
+
+        *slot = func;
+        (void)mprotect((void *)page, psize, PROT_READ);
+        return;
+    }
+
+    *slot = func;
+}
+
+static void
+patch_relocs(ElfW(Addr) base, const reloc_t *rel, size_t relsz,
+    const ElfW(Sym) *symtab, const char *strtab,
+    uintptr_t relro_start, uintptr_t relro_end)
+{
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < relsz / sizeof(*rel); ++i) {
+        const char *name;
+        unsigned long type = RELOC_TYPE(rel[i].r_info);
+
+        if (type != RELOC_JUMP_SLOT && type != RELOC_GLOB_DAT)
+            continue;
+
+        name = strtab + symtab[ RELOC_SYM(rel[i].r_info) ].st_name;
+
+        for (j = 0; j < sizeof(hooks) / sizeof(hooks[0]); ++j) {
+            if (strcmp(name, hooks[j].name) != 0)
+                continue;
+
+            patch_slot((void **)(base + rel[i].r_offset), hooks[j].func,
+                relro_start, relro_end);
+            break;
+        }
+    }
+}
+
+static int
+patch_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+    int i;
+    ElfW(Addr) base = info->dlpi_addr;
+    const ElfW(Dyn) *dyn = NULL;
+    const ElfW(Sym) *symtab = NULL;
+    const char *strtab = NULL;
+    const reloc_t *jmprel = NULL;
+    const reloc_t *rel = NULL;
+    size_t jmprelsz = 0;
+    size_t relsz = 0;
+    uintptr_t relro_start = 0;
+    uintptr_t relro_end = 0;
+    const char *name = info->dlpi_name;
+
+    (void)size;
+
+    if (base == (ElfW(Addr))data
+            || strstr(name, "linux-vdso") != NULL
+            || strstr(name, "linux-gate") != NULL
+            || strstr(name, "/ld-linux") != NULL
+            || strstr(name, "/libc.so") != NULL)
+        return 0;
+
+    for (i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &(info->dlpi_phdr[i]);
+
+        if (phdr->p_type == PT_DYNAMIC)
+            dyn = (const ElfW(Dyn) *)(base + phdr->p_vaddr);
+
+        if (phdr->p_type == PT_GNU_RELRO) {
+            relro_start = base + phdr->p_vaddr;
+            relro_end = relro_start + phdr->p_memsz;
+        }
+    }
+
+    if (dyn == NULL)
+        return 0;
+
+    /* The loader has already relocated these in most objects. */
+#define DYN_PTR(d) \
+    ((d)->d_un.d_ptr < base ? base + (d)->d_un.d_ptr : (d)->d_un.d_ptr)
+
+    for (; dyn->d_tag != DT_NULL; ++dyn) {
+        switch (dyn->d_tag) {
+        case DT_SYMTAB:
+            symtab = (const ElfW(Sym) *)DYN_PTR(dyn);
+            break;
+
+        case DT_STRTAB:
+            strtab = (const char *)DYN_PTR(dyn);
+            break;
+
+        case DT_JMPREL:
+            jmprel = (const reloc_t *)DYN_PTR(dyn);
+            break;
+
+        case DT_PLTRELSZ:
+            jmprelsz = dyn->d_un.d_val;
+            break;
+
+        case DT_RELOC:
+            rel = (const reloc_t *)DYN_PTR(dyn);
+            break;
+
+        case DT_RELOCSZ:
+            relsz = dyn->d_un.d_val;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+#undef DYN_PTR
+
+    if (symtab == NULL || strtab == NULL)
+        return 0;
+
+    if (jmprel != NULL) {
+        patch_relocs(base, jmprel, jmprelsz, symtab, strtab,
+            relro_start, relro_end);
+    }
+
+    if (rel != NULL) {
+        patch_relocs(base, rel, relsz, symtab, strtab,
+            relro_start, relro_end);
+    }
+
+    return 0;
+}
+
+
+__attribute__((constructor))
+static void
+alloc_hook_init(void)
+{
+    int fd;
+    size_t size;
+    Dl_info self;
+    struct alloc_shm *shm;
+    const size_t psize = (size_t)sysconf(_SC_PAGESIZE);
+
+    real_malloc = (void *(*)(size_t))dlsym(RTLD_DEFAULT, "malloc");
+    real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_DEFAULT, "calloc");
+    real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_DEFAULT, "realloc");
+    real_free = (void (*)(void *))dlsym(RTLD_DEFAULT, "free");
+
+    if (real_malloc == NULL || real_calloc == NULL
+            || real_realloc == NULL || real_free == NULL)
+        return;
+
+    if (dladdr((void *)alloc_hook_init, &self) == 0)
+        return;
+
+    if (pthread_key_create(&ring_key, ring_release) != 0)
+        return;
+
+    size = (sizeof(*shm) + psize - 1) & ~(psize - 1);
+
+    fd = memfd_create(ALLOC_MEMFD_NAME, MFD_CLOEXEC);
+
+    if (fd < 0)
+        return;
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return;
+    }
+
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    /* The fd stays open; the daemon finds the rings through it. */
+    if (shm == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    shm->size = size;
+    shm->version = ALLOC_VERSION;
+    alloc_shm = shm;
+
+    __atomic_store_n(&(shm->magic), ALLOC_MAGIC, __ATOMIC_RELEASE);
+
+    (void)dl_iterate_phdr(patch_object, self.dli_fbase);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
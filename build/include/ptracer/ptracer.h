@@ -0,0 +1,645 @@
+#ifndef H_LIB_PTRACER
+#define H_LIB_PTRACER
+
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stddef.h>
+
+#include "shared/list.h"
+
+struct ptracer_ctx;
+/* Used when stopped at a breakpoint */
+typedef void (*ptracer_breakpoint_callback)(struct ptracer_ctx *);
+
+/* Compiled breakpoint condition (see cond.c). */
+#define PTRACER_COND_STACK  (16)
+
+struct ptracer_cond_insn {
+    unsigned char op;
+    unsigned char size;
+    unsigned long value;
+};
+
+struct ptracer_cond {
+    size_t count;
+    struct ptracer_cond_insn insns[];
+};
+
+struct ptracer_sample_set;
+
+/* Node for the breakpoint list and table.
+ * Describes where the breakpoint was set,
+ * what the original byte was before being overwritten,
+ * and what function to call when trapped.
+ *
+ * Every trap is filtered inside the tracer before the callback:
+ *   1 - cond (if set) must evaluate true,
+ *   2 - only every sample_every'th passing hit is dispatched,
+ *   3 - once max_hits hits have been dispatched the breakpoint
+ *       is removed from the process.
+ */
+struct ptracer_breakpoint {
+    struct list_head node;
+    struct list_head hnode;
+    ptracer_breakpoint_callback callback;
+
+    unsigned long addr;
+    unsigned char orig_byte;
+    unsigned char enabled;
+
+    struct ptracer_cond *cond;
+    unsigned long sample_every;
+    unsigned long max_hits;
+
+    /* Read at every dispatched hit, before the callback. */
+    struct ptracer_sample_set *sample;
+
+    unsigned long hits;       /* every trap */
+    unsigned long passed;     /* traps where cond held */
+    unsigned long dispatched; /* traps where the callback ran */
+};
+
+/* Breakpoint lookup table, hashed by address.
+ * Buckets are chained through ptracer_breakpoint.hnode. */
+struct ptracer_breakpoint_table {
+    struct list_head *buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+/* Initial number of table buckets.  Must be a power of two. */
+#define PTRACER_BREAKPOINT_BUCKETS  (64)
+
+/* Hardware watchpoints.
+ *
+ * x86 provides four debug address registers (DR0-DR3) which are
+ * enabled and configured through DR7.  A watchpoint traps *after*
+ * the accessing instruction has executed, so the reported instruction
+ * pointer is the instruction following the access.
+ */
+#define PTRACER_WATCHPOINT_MAX  (4)
+
+/* Number of distinct instruction pointers remembered per watchpoint
+ * for de-duplicating repeated hits.  Must be a power of two. */
+#define PTRACER_WATCHPOINT_IPS  (64)
+
+enum ptracer_watch_type {
+    PTRACER_WATCH_WRITE  = 0x1, /* DR7 R/W bits 01 */
+    PTRACER_WATCH_ACCESS = 0x3  /* DR7 R/W bits 11 (read or write) */
+};
+
+struct ptracer_watchpoint {
+    ptracer_breakpoint_callback callback;
+
+    unsigned long addr;
+    size_t length;
+    enum ptracer_watch_type type;
+    int slot;
+
+    /* Total number of traps, including duplicates. */
+    unsigned long hits;
+
+    /* Instruction pointer and register snapshot of the last hit. */
+    unsigned long ip;
+    struct user_regs_struct regs;
+
+    /* Open addressed set of instruction pointers already reported. */
+    size_t nips;
+    unsigned long ips[PTRACER_WATCHPOINT_IPS];
+};
+
+/* Per-thread register cache (see regcache.c). */
+#define PTRACER_REGSET_GENERAL  (0x01)
+#define PTRACER_REGSET_XSTATE   (0x02)
+
+struct ptracer_regcache {
+    struct list_head node;
+    pid_t tid;
+
+    unsigned int valid;  /* PTRACER_REGSET_* flags fetched this stop */
+    unsigned int dirty;  /* PTRACER_REGSET_* flags to write back */
+
+    struct user_regs_struct regs;
+
+    /* NT_X86_XSTATE or NT_PRFPREG data; starts with
+     * struct user_fpregs_struct in either case. */
+    int xstate_type;
+    size_t xstate_size;
+    size_t xstate_alloc;
+    unsigned char *xstate;
+};
+
+/* Syscall watch (see syscall_watch.c). */
+#define PTRACER_SYSCALL_WATCH_MAX  (128)
+#define PTRACER_SYSCALL_RING_SIZE  (1024)
+
+struct ptracer_syscall_record {
+    pid_t tid;
+    long nr;
+    unsigned long args[6];
+    unsigned long ip;
+
+    long ret;      /* raw return value, -errno on failure */
+    int returned;  /* 0 if the process never came back (exit, kill) */
+};
+
+/* Single producer (the tracer loop), single consumer ring.
+ * The oldest records are overwritten when it is full. */
+struct ptracer_syscall_ring {
+    struct ptracer_syscall_record *records;
+    size_t size;            /* power of 2 */
+    unsigned long head;     /* next record written */
+    unsigned long tail;     /* next record read */
+    unsigned long dropped;  /* overwritten before being read */
+};
+
+struct ptracer_syscall_watch {
+    int active;
+    ptracer_breakpoint_callback callback;
+
+    struct ptracer_syscall_ring ring;
+    struct ptracer_syscall_record *current;
+
+    unsigned long hits;
+};
+
+/* Remote system calls and function calls (see inject.c). */
+struct ptracer_remote_syscall {
+    long nr;
+    unsigned long args[6];
+    long ret;  /* raw return value, -errno on failure */
+};
+
+struct ptracer_inject {
+    /* syscall instruction in the vDSO, 0 if none */
+    unsigned long syscall_insn;
+    int syscall_searched;
+
+    /* Persistent scratch mapping, 0 if not mapped. */
+    unsigned long scratch;
+    size_t scratch_size;
+};
+
+/* Breakpoint-synchronized sampling (see sample.c). */
+#define PTRACER_SAMPLE_RING_SIZE  (1024)
+
+/* Items closer than this (and on the same page) are read as one. */
+#define PTRACER_SAMPLE_GAP        (64)
+
+struct ptracer_sample_item {
+    unsigned long addr;
+    size_t length;
+    size_t offset;  /* in the record data, valid once planned */
+};
+
+struct ptracer_sample {
+    unsigned long seq;   /* number of the sample in its set */
+    unsigned long addr;  /* breakpoint which took it */
+    int complete;        /* 0 if some items could not be read */
+};
+
+struct ptracer_sample_set {
+    struct list_head node;
+
+    struct ptracer_sample_item *items;
+    size_t nitems;
+    size_t items_alloc;
+
+    /* Coalesced reads; their bytes follow each other in a record. */
+    struct iovec *spans;
+    size_t nspans;
+    size_t record_size;
+    int planned;
+
+    /* Single producer (the tracer loop), single consumer ring of
+     * records.  The oldest are overwritten when it is full. */
+    struct ptracer_sample *records;
+    unsigned char *data;    /* size * record_size bytes */
+    size_t size;            /* power of 2 */
+    unsigned long head;
+    unsigned long tail;
+    unsigned long dropped;
+};
+
+#define ptracer_sample_set_entry(list_node) \
+    list_entry(list_node, struct ptracer_sample_set, node)
+
+/* Code patches (see patch.c). */
+struct ptracer_patch {
+    struct list_head node;
+
+    unsigned long addr;
+    size_t length;
+
+    unsigned char *bytes;  /* written when the set is enabled */
+    unsigned char *orig;   /* saved when the set is enabled */
+};
+
+#define ptracer_patch_entry(list_node) \
+    list_entry(list_node, struct ptracer_patch, node)
+
+/* Patches which are switched on and off together. */
+struct ptracer_patch_set {
+    struct list_head node;
+    struct list_head patches;
+    size_t count;
+    int enabled;
+};
+
+#define ptracer_patch_set_entry(list_node) \
+    list_entry(list_node, struct ptracer_patch_set, node)
+
+/* Stop status helpers. */
+#define PTRACER_STATUS_IS_EVENT(status, event) \
+    (((status) >> 8) == (SIGTRAP | ((event) << 8)))
+
+#define PTRACER_STATUS_IS_SYSCALL(status) \
+    (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+
+/* Process state flags and checking functions. */
+
+#define PTRACER_PROC_IS_DEAD(ctx) \
+    ((ctx)->current_state == PTRACER_PROC_STATE_DEAD)
+
+#define PTRACER_PROC_IS_DETACHED(ctx) \
+    ((ctx)->current_state == PTRACE_PROC_STATE_DETACHED)
+
+#define PTRACER_PROC_IS_RUNNING(ctx) \
+    ((ctx)->current_state == PTRACER_PROC_STATE_RUNNING)
+
+#define PTRACER_PROC_IS_SIG_STOPPED(ctx) \
+    ((ctx)->current_state == PTRACER_PROC_STATE_SIG_STOPPED)
+
+#define PTRACER_PROC_IS_PTRACE_STOPPED(ctx) \
+    ((ctx)->current_state == PTRACER_PROC_STATE_PTRACE_STOPPED)
+
+#define PTRACER_PROC_IS_STOPPED(ctx) \
+    (((ctx)->current_state & PTRACER_PROC_STATE_SIG_STOPPED) != 0)
+
+
+#define PTRACER_PROC_STATE_MASK \
+    ( PTRACER_PROC_STATE_DEAD | PTRACER_PROC_STATE_DETATCHED \
+     | PTRACER_PROC_STATE_RUNNING | PTRACER_PROC_STATE_SIG_STOPPED \
+     | PTRACER_PROC_STATE_PTRACE_STOPPED )
+
+#define PTRACER_PROC_STATE_PTRACE_STOPPED \
+    (PTRACER_PROC_STATE_SIG_STOPPED | __PTRACER_PROC_STATE_PTRACE)
+
+#define PTRACER_PROC_STATE_DEAD        (0x00)
+#define PTRACER_PROC_STATE_DETACHED    (0x01)
+#define PTRACER_PROC_STATE_RUNNING     (0x02)
+#define PTRACER_PROC_STATE_SIG_STOPPED (0x04)
+#define __PTRACER_PROC_STATE_PTRACE    (0x08)
+
+
+/* Ptracer context. */
+struct ptracer_ctx {
+    pid_t pid;
+
+    int started;
+    int process_status;
+
+    int current_state;
+    int expected_next_state;
+
+    struct list_head breakpoints;
+    struct ptracer_breakpoint_table breakpoint_table;
+    struct ptracer_breakpoint *current_breakpoint;
+
+    struct ptracer_watchpoint *watchpoints[PTRACER_WATCHPOINT_MAX];
+    struct ptracer_watchpoint *current_watchpoint;
+
+    ptracer_breakpoint_callback run_callback;
+
+    /* /proc/<pid>/mem, opened on first bulk memory access. */
+    int mem_fd;
+
+    /* Registers of the main thread and of any other threads asked for. */
+    struct ptracer_regcache regcache;
+    struct list_head thread_regcaches;
+
+    /* PTRACE_O_* options currently set. */
+    unsigned long options;
+
+    struct ptracer_syscall_watch syscall_watch;
+
+    struct ptracer_inject inject;
+
+    struct list_head patch_sets;
+    struct list_head sample_sets;
+};
+
+#define PTRACER_MEM_FD_CLOSED       (-1)
+#define PTRACER_MEM_FD_UNAVAILABLE  (-2)
+
+
+extern void ptracer_init(struct ptracer_ctx *ctx, pid_t pid);
+extern void ptracer_fini(struct ptracer_ctx *ctx);
+
+extern struct ptracer_ctx *ptracer_new(pid_t pid);
+extern void ptracer_destroy(struct ptracer_ctx *ctx);
+
+
+extern int ptracer_set_breakpoint(struct ptracer_ctx *ctx,
+                unsigned long addr, ptracer_breakpoint_callback cb);
+
+extern int ptracer_set_breakpoints(struct ptracer_ctx *ctx,
+                const unsigned long *addrs, size_t count,
+                ptracer_breakpoint_callback cb);
+
+extern struct ptracer_breakpoint *
+ptracer_find_breakpoint(struct ptracer_ctx *ctx, unsigned long addr);
+
+extern int ptracer_breakpoint_set_condition(struct ptracer_breakpoint *bp,
+                const char *expr);
+extern void ptracer_breakpoint_set_sampling(struct ptracer_breakpoint *bp,
+                unsigned long every);
+extern void ptracer_breakpoint_set_limit(struct ptracer_breakpoint *bp,
+                unsigned long max_hits);
+
+extern struct ptracer_cond *ptracer_cond_compile(const char *expr);
+extern void ptracer_cond_free(struct ptracer_cond *cond);
+extern int ptracer_cond_eval(struct ptracer_ctx *ctx,
+                const struct ptracer_cond *cond);
+
+extern int ptracer_enable_breakpoints(struct ptracer_ctx *ctx);
+extern int ptracer_disable_breakpoints(struct ptracer_ctx *ctx);
+
+extern int ptracer_set_watchpoint(struct ptracer_ctx *ctx,
+                unsigned long addr, size_t length,
+                enum ptracer_watch_type type,
+                ptracer_breakpoint_callback cb);
+
+extern int ptracer_clear_watchpoint(struct ptracer_ctx *ctx, int slot);
+
+extern int ptracer_check_watchpoints(struct ptracer_ctx *ctx);
+
+extern int ptracer_clobber_address(struct ptracer_ctx *ctx,
+                unsigned long addr, size_t length);
+
+
+/* Code patches */
+
+extern struct ptracer_patch_set *ptracer_patch_set_new(
+                struct ptracer_ctx *ctx);
+extern int ptracer_patch_set_free(struct ptracer_ctx *ctx,
+                struct ptracer_patch_set *set);
+
+extern int ptracer_patch_add(struct ptracer_patch_set *set,
+                unsigned long addr, const void *bytes, size_t length);
+extern int ptracer_patch_add_nop(struct ptracer_patch_set *set,
+                unsigned long addr, size_t length);
+extern int ptracer_patch_add_jump(struct ptracer_patch_set *set,
+                unsigned long from, unsigned long to);
+
+extern int ptracer_patch_set_enable(struct ptracer_ctx *ctx,
+                struct ptracer_patch_set *set);
+extern int ptracer_patch_set_disable(struct ptracer_ctx *ctx,
+                struct ptracer_patch_set *set);
+extern int ptracer_patch_sets_switch(struct ptracer_ctx *ctx,
+                struct ptracer_patch_set **on, size_t non,
+                struct ptracer_patch_set **off, size_t noff);
+
+
+/* Breakpoint-synchronized sampling */
+
+extern struct ptracer_sample_set *ptracer_sample_set_new(
+                struct ptracer_ctx *ctx);
+extern void ptracer_sample_set_free(struct ptracer_ctx *ctx,
+                struct ptracer_sample_set *set);
+
+extern int ptracer_sample_set_add(struct ptracer_sample_set *set,
+                unsigned long addr, size_t length);
+extern int ptracer_sample_set_plan(struct ptracer_sample_set *set);
+
+extern int ptracer_breakpoint_set_sample(struct ptracer_breakpoint *bp,
+                struct ptracer_sample_set *set);
+
+extern int ptracer_sample_take(struct ptracer_ctx *ctx,
+                struct ptracer_sample_set *set, unsigned long addr);
+
+extern size_t ptracer_sample_read(struct ptracer_sample_set *set,
+                struct ptracer_sample *out, void *data, size_t max);
+
+static inline const void *
+ptracer_sample_value(const struct ptracer_sample_set *set,
+    const void *data, size_t item)
+{
+    return (const unsigned char *)data + set->items[item].offset;
+}
+
+
+extern int ptracer_run(struct ptracer_ctx *ctx);
+
+
+static inline void
+ptracer_set_run_callback(struct ptracer_ctx *ctx,
+    ptracer_breakpoint_callback cb)
+{
+    ctx->run_callback = cb;
+}
+
+
+/* Remote system calls and function calls */
+
+extern int ptracer_remote_syscall(struct ptracer_ctx *ctx, long *out_ret,
+                long nr, const unsigned long args[6]);
+extern int ptracer_remote_syscalls(struct ptracer_ctx *ctx,
+                struct ptracer_remote_syscall *calls, size_t count);
+
+extern int ptracer_remote_call(struct ptracer_ctx *ctx, unsigned long func,
+                const unsigned long *args, size_t nargs,
+                unsigned long *out_ret);
+
+extern int ptracer_scratch_map(struct ptracer_ctx *ctx);
+extern unsigned long ptracer_scratch_data(struct ptracer_ctx *ctx,
+                size_t *out_size);
+extern int ptracer_scratch_unmap(struct ptracer_ctx *ctx);
+extern void ptracer_scratch_forget(struct ptracer_ctx *ctx);
+
+
+/* Syscall watch */
+
+extern int ptracer_syscall_watch(struct ptracer_ctx *ctx,
+                const long *nrs, size_t count,
+                ptracer_breakpoint_callback cb);
+extern void ptracer_syscall_unwatch(struct ptracer_ctx *ctx);
+
+extern size_t ptracer_syscall_watch_read(struct ptracer_ctx *ctx,
+                struct ptracer_syscall_record *out, size_t max);
+
+extern int ptracer_syscall_watch_dispatch(struct ptracer_ctx *ctx);
+
+
+/* Bulk memory access */
+
+extern int ptracer_read_mem(struct ptracer_ctx *ctx, unsigned long addr,
+                void *buf, size_t len);
+extern int ptrace_read_mem(pid_t pid, unsigned long addr,
+                void *buf, size_t len);
+
+extern int ptracer_write_mem(struct ptracer_ctx *ctx, unsigned long addr,
+                const void *buf, size_t len);
+extern int ptrace_write_mem(pid_t pid, unsigned long addr,
+                const void *buf, size_t len);
+
+extern void ptracer_close_mem(struct ptracer_ctx *ctx);
+
+
+/* Register cache */
+
+extern struct user_regs_struct *ptracer_regs(struct ptracer_ctx *ctx);
+extern struct user_fpregs_struct *ptracer_fpregs(struct ptracer_ctx *ctx);
+extern void ptracer_regs_dirty(struct ptracer_ctx *ctx, unsigned int sets);
+
+extern struct ptracer_regcache *ptracer_regcache(struct ptracer_ctx *ctx,
+                pid_t tid);
+extern struct user_regs_struct *ptracer_regcache_regs(
+                struct ptracer_regcache *rc);
+extern struct user_fpregs_struct *ptracer_regcache_fpregs(
+                struct ptracer_regcache *rc);
+extern void ptracer_regcache_mark_dirty(struct ptracer_regcache *rc,
+                unsigned int sets);
+extern int ptracer_regcache_flush(struct ptracer_regcache *rc);
+extern void ptracer_regcache_invalidate(struct ptracer_regcache *rc);
+
+extern int ptracer_flush_regs(struct ptracer_ctx *ctx);
+extern void ptracer_invalidate_regs(struct ptracer_ctx *ctx);
+extern int ptracer_regs_resume(struct ptracer_ctx *ctx);
+extern void ptracer_free_regs(struct ptracer_ctx *ctx);
+
+
+/* ptrace call wrappers */
+
+extern int ptracer_peektext(struct ptracer_ctx *ctx, unsigned long addr,
+                unsigned long *out);
+extern int ptrace_peektext(pid_t pid, unsigned long addr,
+                unsigned long *out);
+
+
+extern int ptracer_poketext(struct ptracer_ctx *ctx, unsigned long addr,
+                unsigned long val);
+extern int ptrace_poketext(pid_t pid, unsigned long addr,
+                unsigned long val);
+
+
+extern int ptracer_peekuser(struct ptracer_ctx *ctx, unsigned long offset,
+                unsigned long *out);
+extern int ptrace_peekuser(pid_t pid, unsigned long offset,
+                unsigned long *out);
+
+
+extern int ptracer_pokeuser(struct ptracer_ctx *ctx, unsigned long offset,
+                unsigned long val);
+extern int ptrace_pokeuser(pid_t pid, unsigned long offset,
+                unsigned long val);
+
+
+extern int ptracer_singlestep(struct ptracer_ctx *ctx);
+extern int ptrace_singlestep(pid_t pid);
+
+extern int ptracer_singlestep_waitpid(struct ptracer_ctx *ctx,
+                int *out_status, int options);
+extern int ptrace_singlestep_waitpid(pid_t pid, int *out_status,
+                int options);
+
+
+extern int ptracer_syscall(struct ptracer_ctx *ctx);
+extern int ptrace_syscall(pid_t pid);
+
+extern int ptracer_syscall_waitpid(struct ptracer_ctx *ctx,
+                int *out_status, int options);
+extern int ptrace_syscall_waitpid(pid_t pid, int *out_status,
+                int options);
+
+
+extern int ptracer_getregs(struct ptracer_ctx *ctx,
+                struct user_regs_struct *out_regs);
+extern int ptrace_getregs(pid_t pid, struct user_regs_struct *out_regs);
+
+
+extern int ptracer_getfpregs(struct ptracer_ctx *ctx,
+                struct user_fpregs_struct *out_regs);
+extern int ptrace_getfpregs(pid_t pid, struct user_fpregs_struct *out_regs);
+
+
+extern int ptracer_get_all_regs(struct ptracer_ctx *ctx,
+                struct user_regs_struct *out_regs,
+                struct user_fpregs_struct *out_fpregs);
+extern int ptrace_get_all_regs(pid_t pid, struct user_regs_struct *out_regs,
+                struct user_fpregs_struct *out_fpregs);
+
+
+extern int ptracer_setregs(struct ptracer_ctx *ctx,
+                struct user_regs_struct *regs);
+extern int ptrace_setregs(pid_t pid, struct user_regs_struct *regs);
+
+
+extern int ptracer_setfpregs(struct ptracer_ctx *ctx,
+                struct user_fpregs_struct *regs);
+extern int ptrace_setfpregs(pid_t pid, struct user_fpregs_struct *regs);
+
+
+extern int ptracer_set_all_regs(struct ptracer_ctx *ctx,
+                struct user_regs_struct *regs,
+                struct user_fpregs_struct *fpregs);
+extern int ptrace_set_all_regs(pid_t pid, struct user_regs_struct *regs,
+                struct user_fpregs_struct *fpregs);
+
+
+extern int ptracer_getregset(struct ptracer_ctx *ctx, int type,
+                struct iovec *iov);
+extern int ptrace_getregset(pid_t pid, int type, struct iovec *iov);
+
+
+extern int ptracer_setregset(struct ptracer_ctx *ctx, int type,
+                struct iovec *iov);
+extern int ptrace_setregset(pid_t pid, int type, struct iovec *iov);
+
+
+extern int ptracer_setoptions(struct ptracer_ctx *ctx,
+                unsigned long options);
+extern int ptrace_setoptions(pid_t pid, unsigned long options);
+
+
+extern int ptracer_cont(struct ptracer_ctx *ctx);
+extern int ptrace_cont(pid_t pid);
+
+
+/* This is not a real ptrace command.
+ * There is no ptrace_* equivalent. */
+extern int ptracer_stop(struct ptracer_ctx *ctx);
+
+extern int ptracer_stop_waitpid(struct ptracer_ctx *ctx,
+                int *out_status, int options);
+
+
+extern int ptracer_attach(struct ptracer_ctx *ctx);
+extern int ptrace_attach(pid_t pid);
+
+extern int ptracer_attach_waitpid(struct ptracer_ctx *ctx, int *out_status,
+                int options);
+extern int ptrace_attach_waitpid(pid_t pid, int *out_status, int options);
+
+
+/* Thread level, no ptracer_* equivalents. */
+extern int ptrace_seize(pid_t pid, unsigned long options);
+extern int ptrace_interrupt(pid_t pid);
+extern int ptrace_listen(pid_t pid);
+extern int ptrace_cont_signal(pid_t pid, int sig);
+
+
+extern int ptracer_detach(struct ptracer_ctx *ctx);
+extern int ptrace_detach(pid_t pid);
+
+extern int ptracer_waitpid(struct ptracer_ctx *ctx, int *out_status,
+                int options);
+extern int ptrace_waitpid(pid_t pid, int *out_status, int options);
+
+#endif /* H_LIB_PTRACER */
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
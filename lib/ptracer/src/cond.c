@@ -0,0 +1,417 @@
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/util.h"
+#include "ptracer.h"
+
+/**
+ * @file cond.c
+ *
+ * Breakpoint conditions.
+ *
+ * A condition is written in reverse polish notation and compiled once
+ * into a flat array of instructions for a tiny stack machine.  At each
+ * trap, the program is run against the trapped registers before any
+ * callback is made, so uninteresting hits cost only the evaluation.
+ *
+ * Tokens (whitespace separated):
+ *
+ *   <number>                push an immediate (strtol/strtoul, base 0)
+ *   <register>              push a register value (rax, rdi, rsp, ...)
+ *   [1] [2] [4] [8]         pop an address, push the value read there
+ *   + - & | ^               pop b, pop a, push (a op b)
+ *   == != < <= > >=         pop b, pop a, push (a op b), unsigned
+ *   s< s<= s> s>=           signed versions of the above
+ *   && ||                   logical and / or
+ *   !                       logical not
+ *
+ * Examples:
+ *
+ *   "rdi 5 =="                       first argument is 5
+ *   "rsp 8 + [4] 100 s>"             int at rsp + 8 is greater than 100
+ *   "rdi 0 != rsi [1] 65 == &&"      rdi is non-zero and *(char *)rsi == 'A'
+ */
+
+enum cond_op {
+    COND_IMM,
+    COND_REG,
+    COND_LOAD,
+
+    COND_ADD,
+    COND_SUB,
+    COND_AND,
+    COND_OR,
+    COND_XOR,
+
+    COND_EQ,
+    COND_NE,
+    COND_LT,
+    COND_LE,
+    COND_GT,
+    COND_GE,
+    COND_SLT,
+    COND_SLE,
+    COND_SGT,
+    COND_SGE,
+
+    COND_LAND,
+    COND_LOR,
+    COND_LNOT
+};
+
+struct cond_reg {
+    const char *name;
+    size_t offset;
+};
+
+#define REG(name) { #name, offsetof(struct user_regs_struct, name) }
+
+static const struct cond_reg cond_regs[] = {
+#if defined(__x86_64__)
+    REG(rax), REG(rbx), REG(rcx), REG(rdx),
+    REG(rsi), REG(rdi), REG(rbp), REG(rsp),
+    REG(r8),  REG(r9),  REG(r10), REG(r11),
+    REG(r12), REG(r13), REG(r14), REG(r15),
+    REG(rip), REG(eflags), REG(orig_rax),
+    REG(fs_base), REG(gs_base)
+#elif defined(__i386__)
+    REG(eax), REG(ebx), REG(ecx), REG(edx),
+    REG(esi), REG(edi), REG(ebp), REG(esp),
+    REG(eip), REG(eflags), REG(orig_eax)
+#else
+#error Unsupported architecture
+#endif
+};
+
+#undef REG
+
+struct cond_token {
+    const char *name;
+    enum cond_op op;
+};
+
+static const struct cond_token cond_binops[] = {
+    { "+",   COND_ADD  }, { "-",   COND_SUB  },
+    { "&",   COND_AND  }, { "|",   COND_OR   }, { "^",   COND_XOR  },
+    { "==",  COND_EQ   }, { "!=",  COND_NE   },
+    { "<",   COND_LT   }, { "<=",  COND_LE   },
+    { ">",   COND_GT   }, { ">=",  COND_GE   },
+    { "s<",  COND_SLT  }, { "s<=", COND_SLE  },
+    { "s>",  COND_SGT  }, { "s>=", COND_SGE  },
+    { "&&",  COND_LAND }, { "||",  COND_LOR  }
+};
+
+
+static int
+parse_token(const char *tok, size_t len, struct ptracer_cond_insn *insn)
+{
+    size_t i;
+    char buf[32];
+    char *endptr;
+
+    if (len >= sizeof(buf))
+        return -1;
+
+    memcpy(buf, tok, len);
+    buf[len] = '\0';
+
+    memset(insn, 0, sizeof(*insn));
+
+    if (strcmp(buf, "!") == 0) {
+        insn->op = COND_LNOT;
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZ(cond_binops); ++i) {
+        if (strcmp(buf, cond_binops[i].name) == 0) {
+            insn->op = cond_binops[i].op;
+            return 0;
+        }
+    }
+
+    if (buf[0] == '[') {
+        if (strcmp(buf, "[1]") == 0)
+            insn->size = 1;
+        else if (strcmp(buf, "[2]") == 0)
+            insn->size = 2;
+        else if (strcmp(buf, "[4]") == 0)
+            insn->size = 4;
+        else if (strcmp(buf, "[8]") == 0 && sizeof(unsigned long) == 8)
+            insn->size = 8;
+        else
+            return -1;
+
+        insn->op = COND_LOAD;
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZ(cond_regs); ++i) {
+        if (strcmp(buf, cond_regs[i].name) == 0) {
+            insn->op = COND_REG;
+            insn->value = cond_regs[i].offset;
+            return 0;
+        }
+    }
+
+    errno = 0;
+
+    if (buf[0] == '-')
+        insn->value = (unsigned long)strtol(buf, &endptr, 0);
+    else
+        insn->value = strtoul(buf, &endptr, 0);
+
+    if (errno != 0 || *endptr != '\0' || endptr == buf)
+        return -1;
+
+    insn->op = COND_IMM;
+
+    return 0;
+}
+
+/* Stack depth change of an instruction. */
+static inline int
+insn_stack_delta(const struct ptracer_cond_insn *insn)
+{
+    switch (insn->op) {
+    case COND_IMM:
+    case COND_REG:
+        return 1;
+
+    case COND_LOAD:
+    case COND_LNOT:
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/* Number of operands an instruction consumes. */
+static inline int
+insn_stack_needs(const struct ptracer_cond_insn *insn)
+{
+    switch (insn->op) {
+    case COND_IMM:
+    case COND_REG:
+        return 0;
+
+    case COND_LOAD:
+    case COND_LNOT:
+        return 1;
+
+    default:
+        return 2;
+    }
+}
+
+/**
+ * Compile a condition expression.
+ *
+ * @param[in] expr - reverse polish notation expression (see cond.c)
+ *
+ * @return compiled condition on success; free with ptracer_cond_free()
+ * @return NULL on failure with error returned in errno
+ *         (EINVAL for malformed expressions)
+ */
+struct ptracer_cond *
+ptracer_cond_compile(const char *expr)
+{
+    int depth = 0;
+    size_t count = 0;
+    size_t alloc = 8;
+    const char *p = expr;
+    struct ptracer_cond *cond;
+
+    cond = malloc(sizeof(*cond) + alloc * sizeof(cond->insns[0]));
+
+    if (cond == NULL)
+        return NULL;
+
+    for (;;) {
+        size_t len;
+        const char *tok;
+        struct ptracer_cond_insn *insn;
+
+        while (*p != '\0' && isspace((unsigned char)*p))
+            ++p;
+
+        if (*p == '\0')
+            break;
+
+        tok = p;
+
+        while (*p != '\0' && !isspace((unsigned char)*p))
+            ++p;
+
+        len = (size_t)(p - tok);
+
+        if (count == alloc) {
+            void *tmp;
+
+            alloc *= 2;
+            tmp = realloc(cond, sizeof(*cond) + alloc * sizeof(cond->insns[0]));
+
+            if (tmp == NULL) {
+                free(cond);
+                return NULL;
+            }
+
+            cond = tmp;
+        }
+
+        insn = &(cond->insns[count]);
+
+        if (parse_token(tok, len, insn) != 0)
+            goto invalid;
+
+        /* Validate the stack at compile time so evaluation
+         * never needs to check for underflow or overflow. */
+        if (depth < insn_stack_needs(insn))
+            goto invalid;
+
+        depth += insn_stack_delta(insn);
+
+        if (depth > PTRACER_COND_STACK)
+            goto invalid;
+
+        ++count;
+    }
+
+    /* Must leave exactly one result. */
+    if (depth != 1)
+        goto invalid;
+
+    cond->count = count;
+
+    return cond;
+
+invalid:
+
+    free(cond);
+    errno = EINVAL;
+    return NULL;
+}
+
+/**
+ * Free a compiled condition.
+ *
+ * @param cond - condition from ptracer_cond_compile()
+ */
+void
+ptracer_cond_free(struct ptracer_cond *cond)
+{
+    free(cond);
+}
+
+/**
+ * Evaluate a compiled condition against the current stop.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] cond - compiled condition
+ *
+ * @return 1 if the condition holds
+ * @return 0 if the condition does not hold
+ * @return < 0 on a failed memory read with error returned in errno
+ */
+int
+ptracer_cond_eval(struct ptracer_ctx *ctx, const struct ptracer_cond *cond)
+{
+    size_t i;
+    size_t sp = 0;
+    unsigned long stack[PTRACER_COND_STACK];
+
+    const char *regs = (const char *)ptracer_regs(ctx);
+
+    if (regs == NULL)
+        return -1;
+
+    for (i = 0; i < cond->count; ++i) {
+        unsigned long a;
+        unsigned long b;
+        const struct ptracer_cond_insn *insn = &(cond->insns[i]);
+
+        switch (insn->op) {
+        case COND_IMM:
+            stack[sp++] = insn->value;
+            continue;
+
+        case COND_REG:
+            stack[sp++] = *(const unsigned long *)(regs + insn->value);
+            continue;
+
+        case COND_LOAD: {
+            union {
+                uint8_t u8;
+                uint16_t u16;
+                uint32_t u32;
+                unsigned long ul;
+            } v;
+
+            v.ul = 0;
+
+            if (ptracer_read_mem(ctx, stack[sp - 1], &v, insn->size) != 0)
+                return -1;
+
+            switch (insn->size) {
+            case 1:  stack[sp - 1] = v.u8;  break;
+            case 2:  stack[sp - 1] = v.u16; break;
+            case 4:  stack[sp - 1] = v.u32; break;
+            default: stack[sp - 1] = v.ul;  break;
+            }
+
+            continue;
+        }
+
+        case COND_LNOT:
+            stack[sp - 1] = !stack[sp - 1];
+            continue;
+
+        default:
+            break;
+        }
+
+        /* Binary operators. */
+        b = stack[--sp];
+        a = stack[sp - 1];
+
+        switch (insn->op) {
+        case COND_ADD:  a = a + b; break;
+        case COND_SUB:  a = a - b; break;
+        case COND_AND:  a = a & b; break;
+        case COND_OR:   a = a | b; break;
+        case COND_XOR:  a = a ^ b; break;
+
+        case COND_EQ:   a = (a == b); break;
+        case COND_NE:   a = (a != b); break;
+        case COND_LT:   a = (a < b);  break;
+        case COND_LE:   a = (a <= b); break;
+        case COND_GT:   a = (a > b);  break;
+        case COND_GE:   a = (a >= b); break;
+
+        case COND_SLT:  a = ((long)a < (long)b);  break;
+        case COND_SLE:  a = ((long)a <= (long)b); break;
+        case COND_SGT:  a = ((long)a > (long)b);  break;
+        case COND_SGE:  a = ((long)a >= (long)b); break;
+
+        case COND_LAND: a = (a && b); break;
+        case COND_LOR:  a = (a || b); break;
+
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+
+        stack[sp - 1] = a;
+    }
+
+    return (stack[0] != 0);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,798 @@
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/util.h"
+#include "ptracer.h"
+#include "regs.h"
+
+/**
+ * @file inject.c
+ *
+ * Running system calls and functions inside the traced process.
+ *
+ * Every injection saves the registers, points the stopped thread at a
+ * piece of code, runs it into a trap and puts the registers back
+ * through the register cache (they are written back on the next
+ * resume, so back to back injections cost nothing extra).
+ *
+ * Where the code runs:
+ *
+ *   1 - Single system calls, before a scratch area exists, jump to an
+ *       existing syscall instruction in the vDSO and single-step over
+ *       it.  Nothing in the process is written.  If no vDSO syscall
+ *       instruction can be found, "syscall; int3" is written over the
+ *       current instruction for the duration of the call.
+ *
+ *   2 - ptracer_scratch_map() maps a persistent scratch area:
+ *         page 0 - code (r-x, written through /proc/<pid>/mem)
+ *         page 1 - results of batched system calls (rw-)
+ *         page 2 - free for callers, see ptracer_scratch_data() (rw-)
+ *       Once it exists, system calls are batched into one stub per
+ *       stop:  mov nr / args to registers, syscall, store the result;
+ *       repeated, then int3.  One write, one resume and one read cover
+ *       the whole batch.
+ *
+ *   3 - Function calls push a return address pointing at the int3 at
+ *       the start of the scratch code page and jump to the function.
+ *       The full XSAVE state is saved and restored around them.
+ *
+ * @note
+ *  Signals arriving during an injection are discarded.  Breakpoints
+ *  hit by an injected function call abort the call (EFAULT) with the
+ *  callee's state abandoned, so disable them around such calls.  The
+ *  scratch area does not survive execve(); call ptracer_scratch_forget()
+ *  when the process image changes.
+ */
+
+#define SCRATCH_PAGES      (3)
+#define SCRATCH_CODE_PAGE  (0)
+#define SCRATCH_RES_PAGE   (1)
+#define SCRATCH_DATA_PAGE  (2)
+
+/* Batched stubs start after the call trap. */
+#define SCRATCH_CODE_START  (16)
+
+/* Bytes below the stack pointer left alone (x86_64 red zone). */
+#define STACK_RED_ZONE  (128)
+
+#define INSN_INT3  (0xcc)
+
+#if defined(__x86_64__)
+static const unsigned char syscall_insn[] = { 0x0f, 0x05 };
+
+/* movabs <reg>, imm64: rax, rdi, rsi, rdx, r10, r8, r9 */
+static const unsigned char mov_imm[SYSCALL_NARGS + 1][2] = {
+    { 0x48, 0xb8 }, { 0x48, 0xbf }, { 0x48, 0xbe }, { 0x48, 0xba },
+    { 0x49, 0xba }, { 0x49, 0xb8 }, { 0x49, 0xb9 }
+};
+
+/* movabs [moffs64], rax */
+static const unsigned char store_ret[] = { 0x48, 0xa3 };
+
+#define SYS_MMAP  SYS_mmap
+#define MMAP_OFFSET(off)  (off)
+
+#elif defined(__i386__)
+static const unsigned char syscall_insn[] = { 0xcd, 0x80 };
+
+/* mov <reg>, imm32: eax, ebx, ecx, edx, esi, edi, ebp */
+static const unsigned char mov_imm[SYSCALL_NARGS + 1][1] = {
+    { 0xb8 }, { 0xbb }, { 0xb9 }, { 0xba }, { 0xbe }, { 0xbf }, { 0xbd }
+};
+
+/* mov [moffs32], eax */
+static const unsigned char store_ret[] = { 0xa3 };
+
+/* SYS_mmap takes a pointer to its arguments on i386. */
+#define SYS_MMAP  SYS_mmap2
+#define MMAP_OFFSET(off)  ((off) / 4096)
+#endif
+
+#define STUB_CALL_SIZE \
+    ((SYSCALL_NARGS + 1) * (sizeof(mov_imm[0]) + sizeof(unsigned long)) \
+     + sizeof(syscall_insn) + sizeof(store_ret) + sizeof(unsigned long))
+
+#define IS_SYSCALL_ERR(ret)  ((unsigned long)(ret) > -4096UL)
+
+
+static inline size_t
+page_size(void)
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static inline unsigned long
+regs_sp(const struct user_regs_struct *regs)
+{
+#if defined(__x86_64__)
+    return regs->rsp;
+#elif defined(__i386__)
+    return (unsigned long)regs->esp;
+#endif
+}
+
+static inline void
+set_regs_sp(struct user_regs_struct *regs, unsigned long sp)
+{
+#if defined(__x86_64__)
+    regs->rsp = sp;
+#elif defined(__i386__)
+    regs->esp = (long)sp;
+#endif
+}
+
+
+/* Saved thread state around an injection. */
+struct inject_state {
+    struct user_regs_struct regs;
+    unsigned char *xstate;
+    size_t xstate_size;
+};
+
+static int
+state_save(struct ptracer_ctx *ctx, struct inject_state *st, int fpu)
+{
+    struct user_regs_struct *regs;
+
+    memset(st, 0, sizeof(*st));
+
+    regs = ptracer_regs(ctx);
+
+    if (regs == NULL)
+        return -1;
+
+    memcpy(&(st->regs), regs, sizeof(st->regs));
+
+    if (fpu) {
+        struct ptracer_regcache *rc = &(ctx->regcache);
+
+        if (ptracer_regcache_fpregs(rc) == NULL)
+            return -1;
+
+        st->xstate = malloc(rc->xstate_size);
+
+        if (st->xstate == NULL)
+            return -1;
+
+        memcpy(st->xstate, rc->xstate, rc->xstate_size);
+        st->xstate_size = rc->xstate_size;
+    }
+
+    return 0;
+}
+
+/* Put the saved registers back into the (invalidated) cache.
+ * They reach the thread on its next resume. */
+static int
+state_restore(struct ptracer_ctx *ctx, struct inject_state *st)
+{
+    int ret = 0;
+    int oerrno = errno;
+    struct ptracer_regcache *rc = &(ctx->regcache);
+
+    ptracer_invalidate_regs(ctx);
+    (void)ptracer_setregs(ctx, &(st->regs));
+
+    if (st->xstate != NULL) {
+        if (ptracer_regcache_fpregs(rc) != NULL
+                && rc->xstate_size == st->xstate_size) {
+            memcpy(rc->xstate, st->xstate, st->xstate_size);
+            ptracer_regcache_mark_dirty(rc, PTRACER_REGSET_XSTATE);
+        } else {
+            ret = -1;
+            oerrno = errno;
+        }
+
+        free(st->xstate);
+        st->xstate = NULL;
+    }
+
+    errno = oerrno;
+    return ret;
+}
+
+/* Write back the cache, resume with cmd and wait for a SIGTRAP.
+ * Any other signal stop is discarded and the thread resumed again. */
+static int
+run_to_trap(struct ptracer_ctx *ctx, int singlestep)
+{
+    int status;
+
+    if (ptracer_regs_resume(ctx) != 0)
+        return -1;
+
+    for (;;) {
+        int err;
+
+        if (singlestep)
+            err = ptrace_singlestep(ctx->pid);
+        else
+            err = ptrace_cont(ctx->pid);
+
+        if (err != 0)
+            return -1;
+
+        if (ptrace_waitpid(ctx->pid, &status, 0) < 0)
+            return -1;
+
+        if (!WIFSTOPPED(status)) {
+            ctx->current_state = PTRACER_PROC_STATE_DEAD;
+            ctx->process_status = status;
+            errno = ESRCH;
+            return -1;
+        }
+
+        if (WSTOPSIG(status) == SIGTRAP)
+            return 0;
+    }
+}
+
+
+/* Find a syscall instruction in the vDSO. */
+static unsigned long
+find_syscall_insn(struct ptracer_ctx *ctx)
+{
+    FILE *fp;
+    char line[256];
+    char path[64];
+    unsigned long ret = 0;
+    unsigned long start = 0;
+    unsigned long end = 0;
+
+    if (ctx->inject.syscall_searched)
+        return ctx->inject.syscall_insn;
+
+    ctx->inject.syscall_searched = 1;
+
+    (void)snprintf(path, sizeof(path), "/proc/%u/maps",
+        (unsigned int)ctx->pid);
+
+    fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, "[vdso]") == NULL)
+            continue;
+
+        if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+            start = end = 0;
+
+        break;
+    }
+
+    fclose(fp);
+
+    if (end > start && end - start <= 64 * 1024) {
+        size_t i;
+        size_t len = end - start;
+        unsigned char *image = malloc(len);
+
+        if (image != NULL && ptracer_read_mem(ctx, start, image, len) == 0) {
+            for (i = 0; i + sizeof(syscall_insn) <= len; ++i) {
+                if (memcmp(image + i, syscall_insn,
+                            sizeof(syscall_insn)) == 0) {
+                    ret = start + i;
+                    break;
+                }
+            }
+        }
+
+        free(image);
+    }
+
+    ctx->inject.syscall_insn = ret;
+
+    return ret;
+}
+
+/* Run one system call without a scratch area. */
+static int
+syscall_no_scratch(struct ptracer_ctx *ctx, struct ptracer_remote_syscall *call)
+{
+    int err;
+    unsigned long ip;
+    unsigned long insn;
+    struct inject_state st;
+    struct user_regs_struct *regs;
+    unsigned char orig[sizeof(syscall_insn) + 1];
+    unsigned char stub[sizeof(syscall_insn) + 1];
+
+    if (state_save(ctx, &st, 0) != 0)
+        return -1;
+
+    regs = ptracer_regs(ctx);
+    ip = (unsigned long)get_inst_ptr(&(st.regs));
+    insn = find_syscall_insn(ctx);
+
+    if (insn == 0) {
+        /* Borrow the current instruction. */
+        memcpy(stub, syscall_insn, sizeof(syscall_insn));
+        stub[sizeof(syscall_insn)] = INSN_INT3;
+
+        if (ptracer_read_mem(ctx, ip, orig, sizeof(orig)) != 0)
+            return -1;
+
+        if (ptracer_write_mem(ctx, ip, stub, sizeof(stub)) != 0)
+            return -1;
+
+        insn = ip;
+    }
+
+    set_syscall(regs, call->nr, call->args);
+    set_inst_ptr(regs, (INST_PTR_TYPE)insn);
+    ptracer_regs_dirty(ctx, PTRACER_REGSET_GENERAL);
+
+    err = run_to_trap(ctx, (insn != ip));
+
+    if (err == 0) {
+        regs = ptracer_regs(ctx);
+
+        if (regs == NULL)
+            err = -1;
+        else
+            call->ret = get_syscall_ret(regs);
+    }
+
+    if (insn == ip && !PTRACER_PROC_IS_DEAD(ctx)) {
+        int oerrno = errno;
+
+        if (ptracer_write_mem(ctx, ip, orig, sizeof(orig)) != 0)
+            err = -1;
+        else
+            errno = oerrno;
+    }
+
+    if (state_restore(ctx, &st) != 0)
+        err = -1;
+
+    return err;
+}
+
+static unsigned char *
+emit_imm(unsigned char *p, const unsigned char *op, size_t oplen,
+    unsigned long imm)
+{
+    memcpy(p, op, oplen);
+    p += oplen;
+    memcpy(p, &imm, sizeof(imm));
+    return p + sizeof(imm);
+}
+
+/* Run up to one page worth of system calls from the scratch area. */
+static int
+syscall_batch_scratch(struct ptracer_ctx *ctx,
+    struct ptracer_remote_syscall *calls, size_t count)
+{
+    int err;
+    size_t i;
+    size_t code_len;
+    unsigned char *p;
+    unsigned char *code;
+    struct inject_state st;
+    struct user_regs_struct *regs;
+    unsigned long noargs[SYSCALL_NARGS] = { 0 };
+    const size_t psize = page_size();
+    const unsigned long code_addr = ctx->inject.scratch
+                                    + SCRATCH_CODE_PAGE * psize
+                                    + SCRATCH_CODE_START;
+    const unsigned long res_addr = ctx->inject.scratch
+                                   + SCRATCH_RES_PAGE * psize;
+    unsigned long res[psize / sizeof(unsigned long)];
+
+    code = malloc(psize);
+
+    if (code == NULL)
+        return -1;
+
+    p = code;
+
+    for (i = 0; i < count; ++i) {
+        int arg;
+
+        p = emit_imm(p, mov_imm[0], sizeof(mov_imm[0]),
+                (unsigned long)calls[i].nr);
+
+        for (arg = 0; arg < SYSCALL_NARGS; ++arg) {
+            p = emit_imm(p, mov_imm[arg + 1], sizeof(mov_imm[0]),
+                    calls[i].args[arg]);
+        }
+
+        memcpy(p, syscall_insn, sizeof(syscall_insn));
+        p += sizeof(syscall_insn);
+
+        p = emit_imm(p, store_ret, sizeof(store_ret),
+                res_addr + i * sizeof(unsigned long));
+    }
+
+    *p++ = INSN_INT3;
+    code_len = (size_t)(p - code);
+
+    err = ptracer_write_mem(ctx, code_addr, code, code_len);
+    free(code);
+
+    if (err != 0)
+        return -1;
+
+    if (state_save(ctx, &st, 0) != 0)
+        return -1;
+
+    regs = ptracer_regs(ctx);
+
+    /* Not entering a system call; keep the kernel from restarting
+     * one the thread was stopped in. */
+    set_syscall(regs, -1, noargs);
+    set_inst_ptr(regs, (INST_PTR_TYPE)code_addr);
+    ptracer_regs_dirty(ctx, PTRACER_REGSET_GENERAL);
+
+    err = run_to_trap(ctx, 0);
+
+    if (err == 0) {
+        regs = ptracer_regs(ctx);
+
+        /* Stopped somewhere else (a breakpoint in the way?). */
+        if (regs == NULL) {
+            err = -1;
+        } else if ((unsigned long)get_inst_ptr(regs)
+                       != code_addr + code_len) {
+            errno = EFAULT;
+            err = -1;
+        }
+    }
+
+    if (err == 0)
+        err = ptracer_read_mem(ctx, res_addr, res, count * sizeof(res[0]));
+
+    if (err == 0) {
+        for (i = 0; i < count; ++i)
+            calls[i].ret = (long)res[i];
+    }
+
+    if (state_restore(ctx, &st) != 0)
+        err = -1;
+
+    return (err == 0) ? 0 : -1;
+}
+
+
+/**
+ * Run several system calls in the stopped process.
+ *
+ * With a scratch area (see ptracer_scratch_map()) the whole batch runs
+ * from a single stub in one resume.  Otherwise each call is run
+ * separately.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param calls - system calls to run; ret is filled in for each
+ *                (raw value, -errno on failure)
+ * @param[in] count - number of entries in calls
+ *
+ * @note
+ *  Calls which fail in the process still return success here;
+ *  check each calls[i].ret.
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_remote_syscalls(struct ptracer_ctx *ctx,
+    struct ptracer_remote_syscall *calls, size_t count)
+{
+    size_t max;
+
+    if (ctx->inject.scratch == 0) {
+        size_t i;
+
+        for (i = 0; i < count; ++i) {
+            if (syscall_no_scratch(ctx, &(calls[i])) != 0)
+                return 1;
+        }
+
+        return 0;
+    }
+
+    max = (page_size() - SCRATCH_CODE_START - 1) / STUB_CALL_SIZE;
+
+    while (count != 0) {
+        size_t n = (count < max) ? count : max;
+
+        if (syscall_batch_scratch(ctx, calls, n) != 0)
+            return 1;
+
+        calls += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Run a system call in the stopped process.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[out] out_ret - raw return value (-errno on failure)
+ * @param[in] nr - system call number (SYS_*)
+ * @param[in] args - system call arguments
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_remote_syscall(struct ptracer_ctx *ctx, long *out_ret, long nr,
+    const unsigned long args[6])
+{
+    struct ptracer_remote_syscall call;
+
+    call.nr = nr;
+    memcpy(call.args, args, sizeof(call.args));
+    call.ret = 0;
+
+    if (ptracer_remote_syscalls(ctx, &call, 1) != 0)
+        return 1;
+
+    *out_ret = call.ret;
+
+    return 0;
+}
+
+/**
+ * Call a function in the stopped process.
+ *
+ * The function runs on the process stack, below the red zone, and
+ * returns into a trap in the scratch area (mapped if needed).  All
+ * registers, including the FPU/vector state, are restored afterwards.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[in] func - address of the function in the process
+ * @param[in] args - integer / pointer arguments
+ * @param[in] nargs - number of arguments, at most 6
+ * @param[out] out_ret - return value, may be NULL
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_remote_call(struct ptracer_ctx *ctx, unsigned long func,
+    const unsigned long *args, size_t nargs, unsigned long *out_ret)
+{
+    int err;
+    unsigned long sp;
+    unsigned long trap;
+    struct inject_state st;
+    struct user_regs_struct *regs;
+    unsigned long noargs[SYSCALL_NARGS] = { 0 };
+
+    if (nargs > SYSCALL_NARGS) {
+        errno = EINVAL;
+        return 1;
+    }
+
+    if (ptracer_scratch_map(ctx) != 0)
+        return 1;
+
+    trap = ctx->inject.scratch + SCRATCH_CODE_PAGE * page_size();
+
+    if (state_save(ctx, &st, 1) != 0) {
+        free(st.xstate);
+        return 1;
+    }
+
+    regs = ptracer_regs(ctx);
+    sp = (regs_sp(&(st.regs)) - STACK_RED_ZONE) & ~15UL;
+
+    /* Clears orig_*ax so no syscall restart happens. */
+    set_syscall(regs, 0, noargs);
+
+#if defined(__x86_64__)
+    {
+        /* rdi, rsi, rdx, rcx, r8, r9 */
+        unsigned long long *argregs[SYSCALL_NARGS] = {
+            &(regs->rdi), &(regs->rsi), &(regs->rdx),
+            &(regs->rcx), &(regs->r8), &(regs->r9)
+        };
+        size_t i;
+
+        for (i = 0; i < nargs; ++i)
+            *(argregs[i]) = args[i];
+
+        /* Return address; rsp is then 8 mod 16 at entry, as after
+         * a call instruction. */
+        sp -= sizeof(unsigned long);
+        err = ptracer_write_mem(ctx, sp, &trap, sizeof(trap));
+    }
+#elif defined(__i386__)
+    /* cdecl: arguments on the stack, 16 byte aligned at the call. */
+    sp -= nargs * sizeof(unsigned long);
+    sp &= ~15UL;
+    err = ptracer_write_mem(ctx, sp, args, nargs * sizeof(unsigned long));
+
+    if (err == 0) {
+        sp -= sizeof(unsigned long);
+        err = ptracer_write_mem(ctx, sp, &trap, sizeof(trap));
+    }
+#endif
+
+    if (err == 0) {
+        set_regs_sp(regs, sp);
+        set_inst_ptr(regs, (INST_PTR_TYPE)func);
+        ptracer_regs_dirty(ctx, PTRACER_REGSET_GENERAL);
+
+        err = run_to_trap(ctx, 0);
+    }
+
+    if (err == 0) {
+        regs = ptracer_regs(ctx);
+
+        if (regs == NULL) {
+            err = -1;
+        } else if ((unsigned long)get_inst_ptr(regs) != trap + 1) {
+            errno = EFAULT;
+            err = -1;
+        } else if (out_ret != NULL) {
+            *out_ret = (unsigned long)get_syscall_ret(regs);
+        }
+    }
+
+    if (state_restore(ctx, &st) != 0)
+        err = -1;
+
+    return (err == 0) ? 0 : 1;
+}
+
+
+/**
+ * Map the persistent scratch area in the process, if not mapped yet.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_scratch_map(struct ptracer_ctx *ctx)
+{
+    long ret;
+    unsigned long base;
+    unsigned char trap = INSN_INT3;
+    const size_t psize = page_size();
+    struct ptracer_remote_syscall call;
+
+    if (ctx->inject.scratch != 0)
+        return 0;
+
+    memset(&call, 0, sizeof(call));
+    call.nr = SYS_MMAP;
+    call.args[0] = 0;
+    call.args[1] = SCRATCH_PAGES * psize;
+    call.args[2] = PROT_READ | PROT_WRITE;
+    call.args[3] = MAP_PRIVATE | MAP_ANONYMOUS;
+    call.args[4] = (unsigned long)-1;
+    call.args[5] = MMAP_OFFSET(0);
+
+    if (ptracer_remote_syscalls(ctx, &call, 1) != 0)
+        return 1;
+
+    if (IS_SYSCALL_ERR(call.ret)) {
+        errno = (int)-call.ret;
+        return 1;
+    }
+
+    base = (unsigned long)call.ret;
+
+    /* Code page is never writable from inside the process. */
+    memset(&call, 0, sizeof(call));
+    call.nr = SYS_mprotect;
+    call.args[0] = base + SCRATCH_CODE_PAGE * psize;
+    call.args[1] = psize;
+    call.args[2] = PROT_READ | PROT_EXEC;
+
+    if (ptracer_remote_syscalls(ctx, &call, 1) != 0)
+        return 1;
+
+    ret = call.ret;
+
+    if (ret == 0)
+        ret = (ptracer_write_mem(ctx, base, &trap, 1) == 0) ? 0 : -errno;
+
+    if (ret != 0) {
+        memset(&call, 0, sizeof(call));
+        call.nr = SYS_munmap;
+        call.args[0] = base;
+        call.args[1] = SCRATCH_PAGES * psize;
+
+        (void)ptracer_remote_syscalls(ctx, &call, 1);
+
+        errno = (int)-ret;
+        return 1;
+    }
+
+    ctx->inject.scratch = base;
+    ctx->inject.scratch_size = SCRATCH_PAGES * psize;
+
+    return 0;
+}
+
+/**
+ * Get the part of the scratch area free for callers,
+ * mapping the scratch area if needed.
+ *
+ * @param ctx - ptracer context structure
+ * @param[out] out_size - size of the area, may be NULL
+ *
+ * @return address of the area in the process on success
+ * @return 0 on failure with error returned in errno
+ */
+unsigned long
+ptracer_scratch_data(struct ptracer_ctx *ctx, size_t *out_size)
+{
+    if (ptracer_scratch_map(ctx) != 0)
+        return 0;
+
+    if (out_size != NULL)
+        *out_size = page_size();
+
+    return ctx->inject.scratch + SCRATCH_DATA_PAGE * page_size();
+}
+
+/**
+ * Unmap the scratch area from the process.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_scratch_unmap(struct ptracer_ctx *ctx)
+{
+    long ret;
+    unsigned long args[SYSCALL_NARGS] = { 0 };
+
+    if (ctx->inject.scratch == 0)
+        return 0;
+
+    args[0] = ctx->inject.scratch;
+    args[1] = ctx->inject.scratch_size;
+
+    /* Forget it first so the munmap does not run from it. */
+    ptracer_scratch_forget(ctx);
+
+    if (ptracer_remote_syscall(ctx, &ret, SYS_munmap, args) != 0)
+        return 1;
+
+    if (ret != 0) {
+        errno = (int)-ret;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Forget the scratch area without unmapping it,
+ * e.g. after the process called execve().
+ *
+ * @param ctx - ptracer context structure
+ */
+void
+ptracer_scratch_forget(struct ptracer_ctx *ctx)
+{
+    ctx->inject.scratch = 0;
+    ctx->inject.scratch_size = 0;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,289 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ptracer.h"
+
+/**
+ * @file mem.c
+ *
+ * Bulk memory access for the traced process.
+ *
+ * The ptrace_* versions move data one word at a time through
+ * PTRACE_PEEKTEXT / PTRACE_POKETEXT, doing a read-modify-write of
+ * partial words at either end of the range.
+ *
+ * The ptracer_* versions go through /proc/<pid>/mem, which costs a
+ * single syscall for the whole range and (like POKETEXT) is allowed
+ * to write into read-only text mappings.  The file is opened on first
+ * use and kept in ctx->mem_fd.  If it cannot be opened, they fall back
+ * to the word-at-a-time versions.
+ */
+
+static int
+open_mem_fd(struct ptracer_ctx *ctx)
+{
+    char path[64];
+
+    if (ctx->mem_fd >= 0)
+        return ctx->mem_fd;
+
+    /* Only try once. */
+    if (ctx->mem_fd == PTRACER_MEM_FD_UNAVAILABLE)
+        return -1;
+
+    (void)snprintf(path, sizeof(path), "/proc/%u/mem",
+        (unsigned int)ctx->pid);
+
+    ctx->mem_fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (ctx->mem_fd < 0) {
+        ctx->mem_fd = PTRACER_MEM_FD_UNAVAILABLE;
+        return -1;
+    }
+
+    return ctx->mem_fd;
+}
+
+/**
+ * Close the /proc/<pid>/mem file, if open.
+ *
+ * @param ctx - ptracer context structure
+ */
+void
+ptracer_close_mem(struct ptracer_ctx *ctx)
+{
+    if (ctx->mem_fd >= 0)
+        (void)close(ctx->mem_fd);
+
+    ctx->mem_fd = PTRACER_MEM_FD_CLOSED;
+}
+
+
+/**
+ * Read memory from the traced process.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] addr - address to read from
+ * @param[out] buf - storage location for the data
+ * @param[in] len - number of bytes to read
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_read_mem(struct ptracer_ctx *ctx, unsigned long addr,
+    void *buf, size_t len)
+{
+    int fd;
+    char *pbuf = buf;
+
+    fd = open_mem_fd(ctx);
+
+    if (fd < 0)
+        return ptrace_read_mem(ctx->pid, addr, buf, len);
+
+    while (len != 0) {
+        ssize_t ret;
+
+        ret = pread(fd, pbuf, len, (off_t)addr);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+
+        /* Unmapped memory. */
+        if (ret == 0) {
+            errno = EIO;
+            return 1;
+        }
+
+        pbuf += ret;
+        addr += (unsigned long)ret;
+        len -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Write memory into the traced process.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] addr - address to write to
+ * @param[in] buf - data to write
+ * @param[in] len - number of bytes to write
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_write_mem(struct ptracer_ctx *ctx, unsigned long addr,
+    const void *buf, size_t len)
+{
+    int fd;
+    const char *pbuf = buf;
+
+    fd = open_mem_fd(ctx);
+
+    if (fd < 0)
+        return ptrace_write_mem(ctx->pid, addr, buf, len);
+
+    while (len != 0) {
+        ssize_t ret;
+
+        ret = pwrite(fd, pbuf, len, (off_t)addr);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+
+        if (ret == 0) {
+            errno = EIO;
+            return 1;
+        }
+
+        pbuf += ret;
+        addr += (unsigned long)ret;
+        len -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Read memory from a traced process using PTRACE_PEEKTEXT.
+ *
+ * @param[in] pid - process id to read from
+ * @param[in] addr - address to read from
+ * @param[out] buf - storage location for the data
+ * @param[in] len - number of bytes to read
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_read_mem(pid_t pid, unsigned long addr, void *buf, size_t len)
+{
+    char *pbuf = buf;
+    unsigned long word;
+    const size_t wsize = sizeof(word);
+
+    /* Unaligned head. */
+    if ((addr % wsize) != 0) {
+        size_t off = addr % wsize;
+        size_t n = wsize - off;
+
+        if (n > len)
+            n = len;
+
+        if (ptrace_peektext(pid, addr - off, &word) != 0)
+            return 1;
+
+        memcpy(pbuf, (char *)&word + off, n);
+
+        pbuf += n;
+        addr += n;
+        len -= n;
+    }
+
+    while (len >= wsize) {
+        if (ptrace_peektext(pid, addr, &word) != 0)
+            return 1;
+
+        memcpy(pbuf, &word, wsize);
+
+        pbuf += wsize;
+        addr += wsize;
+        len -= wsize;
+    }
+
+    /* Tail. */
+    if (len != 0) {
+        if (ptrace_peektext(pid, addr, &word) != 0)
+            return 1;
+
+        memcpy(pbuf, &word, len);
+    }
+
+    return 0;
+}
+
+/**
+ * Write memory into a traced process using PTRACE_POKETEXT.
+ *
+ * Partial words at either end are read first so the
+ * surrounding bytes are preserved.
+ *
+ * @param[in] pid - process id to write to
+ * @param[in] addr - address to write to
+ * @param[in] buf - data to write
+ * @param[in] len - number of bytes to write
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_write_mem(pid_t pid, unsigned long addr, const void *buf, size_t len)
+{
+    const char *pbuf = buf;
+    unsigned long word;
+    const size_t wsize = sizeof(word);
+
+    /* Unaligned head. */
+    if ((addr % wsize) != 0) {
+        size_t off = addr % wsize;
+        size_t n = wsize - off;
+
+        if (n > len)
+            n = len;
+
+        if (ptrace_peektext(pid, addr - off, &word) != 0)
+            return 1;
+
+        memcpy((char *)&word + off, pbuf, n);
+
+        if (ptrace_poketext(pid, addr - off, word) != 0)
+            return 1;
+
+        pbuf += n;
+        addr += n;
+        len -= n;
+    }
+
+    while (len >= wsize) {
+        memcpy(&word, pbuf, wsize);
+
+        if (ptrace_poketext(pid, addr, word) != 0)
+            return 1;
+
+        pbuf += wsize;
+        addr += wsize;
+        len -= wsize;
+    }
+
+    /* Tail. */
+    if (len != 0) {
+        if (ptrace_peektext(pid, addr, &word) != 0)
+            return 1;
+
+        memcpy(&word, pbuf, len);
+
+        if (ptrace_poketext(pid, addr, word) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
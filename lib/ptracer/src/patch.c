@@ -0,0 +1,787 @@
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/util.h"
+#include "shared/list.h"
+#include "ptracer.h"
+#include "regs.h"
+
+/**
+ * @file patch.c
+ *
+ * Code patches which can be switched on and off.
+ *
+ * A patch is a run of bytes to write at an address; patches are kept
+ * in sets and a set is always enabled or disabled as a whole.  The
+ * original bytes are saved when a patch is written and put back when
+ * it is disabled.
+ *
+ * Switching works like the batched breakpoint patching in ptracer.c:
+ * every patch which changes state is sorted by address and grouped by
+ * page, and each group costs one read and one write of the span it
+ * covers, whatever the number of sets and patches involved.
+ *
+ * Before anything is written the instruction pointer of every thread
+ * is checked; a thread stopped inside a patched range (past its first
+ * byte) would resume in the middle of an instruction, so the switch
+ * fails with EBUSY instead.  Registers come from the register cache
+ * when they were fetched this stop and from /proc/<pid>/task/<tid>/syscall
+ * otherwise.  Threads the kernel reports as running cannot be checked
+ * and are skipped; stop the whole process first.
+ *
+ * Enabled patches may not overlap each other or an enabled breakpoint.
+ * A breakpoint enabled over a patch after the fact keeps working: its
+ * int3 is left in place when the patch is disabled.
+ */
+
+#define NOP_INSN   (0x90)
+#define BREAKPOINT_INSN (0xCC)
+#define JMP_INSN   (0xe9)
+#define JMP_LENGTH (5)
+
+struct patch_op {
+    struct ptracer_patch *patch;
+    int enable;
+};
+
+
+static int
+patch_op_cmp(const void *a, const void *b)
+{
+    const struct patch_op *x = a;
+    const struct patch_op *y = b;
+
+    return (x->patch->addr > y->patch->addr)
+        - (x->patch->addr < y->patch->addr);
+}
+
+static int
+patch_ptr_cmp(const void *a, const void *b)
+{
+    const struct ptracer_patch *x = *(struct ptracer_patch **)a;
+    const struct ptracer_patch *y = *(struct ptracer_patch **)b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int
+set_in(struct ptracer_patch_set *set, struct ptracer_patch_set **sets,
+    size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (sets[i] == set)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* Thread instruction pointers. */
+
+static int
+thread_ip_cached(struct ptracer_ctx *ctx, pid_t tid, unsigned long *ip)
+{
+    struct list_head *entry;
+    struct ptracer_regcache *rc = NULL;
+
+    if (tid == ctx->pid) {
+        rc = &(ctx->regcache);
+    }
+    else {
+        list_for_each(entry, &(ctx->thread_regcaches)) {
+            struct ptracer_regcache *node;
+
+            node = list_entry(entry, struct ptracer_regcache, node);
+
+            if (node->tid == tid) {
+                rc = node;
+                break;
+            }
+        }
+    }
+
+    if (rc == NULL || !(rc->valid & PTRACER_REGSET_GENERAL))
+        return 0;
+
+    *ip = (unsigned long)get_inst_ptr(&(rc->regs));
+
+    return 1;
+}
+
+/* The last field of /proc/<pid>/task/<tid>/syscall is the user space
+ * instruction pointer of a blocked thread. */
+static int
+thread_ip_proc(pid_t pid, pid_t tid, unsigned long *ip)
+{
+    int fd;
+    ssize_t n;
+    char buf[256];
+    char *field;
+
+    (void)snprintf(buf, sizeof(buf), "/proc/%u/task/%u/syscall",
+        (unsigned int)pid, (unsigned int)tid);
+
+    fd = open(buf, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return 0;
+
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0)
+        return 0;
+
+    buf[n] = '\0';
+
+    if (strncmp(buf, "running", 7) == 0)
+        return 0;
+
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+        buf[--n] = '\0';
+
+    field = strrchr(buf, ' ');
+
+    if (field == NULL)
+        return 0;
+
+    *ip = strtoul(field + 1, NULL, 0);
+
+    return 1;
+}
+
+/* Fill ips with the instruction pointer of every thread which could
+ * be read.  Returns the number of entries, with *ips malloc'd. */
+static ssize_t
+thread_ips(struct ptracer_ctx *ctx, unsigned long **ips)
+{
+    DIR *dir;
+    char path[64];
+    size_t count = 0;
+    size_t alloc = 0;
+    struct dirent *dent;
+    unsigned long *list = NULL;
+
+    (void)snprintf(path, sizeof(path), "/proc/%u/task",
+        (unsigned int)ctx->pid);
+
+    dir = opendir(path);
+
+    if (dir == NULL)
+        return -1;
+
+    while ((dent = readdir(dir)) != NULL) {
+        pid_t tid;
+        unsigned long ip;
+
+        if (dent->d_name[0] < '0' || dent->d_name[0] > '9')
+            continue;
+
+        tid = (pid_t)strtoul(dent->d_name, NULL, 10);
+
+        if (!thread_ip_cached(ctx, tid, &ip)
+                && !thread_ip_proc(ctx->pid, tid, &ip))
+            continue;
+
+        if (count == alloc) {
+            unsigned long *tmp;
+
+            alloc = (alloc == 0) ? 16 : alloc * 2;
+            tmp = realloc(list, alloc * sizeof(*list));
+
+            if (tmp == NULL) {
+                int oerrno = errno;
+                free(list);
+                closedir(dir);
+                errno = oerrno;
+                return -1;
+            }
+
+            list = tmp;
+        }
+
+        list[count++] = ip;
+    }
+
+    closedir(dir);
+
+    *ips = list;
+
+    return (ssize_t)count;
+}
+
+
+/* Checks run before anything is written. */
+
+/* Enabled patches after the switch must not overlap. */
+static int
+check_overlap(struct ptracer_ctx *ctx,
+    struct ptracer_patch_set **on, size_t non,
+    struct ptracer_patch_set **off, size_t noff)
+{
+    int ret = -1;
+    size_t i;
+    size_t count = 0;
+    struct list_head *sentry;
+    struct ptracer_patch **patches;
+
+    list_for_each(sentry, &(ctx->patch_sets)) {
+        struct ptracer_patch_set *set = ptracer_patch_set_entry(sentry);
+
+        if (set->enabled ? !set_in(set, off, noff) : set_in(set, on, non))
+            count += set->count;
+    }
+
+    if (count < 2)
+        return 0;
+
+    patches = malloc(count * sizeof(*patches));
+
+    if (patches == NULL)
+        return -1;
+
+    count = 0;
+
+    list_for_each(sentry, &(ctx->patch_sets)) {
+        struct list_head *entry;
+        struct ptracer_patch_set *set = ptracer_patch_set_entry(sentry);
+
+        if (set->enabled ? set_in(set, off, noff) : !set_in(set, on, non))
+            continue;
+
+        list_for_each(entry, &(set->patches))
+            patches[count++] = ptracer_patch_entry(entry);
+    }
+
+    qsort(patches, count, sizeof(*patches), patch_ptr_cmp);
+
+    for (i = 1; i < count; ++i) {
+        if (patches[i - 1]->addr + patches[i - 1]->length > patches[i]->addr) {
+            errno = EBUSY;
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+
+    free(patches);
+
+    return ret;
+}
+
+static int
+check_ops(struct ptracer_ctx *ctx, struct patch_op *ops, size_t count)
+{
+    size_t i;
+    ssize_t nips;
+    unsigned long *ips = NULL;
+
+    for (i = 0; i < count; ++i) {
+        size_t j;
+        const struct ptracer_patch *p = ops[i].patch;
+
+        if (!ops[i].enable)
+            continue;
+
+        for (j = 0; j < p->length; ++j) {
+            struct ptracer_breakpoint *bp;
+
+            bp = ptracer_find_breakpoint(ctx, p->addr + j);
+
+            if (bp != NULL && bp->enabled) {
+                errno = EBUSY;
+                return -1;
+            }
+        }
+    }
+
+    nips = thread_ips(ctx, &ips);
+
+    if (nips < 0)
+        return -1;
+
+    for (i = 0; i < count; ++i) {
+        ssize_t j;
+        const struct ptracer_patch *p = ops[i].patch;
+
+        for (j = 0; j < nips; ++j) {
+            if (ips[j] > p->addr && ips[j] < p->addr + p->length) {
+                free(ips);
+                errno = EBUSY;
+                return -1;
+            }
+        }
+    }
+
+    free(ips);
+
+    return 0;
+}
+
+
+/* Writing. */
+
+static void
+patch_restore(struct ptracer_ctx *ctx, struct ptracer_patch *p,
+    unsigned char *dst)
+{
+    size_t j;
+
+    memcpy(dst, p->orig, p->length);
+
+    /* Keep the int3 of a breakpoint set inside the patch. */
+    for (j = 0; j < p->length; ++j) {
+        struct ptracer_breakpoint *bp;
+
+        bp = ptracer_find_breakpoint(ctx, p->addr + j);
+
+        if (bp != NULL && bp->enabled) {
+            bp->orig_byte = dst[j];
+            dst[j] = BREAKPOINT_INSN;
+        }
+    }
+}
+
+static int
+patch_group(struct ptracer_ctx *ctx, struct patch_op *ops, size_t count,
+    size_t span, unsigned char *buf, int invert)
+{
+    size_t i;
+    unsigned long start;
+
+    start = ops[0].patch->addr;
+
+    if (ptracer_read_mem(ctx, start, buf, span) != 0)
+        return -1;
+
+    /* Restore first: a patch being enabled may cover the bytes of one
+     * being disabled and must save what is under both. */
+    for (i = 0; i < count; ++i) {
+        struct ptracer_patch *p = ops[i].patch;
+
+        if ((ops[i].enable != 0) == (invert != 0))
+            patch_restore(ctx, p, buf + (p->addr - start));
+    }
+
+    for (i = 0; i < count; ++i) {
+        struct ptracer_patch *p = ops[i].patch;
+        unsigned char *dst = buf + (p->addr - start);
+
+        if ((ops[i].enable != 0) != (invert != 0)) {
+            memcpy(p->orig, dst, p->length);
+            memcpy(dst, p->bytes, p->length);
+        }
+    }
+
+    if (ptracer_write_mem(ctx, start, buf, span) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Write ops[0, count) page by page.  On failure the groups already
+ * written are put back and errno is kept. */
+static int
+patch_ops(struct ptracer_ctx *ctx, struct patch_op *ops, size_t count,
+    int invert)
+{
+    int ret = -1;
+    int oerrno;
+    size_t i;
+    size_t page_size;
+    size_t buf_size = 0;
+    unsigned char *buf = NULL;
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    i = 0;
+    while (i < count) {
+        size_t n = 1;
+        size_t span;
+        unsigned long start;
+        unsigned long page;
+
+        start = ops[i].patch->addr;
+        page = start & ~(unsigned long)(page_size - 1);
+        span = ops[i].patch->length;
+
+        /* Same page, or overlapping a patch of the group which runs
+         * into the next page. */
+        while ((i + n) < count
+                && ((ops[i + n].patch->addr
+                        & ~(unsigned long)(page_size - 1)) == page
+                    || ops[i + n].patch->addr < start + span)) {
+            size_t end = (size_t)(ops[i + n].patch->addr - start)
+                + ops[i + n].patch->length;
+
+            if (end > span)
+                span = end;
+
+            ++n;
+        }
+
+        /* A patch may run into the next page. */
+        if (span > buf_size) {
+            unsigned char *tmp = realloc(buf, span);
+
+            if (tmp == NULL)
+                goto fail;
+
+            buf = tmp;
+            buf_size = span;
+        }
+
+        if (patch_group(ctx, &(ops[i]), n, span, buf, invert) != 0)
+            goto fail;
+
+        i += n;
+    }
+
+    ret = 0;
+
+    free(buf);
+
+    return ret;
+
+fail:
+
+    oerrno = errno;
+    free(buf);
+
+    if (i != 0)
+        (void)patch_ops(ctx, ops, i, !invert);
+
+    errno = oerrno;
+
+    return ret;
+}
+
+static size_t
+collect_ops(struct patch_op *ops, size_t count,
+    struct ptracer_patch_set **sets, size_t nsets, int enable)
+{
+    size_t i;
+
+    for (i = 0; i < nsets; ++i) {
+        struct list_head *entry;
+
+        if ((sets[i]->enabled != 0) == (enable != 0))
+            continue;
+
+        list_for_each(entry, &(sets[i]->patches)) {
+            ops[count].patch = ptracer_patch_entry(entry);
+            ops[count].enable = enable;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+/**
+ * Create an empty patch set.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return new disabled patch set, freed with ptracer_fini() or
+ *         ptracer_patch_set_free()
+ * @return NULL on failure with error returned in errno
+ */
+struct ptracer_patch_set *
+ptracer_patch_set_new(struct ptracer_ctx *ctx)
+{
+    struct ptracer_patch_set *set;
+
+    set = calloc(1, sizeof(*set));
+
+    if (set == NULL)
+        return NULL;
+
+    list_head_init(&(set->patches));
+    list_add_tail(&(set->node), &(ctx->patch_sets));
+
+    return set;
+}
+
+/**
+ * Disable a patch set if needed and free it.
+ *
+ * @param ctx - ptracer context structure
+ * @param set - patch set
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno; the set is
+ *         still enabled and was not freed
+ */
+int
+ptracer_patch_set_free(struct ptracer_ctx *ctx,
+    struct ptracer_patch_set *set)
+{
+    struct list_head *next;
+    struct list_head *entry;
+
+    if (set->enabled && ptracer_patch_set_disable(ctx, set) != 0)
+        return -1;
+
+    list_for_each_safe(entry, next, &(set->patches)) {
+        list_del(entry);
+        free(ptracer_patch_entry(entry));
+    }
+
+    list_del(&(set->node));
+    free(set);
+
+    return 0;
+}
+
+/**
+ * Add a patch to a disabled set.
+ *
+ * @param set - patch set
+ * @param[in] addr - address to patch
+ * @param[in] bytes - new contents
+ * @param[in] length - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_patch_add(struct ptracer_patch_set *set,
+    unsigned long addr, const void *bytes, size_t length)
+{
+    struct ptracer_patch *p;
+
+    if (length == 0 || addr + length < addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (set->enabled) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* One block for the patch and both byte runs. */
+    p = malloc(sizeof(*p) + (length * 2));
+
+    if (p == NULL)
+        return -1;
+
+    p->addr = addr;
+    p->length = length;
+    p->bytes = (unsigned char *)(p + 1);
+    p->orig = p->bytes + length;
+
+    memcpy(p->bytes, bytes, length);
+    memset(p->orig, 0, length);
+
+    list_add_tail(&(p->node), &(set->patches));
+    set->count++;
+
+    return 0;
+}
+
+/**
+ * Add a patch which fills a range with NOPs.
+ *
+ * @param set - patch set
+ * @param[in] addr - start of the range
+ * @param[in] length - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_patch_add_nop(struct ptracer_patch_set *set,
+    unsigned long addr, size_t length)
+{
+    int err;
+    unsigned char *buf;
+
+    if (length == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    buf = malloc(length);
+
+    if (buf == NULL)
+        return -1;
+
+    memset(buf, NOP_INSN, length);
+
+    err = ptracer_patch_add(set, addr, buf, length);
+
+    free(buf);
+
+    return err;
+}
+
+/**
+ * Add a patch which replaces the instruction(s) at from with a
+ * 5 byte relative jump to to.
+ *
+ * @param set - patch set
+ * @param[in] from - address of the jump
+ * @param[in] to - jump target
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno (ERANGE if
+ *         the target is more than 2GiB away)
+ */
+int
+ptracer_patch_add_jump(struct ptracer_patch_set *set,
+    unsigned long from, unsigned long to)
+{
+    int32_t rel;
+    long long delta;
+    unsigned char insn[JMP_LENGTH];
+
+    delta = (long long)to - (long long)(from + JMP_LENGTH);
+
+    if (delta < INT32_MIN || delta > INT32_MAX) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    rel = (int32_t)delta;
+
+    insn[0] = JMP_INSN;
+    memcpy(&(insn[1]), &rel, sizeof(rel));
+
+    return ptracer_patch_add(set, from, insn, sizeof(insn));
+}
+
+/**
+ * Enable some patch sets and disable others with one write per page.
+ *
+ * Sets already in the requested state are left alone.  Nothing is
+ * changed if any check fails.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[in] on - sets to enable
+ * @param[in] non - number of sets in on
+ * @param[in] off - sets to disable
+ * @param[in] noff - number of sets in off
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno (EBUSY if
+ *         patches would overlap each other or an enabled breakpoint,
+ *         or a thread is stopped inside a patched range)
+ */
+int
+ptracer_patch_sets_switch(struct ptracer_ctx *ctx,
+    struct ptracer_patch_set **on, size_t non,
+    struct ptracer_patch_set **off, size_t noff)
+{
+    int ret = -1;
+    size_t i;
+    size_t count = 0;
+    struct patch_op *ops = NULL;
+
+    for (i = 0; i < non; ++i) {
+        if (set_in(on[i], off, noff)) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (!on[i]->enabled)
+            count += on[i]->count;
+    }
+
+    for (i = 0; i < noff; ++i) {
+        if (off[i]->enabled)
+            count += off[i]->count;
+    }
+
+    if (count == 0)
+        goto done;
+
+    if (check_overlap(ctx, on, non, off, noff) != 0)
+        return -1;
+
+    ops = malloc(count * sizeof(*ops));
+
+    if (ops == NULL)
+        return -1;
+
+    count = collect_ops(ops, 0, on, non, 1);
+    count = collect_ops(ops, count, off, noff, 0);
+
+    qsort(ops, count, sizeof(*ops), patch_op_cmp);
+
+    if (check_ops(ctx, ops, count) != 0)
+        goto out;
+
+    if (patch_ops(ctx, ops, count, 0) != 0)
+        goto out;
+
+done:
+
+    for (i = 0; i < non; ++i)
+        on[i]->enabled = 1;
+
+    for (i = 0; i < noff; ++i)
+        off[i]->enabled = 0;
+
+    if (count == 0)
+        return 0;
+
+    ret = 0;
+
+out:
+
+    free(ops);
+
+    return ret;
+}
+
+/**
+ * Write every patch of a set, saving the original bytes.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param set - patch set
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_patch_set_enable(struct ptracer_ctx *ctx,
+    struct ptracer_patch_set *set)
+{
+    return ptracer_patch_sets_switch(ctx, &set, 1, NULL, 0);
+}
+
+/**
+ * Put back the original bytes of every patch of a set.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param set - patch set
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_patch_set_disable(struct ptracer_ctx *ctx,
+    struct ptracer_patch_set *set)
+{
+    return ptracer_patch_sets_switch(ctx, NULL, 0, &set, 1);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
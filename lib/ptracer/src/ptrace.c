@@ -1,11 +1,13 @@
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <signal.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "shared/list.h"
 #include "ptracer.h"
@@ -144,7 +146,9 @@ ptracer_waitpid(struct ptracer_ctx *ctx,
     }
 
     if (WIFSTOPPED(status)) {
-        if (WSTOPSIG(status) == SIGSTOP)
+        /* The SIGSTOP sent by PTRACE_ATTACH is a ptrace stop. */
+        if (WSTOPSIG(status) == SIGSTOP
+                && ctx->expected_next_state != PTRACER_PROC_STATE_PTRACE_STOPPED)
             ctx->current_state = PTRACER_PROC_STATE_SIG_STOPPED;
         else
             ctx->current_state = PTRACER_PROC_STATE_PTRACE_STOPPED;
@@ -292,6 +296,85 @@ ptrace_poketext(pid_t pid, unsigned long addr, unsigned long val)
     return (ptrace(PTRACE_POKETEXT, pid, (void *)addr, (void *)val) == -1);
 }
 
+/* PTRACE_PEEKUSER */
+
+/**
+ * ptracer interface wrapper for PTRACE_PEEKUSER.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] offset - offset into struct user to peek
+ * @param[out] out - word read from the user area
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_peekuser(struct ptracer_ctx *ctx,
+    unsigned long offset, unsigned long *out)
+{
+    return ptrace_peekuser(ctx->pid, offset, out);
+}
+
+/**
+ * Wrapper for PTRACE_PEEKUSER.
+ *
+ * @param[in] pid - process id to peek from
+ * @param[in] offset - offset into struct user to peek
+ * @param[out] out - word read from the user area
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_peekuser(pid_t pid, unsigned long offset, unsigned long *out)
+{
+    long val;
+
+    errno = 0;
+    val = ptrace(PTRACE_PEEKUSER, pid, (void *)offset, 0);
+
+    if (errno != 0)
+        return 1;
+
+    *out = *(unsigned long *)&val;
+    return 0;
+}
+
+/* PTRACE_POKEUSER */
+
+/**
+ * ptracer interface wrapper for PTRACE_POKEUSER.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] offset - offset into struct user to poke
+ * @param[in] val - word to write to the user area
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_pokeuser(struct ptracer_ctx *ctx,
+    unsigned long offset, unsigned long val)
+{
+    return ptrace_pokeuser(ctx->pid, offset, val);
+}
+
+/**
+ * Wrapper for PTRACE_POKEUSER.
+ *
+ * @param[in] pid - process id to poke
+ * @param[in] offset - offset into struct user to poke
+ * @param[in] val - word to write to the user area
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_pokeuser(pid_t pid, unsigned long offset, unsigned long val)
+{
+    return (ptrace(PTRACE_POKEUSER, pid, (void *)offset, (void *)val) == -1);
+}
+
 /* PTRACE_SINGLESTEP */
 
 /**
@@ -308,6 +391,9 @@ ptrace_poketext(pid_t pid, unsigned long addr, unsigned long val)
 int
 ptracer_singlestep(struct ptracer_ctx *ctx)
 {
+    if (ptracer_regs_resume(ctx) != 0)
+        return 1;
+
     ctx->expected_next_state = PTRACER_PROC_STATE_PTRACE_STOPPED;
     return ptrace_singlestep(ctx->pid);
 }
@@ -398,6 +484,9 @@ ptrace_singlestep_waitpid(pid_t pid, int *out_status, int options)
 int
 ptracer_syscall(struct ptracer_ctx *ctx)
 {
+    if (ptracer_regs_resume(ctx) != 0)
+        return 1;
+
     ctx->expected_next_state = PTRACER_PROC_STATE_PTRACE_STOPPED;
     return ptrace_syscall(ctx->pid);
 }
@@ -476,6 +565,7 @@ ptrace_syscall_waitpid(pid_t pid, int *out_status, int options)
 
 /**
  * ptracer interface wrapper for PTRACE_GETREGS.
+ * Served from the register cache.
  *
  * @param[in] ctx - ptracer context structure
  * @param[out] out_regs - storage location for the registers
@@ -486,7 +576,14 @@ ptrace_syscall_waitpid(pid_t pid, int *out_status, int options)
 int
 ptracer_getregs(struct ptracer_ctx *ctx, struct user_regs_struct *out_regs)
 {
-    return ptrace_getregs(ctx->pid, out_regs);
+    struct user_regs_struct *regs = ptracer_regs(ctx);
+
+    if (regs == NULL)
+        return 1;
+
+    memcpy(out_regs, regs, sizeof(*out_regs));
+
+    return 0;
 }
 
 /**
@@ -508,6 +605,7 @@ ptrace_getregs(pid_t pid, struct user_regs_struct *out_regs)
 
 /**
  * ptracer interface wrapper for PTRACE_GETFPREGS.
+ * Served from the register cache.
  *
  * @param[in] ctx - ptracer context structure
  * @param[out] out_regs - storage location for the registers
@@ -519,7 +617,14 @@ int
 ptracer_getfpregs(struct ptracer_ctx *ctx,
     struct user_fpregs_struct *out_regs)
 {
-    return ptrace_getfpregs(ctx->pid, out_regs);
+    struct user_fpregs_struct *fpregs = ptracer_fpregs(ctx);
+
+    if (fpregs == NULL)
+        return 1;
+
+    memcpy(out_regs, fpregs, sizeof(*out_regs));
+
+    return 0;
 }
 
 /**
@@ -541,6 +646,7 @@ ptrace_getfpregs(pid_t pid, struct user_fpregs_struct *out_regs)
 
 /**
  * ptracer interface wrapper for PTRACE_GETREGS and PTRACE_GETFPREGS.
+ * Served from the register cache.
  *
  * @param[in] ctx - ptracer context structure
  * @param[out] out_regs - storage location for the registers
@@ -554,7 +660,10 @@ ptracer_get_all_regs(struct ptracer_ctx *ctx,
     struct user_regs_struct *out_regs,
     struct user_fpregs_struct *out_fpregs)
 {
-    return ptrace_get_all_regs(ctx->pid, out_regs, out_fpregs);
+    if (ptracer_getregs(ctx, out_regs) != 0)
+        return 1;
+
+    return ptracer_getfpregs(ctx, out_fpregs);
 }
 
 /**
@@ -581,6 +690,9 @@ ptrace_get_all_regs(pid_t pid, struct user_regs_struct *out_regs,
 /**
  * ptracer interface wrapper for PTRACE_SETREGS.
  *
+ * The registers are stored in the register cache and
+ * written back when the process is next resumed.
+ *
  * @param[in] ctx - ptracer context structure
  * @param[in] regs - pointer to registers to restore
  *
@@ -591,7 +703,15 @@ int
 ptracer_setregs(struct ptracer_ctx *ctx,
     struct user_regs_struct *regs)
 {
-    return ptrace_setregs(ctx->pid, regs);
+    struct ptracer_regcache *rc = &(ctx->regcache);
+
+    if (regs != &(rc->regs))
+        memcpy(&(rc->regs), regs, sizeof(rc->regs));
+
+    rc->valid |= PTRACER_REGSET_GENERAL;
+    rc->dirty |= PTRACER_REGSET_GENERAL;
+
+    return 0;
 }
 
 /**
@@ -614,6 +734,9 @@ ptrace_setregs(pid_t pid, struct user_regs_struct *regs)
 /**
  * ptracer interface wrapper for PTRACE_SETFPREGS.
  *
+ * The registers are stored in the register cache and
+ * written back when the process is next resumed.
+ *
  * @param[in] ctx - ptracer context structure
  * @param[in] regs - pointer to floating point registers to restore
  *
@@ -624,7 +747,20 @@ int
 ptracer_setfpregs(struct ptracer_ctx *ctx,
     struct user_fpregs_struct *regs)
 {
-    return ptrace_setfpregs(ctx->pid, regs);
+    struct user_fpregs_struct *fpregs;
+
+    /* Fetch first so the rest of the XSAVE area is preserved. */
+    fpregs = ptracer_fpregs(ctx);
+
+    if (fpregs == NULL)
+        return 1;
+
+    if (regs != fpregs)
+        memcpy(fpregs, regs, sizeof(*fpregs));
+
+    ptracer_regs_dirty(ctx, PTRACER_REGSET_XSTATE);
+
+    return 0;
 }
 
 /**
@@ -647,6 +783,9 @@ ptrace_setfpregs(pid_t pid, struct user_fpregs_struct *regs)
 /**
  * ptracer interface wrapper for PTRACE_SETREGS and PTRACE_SETFPREGS.
  *
+ * The registers are stored in the register cache and
+ * written back when the process is next resumed.
+ *
  * @param[in] ctx - ptracer context structure
  * @param[in] regs - pointer to registers to restore
  * @param[in] fpregs - pointer to floating point registers to restore
@@ -659,7 +798,10 @@ ptracer_set_all_regs(struct ptracer_ctx *ctx,
     struct user_regs_struct *regs,
     struct user_fpregs_struct *fpregs)
 {
-    return ptrace_set_all_regs(ctx->pid, regs, fpregs);
+    if (ptracer_setregs(ctx, regs) != 0)
+        return 1;
+
+    return ptracer_setfpregs(ctx, fpregs);
 }
 
 /**
@@ -682,6 +824,116 @@ ptrace_set_all_regs(pid_t pid, struct user_regs_struct *regs,
     return ptrace_setfpregs(pid, fpregs);
 }
 
+/* PTRACE_GETREGSET */
+
+/**
+ * ptracer interface wrapper for PTRACE_GETREGSET.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] type - regset type (NT_PRSTATUS, NT_X86_XSTATE, ...)
+ * @param iov - buffer to fill; iov_len is updated to the size read
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_getregset(struct ptracer_ctx *ctx, int type, struct iovec *iov)
+{
+    return ptrace_getregset(ctx->pid, type, iov);
+}
+
+/**
+ * Wrapper function for PTRACE_GETREGSET.
+ *
+ * @param[in] pid - process id to get registers from
+ * @param[in] type - regset type (NT_PRSTATUS, NT_X86_XSTATE, ...)
+ * @param iov - buffer to fill; iov_len is updated to the size read
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_getregset(pid_t pid, int type, struct iovec *iov)
+{
+    return (ptrace(PTRACE_GETREGSET, pid, (void *)(long)type,
+                (void *)iov) == -1);
+}
+
+/* PTRACE_SETREGSET */
+
+/**
+ * ptracer interface wrapper for PTRACE_SETREGSET.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] type - regset type (NT_PRSTATUS, NT_X86_XSTATE, ...)
+ * @param[in] iov - register data to write
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_setregset(struct ptracer_ctx *ctx, int type, struct iovec *iov)
+{
+    return ptrace_setregset(ctx->pid, type, iov);
+}
+
+/**
+ * Wrapper function for PTRACE_SETREGSET.
+ *
+ * @param[in] pid - process id to set registers for
+ * @param[in] type - regset type (NT_PRSTATUS, NT_X86_XSTATE, ...)
+ * @param[in] iov - register data to write
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_setregset(pid_t pid, int type, struct iovec *iov)
+{
+    return (ptrace(PTRACE_SETREGSET, pid, (void *)(long)type,
+                (void *)iov) == -1);
+}
+
+/* PTRACE_SETOPTIONS */
+
+/**
+ * ptracer interface wrapper for PTRACE_SETOPTIONS.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] options - PTRACE_O_* flags; replaces the current set
+ *
+ * @note
+ *  The options in effect are kept in ctx->options.
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_setoptions(struct ptracer_ctx *ctx, unsigned long options)
+{
+    if (ptrace_setoptions(ctx->pid, options) != 0)
+        return 1;
+
+    ctx->options = options;
+
+    return 0;
+}
+
+/**
+ * Wrapper function for PTRACE_SETOPTIONS.
+ *
+ * @param[in] pid - process id to set options for
+ * @param[in] options - PTRACE_O_* flags
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_setoptions(pid_t pid, unsigned long options)
+{
+    return (ptrace(PTRACE_SETOPTIONS, pid, 0, (void *)options) == -1);
+}
+
 /* PTRACE_CONT */
 
 /**
@@ -702,12 +954,15 @@ ptrace_set_all_regs(pid_t pid, struct user_regs_struct *regs,
 int
 ptracer_cont(struct ptracer_ctx *ctx)
 {
+    if (ptracer_regs_resume(ctx) != 0)
+        return 1;
+
     ctx->expected_next_state = PTRACER_PROC_STATE_PTRACE_STOPPED;
 
     if (ctx->current_state == PTRACER_PROC_STATE_SIG_STOPPED)
         return (kill(ctx->pid, SIGCONT) == -1);
 
-    return ptrace_syscall(ctx->pid);
+    return ptrace_cont(ctx->pid);
 }
 
 /**
@@ -874,6 +1129,72 @@ ptrace_attach_waitpid(pid_t pid, int *out_status, int options)
     return ptrace_waitpid(pid, out_status, options);
 }
 
+/* PTRACE_SEIZE, PTRACE_INTERRUPT, PTRACE_LISTEN
+ *
+ * Thread level only; these do not go through the ptracer state
+ * tracking, so there are no ptracer_* equivalents.  A seized thread
+ * keeps running, PTRACE_INTERRUPT stops it with a PTRACE_EVENT_STOP
+ * and PTRACE_LISTEN leaves it in a group-stop while still reporting
+ * events. */
+
+/**
+ * Wrapper function for PTRACE_SEIZE.
+ *
+ * @param[in] pid - thread id to seize
+ * @param[in] options - PTRACE_O_* flags
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_seize(pid_t pid, unsigned long options)
+{
+    return (ptrace(PTRACE_SEIZE, pid, 0, (void *)options) == -1);
+}
+
+/**
+ * Wrapper function for PTRACE_INTERRUPT.
+ *
+ * @param[in] pid - seized thread id to stop
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_interrupt(pid_t pid)
+{
+    return (ptrace(PTRACE_INTERRUPT, pid, 0, 0) == -1);
+}
+
+/**
+ * Wrapper function for PTRACE_LISTEN.
+ *
+ * @param[in] pid - seized thread id in a group-stop
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_listen(pid_t pid)
+{
+    return (ptrace(PTRACE_LISTEN, pid, 0, 0) == -1);
+}
+
+/**
+ * Wrapper function for PTRACE_CONT delivering a signal.
+ *
+ * @param[in] pid - process id to continue
+ * @param[in] sig - signal to deliver, 0 for none
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptrace_cont_signal(pid_t pid, int sig)
+{
+    return (ptrace(PTRACE_CONT, pid, 0, (void *)(long)sig) == -1);
+}
+
 /* PTRACE_DETATCH */
 
 /**
@@ -890,6 +1211,9 @@ ptrace_attach_waitpid(pid_t pid, int *out_status, int options)
 int
 ptracer_detach(struct ptracer_ctx *ctx)
 {
+    if (ptracer_regs_resume(ctx) != 0)
+        return 1;
+
     ctx->current_state = PTRACER_PROC_STATE_DETACHED;
     return ptrace_detach(ctx->pid);
 }
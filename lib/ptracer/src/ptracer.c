@@ -13,33 +13,17 @@
 #include "shared/util.h"
 #include "shared/list.h"
 #include "ptracer.h"
-
-/*
- * TODO: encapsulate register stuff into a header.
- */
-#if defined(__i386__)
-#define __INST_PTR_MEMBER  eip
-#elif defined(__x86_64__)
-#define __INST_PTR_MEMBER  rip
-#else
-#error Unsupported architecture
-#endif
-
-#define INST_PTR_TYPE \
-    typeof( ((struct user_regs_struct *)0)->__INST_PTR_MEMBER )
-
-#define set_inst_ptr(regp, val) \
-    do { (regp)->__INST_PTR_MEMBER = (INST_PTR_TYPE)(val); } while (0)
-
-#define get_inst_ptr(regp) \
-    ({ \
-        INST_PTR_TYPE __ret = (regp)->__INST_PTR_MEMBER; \
-        __ret; \
-    })
+#include "regs.h"
 
 #define breakpoint_entry(entry) \
     list_entry(entry, struct ptracer_breakpoint, node)
 
+#define breakpoint_hentry(entry) \
+    list_entry(entry, struct ptracer_breakpoint, hnode)
+
+/* int3 */
+#define BREAKPOINT_INSN  (0xCC)
+
 
 static inline int
 __ptracer_cont_and_wait(struct ptracer_ctx *ctx, int *out_status, int options)
@@ -82,12 +66,20 @@ ptracer_init(struct ptracer_ctx *ctx, pid_t pid)
 {
     memset(ctx, 0, sizeof(*ctx));
     ctx->pid = pid;
+    ctx->mem_fd = PTRACER_MEM_FD_CLOSED;
     list_head_init(&(ctx->breakpoints));
+
+    ctx->regcache.tid = pid;
+    list_head_init(&(ctx->regcache.node));
+    list_head_init(&(ctx->thread_regcaches));
+    list_head_init(&(ctx->patch_sets));
+    list_head_init(&(ctx->sample_sets));
 }
 
 void
 ptracer_fini(struct ptracer_ctx *ctx)
 {
+    int i;
     struct list_head *next;
     struct list_head *entry;
 
@@ -96,45 +88,356 @@ ptracer_fini(struct ptracer_ctx *ctx)
 
         list_del(entry);
         node = breakpoint_entry(entry);
+        ptracer_cond_free(node->cond);
         free(node);
     }
+
+    free(ctx->breakpoint_table.buckets);
+    memset(&(ctx->breakpoint_table), 0, sizeof(ctx->breakpoint_table));
+
+    for (i = 0; i < PTRACER_WATCHPOINT_MAX; ++i) {
+        free(ctx->watchpoints[i]);
+        ctx->watchpoints[i] = NULL;
+    }
+
+    free(ctx->syscall_watch.ring.records);
+    memset(&(ctx->syscall_watch), 0, sizeof(ctx->syscall_watch));
+
+    /* Like breakpoints, patches left enabled stay in the process. */
+    list_for_each_safe(entry, next, &(ctx->patch_sets)) {
+        struct ptracer_patch_set *set = ptracer_patch_set_entry(entry);
+
+        set->enabled = 0;
+        (void)ptracer_patch_set_free(ctx, set);
+    }
+
+    list_for_each_safe(entry, next, &(ctx->sample_sets))
+        ptracer_sample_set_free(ctx, ptracer_sample_set_entry(entry));
+
+    ptracer_close_mem(ctx);
+    ptracer_free_regs(ctx);
+}
+
+
+/* Breakpoint table. */
+
+static inline size_t
+breakpoint_hash(unsigned long addr, size_t nbuckets)
+{
+    /* Fibonacci hashing; code addresses are poorly
+     * distributed in their low bits. */
+    return (size_t)((addr * 0x9E3779B97F4A7C15ULL) >> 32) & (nbuckets - 1);
+}
+
+static int
+breakpoint_table_resize(struct ptracer_breakpoint_table *table,
+    size_t nbuckets)
+{
+    size_t i;
+    struct list_head *buckets;
+
+    buckets = malloc(nbuckets * sizeof(*buckets));
+
+    if (buckets == NULL)
+        return -1;
+
+    for (i = 0; i < nbuckets; ++i)
+        list_head_init(&(buckets[i]));
+
+    /* Rehash existing entries. */
+    for (i = 0; i < table->nbuckets; ++i) {
+        struct list_head *next;
+        struct list_head *entry;
+
+        list_for_each_safe(entry, next, &(table->buckets[i])) {
+            struct ptracer_breakpoint *bp;
+
+            bp = breakpoint_hentry(entry);
+            list_add(entry, &(buckets[ breakpoint_hash(bp->addr, nbuckets) ]));
+        }
+    }
+
+    free(table->buckets);
+
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+
+    return 0;
+}
+
+static int
+breakpoint_table_add(struct ptracer_breakpoint_table *table,
+    struct ptracer_breakpoint *bp)
+{
+    size_t pos;
+
+    /* Keep the load factor at or below 1. */
+    if (table->count >= table->nbuckets) {
+        size_t size = table->nbuckets * 2;
+
+        if (size == 0)
+            size = PTRACER_BREAKPOINT_BUCKETS;
+
+        if (breakpoint_table_resize(table, size) != 0)
+            return -1;
+    }
+
+    pos = breakpoint_hash(bp->addr, table->nbuckets);
+
+    list_add(&(bp->hnode), &(table->buckets[pos]));
+    table->count++;
+
+    return 0;
 }
 
+static struct ptracer_breakpoint *
+breakpoint_table_find(const struct ptracer_breakpoint_table *table,
+    unsigned long addr)
+{
+    struct list_head *head;
+    struct list_head *entry;
+
+    if (table->count == 0)
+        return NULL;
+
+    head = &(table->buckets[ breakpoint_hash(addr, table->nbuckets) ]);
+
+    list_for_each(entry, head) {
+        struct ptracer_breakpoint *bp = breakpoint_hentry(entry);
+
+        if (bp->addr == addr)
+            return bp;
+    }
+
+    return NULL;
+}
+
+
+/* Single breakpoint patching (one byte through /proc/<pid>/mem). */
 
 static int
 breakpoint_enable(struct ptracer_ctx *ctx,
     struct ptracer_breakpoint *node)
 {
     int err;
-    unsigned long data;
+    unsigned char byte;
+
+    err = ptracer_read_mem(ctx, node->addr, &byte, 1);
+
+    if (err != 0)
+        return err;
+
+    node->orig_byte = byte;
+    byte = BREAKPOINT_INSN;
+
+    err = ptracer_write_mem(ctx, node->addr, &byte, 1);
+
+    if (err != 0)
+        return err;
+
+    node->enabled = 1;
+
+    return 0;
+}
+
+/* Re-write the int3 of a breakpoint whose original byte is known. */
+static inline int
+breakpoint_rearm(struct ptracer_ctx *ctx,
+    struct ptracer_breakpoint *node)
+{
+    int err;
+    unsigned char byte = BREAKPOINT_INSN;
 
-    err = ptracer_peektext(ctx, node->addr, &data);
+    err = ptracer_write_mem(ctx, node->addr, &byte, 1);
 
     if (err != 0)
         return err;
 
-    node->orig_data = data;
-    *(uint8_t *)&data = 0xCC;
+    node->enabled = 1;
 
-    return ptracer_poketext(ctx, node->addr, data);
+    return 0;
 }
 
 static inline int
 breakpoint_disable(struct ptracer_ctx *ctx,
     struct ptracer_breakpoint *node)
 {
-    return ptracer_poketext(ctx, node->addr, node->orig_data);
+    int err;
+
+    err = ptracer_write_mem(ctx, node->addr, &(node->orig_byte), 1);
+
+    if (err != 0)
+        return err;
+
+    node->enabled = 0;
+
+    return 0;
+}
+
+
+/* Batched breakpoint patching.
+ *
+ * All breakpoints which need to change state are sorted by address
+ * and grouped by page.  Each page group is patched with a single read
+ * of the span covering the group's breakpoints, an in-buffer update
+ * of every int3 byte, and a single write back.
+ */
+
+static int
+breakpoint_addr_cmp(const void *a, const void *b)
+{
+    const struct ptracer_breakpoint *x = *(struct ptracer_breakpoint **)a;
+    const struct ptracer_breakpoint *y = *(struct ptracer_breakpoint **)b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int
+breakpoints_patch_page(struct ptracer_ctx *ctx,
+    struct ptracer_breakpoint **bps, size_t count,
+    unsigned char *buf, int enable)
+{
+    size_t i;
+    size_t span;
+    unsigned long start;
+
+    start = bps[0]->addr;
+    span = (size_t)(bps[count - 1]->addr - start) + 1;
+
+    if (ptracer_read_mem(ctx, start, buf, span) != 0)
+        return -1;
+
+    for (i = 0; i < count; ++i) {
+        size_t off = (size_t)(bps[i]->addr - start);
+
+        if (enable) {
+            bps[i]->orig_byte = buf[off];
+            buf[off] = BREAKPOINT_INSN;
+        }
+        else {
+            buf[off] = bps[i]->orig_byte;
+        }
+    }
+
+    if (ptracer_write_mem(ctx, start, buf, span) != 0)
+        return -1;
+
+    for (i = 0; i < count; ++i)
+        bps[i]->enabled = (enable != 0);
+
+    return 0;
+}
+
+static int
+breakpoints_patch(struct ptracer_ctx *ctx, int enable)
+{
+    int ret = -1;
+    size_t i;
+    size_t count = 0;
+    size_t page_size;
+    unsigned char *buf = NULL;
+    struct list_head *entry;
+    struct ptracer_breakpoint **bps;
+
+    if (list_is_empty(&(ctx->breakpoints)))
+        return 0;
+
+    bps = malloc(ctx->breakpoint_table.count * sizeof(*bps));
+
+    if (bps == NULL)
+        return -1;
+
+    list_for_each(entry, &(ctx->breakpoints)) {
+        struct ptracer_breakpoint *bp = breakpoint_entry(entry);
+
+        if ((bp->enabled != 0) != (enable != 0))
+            bps[count++] = bp;
+    }
+
+    if (count == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    buf = malloc(page_size);
+
+    if (buf == NULL)
+        goto out;
+
+    qsort(bps, count, sizeof(*bps), breakpoint_addr_cmp);
+
+    i = 0;
+    while (i < count) {
+        size_t n = 1;
+        unsigned long page = bps[i]->addr & ~(unsigned long)(page_size - 1);
+
+        while ((i + n) < count
+                && (bps[i + n]->addr & ~(unsigned long)(page_size - 1)) == page)
+            ++n;
+
+        if (breakpoints_patch_page(ctx, &(bps[i]), n, buf, enable) != 0)
+            goto out;
+
+        i += n;
+    }
+
+    ret = 0;
+
+out:
+
+    free(buf);
+    free(bps);
+
+    return ret;
+}
+
+/**
+ * Write the int3 for every registered breakpoint which is not
+ * already enabled.  Breakpoints are patched one page at a time.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_enable_breakpoints(struct ptracer_ctx *ctx)
+{
+    return breakpoints_patch(ctx, 1);
+}
+
+/**
+ * Restore the original bytes for every enabled breakpoint.
+ * Breakpoints are patched one page at a time.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @note
+ *  Must be done before detaching, otherwise the process will
+ *  receive a SIGTRAP the next time it hits one.
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_disable_breakpoints(struct ptracer_ctx *ctx)
+{
+    return breakpoints_patch(ctx, 0);
 }
 
 static int
 breakpoint_resume(struct ptracer_ctx *ctx,
-    struct ptracer_breakpoint *node)
+    struct ptracer_breakpoint *node, int rearm)
 {
     int err;
+    struct user_regs_struct *regs;
 
-    err = ptracer_getregs(ctx, &(ctx->regs));
+    /* Still cached from the trap unless a callback resumed the process. */
+    regs = ptracer_regs(ctx);
 
-    if (err != 0) {
+    if (regs == NULL) {
         /* ptrace error */
         return -1;
     }
@@ -142,16 +445,11 @@ breakpoint_resume(struct ptracer_ctx *ctx,
     /* Disable the breakpoint, rewind the IP back to the original
      * instruction and single-step the process.  This executes the
      * original instruction that was replaced by the breakpoint.
+     * The new IP is written back by ptracer_singlestep().
      */
 
-    set_inst_ptr(&(ctx->regs), (INST_PTR_TYPE)node->addr);
-
-    err = ptracer_setregs(ctx, &(ctx->regs));
-
-    if (err != 0) {
-        /* ptrace error */
-        return -1;
-    }
+    set_inst_ptr(regs, (INST_PTR_TYPE)node->addr);
+    ptracer_regs_dirty(ctx, PTRACER_REGSET_GENERAL);
 
     err = breakpoint_disable(ctx, node);
 
@@ -173,11 +471,13 @@ breakpoint_resume(struct ptracer_ctx *ctx,
         return 0;    
 
     /* Re-enable the breakpoint and let the process run. */
-    err = breakpoint_enable(ctx, node);
+    if (rearm) {
+        err = breakpoint_rearm(ctx, node);
 
-    if (err != 0) {
-        /* ptrace error */
-        return -1;
+        if (err != 0) {
+            /* ptrace error */
+            return -1;
+        }
     }
 
     err = __ptracer_cont_and_wait(ctx, NULL, 0);
@@ -200,114 +500,243 @@ breakpoint_resume(struct ptracer_ctx *ctx,
 }
 
 
-int
-ptracer_set_breakpoint(struct ptracer_ctx *ctx,
+static struct ptracer_breakpoint *
+breakpoint_new(struct ptracer_ctx *ctx,
     unsigned long addr, ptracer_breakpoint_callback cb)
 {
     struct ptracer_breakpoint *node;
 
+    if (breakpoint_table_find(&(ctx->breakpoint_table), addr) != NULL) {
+        errno = EEXIST;
+        return NULL;
+    }
+
     node = calloc(1, sizeof(*node));
 
     if (node == NULL)
-        return -1;
+        return NULL;
 
     node->callback = cb;
     node->addr = addr;
 
+    if (breakpoint_table_add(&(ctx->breakpoint_table), node) != 0) {
+        free(node);
+        return NULL;
+    }
+
     list_add(&(node->node), &(ctx->breakpoints));
 
+    return node;
+}
+
+/**
+ * Register a breakpoint.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] addr - address of the instruction to trap on
+ * @param[in] cb - callback to run when trapped
+ *
+ * @note
+ *  If ptracer_run() has already started, the breakpoint is
+ *  written immediately.
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_set_breakpoint(struct ptracer_ctx *ctx,
+    unsigned long addr, ptracer_breakpoint_callback cb)
+{
+    struct ptracer_breakpoint *node;
+
+    node = breakpoint_new(ctx, addr, cb);
+
+    if (node == NULL)
+        return -1;
+
     if (ctx->started)
         return breakpoint_enable(ctx, node);
 
     return 0;
 }
 
+/**
+ * Register many breakpoints sharing a callback.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] addrs - addresses of the instructions to trap on
+ * @param[in] count - number of addresses
+ * @param[in] cb - callback to run when trapped
+ *
+ * @note
+ *  If ptracer_run() has already started, all new breakpoints are
+ *  written with one read-modify-write per page.
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
 int
-ptracer_clobber_addr(struct ptracer_ctx *ctx,
-    unsigned long addr, size_t length)
+ptracer_set_breakpoints(struct ptracer_ctx *ctx,
+    const unsigned long *addrs, size_t count,
+    ptracer_breakpoint_callback cb)
 {
-    int err;
-    size_t rem_len;
+    size_t i;
 
-    unsigned long data;
-    unsigned long left_addr;
+    for (i = 0; i < count; ++i) {
+        if (breakpoint_new(ctx, addrs[i], cb) == NULL)
+            return -1;
+    }
 
-    left_addr = addr;
+    if (ctx->started)
+        return ptracer_enable_breakpoints(ctx);
 
-    rem_len = length / sizeof(data);
+    return 0;
+}
 
-    if (rem_len != 0) {
-        size_t i;
+/**
+ * Attach a condition to a breakpoint.
+ *
+ * @param bp - breakpoint to modify
+ * @param[in] expr - condition expression (see cond.c), NULL to remove
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_breakpoint_set_condition(struct ptracer_breakpoint *bp,
+    const char *expr)
+{
+    struct ptracer_cond *cond = NULL;
 
-        memset(&data, 0x90, sizeof(data));
+    if (expr != NULL) {
+        cond = ptracer_cond_compile(expr);
 
-        for (i = 0; i < rem_len; ++i) {
-            err = ptracer_poketext(ctx, left_addr, data);
+        if (cond == NULL)
+            return -1;
+    }
 
-            if (err != 0) {
-                /* ptrace error */
-                return -1;
-            }
+    ptracer_cond_free(bp->cond);
+    bp->cond = cond;
 
-            left_addr += (i + 1) * sizeof(data);
-        }
-    }
+    return 0;
+}
+
+/**
+ * Only dispatch one in every `every` hits which pass the condition.
+ *
+ * @param bp - breakpoint to modify
+ * @param[in] every - sampling ratio; 0 or 1 dispatches every hit
+ */
+void
+ptracer_breakpoint_set_sampling(struct ptracer_breakpoint *bp,
+    unsigned long every)
+{
+    bp->sample_every = every;
+}
 
-    rem_len = length % sizeof(data);
+/**
+ * Remove the breakpoint from the process after max_hits dispatches.
+ *
+ * @param bp - breakpoint to modify
+ * @param[in] max_hits - dispatch limit; 0 for no limit
+ */
+void
+ptracer_breakpoint_set_limit(struct ptracer_breakpoint *bp,
+    unsigned long max_hits)
+{
+    bp->max_hits = max_hits;
+}
+
+/* Decide whether a trap should reach the callback.
+ * Returns 1 to dispatch, 0 to silently resume. */
+static int
+breakpoint_should_dispatch(struct ptracer_ctx *ctx,
+    struct ptracer_breakpoint *bp)
+{
+    bp->hits++;
 
-    /* Done clobbering. */
-    if (rem_len == 0)
+    /* An unreadable address in the condition counts as false;
+     * it should not stop tracing of the whole process. */
+    if (bp->cond != NULL && ptracer_cond_eval(ctx, bp->cond) <= 0)
         return 0;
 
-    err = ptracer_peektext(ctx, left_addr, &data);
+    bp->passed++;
 
-    if (err != 0) {
-        /* ptrace error */
-        return -1;
-    }
+    if (bp->sample_every > 1 && (bp->passed % bp->sample_every) != 0)
+        return 0;
 
-    /* Data is sequential, so this works properly
-     * regardless of endianess. */
-    memset(&data, 0x90, rem_len);
+    bp->dispatched++;
 
-    return ptracer_poketext(ctx, left_addr, data);
+    return 1;
 }
 
+/**
+ * Look up a registered breakpoint by address.
+ *
+ * @param[in] ctx - ptracer context structure
+ * @param[in] addr - breakpoint address
+ *
+ * @return breakpoint on success
+ * @return NULL if no breakpoint is registered at addr
+ */
+struct ptracer_breakpoint *
+ptracer_find_breakpoint(struct ptracer_ctx *ctx, unsigned long addr)
+{
+    return breakpoint_table_find(&(ctx->breakpoint_table), addr);
+}
 
-static struct ptracer_breakpoint *
-find_breakpoint_node(struct list_head *head, INST_PTR_TYPE ip)
+/**
+ * Overwrite a range of the process with NOPs.
+ *
+ * One write for the whole range; the original bytes are not kept,
+ * use a patch set (see patch.c) to be able to undo it.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] addr - start of the range
+ * @param[in] length - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_clobber_address(struct ptracer_ctx *ctx,
+    unsigned long addr, size_t length)
 {
-    struct list_head *entry;
+    int err;
+    unsigned char *buf;
 
-    list_for_each(entry, head) {
-        struct ptracer_breakpoint *bp;
+    if (length == 0)
+        return 0;
 
-        bp = breakpoint_entry(entry);
+    buf = malloc(length);
 
-        if (bp->addr == (unsigned long)ip)
-            return bp;
-    }
+    if (buf == NULL)
+        return -1;
 
-    return NULL;
+    memset(buf, 0x90, length);
+
+    err = ptracer_write_mem(ctx, addr, buf, length);
+
+    free(buf);
+
+    return err;
 }
 
+
 int
 ptracer_run(struct ptracer_ctx *ctx)
 {
     int err;
     int wait_status;
-    struct list_head *entry;
 
     ctx->started = 1;
 
     /* Set the breakpoints. */
-    list_for_each(entry, &(ctx->breakpoints)) {
-        err = breakpoint_enable(ctx, breakpoint_entry(entry));
+    err = ptracer_enable_breakpoints(ctx);
 
-        if (err != 0) {
-            /* ptrace error */
-            return err;
-        }
+    if (err != 0) {
+        /* ptrace error */
+        return err;
     }
 
     ctx->current_breakpoint = NULL;
@@ -334,13 +763,33 @@ ptracer_run(struct ptracer_ctx *ctx)
 
     for (;;) {
         struct ptracer_breakpoint *node;
+        struct user_regs_struct *regs;
+
+        /* A watched system call (see syscall_watch.c). */
+        if (PTRACER_STATUS_IS_EVENT(ctx->process_status,
+                    PTRACE_EVENT_SECCOMP)) {
+            err = ptracer_syscall_watch_dispatch(ctx);
+
+            if (err < 0) {
+                /* ptrace or waitpid error */
+                return -1;
+            }
+
+            /* Process terminated inside the system call. */
+            if (PTRACER_PROC_IS_DEAD(ctx))
+                return 0;
+
+            node = NULL;
+            goto resume;
+        }
 
         /* Each iteration at this point it is very likely
-         * that a trap occured. */
+         * that a trap occured.  The registers stay cached
+         * for the callbacks until the process is resumed. */
 
-        err = ptracer_getregs(ctx, &(ctx->regs));
+        regs = ptracer_regs(ctx);
 
-        if (err != 0) {
+        if (regs == NULL) {
             /* ptrace error */
             return -1;
         }
@@ -350,11 +799,21 @@ ptracer_run(struct ptracer_ctx *ctx)
          * byte and the breakpoint is registered by the
          * original IP.
          */
-        node = find_breakpoint_node(&(ctx->breakpoints),
-                    get_inst_ptr(&(ctx->regs)) - 1);
+        node = breakpoint_table_find(&(ctx->breakpoint_table),
+                    (unsigned long)get_inst_ptr(regs) - 1);
 
         if (node == NULL) {
-            /* Seems we did not hit a trap for one of our breakpoints. */
+            /* Not one of our breakpoints, maybe a hardware watchpoint. */
+            err = ptracer_check_watchpoints(ctx);
+
+            if (err < 0) {
+                /* ptrace error */
+                return -1;
+            }
+
+resume:
+
+            /* Nothing else to do for this stop either way. */
             err = __ptracer_cont_and_wait(ctx, &wait_status, 0);
 
             /* 0 shouldn't happen */
@@ -374,14 +833,23 @@ ptracer_run(struct ptracer_ctx *ctx)
             continue;
         }
 
-        /* Call the found breakpoint callback. */
-        ctx->current_breakpoint = node;
+        /* Filter the hit before calling back. */
+        if (breakpoint_should_dispatch(ctx, node)) {
+            /* Call the found breakpoint callback. */
+            ctx->current_breakpoint = node;
 
-        if (node->callback != NULL)
-            node->callback(ctx);
+            /* A failed read is kept in the record, not fatal. */
+            if (node->sample != NULL)
+                (void)ptracer_sample_take(ctx, node->sample, node->addr);
+
+            if (node->callback != NULL)
+                node->callback(ctx);
+        }
 
-        /* Resume execution and wait on next event. */
-        err = breakpoint_resume(ctx, node);
+        /* Resume execution and wait on next event.
+         * Breakpoints that reached their limit stay removed. */
+        err = breakpoint_resume(ctx, node,
+                (node->max_hits == 0 || node->dispatched < node->max_hits));
 
         if (err < 0) {
             /* ptrace or waitpid error */
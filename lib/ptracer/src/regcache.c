@@ -0,0 +1,437 @@
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/util.h"
+#include "shared/list.h"
+#include "ptracer.h"
+
+/**
+ * @file regcache.c
+ *
+ * Per-thread register cache.
+ *
+ * Registers are fetched with PTRACE_GETREGSET the first time they are
+ * asked for during a stop and kept until the thread is resumed.  Any
+ * number of callbacks, conditions and watchpoint checks can then look
+ * at them for free.  Changes are only marked dirty; the dirty sets are
+ * written back with PTRACE_SETREGSET just before the thread is resumed
+ * (ptracer_cont(), ptracer_singlestep(), ptracer_syscall() and
+ * ptracer_detach() do this), and clean sets are never written.
+ *
+ * General purpose registers come from NT_PRSTATUS.  On x86_64 the
+ * floating point registers come from NT_X86_XSTATE, whose first 512
+ * bytes are the FXSAVE area (struct user_fpregs_struct), so the AVX
+ * state comes along for the same syscall.  NT_PRFPREG is used when
+ * XSTATE is not available, and always on i386 where the FSAVE layout
+ * of struct user_fpregs_struct does not match the XSAVE area.
+ *
+ * The main thread's cache is embedded in the context; caches for other
+ * threads are allocated on first use.  Anything which resumes the
+ * process without going through the ptracer_* calls must call
+ * ptracer_flush_regs() and ptracer_invalidate_regs() itself.
+ */
+
+#define regcache_entry(entry) \
+    list_entry(entry, struct ptracer_regcache, node)
+
+/* Initial XSTATE buffer; grown if the kernel fills it. */
+#define XSTATE_INITIAL_SIZE  (4096)
+
+/* Offset of XSTATE_BV in the XSAVE header. */
+#define XSTATE_BV_OFFSET     (512)
+/* x87 and SSE feature bits. */
+#define XSTATE_BV_FPSSE      (0x3ULL)
+
+
+static void
+regcache_init(struct ptracer_regcache *rc, pid_t tid)
+{
+    memset(rc, 0, sizeof(*rc));
+    list_head_init(&(rc->node));
+    rc->tid = tid;
+}
+
+static int
+regcache_fill_general(struct ptracer_regcache *rc)
+{
+    struct iovec iov;
+
+    iov.iov_base = &(rc->regs);
+    iov.iov_len = sizeof(rc->regs);
+
+    if (ptrace_getregset(rc->tid, NT_PRSTATUS, &iov) != 0)
+        return -1;
+
+    rc->valid |= PTRACER_REGSET_GENERAL;
+
+    return 0;
+}
+
+static int
+regcache_grow_xstate(struct ptracer_regcache *rc, size_t size)
+{
+    unsigned char *tmp;
+
+    tmp = realloc(rc->xstate, size);
+
+    if (tmp == NULL)
+        return -1;
+
+    rc->xstate = tmp;
+    rc->xstate_alloc = size;
+
+    return 0;
+}
+
+static int
+regcache_fill_xstate(struct ptracer_regcache *rc)
+{
+    struct iovec iov;
+
+    if (rc->xstate == NULL) {
+        size_t size = XSTATE_INITIAL_SIZE;
+
+        if (size < sizeof(struct user_fpregs_struct))
+            size = sizeof(struct user_fpregs_struct);
+
+        if (regcache_grow_xstate(rc, size) != 0)
+            return -1;
+    }
+
+#if defined(__x86_64__)
+    if (rc->xstate_type != NT_PRFPREG) {
+        for (;;) {
+            iov.iov_base = rc->xstate;
+            iov.iov_len = rc->xstate_alloc;
+
+            if (ptrace_getregset(rc->tid, NT_X86_XSTATE, &iov) != 0) {
+                /* No XSAVE support; use the FXSAVE area only. */
+                if (errno == EINVAL || errno == ENODEV)
+                    break;
+                return -1;
+            }
+
+            /* Filled the buffer exactly; it may have been truncated. */
+            if (iov.iov_len == rc->xstate_alloc) {
+                if (regcache_grow_xstate(rc, rc->xstate_alloc * 2) != 0)
+                    return -1;
+                continue;
+            }
+
+            rc->xstate_type = NT_X86_XSTATE;
+            rc->xstate_size = iov.iov_len;
+            rc->valid |= PTRACER_REGSET_XSTATE;
+
+            return 0;
+        }
+    }
+#endif
+
+    iov.iov_base = rc->xstate;
+    iov.iov_len = sizeof(struct user_fpregs_struct);
+
+    if (ptrace_getregset(rc->tid, NT_PRFPREG, &iov) != 0)
+        return -1;
+
+    rc->xstate_type = NT_PRFPREG;
+    rc->xstate_size = iov.iov_len;
+    rc->valid |= PTRACER_REGSET_XSTATE;
+
+    return 0;
+}
+
+
+/**
+ * Get the register cache for a thread of the traced process.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] tid - thread id (ctx->pid for the main thread)
+ *
+ * @return register cache on success
+ * @return NULL on failure with error returned in errno
+ */
+struct ptracer_regcache *
+ptracer_regcache(struct ptracer_ctx *ctx, pid_t tid)
+{
+    struct list_head *entry;
+    struct ptracer_regcache *rc;
+
+    if (tid == ctx->pid)
+        return &(ctx->regcache);
+
+    list_for_each(entry, &(ctx->thread_regcaches)) {
+        rc = regcache_entry(entry);
+
+        if (rc->tid == tid)
+            return rc;
+    }
+
+    rc = malloc(sizeof(*rc));
+
+    if (rc == NULL)
+        return NULL;
+
+    regcache_init(rc, tid);
+    list_add(&(rc->node), &(ctx->thread_regcaches));
+
+    return rc;
+}
+
+/**
+ * Get the general purpose registers from a register cache,
+ * fetching them if they are not already cached.
+ *
+ * @param rc - register cache
+ *
+ * @return pointer to the cached registers on success
+ * @return NULL on failure with error returned in errno
+ */
+struct user_regs_struct *
+ptracer_regcache_regs(struct ptracer_regcache *rc)
+{
+    if ((rc->valid & PTRACER_REGSET_GENERAL) == 0) {
+        if (regcache_fill_general(rc) != 0)
+            return NULL;
+    }
+
+    return &(rc->regs);
+}
+
+/**
+ * Get the floating point registers from a register cache,
+ * fetching them if they are not already cached.
+ *
+ * @param rc - register cache
+ *
+ * @return pointer to the cached registers on success
+ * @return NULL on failure with error returned in errno
+ */
+struct user_fpregs_struct *
+ptracer_regcache_fpregs(struct ptracer_regcache *rc)
+{
+    if ((rc->valid & PTRACER_REGSET_XSTATE) == 0) {
+        if (regcache_fill_xstate(rc) != 0)
+            return NULL;
+    }
+
+    return (struct user_fpregs_struct *)rc->xstate;
+}
+
+/**
+ * Mark register sets as modified so they are written back
+ * before the thread is resumed.
+ *
+ * @param rc - register cache
+ * @param[in] sets - PTRACER_REGSET_* flags; only cached sets are marked
+ */
+void
+ptracer_regcache_mark_dirty(struct ptracer_regcache *rc, unsigned int sets)
+{
+    rc->dirty |= (sets & rc->valid);
+}
+
+/**
+ * Write back the dirty register sets of a register cache.
+ *
+ * @param rc - register cache
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_regcache_flush(struct ptracer_regcache *rc)
+{
+    struct iovec iov;
+
+    if ((rc->dirty & PTRACER_REGSET_GENERAL) != 0) {
+        iov.iov_base = &(rc->regs);
+        iov.iov_len = sizeof(rc->regs);
+
+        if (ptrace_setregset(rc->tid, NT_PRSTATUS, &iov) != 0)
+            return 1;
+
+        rc->dirty &= ~PTRACER_REGSET_GENERAL;
+    }
+
+    if ((rc->dirty & PTRACER_REGSET_XSTATE) != 0) {
+#if defined(__x86_64__)
+        /* Components whose XSTATE_BV bit is clear are reset to their
+         * initial state by the kernel, which would throw away changes
+         * made through the FXSAVE area. */
+        if (rc->xstate_type == NT_X86_XSTATE
+                && rc->xstate_size >= XSTATE_BV_OFFSET + sizeof(uint64_t)) {
+            uint64_t bv;
+
+            memcpy(&bv, rc->xstate + XSTATE_BV_OFFSET, sizeof(bv));
+            bv |= XSTATE_BV_FPSSE;
+            memcpy(rc->xstate + XSTATE_BV_OFFSET, &bv, sizeof(bv));
+        }
+#endif
+
+        iov.iov_base = rc->xstate;
+        iov.iov_len = rc->xstate_size;
+
+        if (ptrace_setregset(rc->tid, rc->xstate_type, &iov) != 0)
+            return 1;
+
+        rc->dirty &= ~PTRACER_REGSET_XSTATE;
+    }
+
+    return 0;
+}
+
+/**
+ * Drop the cached registers of a register cache.
+ * Dirty registers which were not flushed are lost.
+ *
+ * @param rc - register cache
+ */
+void
+ptracer_regcache_invalidate(struct ptracer_regcache *rc)
+{
+    rc->valid = 0;
+    rc->dirty = 0;
+}
+
+
+/**
+ * Get the cached general purpose registers of the main thread.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @note
+ *  Changes made through the returned pointer must be followed by
+ *  ptracer_regs_dirty() to be written back.
+ *
+ * @return pointer to the cached registers on success
+ * @return NULL on failure with error returned in errno
+ */
+struct user_regs_struct *
+ptracer_regs(struct ptracer_ctx *ctx)
+{
+    return ptracer_regcache_regs(&(ctx->regcache));
+}
+
+/**
+ * Get the cached floating point registers of the main thread.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return pointer to the cached registers on success
+ * @return NULL on failure with error returned in errno
+ */
+struct user_fpregs_struct *
+ptracer_fpregs(struct ptracer_ctx *ctx)
+{
+    return ptracer_regcache_fpregs(&(ctx->regcache));
+}
+
+/**
+ * Mark register sets of the main thread as modified.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] sets - PTRACER_REGSET_* flags
+ */
+void
+ptracer_regs_dirty(struct ptracer_ctx *ctx, unsigned int sets)
+{
+    ptracer_regcache_mark_dirty(&(ctx->regcache), sets);
+}
+
+/**
+ * Write back every dirty register set.
+ *
+ * Threads other than the main thread which are no longer stopped
+ * (ESRCH) are skipped; their changes are dropped.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_flush_regs(struct ptracer_ctx *ctx)
+{
+    struct list_head *entry;
+
+    if (ptracer_regcache_flush(&(ctx->regcache)) != 0)
+        return 1;
+
+    list_for_each(entry, &(ctx->thread_regcaches)) {
+        struct ptracer_regcache *rc = regcache_entry(entry);
+
+        if (ptracer_regcache_flush(rc) != 0 && errno != ESRCH)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Drop every cached register set.
+ *
+ * @param ctx - ptracer context structure
+ */
+void
+ptracer_invalidate_regs(struct ptracer_ctx *ctx)
+{
+    struct list_head *entry;
+
+    ptracer_regcache_invalidate(&(ctx->regcache));
+
+    list_for_each(entry, &(ctx->thread_regcaches))
+        ptracer_regcache_invalidate(regcache_entry(entry));
+}
+
+/**
+ * Flush and invalidate the register caches before resuming.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_regs_resume(struct ptracer_ctx *ctx)
+{
+    if (ptracer_flush_regs(ctx) != 0)
+        return 1;
+
+    ptracer_invalidate_regs(ctx);
+
+    return 0;
+}
+
+/**
+ * Free all register caches.
+ *
+ * @param ctx - ptracer context structure
+ */
+void
+ptracer_free_regs(struct ptracer_ctx *ctx)
+{
+    struct list_head *next;
+    struct list_head *entry;
+
+    list_for_each_safe(entry, next, &(ctx->thread_regcaches)) {
+        struct ptracer_regcache *rc = regcache_entry(entry);
+
+        list_del(entry);
+        free(rc->xstate);
+        free(rc);
+    }
+
+    free(ctx->regcache.xstate);
+    regcache_init(&(ctx->regcache), ctx->pid);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
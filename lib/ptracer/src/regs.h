@@ -0,0 +1,97 @@
+#ifndef H_PTRACER_REGS
+#define H_PTRACER_REGS
+
+#include <sys/user.h>
+
+/* Architecture specific register accessors. */
+
+#if defined(__i386__)
+#define __INST_PTR_MEMBER  eip
+#elif defined(__x86_64__)
+#define __INST_PTR_MEMBER  rip
+#else
+#error Unsupported architecture
+#endif
+
+#define INST_PTR_TYPE \
+    typeof( ((struct user_regs_struct *)0)->__INST_PTR_MEMBER )
+
+#define set_inst_ptr(regp, val) \
+    do { (regp)->__INST_PTR_MEMBER = (INST_PTR_TYPE)(val); } while (0)
+
+#define get_inst_ptr(regp) \
+    ({ \
+        INST_PTR_TYPE __ret = (regp)->__INST_PTR_MEMBER; \
+        __ret; \
+    })
+
+
+/* System call registers.
+ * The number is read from orig_*ax, which keeps it after the
+ * kernel has replaced *ax with the return value. */
+
+#if defined(__i386__)
+#define __SYSCALL_NR_MEMBER   orig_eax
+#define __SYSCALL_RET_MEMBER  eax
+#define __SYSCALL_ARG_MEMBERS(r) \
+    { (r)->ebx, (r)->ecx, (r)->edx, (r)->esi, (r)->edi, (r)->ebp }
+#elif defined(__x86_64__)
+#define __SYSCALL_NR_MEMBER   orig_rax
+#define __SYSCALL_RET_MEMBER  rax
+#define __SYSCALL_ARG_MEMBERS(r) \
+    { (r)->rdi, (r)->rsi, (r)->rdx, (r)->r10, (r)->r8, (r)->r9 }
+#endif
+
+#define SYSCALL_NARGS  (6)
+
+#define get_syscall_nr(regp) \
+    ((long)(regp)->__SYSCALL_NR_MEMBER)
+
+#define get_syscall_ret(regp) \
+    ((long)(regp)->__SYSCALL_RET_MEMBER)
+
+#define set_syscall_ret(regp, val) \
+    do { (regp)->__SYSCALL_RET_MEMBER = (val); } while (0)
+
+static inline void
+get_syscall_args(const struct user_regs_struct *regs,
+    unsigned long args[SYSCALL_NARGS])
+{
+    const unsigned long long vals[SYSCALL_NARGS] =
+        __SYSCALL_ARG_MEMBERS(regs);
+    int i;
+
+    for (i = 0; i < SYSCALL_NARGS; ++i)
+        args[i] = (unsigned long)vals[i];
+}
+
+/* Load registers for entering a system call with the syscall
+ * instruction.  orig_*ax is set to -1 so the kernel does not try
+ * to restart a system call the thread was stopped in. */
+static inline void
+set_syscall(struct user_regs_struct *regs, long nr,
+    const unsigned long args[SYSCALL_NARGS])
+{
+#if defined(__i386__)
+    regs->eax = nr;
+    regs->orig_eax = -1;
+    regs->ebx = args[0];
+    regs->ecx = args[1];
+    regs->edx = args[2];
+    regs->esi = args[3];
+    regs->edi = args[4];
+    regs->ebp = args[5];
+#elif defined(__x86_64__)
+    regs->rax = (unsigned long)nr;
+    regs->orig_rax = (unsigned long)-1;
+    regs->rdi = args[0];
+    regs->rsi = args[1];
+    regs->rdx = args[2];
+    regs->r10 = args[3];
+    regs->r8  = args[4];
+    regs->r9  = args[5];
+#endif
+}
+
+#endif /* H_PTRACER_REGS */
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
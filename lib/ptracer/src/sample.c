@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/util.h"
+#include "shared/list.h"
+#include "ptracer.h"
+
+/**
+ * @file sample.c
+ *
+ * Breakpoint-synchronized sampling.
+ *
+ * A sample set is a list of (address, length) items which are read
+ * together every time a breakpoint it is attached to is dispatched,
+ * e.g. once per call of a frame function.  Each read is appended to
+ * the set's ring buffer as one record.
+ *
+ * The reads are planned once: items are sorted and merged into spans
+ * (overlapping items, and items less than PTRACER_SAMPLE_GAP bytes
+ * apart on the same page), and each item is given the offset of its
+ * bytes within a record.  A sample is then a single process_vm_readv()
+ * of all spans straight into the next ring slot; nothing is copied
+ * afterwards.
+ *
+ * If process_vm_readv() is not available the spans are read one by
+ * one through ptracer_read_mem().  A span which cannot be read leaves
+ * the record marked incomplete and its bytes zeroed.
+ */
+
+#ifndef IOV_MAX
+#define IOV_MAX  (1024)
+#endif
+
+
+static int
+item_addr_cmp(const void *a, const void *b)
+{
+    const struct ptracer_sample_item *x = *(struct ptracer_sample_item **)a;
+    const struct ptracer_sample_item *y = *(struct ptracer_sample_item **)b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static void
+sample_set_reset(struct ptracer_sample_set *set)
+{
+    free(set->spans);
+    free(set->records);
+    free(set->data);
+
+    set->spans = NULL;
+    set->nspans = 0;
+    set->record_size = 0;
+    set->planned = 0;
+
+    set->records = NULL;
+    set->data = NULL;
+    set->size = 0;
+    set->head = 0;
+    set->tail = 0;
+    set->dropped = 0;
+}
+
+
+/**
+ * Create an empty sample set.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return new sample set, freed with ptracer_fini() or
+ *         ptracer_sample_set_free()
+ * @return NULL on failure with error returned in errno
+ */
+struct ptracer_sample_set *
+ptracer_sample_set_new(struct ptracer_ctx *ctx)
+{
+    struct ptracer_sample_set *set;
+
+    set = calloc(1, sizeof(*set));
+
+    if (set == NULL)
+        return NULL;
+
+    list_add_tail(&(set->node), &(ctx->sample_sets));
+
+    return set;
+}
+
+/**
+ * Free a sample set, detaching it from every breakpoint.
+ *
+ * @param ctx - ptracer context structure
+ * @param set - sample set
+ */
+void
+ptracer_sample_set_free(struct ptracer_ctx *ctx,
+    struct ptracer_sample_set *set)
+{
+    struct list_head *entry;
+
+    list_for_each(entry, &(ctx->breakpoints)) {
+        struct ptracer_breakpoint *bp;
+
+        bp = list_entry(entry, struct ptracer_breakpoint, node);
+
+        if (bp->sample == set)
+            bp->sample = NULL;
+    }
+
+    sample_set_reset(set);
+    free(set->items);
+
+    list_del(&(set->node));
+    free(set);
+}
+
+/**
+ * Add an item to a sample set.
+ *
+ * Items are numbered in the order they are added, starting at 0, for
+ * ptracer_sample_value().  Adding to a planned set drops the records
+ * it holds.
+ *
+ * @param set - sample set
+ * @param[in] addr - address to read
+ * @param[in] length - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_sample_set_add(struct ptracer_sample_set *set,
+    unsigned long addr, size_t length)
+{
+    struct ptracer_sample_item *item;
+
+    if (length == 0 || addr + length < addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (set->nitems == set->items_alloc) {
+        size_t alloc;
+        struct ptracer_sample_item *tmp;
+
+        alloc = (set->items_alloc == 0) ? 16 : set->items_alloc * 2;
+        tmp = realloc(set->items, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        set->items = tmp;
+        set->items_alloc = alloc;
+    }
+
+    item = &(set->items[set->nitems++]);
+    item->addr = addr;
+    item->length = length;
+    item->offset = 0;
+
+    if (set->planned)
+        sample_set_reset(set);
+
+    return 0;
+}
+
+/**
+ * Plan the reads of a sample set and allocate its ring.
+ *
+ * Done by ptracer_breakpoint_set_sample() and, if needed, on the
+ * first sample; calling it directly only moves the cost.
+ *
+ * @param set - sample set with at least one item
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_sample_set_plan(struct ptracer_sample_set *set)
+{
+    int ret = -1;
+    size_t i;
+    size_t page_size;
+    size_t size = 0;
+    struct ptracer_sample_item **sorted;
+
+    if (set->planned)
+        return 0;
+
+    if (set->nitems == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sorted = malloc(set->nitems * sizeof(*sorted));
+    set->spans = malloc(set->nitems * sizeof(*(set->spans)));
+
+    if (sorted == NULL || set->spans == NULL)
+        goto out;
+
+    for (i = 0; i < set->nitems; ++i)
+        sorted[i] = &(set->items[i]);
+
+    qsort(sorted, set->nitems, sizeof(*sorted), item_addr_cmp);
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (i = 0; i < set->nitems; ++i) {
+        struct ptracer_sample_item *item = sorted[i];
+        struct iovec *span = NULL;
+        unsigned long end = 0;
+
+        if (set->nspans != 0) {
+            span = &(set->spans[set->nspans - 1]);
+            end = (unsigned long)span->iov_base + span->iov_len;
+        }
+
+        /* Merging must not pull an unmapped page into the span. */
+        if (span != NULL
+                && (item->addr <= end
+                    || (item->addr - end <= PTRACER_SAMPLE_GAP
+                        && (item->addr / page_size)
+                            == ((end - 1) / page_size)))) {
+            unsigned long item_end = item->addr + item->length;
+
+            item->offset = size - span->iov_len
+                + (size_t)(item->addr - (unsigned long)span->iov_base);
+
+            if (item_end > end) {
+                size += (size_t)(item_end - end);
+                span->iov_len += (size_t)(item_end - end);
+            }
+
+            continue;
+        }
+
+        span = &(set->spans[set->nspans++]);
+        span->iov_base = (void *)item->addr;
+        span->iov_len = item->length;
+
+        item->offset = size;
+        size += item->length;
+    }
+
+    set->record_size = size;
+    set->size = PTRACER_SAMPLE_RING_SIZE;
+
+    set->records = calloc(set->size, sizeof(*(set->records)));
+    set->data = calloc(set->size, size);
+
+    if (set->records == NULL || set->data == NULL)
+        goto out;
+
+    set->head = 0;
+    set->tail = 0;
+    set->dropped = 0;
+    set->planned = 1;
+
+    ret = 0;
+
+out:
+
+    free(sorted);
+
+    if (ret != 0) {
+        int oerrno = errno;
+        sample_set_reset(set);
+        errno = oerrno;
+    }
+
+    return ret;
+}
+
+/**
+ * Take a sample at every dispatched hit of a breakpoint.
+ *
+ * The sample is taken after the condition and sampling filters pass
+ * and before the callback runs.  A set may be shared by any number of
+ * breakpoints.
+ *
+ * @param bp - breakpoint to modify
+ * @param set - sample set, NULL to stop sampling
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_breakpoint_set_sample(struct ptracer_breakpoint *bp,
+    struct ptracer_sample_set *set)
+{
+    if (set != NULL && ptracer_sample_set_plan(set) != 0)
+        return -1;
+
+    bp->sample = set;
+
+    return 0;
+}
+
+static int
+read_spans(struct ptracer_ctx *ctx, const struct ptracer_sample_set *set,
+    unsigned char *dst)
+{
+    size_t i;
+    size_t done = 0;
+    int complete = 1;
+
+    /* Usually a single call. */
+    while (done < set->nspans) {
+        ssize_t got;
+        ssize_t want = 0;
+        struct iovec local;
+        size_t n = set->nspans - done;
+
+        if (n > IOV_MAX)
+            n = IOV_MAX;
+
+        for (i = 0; i < n; ++i)
+            want += (ssize_t)set->spans[done + i].iov_len;
+
+        local.iov_base = dst;
+        local.iov_len = (size_t)want;
+
+        got = process_vm_readv(ctx->pid, &local, 1,
+                    &(set->spans[done]), n, 0);
+
+        if (got == want) {
+            dst += want;
+            done += n;
+            continue;
+        }
+
+        if (got < 0 && errno != EFAULT)
+            break;
+
+        /* A span failed; skip it and carry on after it. */
+        if (got < 0)
+            got = 0;
+
+        while (got >= (ssize_t)set->spans[done].iov_len) {
+            got -= (ssize_t)set->spans[done].iov_len;
+            dst += set->spans[done].iov_len;
+            done++;
+        }
+
+        memset(dst, 0, set->spans[done].iov_len);
+        dst += set->spans[done].iov_len;
+        done++;
+        complete = 0;
+    }
+
+    /* No process_vm_readv(); one read per span. */
+    for (i = done; i < set->nspans; ++i) {
+        const struct iovec *span = &(set->spans[i]);
+
+        if (ptracer_read_mem(ctx, (unsigned long)span->iov_base,
+                    dst, span->iov_len) != 0) {
+            memset(dst, 0, span->iov_len);
+            complete = 0;
+        }
+
+        dst += span->iov_len;
+    }
+
+    return complete;
+}
+
+/**
+ * Read every item of a sample set into a new record.
+ *
+ * Called by ptracer_run() for breakpoints with a sample set; may also
+ * be called directly at any stop.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param set - sample set
+ * @param[in] addr - stored in the record, e.g. the breakpoint address
+ *
+ * @return 0 on success
+ * @return not 0 if some items could not be read (the record is still
+ *         added) or the set could not be planned, with error returned
+ *         in errno
+ */
+int
+ptracer_sample_take(struct ptracer_ctx *ctx,
+    struct ptracer_sample_set *set, unsigned long addr)
+{
+    size_t slot;
+    struct ptracer_sample *rec;
+
+    if (!set->planned && ptracer_sample_set_plan(set) != 0)
+        return -1;
+
+    if (set->head - set->tail == set->size) {
+        set->tail++;
+        set->dropped++;
+    }
+
+    slot = set->head & (set->size - 1);
+    rec = &(set->records[slot]);
+
+    rec->seq = set->head;
+    rec->addr = addr;
+    rec->complete = read_spans(ctx, set,
+                        set->data + (slot * set->record_size));
+
+    set->head++;
+
+    if (!rec->complete) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Take records out of a sample set's ring, oldest first.
+ *
+ * @param set - sample set
+ * @param[out] out - storage for the records, may be NULL
+ * @param[out] data - storage for max * set->record_size bytes of
+ *                    record data, may be NULL
+ * @param[in] max - number of records to take at most
+ *
+ * @return number of records taken
+ */
+size_t
+ptracer_sample_read(struct ptracer_sample_set *set,
+    struct ptracer_sample *out, void *data, size_t max)
+{
+    size_t n = 0;
+    unsigned char *dst = data;
+
+    while (n < max && set->tail != set->head) {
+        size_t slot = set->tail & (set->size - 1);
+
+        if (out != NULL)
+            out[n] = set->records[slot];
+
+        if (dst != NULL) {
+            memcpy(dst, set->data + (slot * set->record_size),
+                set->record_size);
+            dst += set->record_size;
+        }
+
+        set->tail++;
+        n++;
+    }
+
+    return n;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,346 @@
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/util.h"
+#include "ptracer.h"
+#include "regs.h"
+
+/**
+ * @file syscall_watch.c
+ *
+ * System call tracing through a seccomp filter.
+ *
+ * PTRACE_SYSCALL stops the process on entry to and exit from every
+ * system call.  Instead, a seccomp-bpf filter is installed in the
+ * process which returns SECCOMP_RET_TRACE for the watched system calls
+ * and SECCOMP_RET_ALLOW for everything else, so only the watched calls
+ * ever reach the tracer (as PTRACE_EVENT_SECCOMP stops).
+ *
+ * On such a stop the number and arguments are recorded, the process
+ * is stepped to the syscall-exit-stop with PTRACE_SYSCALL to pick up
+ * the return value and the record is pushed into a ring buffer.  The
+ * callback (if any) runs at the exit stop and may change the return
+ * value through ptracer_regs().
+ *
+ * The filter is installed by making the process itself call
+ * prctl(PR_SET_SECCOMP) (see inject.c).  If the process lacks
+ * CAP_SYS_ADMIN, PR_SET_NO_NEW_PRIVS is set first, as the kernel
+ * requires.
+ *
+ * @note
+ *  A seccomp filter can never be removed.  While no tracer with
+ *  PTRACE_O_TRACESECCOMP is attached, the watched system calls fail
+ *  with ENOSYS.  ptracer_syscall_unwatch() only stops the recording;
+ *  the process must stay traced for as long as it runs.  The filter
+ *  is installed on the stopped thread only and is inherited by any
+ *  threads or children it creates from then on.
+ */
+
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH  AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_AUDIT_ARCH  AUDIT_ARCH_I386
+#endif
+
+/* Bytes below the stack pointer left alone (x86_64 red zone). */
+#define STACK_RED_ZONE  (128)
+
+
+/* Build the filter program.
+ *
+ *   load arch;  not ours -> allow
+ *   load nr;    nr == nrs[0] -> trace ... nr == nrs[n-1] -> trace
+ *   allow
+ *   trace
+ */
+static size_t
+build_filter(struct sock_filter *prog, const long *nrs, size_t count)
+{
+    size_t i;
+    size_t n = 0;
+
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                    offsetof(struct seccomp_data, arch));
+    prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                    SECCOMP_AUDIT_ARCH, 1, 0);
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+                    SECCOMP_RET_ALLOW);
+
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                    offsetof(struct seccomp_data, nr));
+
+    for (i = 0; i < count; ++i) {
+        /* Jump over the remaining compares and the allow. */
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                        (unsigned int)nrs[i], (unsigned char)(count - i), 0);
+    }
+
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+                    SECCOMP_RET_ALLOW);
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+                    SECCOMP_RET_TRACE);
+
+    return n;
+}
+
+/* Copy the filter onto the process stack, below the red zone,
+ * and have the process install it. */
+static int
+install_filter(struct ptracer_ctx *ctx, const struct sock_filter *prog,
+    size_t len)
+{
+    long ret;
+    unsigned long sp;
+    unsigned long prog_addr;
+    unsigned long fprog_addr;
+    struct sock_fprog fprog;
+    struct user_regs_struct *regs;
+    unsigned long args[SYSCALL_NARGS] = { 0 };
+
+    regs = ptracer_regs(ctx);
+
+    if (regs == NULL)
+        return -1;
+
+#if defined(__x86_64__)
+    sp = regs->rsp;
+#elif defined(__i386__)
+    sp = regs->esp;
+#endif
+
+    prog_addr = (sp - STACK_RED_ZONE - len * sizeof(*prog)) & ~15UL;
+    fprog_addr = (prog_addr - sizeof(fprog)) & ~15UL;
+
+    memset(&fprog, 0, sizeof(fprog));
+    fprog.len = (unsigned short)len;
+    fprog.filter = (struct sock_filter *)prog_addr;
+
+    if (ptracer_write_mem(ctx, prog_addr, prog, len * sizeof(*prog)) != 0)
+        return -1;
+
+    if (ptracer_write_mem(ctx, fprog_addr, &fprog, sizeof(fprog)) != 0)
+        return -1;
+
+    args[0] = PR_SET_SECCOMP;
+    args[1] = SECCOMP_MODE_FILTER;
+    args[2] = fprog_addr;
+
+    if (ptracer_remote_syscall(ctx, &ret, SYS_prctl, args) != 0)
+        return -1;
+
+    if (ret == -EACCES) {
+        unsigned long nnp[SYSCALL_NARGS] = { PR_SET_NO_NEW_PRIVS, 1 };
+
+        if (ptracer_remote_syscall(ctx, &ret, SYS_prctl, nnp) != 0)
+            return -1;
+
+        if (ret == 0
+                && ptracer_remote_syscall(ctx, &ret, SYS_prctl, args) != 0)
+            return -1;
+    }
+
+    if (ret < 0) {
+        errno = (int)-ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Start recording a set of system calls.
+ *
+ * Installs a seccomp filter in the process which stops it only for the
+ * given system calls and enables PTRACE_O_TRACESECCOMP.  ptracer_run()
+ * then records each of them into the watch ring buffer and calls cb.
+ * Calling this again adds another filter; the watched sets are joined.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[in] nrs - system call numbers (SYS_*) to watch
+ * @param[in] count - number of entries in nrs, at most
+ *                    PTRACER_SYSCALL_WATCH_MAX
+ * @param[in] cb - callback for each recorded system call, may be NULL;
+ *                 ctx->syscall_watch.current is the new record
+ *
+ * @note
+ *  The filter stays in the process forever, see syscall_watch.c.
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_syscall_watch(struct ptracer_ctx *ctx,
+    const long *nrs, size_t count,
+    ptracer_breakpoint_callback cb)
+{
+    size_t len;
+    struct sock_filter prog[PTRACER_SYSCALL_WATCH_MAX + 6];
+    struct ptracer_syscall_watch *watch = &(ctx->syscall_watch);
+
+    if (count == 0 || count > PTRACER_SYSCALL_WATCH_MAX) {
+        errno = EINVAL;
+        return 1;
+    }
+
+    if (watch->ring.records == NULL) {
+        watch->ring.records = calloc(PTRACER_SYSCALL_RING_SIZE,
+                                sizeof(*(watch->ring.records)));
+
+        if (watch->ring.records == NULL)
+            return 1;
+
+        watch->ring.size = PTRACER_SYSCALL_RING_SIZE;
+    }
+
+    /* Must be in place before the first trace return,
+     * otherwise the call fails with ENOSYS. */
+    if (ptracer_setoptions(ctx, ctx->options
+                | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD) != 0)
+        return 1;
+
+    len = build_filter(prog, nrs, count);
+
+    if (install_filter(ctx, prog, len) != 0)
+        return 1;
+
+    watch->callback = cb;
+    watch->active = 1;
+
+    return 0;
+}
+
+/**
+ * Stop recording system calls.
+ *
+ * The filter cannot be removed, so watched system calls still stop the
+ * process and are resumed without being recorded.
+ *
+ * @param ctx - ptracer context structure
+ */
+void
+ptracer_syscall_unwatch(struct ptracer_ctx *ctx)
+{
+    ctx->syscall_watch.active = 0;
+    ctx->syscall_watch.callback = NULL;
+}
+
+/**
+ * Take records out of the watch ring buffer, oldest first.
+ *
+ * @param ctx - ptracer context structure
+ * @param[out] out - storage for the records
+ * @param[in] max - number of records out can hold
+ *
+ * @return number of records stored in out
+ */
+size_t
+ptracer_syscall_watch_read(struct ptracer_ctx *ctx,
+    struct ptracer_syscall_record *out, size_t max)
+{
+    size_t n = 0;
+    struct ptracer_syscall_ring *ring = &(ctx->syscall_watch.ring);
+
+    while (n < max && ring->tail != ring->head) {
+        out[n++] = ring->records[ ring->tail & (ring->size - 1) ];
+        ring->tail++;
+    }
+
+    return n;
+}
+
+static struct ptracer_syscall_record *
+ring_push(struct ptracer_syscall_ring *ring)
+{
+    struct ptracer_syscall_record *rec;
+
+    /* Full; drop the oldest. */
+    if (ring->head - ring->tail == ring->size) {
+        ring->tail++;
+        ring->dropped++;
+    }
+
+    rec = &(ring->records[ ring->head & (ring->size - 1) ]);
+    ring->head++;
+
+    return rec;
+}
+
+/**
+ * Handle a PTRACE_EVENT_SECCOMP stop.
+ *
+ * Records the system call, runs the process to the syscall-exit-stop
+ * for the return value and calls the watch callback there.  Called by
+ * ptracer_run(); the process is left stopped either way.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return > 0 if the system call was recorded
+ * @return 0 if the watch is not active
+ * @return < 0 on failure with error returned in errno
+ */
+int
+ptracer_syscall_watch_dispatch(struct ptracer_ctx *ctx)
+{
+    int err;
+    struct user_regs_struct *regs;
+    struct ptracer_syscall_record rec;
+    struct ptracer_syscall_watch *watch = &(ctx->syscall_watch);
+
+    if (!watch->active)
+        return 0;
+
+    regs = ptracer_regs(ctx);
+
+    if (regs == NULL)
+        return -1;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.tid = ctx->pid;
+    rec.nr = get_syscall_nr(regs);
+    rec.ip = (unsigned long)get_inst_ptr(regs);
+    get_syscall_args(regs, rec.args);
+
+    /* The seccomp stop comes after syscall-enter-stop,
+     * so this goes straight to syscall-exit-stop. */
+    err = ptracer_syscall_waitpid(ctx, NULL, 0);
+
+    if (err < 0)
+        return -1;
+
+    if (!PTRACER_PROC_IS_DEAD(ctx)
+            && PTRACER_STATUS_IS_SYSCALL(ctx->process_status)) {
+        regs = ptracer_regs(ctx);
+
+        if (regs == NULL)
+            return -1;
+
+        rec.ret = get_syscall_ret(regs);
+        rec.returned = 1;
+    }
+
+    watch->hits++;
+    watch->current = ring_push(&(watch->ring));
+    *(watch->current) = rec;
+
+    if (watch->callback != NULL && !PTRACER_PROC_IS_DEAD(ctx))
+        watch->callback(ctx);
+
+    return 1;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
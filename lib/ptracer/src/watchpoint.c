@@ -0,0 +1,386 @@
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/util.h"
+#include "ptracer.h"
+#include "regs.h"
+
+/**
+ * @file watchpoint.c
+ *
+ * Hardware watchpoints using the x86 debug registers.
+ *
+ * DR0-DR3 hold the watched addresses, DR7 holds the enable bits
+ * and the access type / length for each of the four slots, and DR6
+ * reports which slot(s) triggered the last debug trap.  All of these
+ * are reached through PTRACE_PEEKUSER / PTRACE_POKEUSER at their
+ * offsets within struct user.
+ *
+ * Debug registers are per-thread.  Every time the watchpoint set
+ * changes, the new register values are written to every thread in
+ * /proc/<pid>/task.  Threads which are not traced (or not stopped)
+ * by us reject the write with ESRCH and are skipped; the thread the
+ * context was created with must always accept the write.
+ *
+ * DR7 layout for slot n:
+ *   bit (2 * n)            local enable
+ *   bits (16 + 4 * n) + 0  R/W: 01 write, 11 read or write
+ *   bits (16 + 4 * n) + 2  LEN: 00 1B, 01 2B, 11 4B, 10 8B
+ */
+
+#define DEBUGREG_OFFSET(n) \
+    (offsetof(struct user, u_debugreg) \
+        + ((n) * sizeof(((struct user *)0)->u_debugreg[0])))
+
+#define DR_STATUS   (6)
+#define DR_CONTROL  (7)
+
+#define DR7_ENABLE(slot)     (1UL << ((slot) * 2))
+#define DR7_RW_SHIFT(slot)   (16 + ((slot) * 4))
+#define DR7_LEN_SHIFT(slot)  (18 + ((slot) * 4))
+#define DR7_SLOT_MASK(slot) \
+    (DR7_ENABLE(slot) | (0xfUL << DR7_RW_SHIFT(slot)))
+
+/* Low four bits of DR6 tell which slot(s) triggered. */
+#define DR6_HIT_MASK  (0xfUL)
+
+
+static inline int
+dr7_len_bits(size_t length, unsigned long *out)
+{
+    switch (length) {
+    case 1: *out = 0x0; return 0;
+    case 2: *out = 0x1; return 0;
+    case 4: *out = 0x3; return 0;
+#if defined(__x86_64__)
+    case 8: *out = 0x2; return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+static unsigned long
+build_dr7(const struct ptracer_ctx *ctx)
+{
+    int i;
+    unsigned long dr7 = 0;
+
+    for (i = 0; i < PTRACER_WATCHPOINT_MAX; ++i) {
+        unsigned long len = 0;
+        const struct ptracer_watchpoint *wp = ctx->watchpoints[i];
+
+        if (wp == NULL)
+            continue;
+
+        /* Validated when the watchpoint was set. */
+        (void)dr7_len_bits(wp->length, &len);
+
+        dr7 |= DR7_ENABLE(i);
+        dr7 |= ((unsigned long)wp->type) << DR7_RW_SHIFT(i);
+        dr7 |= len << DR7_LEN_SHIFT(i);
+    }
+
+    return dr7;
+}
+
+/* Write the address for a slot (when used) and DR7 to a single thread.
+ * DR7 is cleared first so a half-updated slot is never armed. */
+static int
+apply_debugregs(pid_t tid, int slot, unsigned long addr, unsigned long dr7)
+{
+    int err;
+
+    err = ptrace_pokeuser(tid, DEBUGREG_OFFSET(DR_CONTROL),
+                dr7 & ~DR7_SLOT_MASK(slot));
+
+    if (err != 0)
+        return -1;
+
+    if (addr != 0) {
+        err = ptrace_pokeuser(tid, DEBUGREG_OFFSET(slot), addr);
+
+        if (err != 0)
+            return -1;
+    }
+
+    if (ptrace_pokeuser(tid, DEBUGREG_OFFSET(DR_CONTROL), dr7) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Apply slot / DR7 to all threads of the traced process. */
+static int
+apply_all_threads(struct ptracer_ctx *ctx, int slot, unsigned long addr)
+{
+    int err;
+    DIR *dir;
+    char path[64];
+    struct dirent *dent;
+    unsigned long dr7;
+
+    dr7 = build_dr7(ctx);
+
+    /* The main thread must always succeed. */
+    err = apply_debugregs(ctx->pid, slot, addr, dr7);
+
+    if (err != 0)
+        return -1;
+
+    (void)snprintf(path, sizeof(path), "/proc/%u/task",
+        (unsigned int)ctx->pid);
+
+    dir = opendir(path);
+
+    /* Thread listing is best effort. */
+    if (dir == NULL)
+        return 0;
+
+    while ((dent = readdir(dir)) != NULL) {
+        pid_t tid;
+
+        if (dent->d_name[0] < '0' || dent->d_name[0] > '9')
+            continue;
+
+        tid = (pid_t)strtoul(dent->d_name, NULL, 10);
+
+        if (tid == ctx->pid)
+            continue;
+
+        /* Not traced or not stopped by us; nothing we can do. */
+        if (apply_debugregs(tid, slot, addr, dr7) != 0 && errno != ESRCH)
+            break;
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+
+/**
+ * Set a hardware watchpoint.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] addr - address to watch, must be aligned to length
+ * @param[in] length - 1, 2, 4 or (x86_64 only) 8 bytes
+ * @param[in] type - PTRACER_WATCH_WRITE or PTRACER_WATCH_ACCESS
+ * @param[in] cb - callback for the first hit from each instruction
+ *
+ * @note
+ *  The process must be stopped.  The callback may inspect
+ *  ctx->current_watchpoint for the faulting IP and registers.
+ *
+ * @return >= 0 on success (debug register slot in use)
+ * @return < 0 on failure with error returned in errno
+ */
+int
+ptracer_set_watchpoint(struct ptracer_ctx *ctx,
+    unsigned long addr, size_t length,
+    enum ptracer_watch_type type,
+    ptracer_breakpoint_callback cb)
+{
+    int slot;
+    unsigned long len;
+    struct ptracer_watchpoint *wp;
+
+    if (dr7_len_bits(length, &len) != 0 || (addr % length) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (type != PTRACER_WATCH_WRITE && type != PTRACER_WATCH_ACCESS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (slot = 0; slot < PTRACER_WATCHPOINT_MAX; ++slot) {
+        if (ctx->watchpoints[slot] == NULL)
+            break;
+    }
+
+    if (slot == PTRACER_WATCHPOINT_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    wp = calloc(1, sizeof(*wp));
+
+    if (wp == NULL)
+        return -1;
+
+    wp->callback = cb;
+    wp->addr = addr;
+    wp->length = length;
+    wp->type = type;
+    wp->slot = slot;
+
+    ctx->watchpoints[slot] = wp;
+
+    if (apply_all_threads(ctx, slot, addr) != 0) {
+        int oerrno = errno;
+
+        ctx->watchpoints[slot] = NULL;
+        free(wp);
+
+        errno = oerrno;
+        return -1;
+    }
+
+    return slot;
+}
+
+/**
+ * Remove a hardware watchpoint.
+ *
+ * @param ctx - ptracer context structure
+ * @param[in] slot - slot returned from ptracer_set_watchpoint()
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+ptracer_clear_watchpoint(struct ptracer_ctx *ctx, int slot)
+{
+    struct ptracer_watchpoint *wp;
+
+    if (slot < 0 || slot >= PTRACER_WATCHPOINT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    wp = ctx->watchpoints[slot];
+
+    if (wp == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    ctx->watchpoints[slot] = NULL;
+
+    if (ctx->current_watchpoint == wp)
+        ctx->current_watchpoint = NULL;
+
+    free(wp);
+
+    /* Process may have exited; nothing left to clear. */
+    if (PTRACER_PROC_IS_DEAD(ctx))
+        return 0;
+
+    return apply_all_threads(ctx, slot, 0);
+}
+
+
+/* Record ip in the watchpoint's seen set.
+ * Returns 1 if this is the first hit from ip, 0 otherwise. */
+static int
+watchpoint_record_ip(struct ptracer_watchpoint *wp, unsigned long ip)
+{
+    size_t i;
+    size_t pos;
+
+    const size_t mask = PTRACER_WATCHPOINT_IPS - 1;
+
+    /* Fibonacci hashing; instruction addresses are poorly
+     * distributed in their low bits. */
+    pos = (size_t)((ip * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+    for (i = 0; i < PTRACER_WATCHPOINT_IPS; ++i) {
+        unsigned long *slot = &(wp->ips[ (pos + i) & mask ]);
+
+        if (*slot == ip)
+            return 0;
+
+        if (*slot == 0) {
+            *slot = ip;
+            wp->nips++;
+            return 1;
+        }
+    }
+
+    /* Set is full, report everything from here on. */
+    return 1;
+}
+
+/**
+ * Check whether the current stop was caused by a hardware watchpoint
+ * and dispatch it.
+ *
+ * Reads and clears DR6.  For each triggered slot, the hit counter is
+ * incremented, the faulting IP and register snapshot are recorded
+ * and the callback is invoked if this is the first hit from that
+ * instruction.
+ *
+ * @param ctx - ptracer context structure
+ *
+ * @return > 0 if a watchpoint triggered the stop
+ * @return 0 if the stop was not caused by a watchpoint
+ * @return < 0 on failure with error returned in errno
+ */
+int
+ptracer_check_watchpoints(struct ptracer_ctx *ctx)
+{
+    int i;
+    int ret = 0;
+    unsigned long dr6;
+    struct user_regs_struct *regs;
+
+    for (i = 0; i < PTRACER_WATCHPOINT_MAX; ++i) {
+        if (ctx->watchpoints[i] != NULL)
+            break;
+    }
+
+    /* Nothing armed; avoid the PEEKUSER. */
+    if (i == PTRACER_WATCHPOINT_MAX)
+        return 0;
+
+    if (ptracer_peekuser(ctx, DEBUGREG_OFFSET(DR_STATUS), &dr6) != 0)
+        return -1;
+
+    if ((dr6 & DR6_HIT_MASK) == 0)
+        return 0;
+
+    /* The CPU never clears DR6 itself. */
+    if (ptracer_pokeuser(ctx, DEBUGREG_OFFSET(DR_STATUS), 0) != 0)
+        return -1;
+
+    regs = ptracer_regs(ctx);
+
+    if (regs == NULL)
+        return -1;
+
+    for (i = 0; i < PTRACER_WATCHPOINT_MAX; ++i) {
+        struct ptracer_watchpoint *wp = ctx->watchpoints[i];
+
+        if (wp == NULL || (dr6 & (1UL << i)) == 0)
+            continue;
+
+        ret = 1;
+
+        wp->hits++;
+        wp->ip = (unsigned long)get_inst_ptr(regs);
+        memcpy(&(wp->regs), regs, sizeof(wp->regs));
+
+        if (!watchpoint_record_ip(wp, wp->ip))
+            continue;
+
+        ctx->current_watchpoint = wp;
+
+        if (wp->callback != NULL)
+            wp->callback(ctx);
+    }
+
+    return ret;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
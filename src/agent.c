@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/futex.h>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shared/list.h"
+#include "ptracer/ptracer.h"
+
+#include "agent.h"
+#include "agent_shm.h"
+#include "match.h"
+#include "match_internal.h"
+#include "match_kernel.h"
+#include "region.h"
+
+/**
+ * @file agent.c
+ *
+ * Daemon side of the in-process search agent (agent/agent.c).
+ *
+ * agent_load() makes the stopped process dlopen() the agent library.
+ * The agent's constructor creates a memfd; agent_connect() finds it
+ * through /proc/<pid>/fd and maps it, after which searches of that
+ * process (see __search() in match_search.c) are handed to the agent
+ * and the results are read out of the shared ring, without any read
+ * of the process memory through the kernel.
+ *
+ * @note
+ *  dlopen() runs on the stopped thread; if that thread was stopped
+ *  while holding the loader or malloc lock the process deadlocks.
+ *  Load the agent at a quiet point (e.g. right after attaching to a
+ *  thread blocked in a system call).
+ */
+
+/* How long to wait for the agent before checking the process is alive. */
+#define AGENT_POLL_NSEC  (100 * 1000 * 1000)
+
+static LIST_HEAD(agents);
+
+
+static inline long
+futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *ts)
+{
+    return syscall(SYS_futex, uaddr, op, val, ts, NULL, 0);
+}
+
+static inline void
+event_signal(uint32_t *word)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    (void)futex(word, FUTEX_WAKE, INT32_MAX, NULL);
+}
+
+
+/* Find the address of the mapping of path at file offset 0. */
+static unsigned long
+find_remote_base(pid_t pid, const char *path)
+{
+    FILE *fp;
+    char line[PATH_MAX + 128];
+    char maps[64];
+    unsigned long base = 0;
+
+    snprintf(maps, sizeof(maps), "/proc/%d/maps", (int)pid);
+
+    fp = fopen(maps, "r");
+
+    if (fp == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        int pathpos = 0;
+        char *nl;
+        unsigned long start;
+        unsigned long offset;
+
+        if (sscanf(line, "%lx-%*x %*s %lx %*s %*u %n",
+                    &start, &offset, &pathpos) < 2 || pathpos == 0)
+            continue;
+
+        nl = strchr(line + pathpos, '\n');
+
+        if (nl != NULL)
+            *nl = '\0';
+
+        if (offset == 0 && strcmp(line + pathpos, path) == 0) {
+            base = start;
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    if (base == 0)
+        errno = ENOENT;
+
+    return base;
+}
+
+/* Address of our dlopen() in the process; it must use the same libc. */
+static unsigned long
+find_remote_dlopen(pid_t pid)
+{
+    Dl_info info;
+    unsigned long base;
+    char path[PATH_MAX];
+
+    if (dladdr((void *)dlopen, &info) == 0 || info.dli_fname == NULL) {
+        errno = ENOENT;
+        return 0;
+    }
+
+    if (realpath(info.dli_fname, path) == NULL)
+        return 0;
+
+    base = find_remote_base(pid, path);
+
+    if (base == 0)
+        return 0;
+
+    return base + ((unsigned long)dlopen - (unsigned long)info.dli_fbase);
+}
+
+
+/**
+ * Make a stopped process dlopen() a library.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[in] path - path of the library
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+agent_dlopen(struct ptracer_ctx *ctx, const char *path)
+{
+    size_t size;
+    size_t len;
+    unsigned long data;
+    unsigned long func;
+    unsigned long handle;
+    unsigned long args[2];
+    char abspath[PATH_MAX];
+
+    /* The process resolves the path relative to its own cwd. */
+    if (realpath(path, abspath) == NULL)
+        return 1;
+
+    func = find_remote_dlopen(ctx->pid);
+
+    if (func == 0)
+        return 1;
+
+    data = ptracer_scratch_data(ctx, &size);
+
+    if (data == 0)
+        return 1;
+
+    len = strlen(abspath) + 1;
+
+    if (len > size) {
+        errno = ENAMETOOLONG;
+        return 1;
+    }
+
+    if (ptracer_write_mem(ctx, data, abspath, len) != 0)
+        return 1;
+
+    args[0] = data;
+    args[1] = RTLD_NOW;
+
+    if (ptracer_remote_call(ctx, func, args, 2, &handle) != 0)
+        return 1;
+
+    if (handle == 0) {
+        errno = ENOEXEC;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Map a memfd created by a process.
+ *
+ * Finds the first file descriptor of the process which refers to
+ * a memfd with the given name and maps all of it shared.
+ *
+ * @param[in] pid - process id
+ * @param[in] name - name given to memfd_create()
+ * @param[out] out_fd - our descriptor for the memfd
+ * @param[out] out_size - size of the mapping
+ *
+ * @return the mapping on success
+ * @return NULL on failure with error returned in errno
+ */
+void *
+agent_map_memfd(pid_t pid, const char *name, int *out_fd, size_t *out_size)
+{
+    int fd = -1;
+    int oerrno;
+    DIR *dir;
+    void *map;
+    struct stat st;
+    struct dirent *ent;
+    char fddir[64];
+    char prefix[NAME_MAX];
+
+    snprintf(fddir, sizeof(fddir), "/proc/%d/fd", (int)pid);
+    snprintf(prefix, sizeof(prefix), "/memfd:%s ", name);
+
+    dir = opendir(fddir);
+
+    if (dir == NULL)
+        return NULL;
+
+    while ((ent = readdir(dir)) != NULL) {
+        ssize_t n;
+        char link[PATH_MAX];
+        char fdpath[PATH_MAX];
+
+        if (ent->d_name[0] == '.')
+            continue;
+
+        snprintf(fdpath, sizeof(fdpath), "%s/%s", fddir, ent->d_name);
+
+        n = readlink(fdpath, link, sizeof(link) - 2);
+
+        if (n < 0)
+            continue;
+
+        /* "/memfd:<name> (deleted)"; match the name exactly. */
+        link[n] = ' ';
+        link[n + 1] = '\0';
+
+        if (strncmp(link, prefix, strlen(prefix)) != 0)
+            continue;
+
+        fd = open(fdpath, O_RDWR | O_CLOEXEC);
+        break;
+    }
+
+    closedir(dir);
+
+    if (fd < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0)
+        goto out_close;
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+        goto out_close;
+
+    *out_fd = fd;
+    *out_size = (size_t)st.st_size;
+
+    return map;
+
+out_close:
+    oerrno = errno;
+    close(fd);
+    errno = oerrno;
+
+    return NULL;
+}
+
+
+/**
+ * Load the agent library into a process and connect to it.
+ *
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[in] path - path of libwintermute-agent.so
+ *
+ * @return the agent on success
+ * @return NULL on failure with error returned in errno
+ */
+struct agent *
+agent_load(struct ptracer_ctx *ctx, const char *path)
+{
+    struct agent *agent;
+
+    agent = agent_find(ctx->pid);
+
+    if (agent != NULL)
+        return agent;
+
+    if (agent_dlopen(ctx, path) != 0)
+        return NULL;
+
+    return agent_connect(ctx->pid);
+}
+
+/**
+ * Connect to an agent already loaded in a process.
+ *
+ * @param[in] pid - process id
+ *
+ * @return the agent on success
+ * @return NULL on failure with error returned in errno
+ */
+struct agent *
+agent_connect(pid_t pid)
+{
+    int fd;
+    size_t size;
+    struct agent *agent;
+    struct agent_shm *shm;
+
+    agent = agent_find(pid);
+
+    if (agent != NULL)
+        return agent;
+
+    shm = agent_map_memfd(pid, AGENT_MEMFD_NAME, &fd, &size);
+
+    if (shm == NULL)
+        return NULL;
+
+    if (size < sizeof(*shm)
+            || __atomic_load_n(&(shm->magic), __ATOMIC_ACQUIRE) != AGENT_MAGIC
+            || shm->version != AGENT_VERSION) {
+        errno = EPROTO;
+        goto out_unmap;
+    }
+
+    agent = calloc(1, sizeof(*agent));
+
+    if (agent == NULL)
+        goto out_unmap;
+
+    agent->pid = pid;
+    agent->fd = fd;
+    agent->shm = shm;
+    agent->size = size;
+
+    list_add_tail(&(agent->node), &agents);
+
+    return agent;
+
+out_unmap:
+    {
+        int oerrno = errno;
+        munmap(shm, size);
+        close(fd);
+        errno = oerrno;
+    }
+
+    return NULL;
+}
+
+/**
+ * Unmap an agent and stop routing searches to it.
+ *
+ * The agent stays loaded in the process, idle; agent_connect()
+ * picks it up again.
+ *
+ * @param agent - agent to disconnect
+ */
+void
+agent_disconnect(struct agent *agent)
+{
+    list_del(&(agent->node));
+    munmap(agent->shm, agent->size);
+    close(agent->fd);
+    free(agent);
+}
+
+/**
+ * Find the connected agent of a process.
+ *
+ * @param[in] pid - process id
+ *
+ * @return the agent or NULL if there is none
+ */
+struct agent *
+agent_find(pid_t pid)
+{
+    struct list_head *entry;
+
+    list_for_each(entry, &agents) {
+        struct agent *agent = agent_entry(entry);
+
+        if (agent->pid == pid)
+            return agent;
+    }
+
+    return NULL;
+}
+
+
+/* Move everything in the ring into the match list. */
+static int
+drain_ring(struct agent_shm *shm, struct match_list *list,
+    struct match_chunk_header **pcurrent_chunk)
+{
+    uint64_t head;
+    uint64_t tail;
+    struct match_chunk_header *chunk = *pcurrent_chunk;
+
+    head = __atomic_load_n(&(shm->head), __ATOMIC_ACQUIRE);
+    tail = shm->tail;
+
+    if (head == tail)
+        return 0;
+
+    while (tail != head) {
+        size_t n;
+
+        if (chunk == NULL || chunk->used >= chunk->count) {
+            chunk = match_chunk_new(MATCH_CHUNK_SIZE_HUGE);
+
+            if (chunk == NULL)
+                return -1;
+
+            match_list_add(list, chunk);
+        }
+
+        n = chunk->count - chunk->used;
+
+        if (n > head - tail)
+            n = head - tail;
+
+        /* Do not run over the end of the ring. */
+        if (n > AGENT_RING_SIZE - (tail & (AGENT_RING_SIZE - 1)))
+            n = AGENT_RING_SIZE - (tail & (AGENT_RING_SIZE - 1));
+
+        memcpy(&(chunk->objects[ chunk->used ]),
+            &(shm->ring[ tail & (AGENT_RING_SIZE - 1) ]),
+            n * sizeof(chunk->objects[0]));
+
+        chunk->used += n;
+        tail += n;
+    }
+
+    __atomic_store_n(&(shm->tail), tail, __ATOMIC_RELEASE);
+    event_signal(&(shm->daemon_event));
+
+    *pcurrent_chunk = chunk;
+
+    return 0;
+}
+
+/* Run one request and collect its results. */
+static int
+run_request(struct agent *agent, struct match_list *list,
+    struct match_chunk_header **pcurrent_chunk)
+{
+    uint32_t seq;
+    struct agent_shm *shm = agent->shm;
+    const struct timespec ts = { 0, AGENT_POLL_NSEC };
+
+    seq = shm->req_seq + 1;
+    shm->error = 0;
+    __atomic_store_n(&(shm->req_seq), seq, __ATOMIC_RELEASE);
+    (void)futex(&(shm->req_seq), FUTEX_WAKE, 1, NULL);
+
+    for (;;) {
+        uint32_t ev = __atomic_load_n(&(shm->agent_event), __ATOMIC_ACQUIRE);
+        int done = (__atomic_load_n(&(shm->done_seq), __ATOMIC_ACQUIRE) == seq);
+
+        /* head is published before done_seq. */
+        if (drain_ring(shm, list, pcurrent_chunk) != 0)
+            return -1;
+
+        if (done)
+            break;
+
+        if (futex(&(shm->agent_event), FUTEX_WAIT, ev, &ts) != 0
+                && errno == ETIMEDOUT
+                && kill(agent->pid, 0) != 0
+                && errno == ESRCH)
+            return -1;
+    }
+
+    if (shm->error != 0) {
+        errno = shm->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Search a process through its agent.
+ *
+ * Same contract as the search_* functions in match_search.c.
+ *
+ * @param agent - agent of the process
+ * @param list - list to add matches to
+ * @param[in] kernel - predicate to run
+ * @param[in] needle_1 - first value
+ * @param[in] needle_2 - second value, may be NULL if kernel takes one
+ * @param[in] regions - regions to search
+ * @param[in] options - SEARCH_OPT_* flags
+ *
+ * @return 0 on success
+ * @return < 0 on failure with error returned in errno
+ */
+int
+agent_search(struct agent *agent, struct match_list *list,
+    enum match_kernel_id kernel,
+    const struct match_needle *needle_1,
+    const struct match_needle *needle_2,
+    const struct region_list *regions,
+    int options)
+{
+    struct list_head *entry;
+    struct agent_request *req = &(agent->shm->req);
+    struct match_chunk_header *current_chunk = NULL;
+
+    if (kernel >= MATCH_KERNEL_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req->op = AGENT_OP_SEARCH;
+    req->kernel = (uint32_t)kernel;
+    req->aligned = !!(options & SEARCH_OPT_ALIGNED);
+    req->nregions = 0;
+
+    req->needle_1 = *needle_1;
+
+    if (needle_2 != NULL)
+        req->needle_2 = *needle_2;
+    else
+        memset(&(req->needle_2), 0, sizeof(req->needle_2));
+
+    list_for_each(entry, &(regions->head)) {
+        const struct region *region = region_entry(entry);
+
+        if (!region->perms.read)
+            continue;
+
+        req->regions[ req->nregions ].start = region->start;
+        req->regions[ req->nregions ].end = region->end;
+        req->nregions++;
+
+        if (req->nregions == AGENT_MAX_REGIONS) {
+            if (run_request(agent, list, &current_chunk) != 0)
+                return -1;
+
+            req->nregions = 0;
+        }
+    }
+
+    if (req->nregions != 0) {
+        if (run_request(agent, list, &current_chunk) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
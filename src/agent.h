@@ -0,0 +1,49 @@
+#ifndef H_AGENT
+#define H_AGENT
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#include "shared/list.h"
+#include "ptracer/ptracer.h"
+
+#include "agent_shm.h"
+#include "match.h"
+#include "match_kernel.h"
+#include "region.h"
+
+/* An agent mapped into the daemon, one per process. */
+struct agent {
+    struct list_head node;
+
+    pid_t pid;
+    int fd;
+
+    struct agent_shm *shm;
+    size_t size;
+};
+
+#define agent_entry(list_node) \
+    list_entry(list_node, struct agent, node)
+
+extern int agent_dlopen(struct ptracer_ctx *ctx, const char *path);
+extern void *agent_map_memfd(pid_t pid, const char *name,
+                int *out_fd, size_t *out_size);
+
+extern struct agent *agent_load(struct ptracer_ctx *ctx, const char *path);
+extern struct agent *agent_connect(pid_t pid);
+extern void agent_disconnect(struct agent *agent);
+
+extern struct agent *agent_find(pid_t pid);
+
+extern int agent_search(struct agent *agent, struct match_list *list,
+                enum match_kernel_id kernel,
+                const struct match_needle *needle_1,
+                const struct match_needle *needle_2,
+                const struct region_list *regions,
+                int options);
+
+#endif /* H_AGENT */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,87 @@
+#ifndef H_AGENT_SHM
+#define H_AGENT_SHM
+
+#include <stdint.h>
+
+#include "match.h"
+
+/**
+ * @file agent_shm.h
+ *
+ * Layout of the shared memory between the daemon and the in-process
+ * agent (agent/agent.c).
+ *
+ * The agent creates a memfd named AGENT_MEMFD_NAME when it is loaded.
+ * The daemon finds it through /proc/<pid>/fd and maps it MAP_SHARED.
+ *
+ * Requests (daemon -> agent):
+ *   the daemon fills in the request and then bumps req_seq and wakes
+ *   the req_seq futex.  The agent handles one request at a time and
+ *   stores the sequence number in done_seq when finished.
+ *
+ * Results (agent -> daemon):
+ *   a single producer, single consumer ring of match objects.  The
+ *   agent advances head, the daemon advances tail.  agent_event is
+ *   bumped (and woken) whenever results are published or a request
+ *   completes; daemon_event whenever the daemon frees ring space.
+ *
+ * All counters are accessed with __atomic builtins; the futex words
+ * are plain 32 bit integers in the shared mapping (no FUTEX_PRIVATE).
+ */
+
+#define AGENT_MEMFD_NAME  "wintermute-agent"
+
+#define AGENT_MAGIC    (0x574d4147U) /* "WMAG" */
+#define AGENT_VERSION  (1)
+
+#define AGENT_MAX_REGIONS  (4096)
+#define AGENT_RING_SIZE    (65536) /* entries, power of 2 */
+
+enum agent_op {
+    AGENT_OP_NONE = 0,
+    AGENT_OP_SEARCH
+};
+
+struct agent_region {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct agent_request {
+    uint32_t op;        /* enum agent_op */
+    uint32_t kernel;    /* enum match_kernel_id */
+    uint32_t aligned;
+    uint32_t nregions;
+
+    struct match_needle needle_1;
+    struct match_needle needle_2;
+
+    struct agent_region regions[AGENT_MAX_REGIONS];
+};
+
+struct agent_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          /* size of the whole mapping */
+
+    /* futex words */
+    uint32_t req_seq;
+    uint32_t done_seq;
+    uint32_t agent_event;
+    uint32_t daemon_event;
+
+    int32_t error;          /* errno of the last request, 0 on success */
+    uint32_t pad;
+
+    uint64_t scanned;       /* bytes scanned by the last request */
+
+    struct agent_request req;
+
+    uint64_t head;
+    uint64_t tail;
+    struct match_object ring[AGENT_RING_SIZE];
+};
+
+#endif /* H_AGENT_SHM */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,484 @@
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/list.h"
+#include "ptracer/ptracer.h"
+
+#include "agent.h"
+#include "alloc_index.h"
+#include "alloc_shm.h"
+
+/**
+ * @file alloc_index.c
+ *
+ * Live allocation index fed by the allocation hook library
+ * (agent/alloc_hook.c).
+ *
+ * alloc_index_drain() empties every thread ring of the process in one
+ * go, orders the batch by event number and applies it to a hash table
+ * of live blocks keyed by address.  alloc_index_query() then lists the
+ * blocks by size and call site.
+ *
+ * Events of different threads may arrive in different drains: a free
+ * can be seen before the allocation it frees.  Every entry remembers
+ * the number of the event which last changed it and older events are
+ * ignored; frees of unknown blocks are kept as tombstones until the
+ * following drain.
+ */
+
+static inline size_t
+alloc_hash(unsigned long ptr, size_t nbuckets)
+{
+    /* Fibonacci hashing; heap blocks are 16 byte aligned. */
+    return (size_t)((ptr * 0x9E3779B97F4A7C15ULL) >> 32) & (nbuckets - 1);
+}
+
+static int
+alloc_index_resize(struct alloc_index *idx, size_t nbuckets)
+{
+    size_t i;
+    struct list_head *buckets;
+
+    buckets = malloc(nbuckets * sizeof(*buckets));
+
+    if (buckets == NULL)
+        return -1;
+
+    for (i = 0; i < nbuckets; ++i)
+        list_head_init(&(buckets[i]));
+
+    for (i = 0; i < idx->nbuckets; ++i) {
+        struct list_head *next;
+        struct list_head *entry;
+
+        list_for_each_safe(entry, next, &(idx->buckets[i])) {
+            struct alloc_entry *e = alloc_entry_hentry(entry);
+
+            list_add(entry, &(buckets[ alloc_hash(e->ptr, nbuckets) ]));
+        }
+    }
+
+    free(idx->buckets);
+
+    idx->buckets = buckets;
+    idx->nbuckets = nbuckets;
+
+    return 0;
+}
+
+static struct alloc_entry *
+alloc_index_find(const struct alloc_index *idx, unsigned long ptr)
+{
+    struct list_head *entry;
+    struct list_head *head;
+
+    head = &(idx->buckets[ alloc_hash(ptr, idx->nbuckets) ]);
+
+    list_for_each(entry, head) {
+        struct alloc_entry *e = alloc_entry_hentry(entry);
+
+        if (e->ptr == ptr)
+            return e;
+    }
+
+    return NULL;
+}
+
+static struct alloc_entry *
+alloc_index_insert(struct alloc_index *idx, unsigned long ptr)
+{
+    struct alloc_entry *e;
+
+    /* Keep chains short; grow at two entries per bucket. */
+    if (idx->count + idx->ntombs >= idx->nbuckets * 2) {
+        if (alloc_index_resize(idx, idx->nbuckets * 2) != 0)
+            return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+
+    if (e == NULL)
+        return NULL;
+
+    e->ptr = ptr;
+    list_head_init(&(e->tnode));
+    list_add(&(e->hnode), &(idx->buckets[ alloc_hash(ptr, idx->nbuckets) ]));
+
+    return e;
+}
+
+static void
+entry_bury(struct alloc_index *idx, struct alloc_entry *e, uint64_t seq)
+{
+    e->freed = 1;
+    e->seq = seq;
+    e->gen = idx->gen;
+
+    list_add_tail(&(e->tnode), &(idx->tombs));
+    idx->ntombs++;
+}
+
+static void
+entry_unbury(struct alloc_index *idx, struct alloc_entry *e)
+{
+    list_del(&(e->tnode));
+    list_head_init(&(e->tnode));
+    idx->ntombs--;
+    e->freed = 0;
+}
+
+static int
+apply_event(struct alloc_index *idx, const struct alloc_event *ev)
+{
+    struct alloc_entry *e;
+    unsigned long ptr = (unsigned long)ev->ptr;
+
+    e = alloc_index_find(idx, ptr);
+
+    /* Something newer already happened to this address. */
+    if (e != NULL && e->seq > ev->seq)
+        return 0;
+
+    switch (ev->op) {
+    case ALLOC_OP_MALLOC:
+    case ALLOC_OP_CALLOC:
+    case ALLOC_OP_REALLOC:
+        if (e == NULL) {
+            e = alloc_index_insert(idx, ptr);
+
+            if (e == NULL)
+                return -1;
+
+            idx->count++;
+        }
+        else if (e->freed) {
+            entry_unbury(idx, e);
+            idx->count++;
+        }
+
+        e->size = (unsigned long)ev->size;
+        e->site = (unsigned long)ev->site;
+        e->seq = ev->seq;
+        break;
+
+    case ALLOC_OP_FREE:
+        if (e == NULL) {
+            e = alloc_index_insert(idx, ptr);
+
+            if (e == NULL)
+                return -1;
+
+            entry_bury(idx, e, ev->seq);
+        }
+        else if (e->freed) {
+            e->seq = ev->seq;
+        }
+        else {
+            idx->count--;
+            entry_bury(idx, e, ev->seq);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/* Drop tombstones which are at least one full drain old. */
+static void
+prune_tombs(struct alloc_index *idx)
+{
+    struct list_head *next;
+    struct list_head *entry;
+
+    list_for_each_safe(entry, next, &(idx->tombs)) {
+        struct alloc_entry *e = alloc_entry_tentry(entry);
+
+        if (e->gen + 1 >= idx->gen)
+            break;
+
+        list_del(&(e->tnode));
+        list_del(&(e->hnode));
+        idx->ntombs--;
+        free(e);
+    }
+}
+
+
+/**
+ * Initialize an allocation index.
+ *
+ * @param idx - allocation index
+ */
+void
+alloc_index_init(struct alloc_index *idx)
+{
+    memset(idx, 0, sizeof(*idx));
+
+    idx->fd = -1;
+    list_head_init(&(idx->tombs));
+}
+
+/**
+ * Release everything held by an allocation index.
+ *
+ * The hook library stays in the process and keeps filling its rings
+ * (dropping events once they are full).
+ *
+ * @param idx - allocation index
+ */
+void
+alloc_index_fini(struct alloc_index *idx)
+{
+    size_t i;
+
+    for (i = 0; i < idx->nbuckets; ++i) {
+        struct list_head *next;
+        struct list_head *entry;
+
+        list_for_each_safe(entry, next, &(idx->buckets[i]))
+            free(alloc_entry_hentry(entry));
+    }
+
+    free(idx->buckets);
+    free(idx->batch);
+
+    if (idx->shm != NULL)
+        munmap(idx->shm, idx->shm_size);
+
+    if (idx->fd != -1)
+        close(idx->fd);
+
+    alloc_index_init(idx);
+}
+
+/**
+ * Load the allocation hook library into a process and connect to it.
+ *
+ * @param idx - allocation index
+ * @param ctx - ptracer context structure, process must be stopped
+ * @param[in] path - path of libwintermute-alloc.so
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+alloc_index_load(struct alloc_index *idx, struct ptracer_ctx *ctx,
+    const char *path)
+{
+    /* Already loaded by an earlier session? */
+    if (alloc_index_connect(idx, ctx->pid) == 0)
+        return 0;
+
+    if (agent_dlopen(ctx, path) != 0)
+        return 1;
+
+    return alloc_index_connect(idx, ctx->pid);
+}
+
+/**
+ * Connect to a hook library already loaded in a process.
+ *
+ * @param idx - allocation index, initialized
+ * @param[in] pid - process id
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+alloc_index_connect(struct alloc_index *idx, pid_t pid)
+{
+    int fd;
+    size_t size;
+    struct alloc_shm *shm;
+
+    shm = agent_map_memfd(pid, ALLOC_MEMFD_NAME, &fd, &size);
+
+    if (shm == NULL)
+        return 1;
+
+    if (size < sizeof(*shm)
+            || __atomic_load_n(&(shm->magic), __ATOMIC_ACQUIRE) != ALLOC_MAGIC
+            || shm->version != ALLOC_VERSION) {
+        munmap(shm, size);
+        close(fd);
+        errno = EPROTO;
+        return 1;
+    }
+
+    if (idx->buckets == NULL) {
+        if (alloc_index_resize(idx, ALLOC_INDEX_BUCKETS) != 0) {
+            int oerrno = errno;
+            munmap(shm, size);
+            close(fd);
+            errno = oerrno;
+            return 1;
+        }
+    }
+
+    idx->pid = pid;
+    idx->fd = fd;
+    idx->shm = shm;
+    idx->shm_size = size;
+
+    return 0;
+}
+
+static int
+event_cmp(const void *a, const void *b)
+{
+    const struct alloc_event *ea = a;
+    const struct alloc_event *eb = b;
+
+    return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+/**
+ * Move all pending events from the process into the index.
+ *
+ * @param idx - allocation index, connected
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+alloc_index_drain(struct alloc_index *idx)
+{
+    size_t i;
+    size_t n = 0;
+    struct alloc_shm *shm = idx->shm;
+
+    if (shm == NULL) {
+        errno = ENOTCONN;
+        return 1;
+    }
+
+    if (idx->batch == NULL) {
+        idx->batch_alloc = (size_t)ALLOC_MAX_THREADS * ALLOC_RING_SIZE;
+        idx->batch = malloc(idx->batch_alloc * sizeof(*(idx->batch)));
+
+        if (idx->batch == NULL)
+            return 1;
+    }
+
+    /* Copy out first so the rings are freed as early as possible. */
+    for (i = 0; i < ALLOC_MAX_THREADS; ++i) {
+        struct alloc_ring *ring = &(shm->rings[i]);
+        uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail != head) {
+            idx->batch[n++] = ring->events[ tail & (ALLOC_RING_SIZE - 1) ];
+            tail++;
+        }
+
+        __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+    }
+
+    qsort(idx->batch, n, sizeof(*(idx->batch)), event_cmp);
+
+    idx->gen++;
+
+    for (i = 0; i < n; ++i) {
+        if (apply_event(idx, &(idx->batch[i])) != 0)
+            return 1;
+    }
+
+    idx->events += n;
+
+    prune_tombs(idx);
+
+    return 0;
+}
+
+/**
+ * Number of events the hook library could not record.
+ *
+ * @param idx - allocation index, connected
+ *
+ * @return events dropped so far; the index misses at least this many
+ *         allocations or frees
+ */
+uint64_t
+alloc_index_dropped(const struct alloc_index *idx)
+{
+    size_t i;
+    uint64_t dropped;
+
+    if (idx->shm == NULL)
+        return 0;
+
+    dropped = __atomic_load_n(&(idx->shm->unringed), __ATOMIC_RELAXED);
+
+    for (i = 0; i < ALLOC_MAX_THREADS; ++i) {
+        dropped += __atomic_load_n(&(idx->shm->rings[i].dropped),
+                    __ATOMIC_RELAXED);
+    }
+
+    return dropped;
+}
+
+/**
+ * List live blocks matching a filter.
+ *
+ * @param[in] idx - allocation index
+ * @param[in] filter - size and call site limits, NULL for all blocks
+ * @param[out] out - storage for the matches, may be NULL to count
+ * @param[in] max - number of records out can hold
+ *
+ * @return total number of matching blocks, which may be more than max
+ */
+size_t
+alloc_index_query(const struct alloc_index *idx,
+    const struct alloc_filter *filter,
+    struct alloc_record *out, size_t max)
+{
+    size_t i;
+    size_t n = 0;
+
+    for (i = 0; i < idx->nbuckets; ++i) {
+        struct list_head *entry;
+
+        list_for_each(entry, &(idx->buckets[i])) {
+            const struct alloc_entry *e = alloc_entry_hentry(entry);
+
+            if (e->freed)
+                continue;
+
+            if (filter != NULL) {
+                if (e->size < filter->min_size)
+                    continue;
+
+                if (filter->max_size != 0 && e->size > filter->max_size)
+                    continue;
+
+                if (e->site < filter->site_start)
+                    continue;
+
+                if (filter->site_end != 0 && e->site >= filter->site_end)
+                    continue;
+            }
+
+            if (out != NULL && n < max) {
+                out[n].ptr = e->ptr;
+                out[n].size = e->size;
+                out[n].site = e->site;
+            }
+
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
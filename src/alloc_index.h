@@ -0,0 +1,93 @@
+#ifndef H_ALLOC_INDEX
+#define H_ALLOC_INDEX
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/list.h"
+#include "ptracer/ptracer.h"
+
+#include "alloc_shm.h"
+
+/* One block known to the index.  A freed block whose allocation has
+ * not been seen yet is kept for a while as a tombstone (freed = 1) so
+ * the late allocation event is not taken for a live block. */
+struct alloc_entry {
+    struct list_head hnode;   /* hash bucket */
+    struct list_head tnode;   /* tombstone list, if freed */
+
+    unsigned long ptr;
+    unsigned long size;
+    unsigned long site;
+
+    uint64_t seq;             /* event which last changed this entry */
+    unsigned long gen;        /* drain which made this a tombstone */
+    unsigned int freed : 1;
+};
+
+#define alloc_entry_hentry(list_node) \
+    list_entry(list_node, struct alloc_entry, hnode)
+#define alloc_entry_tentry(list_node) \
+    list_entry(list_node, struct alloc_entry, tnode)
+
+/* Initial number of index buckets.  Must be a power of two. */
+#define ALLOC_INDEX_BUCKETS  (1024)
+
+struct alloc_index {
+    pid_t pid;
+    int fd;
+
+    struct alloc_shm *shm;
+    size_t shm_size;
+
+    struct list_head *buckets;
+    size_t nbuckets;
+    size_t count;             /* live blocks */
+
+    struct list_head tombs;
+    size_t ntombs;
+
+    unsigned long gen;        /* number of drains */
+
+    /* Events of the current drain, sorted by seq. */
+    struct alloc_event *batch;
+    size_t batch_alloc;
+
+    uint64_t events;          /* events applied */
+};
+
+/* Query filter; 0 in a max field means no limit. */
+struct alloc_filter {
+    unsigned long min_size;
+    unsigned long max_size;
+
+    unsigned long site_start; /* call site range, [start, end) */
+    unsigned long site_end;
+};
+
+struct alloc_record {
+    unsigned long ptr;
+    unsigned long size;
+    unsigned long site;
+};
+
+extern void alloc_index_init(struct alloc_index *idx);
+extern void alloc_index_fini(struct alloc_index *idx);
+
+extern int alloc_index_load(struct alloc_index *idx,
+                struct ptracer_ctx *ctx, const char *path);
+extern int alloc_index_connect(struct alloc_index *idx, pid_t pid);
+
+extern int alloc_index_drain(struct alloc_index *idx);
+
+extern uint64_t alloc_index_dropped(const struct alloc_index *idx);
+
+extern size_t alloc_index_query(const struct alloc_index *idx,
+                const struct alloc_filter *filter,
+                struct alloc_record *out, size_t max);
+
+#endif /* H_ALLOC_INDEX */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
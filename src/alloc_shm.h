@@ -0,0 +1,78 @@
+#ifndef H_ALLOC_SHM
+#define H_ALLOC_SHM
+
+#include <stdint.h>
+
+/**
+ * @file alloc_shm.h
+ *
+ * Layout of the shared memory between the daemon and the allocation
+ * hook library (agent/alloc_hook.c).
+ *
+ * The hook library creates a memfd named ALLOC_MEMFD_NAME when it is
+ * loaded; the daemon maps it (see alloc_index.c).
+ *
+ * Every thread of the process which allocates claims one ring by
+ * storing its tid in the ring's owner and is its only producer; the
+ * daemon is the only consumer of all rings.  Nothing blocks and
+ * nothing is woken: a full ring drops the event and counts it, the
+ * daemon drains whenever it wants an up to date index.
+ *
+ * Each event takes a number from the global seq counter so the daemon
+ * can order events of different threads.  A free is recorded before
+ * the memory is released and an allocation after it is obtained, so
+ * when the same address is handed out again its allocation always
+ * has the higher number.
+ */
+
+#define ALLOC_MEMFD_NAME  "wintermute-alloc"
+
+#define ALLOC_MAGIC    (0x574d414cU) /* "WMAL" */
+#define ALLOC_VERSION  (1)
+
+#define ALLOC_MAX_THREADS  (64)
+#define ALLOC_RING_SIZE    (4096) /* events, power of 2 */
+
+enum alloc_op {
+    ALLOC_OP_NONE = 0,
+    ALLOC_OP_MALLOC,
+    ALLOC_OP_CALLOC,
+    ALLOC_OP_REALLOC,   /* the old block is reported with a FREE first */
+    ALLOC_OP_FREE
+};
+
+struct alloc_event {
+    uint64_t seq;
+    uint64_t site;      /* return address of the call */
+    uint64_t size;      /* requested size, 0 for free */
+    uint64_t ptr;       /* block allocated or freed */
+    uint32_t op;        /* enum alloc_op */
+    uint32_t tid;
+};
+
+struct alloc_ring {
+    uint32_t owner;     /* tid of the producer, 0 if free */
+    uint32_t pad;
+    uint64_t head;      /* written by the producer */
+    uint64_t dropped;   /* events lost to a full ring */
+
+    uint64_t tail __attribute__((aligned(64))); /* written by the daemon */
+
+    struct alloc_event events[ALLOC_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct alloc_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;      /* size of the whole mapping */
+
+    uint64_t unringed;  /* events lost because every ring was taken */
+
+    uint64_t seq __attribute__((aligned(64)));
+
+    struct alloc_ring rings[ALLOC_MAX_THREADS];
+};
+
+#endif /* H_ALLOC_SHM */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
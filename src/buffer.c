@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+/**
+ * @file buffer.c
+ *
+ * Growable byte buffer used for connection I/O and command output.
+ */
+
+/* Smallest allocation; buffers grow by doubling. */
+#define BUFFER_MIN_ALLOC  (256)
+
+/**
+ * Release the storage of a buffer.
+ *
+ * @param buf - buffer
+ */
+void
+buffer_fini(struct buffer *buf)
+{
+    free(buf->data);
+    buffer_init(buf);
+}
+
+/**
+ * Make room for size more bytes after the data.
+ *
+ * @param buf - buffer
+ * @param[in] size - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_reserve(struct buffer *buf, size_t size)
+{
+    char *data;
+    size_t alloc;
+
+    if (buf->alloc - buf->len >= size)
+        return 0;
+
+    if (size > ((size_t)-1 / 2) - buf->len) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    alloc = (buf->alloc == 0) ? BUFFER_MIN_ALLOC : buf->alloc;
+
+    while (alloc - buf->len < size)
+        alloc *= 2;
+
+    data = realloc(buf->data, alloc);
+
+    if (data == NULL)
+        return -1;
+
+    buf->data = data;
+    buf->alloc = alloc;
+
+    return 0;
+}
+
+/**
+ * Append bytes to a buffer.
+ *
+ * @param buf - buffer
+ * @param[in] data - bytes to append
+ * @param[in] size - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_append(struct buffer *buf, const void *data, size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    if (buffer_reserve(buf, size) != 0)
+        return -1;
+
+    memcpy(buf->data + buf->len, data, size);
+    buf->len += size;
+
+    return 0;
+}
+
+/**
+ * Append formatted text to a buffer.  No terminating NUL is kept.
+ *
+ * @param buf - buffer
+ * @param[in] fmt - printf(3) format
+ * @param[in] ap - format arguments
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_vprintf(struct buffer *buf, const char *fmt, va_list ap)
+{
+    int n;
+    va_list aq;
+
+    /* Usually fits in what is left. */
+    if (buffer_reserve(buf, 64) != 0)
+        return -1;
+
+    va_copy(aq, ap);
+    n = vsnprintf(buf->data + buf->len, buf->alloc - buf->len, fmt, aq);
+    va_end(aq);
+
+    if (n < 0)
+        return -1;
+
+    if ((size_t)n >= buf->alloc - buf->len) {
+        if (buffer_reserve(buf, (size_t)n + 1) != 0)
+            return -1;
+
+        (void)vsnprintf(buf->data + buf->len, (size_t)n + 1, fmt, ap);
+    }
+
+    buf->len += (size_t)n;
+
+    return 0;
+}
+
+/**
+ * Append formatted text to a buffer.  No terminating NUL is kept.
+ *
+ * @param buf - buffer
+ * @param[in] fmt - printf(3) format
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_printf(struct buffer *buf, const char *fmt, ...)
+{
+    int err;
+    va_list ap;
+
+    va_start(ap, fmt);
+    err = buffer_vprintf(buf, fmt, ap);
+    va_end(ap);
+
+    return err;
+}
+
+/**
+ * Append an unsigned number in decimal, without printf(3).
+ *
+ * @param buf - buffer
+ * @param[in] value - number
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_put_ulong(struct buffer *buf, unsigned long value)
+{
+    char digits[20];
+    size_t n = 0;
+
+    do {
+        digits[n++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value != 0);
+
+    if (buffer_reserve(buf, n) != 0)
+        return -1;
+
+    while (n != 0)
+        buf->data[buf->len++] = digits[--n];
+
+    return 0;
+}
+
+/**
+ * Append an unsigned number as 0x and lowercase hex, without
+ * printf(3).  Same as "0x%lx".
+ *
+ * @param buf - buffer
+ * @param[in] value - number
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_put_xlong(struct buffer *buf, unsigned long value)
+{
+    static const char hex[] = "0123456789abcdef";
+    char digits[16];
+    size_t n = 0;
+
+    do {
+        digits[n++] = hex[value & 0x0f];
+        value >>= 4;
+    } while (value != 0);
+
+    if (buffer_reserve(buf, n + 2) != 0)
+        return -1;
+
+    buf->data[buf->len++] = '0';
+    buf->data[buf->len++] = 'x';
+
+    while (n != 0)
+        buf->data[buf->len++] = digits[--n];
+
+    return 0;
+}
+
+/**
+ * Append bytes as lowercase hex, two digits each.
+ *
+ * @param buf - buffer
+ * @param[in] data - bytes
+ * @param[in] size - number of bytes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+buffer_put_hex(struct buffer *buf, const void *data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+    const unsigned char *bytes = data;
+
+    if (buffer_reserve(buf, size * 2) != 0)
+        return -1;
+
+    for (i = 0; i < size; ++i) {
+        buf->data[buf->len++] = hex[bytes[i] >> 4];
+        buf->data[buf->len++] = hex[bytes[i] & 0x0f];
+    }
+
+    return 0;
+}
+
+/**
+ * Drop bytes from the front of a buffer.
+ *
+ * @param buf - buffer
+ * @param[in] size - number of bytes, at most buf->len
+ */
+void
+buffer_consume(struct buffer *buf, size_t size)
+{
+    if (size >= buf->len) {
+        buf->len = 0;
+        return;
+    }
+
+    memmove(buf->data, buf->data + size, buf->len - size);
+    buf->len -= size;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,45 @@
+#ifndef H_BUFFER
+#define H_BUFFER
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/* Growable byte buffer.  Data is appended at len and consumed from
+ * the front. */
+struct buffer {
+    char *data;
+    size_t len;
+    size_t alloc;
+};
+
+static inline void
+buffer_init(struct buffer *buf)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->alloc = 0;
+}
+
+static inline void
+buffer_reset(struct buffer *buf)
+{
+    buf->len = 0;
+}
+
+extern void buffer_fini(struct buffer *buf);
+
+extern int buffer_reserve(struct buffer *buf, size_t size);
+extern int buffer_append(struct buffer *buf, const void *data, size_t size);
+extern int buffer_printf(struct buffer *buf, const char *fmt, ...)
+                __attribute__((format(printf, 2, 3)));
+extern int buffer_vprintf(struct buffer *buf, const char *fmt, va_list ap);
+
+extern int buffer_put_ulong(struct buffer *buf, unsigned long value);
+extern int buffer_put_xlong(struct buffer *buf, unsigned long value);
+extern int buffer_put_hex(struct buffer *buf, const void *data, size_t size);
+
+extern void buffer_consume(struct buffer *buf, size_t size);
+
+#endif /* H_BUFFER */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -1,13 +1,48 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "buffer.h"
 #include "command.h"
 #include "shared/list.h"
 #include "shared/util.h"
 
+/* Scripts: see exec_script(). */
+#define SCRIPT_MAX_VARS   (64)
+#define SCRIPT_MAX_NAME   (32)
+#define SCRIPT_MAX_DEPTH  (16)
+
+struct script_var {
+    char name[SCRIPT_MAX_NAME];
+    struct buffer value;
+};
+
+struct script {
+    struct command_list *list;
+    struct command_ctx *ctx;
+
+    char *text;
+    char **lines;
+    size_t *ends;           /* line of the end closing a block */
+    size_t count;
+
+    struct script_var vars[SCRIPT_MAX_VARS];
+    size_t nvars;
+
+    int last;               /* status of the last command, $? */
+    size_t failed;          /* line which failed, from 1 */
+};
+
+/* Slots per command, at least. */
+#define COMMAND_TABLE_LOAD  (2)
+
+/* argv entries an arena starts with. */
+#define COMMAND_ARGV_MIN    (16)
+
 void
 command_list_clear(struct command_list *list)
 {
@@ -22,14 +57,129 @@ command_list_clear(struct command_list *list)
         free(command);
     }
 
+    free(list->table);
+    free(list->sorted);
+
     command_list_init(list);
 }
 
+void
+command_arena_fini(struct command_arena *arena)
+{
+    free(arena->text);
+    free(arena->argv);
+
+    command_arena_init(arena);
+}
+
+/* FNV-1a */
+static size_t
+name_hash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static void
+table_insert(struct command **table, size_t table_size,
+    struct command *command)
+{
+    size_t mask = table_size - 1;
+    size_t i = name_hash(command->name) & mask;
+
+    while (table[i] != NULL)
+        i = (i + 1) & mask;
+
+    table[i] = command;
+}
+
+static struct command *
+table_find(const struct command_list *list, const char *name)
+{
+    size_t i;
+    size_t mask;
+
+    if (list->table_size == 0)
+        return NULL;
+
+    mask = list->table_size - 1;
+
+    for (i = name_hash(name) & mask; list->table[i] != NULL;
+            i = (i + 1) & mask) {
+        if (strcmp(list->table[i]->name, name) == 0)
+            return list->table[i];
+    }
+
+    return NULL;
+}
+
+/* Make room for one more command in both indexes. */
+static int
+index_grow(struct command_list *list)
+{
+    size_t i;
+    size_t table_size;
+    struct command **table;
+    struct command **sorted;
+
+    sorted = realloc(list->sorted, (list->size + 1) * sizeof(*sorted));
+
+    if (sorted == NULL)
+        return -ENOMEM;
+
+    list->sorted = sorted;
+
+    if ((list->size + 1) * COMMAND_TABLE_LOAD <= list->table_size)
+        return 0;
+
+    table_size = (list->table_size == 0) ? 32 : list->table_size * 2;
+    table = calloc(table_size, sizeof(*table));
+
+    if (table == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < list->size; ++i)
+        table_insert(table, table_size, list->sorted[i]);
+
+    free(list->table);
+    list->table = table;
+    list->table_size = table_size;
+
+    return 0;
+}
+
+/* Index of the first sorted command not less than name. */
+static size_t
+sorted_lower_bound(const struct command_list *list, const char *name)
+{
+    size_t lo = 0;
+    size_t hi = list->size;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(list->sorted[mid]->name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
 int
 register_command(struct command_list *list,
     const char *name, command_fn_t handler,
     const char *shortdoc, const char *longdoc)
 {
+    int err;
+    size_t pos;
     size_t slen;
     struct command *command;
 
@@ -42,6 +192,12 @@ register_command(struct command_list *list,
     if (name[0] == '\0')
         return -EINVAL;
 
+    if (table_find(list, name) != NULL)
+        return -EEXIST;
+
+    if ((err = index_grow(list)) != 0)
+        return err;
+
     slen = strlen(name);
 
     command = malloc(sizeof(*command) + slen);
@@ -57,131 +213,772 @@ register_command(struct command_list *list,
 
     command->id = list->next_id++;
 
-    list_add(&(list->head), &(command->node));
+    list_add(&(command->node), &(list->head));
+
+    table_insert(list->table, list->table_size, command);
+
+    pos = sorted_lower_bound(list, name);
+    memmove(&(list->sorted[pos + 1]), &(list->sorted[pos]),
+        (list->size - pos) * sizeof(*(list->sorted)));
+    list->sorted[pos] = command;
+
     list->size++;
 
     return 0;
 }
 
-static struct command *
-find_command(struct command_list *list, const char *name)
+/*
+ * Find a command by name, or by a prefix of exactly one command's name.
+ *
+ * Returns 0, -ENOENT if no command matches or -ENOTUNIQ if the prefix
+ * is ambiguous.
+ */
+static int
+find_command(struct command_list *list, const char *name,
+    struct command **command)
 {
-    struct list_head *entry;
+    size_t pos;
+    size_t len;
+
+    *command = table_find(list, name);
+
+    if (*command != NULL)
+        return 0;
+
+    /* Commands starting with name sort together, right after it. */
+    len = strlen(name);
+    pos = sorted_lower_bound(list, name);
+
+    if (pos == list->size || strncmp(list->sorted[pos]->name, name, len) != 0)
+        return -ENOENT;
+
+    if (pos + 1 < list->size
+            && strncmp(list->sorted[pos + 1]->name, name, len) == 0)
+        return -ENOTUNIQ;
+
+    *command = list->sorted[pos];
+
+    return 0;
+}
+
+static int
+arena_push(struct command_arena *arena, size_t argc, char *arg)
+{
+    /* Room for a NULL after the last argument. */
+    if (argc + 1 >= arena->argv_alloc) {
+        size_t alloc;
+        char **argv;
+
+        alloc = (arena->argv_alloc == 0)
+            ? COMMAND_ARGV_MIN : arena->argv_alloc * 2;
 
-    list_for_each(entry, &(list->head)) {
-        struct command *command = command_entry(entry);
+        argv = realloc(arena->argv, alloc * sizeof(*argv));
 
-        if (strcmp(command->name, name) == 0)
-            return command;
+        if (argv == NULL)
+            return -ENOMEM;
+
+        arena->argv = argv;
+        arena->argv_alloc = alloc;
     }
 
-    return NULL;
+    arena->argv[argc] = arg;
+    arena->argv[argc + 1] = NULL;
+
+    return 0;
 }
 
-int
-exec_line(struct command_list *list, const char *line)
+/*
+ * Split line into arena->argv, copying it to arena->text and unquoting
+ * in place.  Arguments are separated by whitespace.  Inside '...'
+ * everything is literal; inside "..." a backslash escapes the next
+ * character, as it does outside quotes.
+ *
+ * Returns 0 or a negative errno value; -EINVAL for an unterminated
+ * quote or a trailing backslash.
+ */
+static int
+tokenize(struct command_arena *arena, const char *line, size_t *argc)
 {
     int err;
+    char *r;
+    char *w;
+    size_t len = strlen(line);
 
-    char *p;
-    char *pline;
+    if (len + 1 > arena->text_alloc) {
+        char *text = realloc(arena->text, len + 1);
+
+        if (text == NULL)
+            return -ENOMEM;
+
+        arena->text = text;
+        arena->text_alloc = len + 1;
+    }
+
+    memcpy(arena->text, line, len + 1);
+
+    *argc = 0;
+    r = w = arena->text;
 
-    size_t argc = 0;
-    char **argv = NULL;
+    for (;;) {
+        char *arg;
 
-    size_t stack_pos = 0;
-    char *argv_stack[16];
+        while (*r != '\0' && isspace((unsigned char)*r))
+            ++r;
 
+        if (*r == '\0')
+            break;
+
+        /* Unquoting only shrinks, so w never passes r. */
+        arg = w;
+
+        while (*r != '\0' && !isspace((unsigned char)*r)) {
+            char quote = *r;
+
+            if (quote == '\\') {
+                if (*++r == '\0')
+                    return -EINVAL;
+
+                *w++ = *r++;
+                continue;
+            }
+
+            if (quote != '\'' && quote != '"') {
+                *w++ = *r++;
+                continue;
+            }
+
+            for (++r; *r != quote; ++r) {
+                if (*r == '\0')
+                    return -EINVAL;
+
+                if (quote == '"' && *r == '\\' && r[1] != '\0')
+                    ++r;
+
+                *w++ = *r;
+            }
+
+            ++r;
+        }
+
+        /* Either r is at the NUL already or this overwrites the
+         * separator, which was read. */
+        if (*r != '\0')
+            ++r;
+
+        *w++ = '\0';
+
+        if ((err = arena_push(arena, *argc, arg)) != 0)
+            return err;
+
+        (*argc)++;
+    }
+
+    return 0;
+}
+
+int
+exec_line(struct command_list *list, struct command_ctx *ctx,
+    const char *line)
+{
+    int err;
+    size_t argc;
     struct command *command;
+    struct command_arena local;
+    struct command_arena *arena = ctx->arena;
 
-    /* Empty string. */
-    if (line[0] == '\0')
-        return 0;
+    if (arena == NULL) {
+        command_arena_init(&local);
+        arena = &local;
+    }
 
-    pline = strdup(line);
+    err = tokenize(arena, line, &argc);
 
-    if (pline == NULL)
-        return -errno;
+    /* Empty or just whitespace. */
+    if (err != 0 || argc == 0)
+        goto out;
 
-    p = pline;
+    err = find_command(list, arena->argv[0], &command);
 
-    while (*p && isspace(*p)) ++p;
+    if (err != 0)
+        goto out;
 
-    /* Just whitespace. */
-    if (*p == '\0')
-        return 0;
+    err = command->handler(ctx, argc, arena->argv);
+
+out:
+
+    if (arena == &local)
+        command_arena_fini(&local);
+
+    return err;
+}
+
+
+/* Scripts */
+
+static int
+is_name_char(int c)
+{
+    return isalnum(c) || c == '_';
+}
+
+/* Split off the first word of *p, NUL terminating it. */
+static char *
+next_word(char **p)
+{
+    char *word;
+    char *s = *p;
+
+    while (*s != '\0' && isspace((unsigned char)*s))
+        ++s;
+
+    if (*s == '\0') {
+        *p = s;
+        return NULL;
+    }
+
+    word = s;
+
+    while (*s != '\0' && !isspace((unsigned char)*s))
+        ++s;
+
+    if (*s != '\0')
+        *s++ = '\0';
+
+    while (*s != '\0' && isspace((unsigned char)*s))
+        ++s;
+
+    *p = s;
+
+    return word;
+}
+
+static int
+is_block(const char *word)
+{
+    return strcmp(word, "repeat") == 0 || strcmp(word, "for") == 0
+        || strcmp(word, "foreach") == 0;
+}
+
+static struct script_var *
+var_find(struct script *script, const char *name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < script->nvars; ++i) {
+        struct script_var *var = &(script->vars[i]);
+
+        if (strncmp(var->name, name, len) == 0 && var->name[len] == '\0')
+            return var;
+    }
+
+    return NULL;
+}
+
+static int
+var_set(struct script *script, const char *name, const char *value,
+    size_t len)
+{
+    size_t nlen = strlen(name);
+    struct script_var *var;
+
+    if (nlen == 0 || nlen >= SCRIPT_MAX_NAME)
+        return -EINVAL;
+
+    var = var_find(script, name, nlen);
+
+    if (var == NULL) {
+        if (script->nvars == SCRIPT_MAX_VARS)
+            return -ENOSPC;
+
+        var = &(script->vars[script->nvars++]);
+        memcpy(var->name, name, nlen + 1);
+        buffer_init(&(var->value));
+    }
+
+    buffer_reset(&(var->value));
+
+    /* Kept NUL terminated. */
+    if (buffer_reserve(&(var->value), len + 1) != 0)
+        return -ENOMEM;
+
+    (void)buffer_append(&(var->value), value, len);
+    var->value.data[len] = '\0';
 
-    argv_stack[stack_pos++] = p;
+    return 0;
+}
+
+static int
+var_set_long(struct script *script, const char *name, long value)
+{
+    char num[32];
+    int len;
+
+    len = snprintf(num, sizeof(num), "%ld", value);
 
-    for (;*p != '\0'; ++p) {
-        if (isspace(*p)) {
-            void *new_argv;
+    return var_set(script, name, num, (size_t)len);
+}
 
-            *p = '\0';
+/* Append field (from 1) of a whitespace separated value. */
+static int
+append_field(struct buffer *out, const char *value, unsigned long field)
+{
+    const char *p = value;
+
+    for (;;) {
+        const char *start;
+
+        while (*p != '\0' && isspace((unsigned char)*p))
             ++p;
 
-            while (*p && isspace(*p)) ++p;
+        if (*p == '\0')
+            return 0;
 
-            if (*p == '\0')
-                break;
+        start = p;
 
-            /* Add next argument. */
-            if (stack_pos < ARRAY_SIZ(argv_stack)) {
-                argv_stack[stack_pos++] = p;
-                continue;
-            }
+        while (*p != '\0' && !isspace((unsigned char)*p))
+            ++p;
+
+        if (--field == 0)
+            return buffer_append(out, start, (size_t)(p - start));
+    }
+}
+
+/*
+ * Expand $name, ${name}, ${name:field}, $? and $$ in line.
+ *
+ * Returns 0 or a negative errno value; -EINVAL for unknown variables.
+ */
+static int
+expand(struct script *script, const char *line, struct buffer *out)
+{
+    const char *p = line;
+
+    buffer_reset(out);
+
+    while (*p != '\0') {
+        const char *name;
+        size_t len;
+        unsigned long field = 0;
+        struct script_var *var;
+        const char *dollar = strchr(p, '$');
+
+        if (dollar == NULL)
+            dollar = p + strlen(p);
+
+        if (buffer_append(out, p, (size_t)(dollar - p)) != 0)
+            return -ENOMEM;
 
-            /* Filled up the stack, expand argv. */
-            new_argv = realloc(argv,
-                (argc + ARRAY_SIZ(argv_stack)) * sizeof(*argv));
+        p = dollar;
 
-            if (new_argv == NULL) {
-                err = -errno;
-                goto out;
+        if (*p == '\0')
+            break;
+
+        ++p;
+
+        if (*p == '$' || *p == '?') {
+            int err;
+
+            if (*p == '$')
+                err = buffer_append(out, "$", 1);
+            else
+                err = buffer_printf(out, "%d", script->last);
+
+            if (err != 0)
+                return -ENOMEM;
+
+            ++p;
+            continue;
+        }
+
+        if (*p == '{') {
+            name = ++p;
+
+            while (is_name_char((unsigned char)*p))
+                ++p;
+
+            len = (size_t)(p - name);
+
+            if (*p == ':') {
+                char *endptr = NULL;
+
+                field = strtoul(p + 1, &endptr, 10);
+
+                if (endptr == p + 1 || field == 0)
+                    return -EINVAL;
+
+                p = endptr;
             }
 
-            argv = new_argv;
+            if (*p != '}')
+                return -EINVAL;
+
+            ++p;
+        }
+        else {
+            name = p;
+
+            while (is_name_char((unsigned char)*p))
+                ++p;
+
+            len = (size_t)(p - name);
+        }
+
+        var = (len != 0) ? var_find(script, name, len) : NULL;
 
-            memcpy(&argv[argc], argv_stack,
-                ARRAY_SIZ(argv_stack) * sizeof(*argv));
+        if (var == NULL)
+            return -EINVAL;
 
-            argc += ARRAY_SIZ(argv_stack);
-            stack_pos = 0;
+        if (field != 0) {
+            if (append_field(out, var->value.data, field) != 0)
+                return -ENOMEM;
+        }
+        else if (buffer_append(out, var->value.data, var->value.len) != 0) {
+            return -ENOMEM;
         }
     }
 
-    if (argc == 0) {
-        argv = argv_stack;
-        argc = stack_pos;
+    if (buffer_append(out, "", 1) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+parse_long(const char *str, long *value)
+{
+    char *endptr = NULL;
+
+    if (str == NULL)
+        return -EINVAL;
+
+    errno = 0;
+    *value = strtol(str, &endptr, 0);
+
+    if (errno != 0 || endptr == str || *endptr != '\0')
+        return -EINVAL;
+
+    return 0;
+}
+
+static int run_block(struct script *script, size_t first, size_t last,
+    unsigned int depth);
+
+static int
+run_repeat(struct script *script, size_t i, char *args, unsigned int depth)
+{
+    int err;
+    long n;
+    long k;
+    char *count = next_word(&args);
+    char *var = next_word(&args);
+
+    if (parse_long(count, &n) != 0 || n < 0 || *args != '\0')
+        return -EINVAL;
+
+    for (k = 0; k < n; ++k) {
+        if (var != NULL && (err = var_set_long(script, var, k)) != 0)
+            return err;
+
+        err = run_block(script, i + 1, script->ends[i], depth + 1);
+
+        if (err != 0)
+            return err;
+    }
+
+    return 0;
+}
+
+static int
+run_for(struct script *script, size_t i, char *args, unsigned int depth)
+{
+    int err;
+    long from;
+    long to;
+    long step = 1;
+    long k;
+    char *var = next_word(&args);
+    char *sfrom = next_word(&args);
+    char *sto = next_word(&args);
+    char *sstep = next_word(&args);
+
+    if (var == NULL || parse_long(sfrom, &from) != 0
+            || parse_long(sto, &to) != 0 || *args != '\0')
+        return -EINVAL;
+
+    if (sstep != NULL && (parse_long(sstep, &step) != 0 || step == 0))
+        return -EINVAL;
+
+    for (k = from; (step > 0) ? (k <= to) : (k >= to); k += step) {
+        if ((err = var_set_long(script, var, k)) != 0)
+            return err;
+
+        err = run_block(script, i + 1, script->ends[i], depth + 1);
+
+        if (err != 0)
+            return err;
+
+        /* Stop before k wraps around. */
+        if ((step > 0 && k > to - step) || (step < 0 && k < to - step))
+            break;
+    }
+
+    return 0;
+}
+
+static int
+run_foreach(struct script *script, size_t i, char *args, unsigned int depth)
+{
+    int err;
+    char *p;
+    char *nl;
+    struct buffer lines;
+    struct buffer *out = script->ctx->out;
+    char *var = next_word(&args);
+
+    if (var == NULL || *args == '\0')
+        return -EINVAL;
+
+    buffer_init(&lines);
+
+    /* The command's output is what the body runs over. */
+    script->ctx->out = &lines;
+    err = exec_line(script->list, script->ctx, args);
+    script->ctx->out = out;
+
+    script->last = err;
+
+    if (err == 0 && buffer_append(&lines, "", 1) != 0)
+        err = -ENOMEM;
+
+    for (p = lines.data; err == 0 && p != NULL && *p != '\0'; p = nl) {
+        nl = strchr(p, '\n');
+
+        if (nl != NULL)
+            *nl++ = '\0';
+
+        if ((err = var_set(script, var, p, strlen(p))) != 0)
+            break;
+
+        err = run_block(script, i + 1, script->ends[i], depth + 1);
+    }
+
+    buffer_fini(&lines);
+
+    return err;
+}
+
+static int
+run_block(struct script *script, size_t first, size_t last,
+    unsigned int depth)
+{
+    int err = 0;
+    size_t i;
+    struct buffer line;
+
+    if (depth > SCRIPT_MAX_DEPTH)
+        return -ELOOP;
+
+    buffer_init(&line);
+
+    for (i = first; i < last; ++i) {
+        char *p;
+        char *word;
+
+        err = expand(script, script->lines[i], &line);
+
+        if (err != 0) {
+            if (script->failed == 0)
+                script->failed = i + 1;
+            break;
+        }
+
+        p = line.data;
+        word = next_word(&p);
+
+        if (word == NULL || word[0] == '#')
+            continue;
+
+        if (strcmp(word, "set") == 0) {
+            char *name = next_word(&p);
+
+            err = (name == NULL) ? -EINVAL
+                : var_set(script, name, p, strlen(p));
+        }
+        else if (strcmp(word, "repeat") == 0) {
+            err = run_repeat(script, i, p, depth);
+        }
+        else if (strcmp(word, "for") == 0) {
+            err = run_for(script, i, p, depth);
+        }
+        else if (strcmp(word, "foreach") == 0) {
+            err = run_foreach(script, i, p, depth);
+        }
+        else {
+            /* Put the command name back for exec_line(). */
+            if (*p != '\0')
+                p[-1] = ' ';
+
+            err = exec_line(script->list, script->ctx, word);
+            script->last = err;
+        }
+
+        if (err != 0) {
+            if (script->failed == 0)
+                script->failed = i + 1;
+            break;
+        }
+
+        if (is_block(word))
+            i = script->ends[i];
     }
-    else if (stack_pos != 0) {
-        void *new_argv;
 
-        /* We have both dynamicly allocated members and stack members. */
-        new_argv = realloc(argv, (argc + stack_pos) * sizeof(*argv));
+    buffer_fini(&line);
 
-        if (new_argv == NULL) {
-            err = -errno;
-            goto out;
+    return err;
+}
+
+/* Find the end of every block. */
+static int
+script_match(struct script *script)
+{
+    size_t i;
+    size_t depth = 0;
+    size_t open[SCRIPT_MAX_DEPTH + 1];
+
+    for (i = 0; i < script->count; ++i) {
+        char *p = script->lines[i];
+        char word[16];
+        size_t len;
+
+        while (*p != '\0' && isspace((unsigned char)*p))
+            ++p;
+
+        for (len = 0; p[len] != '\0' && !isspace((unsigned char)p[len]); ++len)
+            ;
+
+        if (len >= sizeof(word))
+            continue;
+
+        memcpy(word, p, len);
+        word[len] = '\0';
+
+        if (is_block(word)) {
+            if (depth > SCRIPT_MAX_DEPTH) {
+                script->failed = i + 1;
+                return -ELOOP;
+            }
+
+            open[depth++] = i;
+        }
+        else if (strcmp(word, "end") == 0) {
+            if (depth == 0) {
+                script->failed = i + 1;
+                return -EINVAL;
+            }
+
+            script->ends[open[--depth]] = i;
         }
+    }
 
-        argv = new_argv;
+    if (depth != 0) {
+        script->failed = open[depth - 1] + 1;
+        return -EINVAL;
+    }
 
-        memcpy(&argv[argc], argv_stack, stack_pos * sizeof(*argv));
+    return 0;
+}
 
-        argc += stack_pos;
+/**
+ * Run a script: newline separated command lines, with variables and
+ * loops, all against one context.
+ *
+ *   set <var> <value...>          set a variable
+ *   repeat <n> [var] ... end      run the body n times, var from 0
+ *   for <var> <from> <to> [step] ... end
+ *                                 run the body with var from..to
+ *   foreach <var> <command...> ... end
+ *                                 run the body once per output line
+ *                                 of the command, var holding the line
+ *
+ * $var and ${var} expand to a variable, ${var:n} to its nth field,
+ * $? to the status of the last command and $$ to $.  Lines starting
+ * with # are ignored.
+ *
+ * Commands write their output to ctx->out in turn.  The script stops
+ * at the first command which fails, appending "! <line> <status>".
+ *
+ * @param list - command list
+ * @param ctx - context every command runs with
+ * @param[in] text - script
+ *
+ * @return 0 on success
+ * @return negative errno value of the command which failed
+ */
+int
+exec_script(struct command_list *list, struct command_ctx *ctx,
+    const char *text)
+{
+    int err;
+    size_t i;
+    char *p;
+    struct script script;
+
+    memset(&script, 0, sizeof(script));
+
+    script.list = list;
+    script.ctx = ctx;
+    script.text = strdup(text);
+
+    if (script.text == NULL)
+        return -ENOMEM;
+
+    script.count = 1;
+
+    for (p = script.text; *p != '\0'; ++p) {
+        if (*p == '\n')
+            script.count++;
+    }
+
+    script.lines = malloc(script.count * sizeof(*(script.lines)));
+    script.ends = calloc(script.count, sizeof(*(script.ends)));
+
+    if (script.lines == NULL || script.ends == NULL) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0, p = script.text; i < script.count; ++i) {
+        char *nl = strchr(p, '\n');
+
+        script.lines[i] = p;
+
+        if (nl == NULL)
+            break;
+
+        *nl = '\0';
+
+        if (nl != p && nl[-1] == '\r')
+            nl[-1] = '\0';
+
+        p = nl + 1;
     }
 
-    command = find_command(list, argv[0]);
+    err = script_match(&script);
+
+    if (err == 0)
+        err = run_block(&script, 0, script.count, 0);
 
-    err = command->handler(argc, argv);
+    if (err != 0)
+        (void)buffer_printf(ctx->out, "! %zu %d\n", script.failed, err);
 
 out:
 
-    if (argv != NULL && argv != argv_stack)
-        free(argv);
+    for (i = 0; i < script.nvars; ++i)
+        buffer_fini(&(script.vars[i].value));
 
-    free(pline);
+    free(script.ends);
+    free(script.lines);
+    free(script.text);
 
     return err;
 }
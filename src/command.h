@@ -5,9 +5,33 @@
 
 #include "shared/list.h"
 
-/* TODO: Hash Table */
+struct buffer;
+struct job_table;
+struct stream;
+struct target;
+
+/* Where exec_line() splits a line into arguments.  Kept from line to
+ * line, so once it has grown tokenizing allocates nothing.  Only one
+ * thread may use an arena. */
+struct command_arena {
+    char *text;
+    size_t text_alloc;
+    char **argv;
+    size_t argv_alloc;
+};
+
+/* What a command runs against and where its output goes. */
+struct command_ctx {
+    struct buffer *out;
+    struct command_arena *arena;    /* NULL to allocate per line */
+    struct target *target;  /* NULL if the request named none */
+    struct job_table *jobs; /* only for commands naming no target */
+    struct stream *stream;  /* binary results asked for, or NULL */
+    int pass_fd;            /* sent along with the reply, or -1 */
+};
 
-typedef int(*command_fn_t)(size_t, char **);
+/* Handlers return 0 or a negative errno value. */
+typedef int(*command_fn_t)(struct command_ctx *, size_t, char **);
 
 struct command {
     struct list_head node;
@@ -23,10 +47,16 @@ struct command {
     char name[1];
 };
 
+/* Commands are found by exact name in an open addressed hash table,
+ * or by unique prefix in an array sorted by name. */
 struct command_list {
     struct list_head head;
     size_t next_id;
     size_t size;
+
+    struct command **table;     /* table_size slots, a power of two */
+    size_t table_size;
+    struct command **sorted;    /* size commands */
 };
 
 
@@ -36,8 +66,22 @@ command_list_init(struct command_list *list)
     list_head_init(&(list->head));
     list->next_id = 1;
     list->size = 0;
+    list->table = NULL;
+    list->table_size = 0;
+    list->sorted = NULL;
+}
+
+static inline void
+command_arena_init(struct command_arena *arena)
+{
+    arena->text = NULL;
+    arena->text_alloc = 0;
+    arena->argv = NULL;
+    arena->argv_alloc = 0;
 }
 
+extern void command_arena_fini(struct command_arena *arena);
+
 extern void command_list_clear(struct command_list *list);
 
 #define command_list_is_empty(command_list) \
@@ -51,7 +95,11 @@ extern int register_command(struct command_list *list,
     const char *name, command_fn_t handler,
     const char *shortdoc, const char *longdoc);
 
-extern int exec_line(struct command_list *list, const char *line);
+extern int exec_line(struct command_list *list, struct command_ctx *ctx,
+    const char *line);
+
+extern int exec_script(struct command_list *list, struct command_ctx *ctx,
+    const char *text);
 
 #endif /* H_COMMAND */
 /* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,1430 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/list.h"
+
+#include "elf_index.h"
+#include "pid_mem.h"
+
+/**
+ * @file elf_index.c
+ *
+ * Symbol index of the ELF objects loaded in a process.
+ *
+ * elf_index_build() walks /proc/<pid>/maps and, for each mapped ELF
+ * file, reads .symtab, .dynsym, the PLT relocations and the build-id.
+ * The file is read from disk; deleted files are read through
+ * /proc/<pid>/map_files and, failing that, from the process memory
+ * through the dynamic section (which only gives .dynsym).
+ *
+ * Each file becomes an elf_image: symbols sorted by address and a
+ * hash table by name.  Images are cached by build-id, so a library is
+ * parsed once no matter how many processes or indexes map it.  The
+ * index itself adds a process wide name table, filled in load order
+ * like the dynamic linker does, so a lookup is one hash probe.
+ *
+ * Only objects of the daemon's own ELF class are indexed.
+ */
+
+#define ELF_NAME_EMPTY  (UINT32_MAX)
+
+#if __WORDSIZE == 64
+#define ELF_R_SYM(i)    ELF64_R_SYM(i)
+#define ELF_ST_TYPE(i)  ELF64_ST_TYPE(i)
+#define ELF_ST_BIND(i)  ELF64_ST_BIND(i)
+#else
+#define ELF_R_SYM(i)    ELF32_R_SYM(i)
+#define ELF_ST_TYPE(i)  ELF32_ST_TYPE(i)
+#define ELF_ST_BIND(i)  ELF32_ST_BIND(i)
+#endif
+
+/* Images shared by build-id. */
+static LIST_HEAD(elf_images);
+
+struct sym_array {
+    struct elf_symbol *syms;
+    size_t count;
+    size_t alloc;
+};
+
+struct plt_array {
+    struct elf_plt_slot *slots;
+    size_t count;
+    size_t alloc;
+};
+
+
+static inline uint32_t
+elf_name_hash(const char *name)
+{
+    /* Same as DT_GNU_HASH. */
+    uint32_t h = 5381;
+
+    for (; *name != '\0'; ++name)
+        h = (h << 5) + h + (unsigned char)*name;
+
+    return h;
+}
+
+static inline size_t
+round_pow2(size_t n)
+{
+    size_t ret = 16;
+
+    while (ret < n)
+        ret <<= 1;
+
+    return ret;
+}
+
+static int
+sym_array_add(struct sym_array *arr, const char *name, const ElfW(Sym) *sym)
+{
+    struct elf_symbol *out;
+    unsigned char type = ELF_ST_TYPE(sym->st_info);
+
+    if (name[0] == '\0' || sym->st_shndx == SHN_UNDEF)
+        return 0;
+
+    if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE
+            && type != STT_GNU_IFUNC)
+        return 0;
+
+    if (arr->count == arr->alloc) {
+        size_t alloc = (arr->alloc == 0) ? 256 : arr->alloc * 2;
+        struct elf_symbol *tmp;
+
+        tmp = realloc(arr->syms, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        arr->syms = tmp;
+        arr->alloc = alloc;
+    }
+
+    out = &(arr->syms[ arr->count++ ]);
+    out->name = name;
+    out->value = (unsigned long)sym->st_value;
+    out->size = (unsigned long)sym->st_size;
+    out->type = type;
+    out->bind = ELF_ST_BIND(sym->st_info);
+
+    return 0;
+}
+
+static int
+plt_array_add(struct plt_array *arr, const char *name, unsigned long offset)
+{
+    if (arr->count == arr->alloc) {
+        size_t alloc = (arr->alloc == 0) ? 64 : arr->alloc * 2;
+        struct elf_plt_slot *tmp;
+
+        tmp = realloc(arr->slots, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        arr->slots = tmp;
+        arr->alloc = alloc;
+    }
+
+    arr->slots[arr->count].name = name;
+    arr->slots[arr->count].offset = offset;
+    arr->count++;
+
+    return 0;
+}
+
+static int
+symbol_cmp(const void *a, const void *b)
+{
+    const struct elf_symbol *sa = a;
+    const struct elf_symbol *sb = b;
+
+    return (sa->value > sb->value) - (sa->value < sb->value);
+}
+
+/* Sort the symbols and build the name table. */
+static int
+image_finish(struct elf_image *image, struct sym_array *syms,
+    struct plt_array *plt)
+{
+    size_t i;
+
+    qsort(syms->syms, syms->count, sizeof(*(syms->syms)), symbol_cmp);
+
+    image->symbols = syms->syms;
+    image->nsymbols = syms->count;
+    image->plt = plt->slots;
+    image->nplt = plt->count;
+
+    image->nnames = round_pow2(syms->count * 2);
+    image->names = malloc(image->nnames * sizeof(*(image->names)));
+
+    if (image->names == NULL)
+        return -1;
+
+    for (i = 0; i < image->nnames; ++i)
+        image->names[i].index = ELF_NAME_EMPTY;
+
+    for (i = 0; i < image->nsymbols; ++i) {
+        const struct elf_symbol *sym = &(image->symbols[i]);
+        uint32_t hash = elf_name_hash(sym->name);
+        size_t pos = hash & (image->nnames - 1);
+
+        for (;;) {
+            struct elf_name_slot *slot = &(image->names[pos]);
+            const struct elf_symbol *old;
+
+            if (slot->index == ELF_NAME_EMPTY) {
+                slot->hash = hash;
+                slot->index = (uint32_t)i;
+                break;
+            }
+
+            old = &(image->symbols[ slot->index ]);
+
+            if (slot->hash == hash && strcmp(old->name, sym->name) == 0) {
+                /* A global definition hides a local one. */
+                if (old->bind == STB_LOCAL && sym->bind != STB_LOCAL)
+                    slot->index = (uint32_t)i;
+                break;
+            }
+
+            pos = (pos + 1) & (image->nnames - 1);
+        }
+    }
+
+    return 0;
+}
+
+
+static struct elf_image *
+image_new(const char *path)
+{
+    size_t len = strlen(path);
+    struct elf_image *image;
+
+    image = calloc(1, sizeof(*image) + len);
+
+    if (image == NULL)
+        return NULL;
+
+    memcpy(image->path, path, len + 1);
+    list_head_init(&(image->node));
+    image->refs = 1;
+
+    return image;
+}
+
+static void
+image_put(struct elf_image *image)
+{
+    if (image == NULL || --(image->refs) != 0)
+        return;
+
+    list_del(&(image->node));
+
+    if (image->blob_mapped)
+        munmap(image->blob, image->blob_size);
+    else
+        free(image->blob);
+
+    free(image->symbols);
+    free(image->names);
+    free(image->plt);
+    free(image);
+}
+
+static struct elf_image *
+image_cached(const unsigned char *build_id, size_t len)
+{
+    struct list_head *entry;
+
+    if (len == 0)
+        return NULL;
+
+    list_for_each(entry, &elf_images) {
+        struct elf_image *image;
+
+        image = list_entry(entry, struct elf_image, node);
+
+        if (image->build_id_len == len
+                && memcmp(image->build_id, build_id, len) == 0) {
+            image->refs++;
+            return image;
+        }
+    }
+
+    return NULL;
+}
+
+/* Walk a note area looking for NT_GNU_BUILD_ID. */
+static size_t
+find_build_id(const unsigned char *notes, size_t size, unsigned char *out)
+{
+    size_t pos = 0;
+
+    while (pos + sizeof(ElfW(Nhdr)) <= size) {
+        const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)(notes + pos);
+        size_t name = (nhdr->n_namesz + 3) & ~(size_t)3;
+        size_t desc = (nhdr->n_descsz + 3) & ~(size_t)3;
+        size_t data = pos + sizeof(*nhdr) + name;
+
+        if (data + desc > size)
+            break;
+
+        if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+                && memcmp(notes + pos + sizeof(*nhdr), "GNU", 4) == 0
+                && nhdr->n_descsz <= ELF_BUILD_ID_MAX) {
+            memcpy(out, notes + data, nhdr->n_descsz);
+            return nhdr->n_descsz;
+        }
+
+        pos = data + desc;
+    }
+
+    return 0;
+}
+
+static int
+ehdr_valid(const ElfW(Ehdr) *ehdr)
+{
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0)
+        return 0;
+
+#if __WORDSIZE == 64
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+        return 0;
+#else
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS32)
+        return 0;
+#endif
+
+    return ehdr->e_type == ET_EXEC || ehdr->e_type == ET_DYN;
+}
+
+/* Lowest PT_LOAD address, page aligned; maps to the offset 0 mapping. */
+static unsigned long
+load_vaddr(const ElfW(Phdr) *phdr, size_t phnum)
+{
+    size_t i;
+    const unsigned long psize = (unsigned long)sysconf(_SC_PAGESIZE);
+
+    for (i = 0; i < phnum; ++i) {
+        if (phdr[i].p_type == PT_LOAD)
+            return (unsigned long)phdr[i].p_vaddr & ~(psize - 1);
+    }
+
+    return 0;
+}
+
+
+/* Bounds check on the file mapping. */
+#define IN_FILE(off, len, size) \
+    ((off) <= (size) && (len) <= (size) - (off))
+
+static int
+parse_file_symtab(const unsigned char *data, size_t size,
+    const ElfW(Shdr) *shdr, size_t shnum, const ElfW(Shdr) *sec,
+    struct sym_array *syms)
+{
+    size_t i;
+    const ElfW(Sym) *symtab;
+    const ElfW(Shdr) *strsec;
+    const char *strtab;
+
+    if (sec->sh_link >= shnum || sec->sh_entsize != sizeof(ElfW(Sym)))
+        return 0;
+
+    strsec = &(shdr[ sec->sh_link ]);
+
+    if (!IN_FILE(sec->sh_offset, sec->sh_size, size)
+            || !IN_FILE(strsec->sh_offset, strsec->sh_size, size)
+            || strsec->sh_size == 0
+            || data[ strsec->sh_offset + strsec->sh_size - 1 ] != '\0')
+        return 0;
+
+    symtab = (const ElfW(Sym) *)(data + sec->sh_offset);
+    strtab = (const char *)(data + strsec->sh_offset);
+
+    for (i = 0; i < sec->sh_size / sizeof(*symtab); ++i) {
+        if (symtab[i].st_name >= strsec->sh_size)
+            continue;
+
+        if (sym_array_add(syms, strtab + symtab[i].st_name, &(symtab[i])) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+parse_file_plt(const unsigned char *data, size_t size,
+    const ElfW(Shdr) *shdr, size_t shnum, const ElfW(Shdr) *sec,
+    struct plt_array *plt)
+{
+    size_t i;
+    size_t nrel;
+    const ElfW(Sym) *symtab;
+    const ElfW(Shdr) *symsec;
+    const ElfW(Shdr) *strsec;
+    const char *strtab;
+
+    if (sec->sh_link >= shnum)
+        return 0;
+
+    symsec = &(shdr[ sec->sh_link ]);
+
+    if (symsec->sh_link >= shnum)
+        return 0;
+
+    strsec = &(shdr[ symsec->sh_link ]);
+
+    if (!IN_FILE(sec->sh_offset, sec->sh_size, size)
+            || !IN_FILE(symsec->sh_offset, symsec->sh_size, size)
+            || !IN_FILE(strsec->sh_offset, strsec->sh_size, size))
+        return 0;
+
+    symtab = (const ElfW(Sym) *)(data + symsec->sh_offset);
+    strtab = (const char *)(data + strsec->sh_offset);
+
+    nrel = sec->sh_size / ((sec->sh_type == SHT_RELA)
+                ? sizeof(ElfW(Rela)) : sizeof(ElfW(Rel)));
+
+    for (i = 0; i < nrel; ++i) {
+        size_t symi;
+        unsigned long offset;
+
+        if (sec->sh_type == SHT_RELA) {
+            const ElfW(Rela) *rel = (const ElfW(Rela) *)(data + sec->sh_offset);
+            symi = ELF_R_SYM(rel[i].r_info);
+            offset = (unsigned long)rel[i].r_offset;
+        }
+        else {
+            const ElfW(Rel) *rel = (const ElfW(Rel) *)(data + sec->sh_offset);
+            symi = ELF_R_SYM(rel[i].r_info);
+            offset = (unsigned long)rel[i].r_offset;
+        }
+
+        if (symi == 0 || symi >= symsec->sh_size / sizeof(*symtab)
+                || symtab[symi].st_name >= strsec->sh_size)
+            continue;
+
+        if (plt_array_add(plt, strtab + symtab[symi].st_name, offset) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Parse a mapped ELF file.  On success the image owns the mapping. */
+static struct elf_image *
+image_from_file(const char *path, unsigned char *data, size_t size,
+    unsigned long *out_load_vaddr)
+{
+    size_t i;
+    size_t id_len = 0;
+    unsigned char id[ELF_BUILD_ID_MAX] = { 0 };
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *)data;
+    const ElfW(Phdr) *phdr;
+    const ElfW(Shdr) *shdr = NULL;
+    const char *shstrtab = NULL;
+    size_t shstrsz = 0;
+    struct sym_array syms;
+    struct plt_array plt;
+    struct elf_image *image;
+
+    if (size < sizeof(*ehdr) || !ehdr_valid(ehdr)
+            || !IN_FILE(ehdr->e_phoff,
+                    (size_t)ehdr->e_phnum * sizeof(*phdr), size)) {
+        errno = ENOEXEC;
+        return NULL;
+    }
+
+    phdr = (const ElfW(Phdr) *)(data + ehdr->e_phoff);
+    *out_load_vaddr = load_vaddr(phdr, ehdr->e_phnum);
+
+    for (i = 0; i < ehdr->e_phnum && id_len == 0; ++i) {
+        if (phdr[i].p_type == PT_NOTE
+                && IN_FILE(phdr[i].p_offset, phdr[i].p_filesz, size)) {
+            id_len = find_build_id(data + phdr[i].p_offset,
+                        phdr[i].p_filesz, id);
+        }
+    }
+
+    image = image_cached(id, id_len);
+
+    if (image != NULL) {
+        munmap(data, size);
+        return image;
+    }
+
+    if (ehdr->e_shnum != 0
+            && IN_FILE(ehdr->e_shoff,
+                (size_t)ehdr->e_shnum * sizeof(*shdr), size)) {
+        shdr = (const ElfW(Shdr) *)(data + ehdr->e_shoff);
+
+        if (ehdr->e_shstrndx < ehdr->e_shnum
+                && IN_FILE(shdr[ehdr->e_shstrndx].sh_offset,
+                    shdr[ehdr->e_shstrndx].sh_size, size)) {
+            shstrtab = (const char *)(data + shdr[ehdr->e_shstrndx].sh_offset);
+            shstrsz = shdr[ehdr->e_shstrndx].sh_size;
+        }
+    }
+
+    memset(&syms, 0, sizeof(syms));
+    memset(&plt, 0, sizeof(plt));
+
+    for (i = 0; shdr != NULL && i < ehdr->e_shnum; ++i) {
+        const ElfW(Shdr) *sec = &(shdr[i]);
+        int err = 0;
+
+        switch (sec->sh_type) {
+        case SHT_SYMTAB:
+        case SHT_DYNSYM:
+            err = parse_file_symtab(data, size, shdr, ehdr->e_shnum,
+                    sec, &syms);
+            break;
+
+        case SHT_RELA:
+        case SHT_REL:
+            if (shstrtab != NULL && sec->sh_name < shstrsz
+                    && (strcmp(shstrtab + sec->sh_name, ".rela.plt") == 0
+                        || strcmp(shstrtab + sec->sh_name, ".rel.plt") == 0)) {
+                err = parse_file_plt(data, size, shdr, ehdr->e_shnum,
+                        sec, &plt);
+            }
+            break;
+
+        case SHT_NOTE:
+            if (id_len == 0
+                    && IN_FILE(sec->sh_offset, sec->sh_size, size)) {
+                id_len = find_build_id(data + sec->sh_offset,
+                            sec->sh_size, id);
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        if (err != 0)
+            goto out_free;
+    }
+
+    image = image_new(path);
+
+    if (image == NULL)
+        goto out_free;
+
+    memcpy(image->build_id, id, id_len);
+    image->build_id_len = id_len;
+
+    if (image_finish(image, &syms, &plt) != 0) {
+        image_put(image);
+        return NULL;
+    }
+
+    /* Strings point into the file. */
+    image->blob = data;
+    image->blob_size = size;
+    image->blob_mapped = 1;
+
+    if (id_len != 0)
+        list_add(&(image->node), &elf_images);
+
+    return image;
+
+out_free:
+    free(syms.syms);
+    free(plt.slots);
+
+    return NULL;
+}
+
+static struct elf_image *
+image_open(const char *path, unsigned long *out_load_vaddr)
+{
+    int fd;
+    void *data;
+    struct stat st;
+    struct elf_image *image;
+    unsigned char magic[SELFMAG];
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+
+    /* Skip fonts, locale archives and the like without mapping them. */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)
+            || memcmp(magic, ELFMAG, SELFMAG) != 0) {
+        close(fd);
+        errno = ENOEXEC;
+        return NULL;
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return NULL;
+
+    image = image_from_file(path, data, (size_t)st.st_size, out_load_vaddr);
+
+    if (image == NULL) {
+        int oerrno = errno;
+        munmap(data, (size_t)st.st_size);
+        errno = oerrno;
+    }
+
+    return image;
+}
+
+
+static int
+mem_read(int fd, unsigned long addr, void *buf, size_t size)
+{
+    ssize_t len = read_pid_mem_loop_fd(fd, buf, size, (off_t)addr);
+
+    if (len < 0)
+        return -1;
+
+    if ((size_t)len != size) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Number of symbols from DT_GNU_HASH: one past the last chain end. */
+static size_t
+gnu_hash_nsyms(int fd, unsigned long addr)
+{
+    size_t i;
+    uint32_t hdr[4];
+    uint32_t *buckets;
+    uint32_t last = 0;
+    unsigned long chains;
+
+    if (mem_read(fd, addr, hdr, sizeof(hdr)) != 0)
+        return 0;
+
+    buckets = malloc(hdr[0] * sizeof(*buckets));
+
+    if (buckets == NULL)
+        return 0;
+
+    addr += sizeof(hdr) + (unsigned long)hdr[2] * sizeof(ElfW(Addr));
+
+    if (mem_read(fd, addr, buckets, hdr[0] * sizeof(*buckets)) != 0) {
+        free(buckets);
+        return 0;
+    }
+
+    for (i = 0; i < hdr[0]; ++i) {
+        if (buckets[i] > last)
+            last = buckets[i];
+    }
+
+    free(buckets);
+
+    if (last < hdr[1])
+        return hdr[1];
+
+    chains = addr + hdr[0] * sizeof(uint32_t);
+
+    for (;;) {
+        uint32_t val;
+
+        if (mem_read(fd, chains + (last - hdr[1]) * sizeof(val),
+                    &val, sizeof(val)) != 0)
+            return 0;
+
+        if (val & 1)
+            return (size_t)last + 1;
+
+        last++;
+    }
+}
+
+/* Read .dynsym through the dynamic section of a loaded object. */
+static struct elf_image *
+image_from_memory(pid_t pid, const char *path, unsigned long base,
+    unsigned long *out_load_vaddr)
+{
+    int fd;
+    size_t i;
+    size_t nsyms = 0;
+    size_t id_len = 0;
+    size_t ndyn = 0;
+    unsigned long bias;
+    unsigned long symtab_addr = 0;
+    unsigned long strtab_addr = 0;
+    unsigned long strsz = 0;
+    unsigned long hash_addr = 0;
+    unsigned long gnu_hash_addr = 0;
+    unsigned long jmprel_addr = 0;
+    unsigned long jmprelsz = 0;
+    unsigned char id[ELF_BUILD_ID_MAX] = { 0 };
+    ElfW(Ehdr) ehdr;
+    ElfW(Phdr) *phdr = NULL;
+    ElfW(Dyn) *dyn = NULL;
+    ElfW(Sym) *symtab = NULL;
+    char *strtab = NULL;
+    struct sym_array syms;
+    struct plt_array plt;
+    struct elf_image *image = NULL;
+
+    memset(&syms, 0, sizeof(syms));
+    memset(&plt, 0, sizeof(plt));
+
+    fd = open_pid_mem(pid, PID_MEM_FLAGS_READ);
+
+    if (fd < 0)
+        return NULL;
+
+    if (mem_read(fd, base, &ehdr, sizeof(ehdr)) != 0)
+        goto out;
+
+    if (!ehdr_valid(&ehdr)) {
+        errno = ENOEXEC;
+        goto out;
+    }
+
+    phdr = malloc(ehdr.e_phnum * sizeof(*phdr));
+
+    if (phdr == NULL
+            || mem_read(fd, base + ehdr.e_phoff, phdr,
+                    ehdr.e_phnum * sizeof(*phdr)) != 0)
+        goto out;
+
+    *out_load_vaddr = load_vaddr(phdr, ehdr.e_phnum);
+    bias = base - *out_load_vaddr;
+
+    for (i = 0; i < ehdr.e_phnum; ++i) {
+        if (phdr[i].p_type == PT_NOTE && id_len == 0
+                && phdr[i].p_filesz <= 4096) {
+            unsigned char notes[4096];
+
+            if (mem_read(fd, bias + phdr[i].p_vaddr, notes,
+                        phdr[i].p_filesz) == 0)
+                id_len = find_build_id(notes, phdr[i].p_filesz, id);
+        }
+
+        if (phdr[i].p_type == PT_DYNAMIC) {
+            ndyn = phdr[i].p_memsz / sizeof(*dyn);
+            dyn = malloc(ndyn * sizeof(*dyn));
+
+            if (dyn == NULL
+                    || mem_read(fd, bias + phdr[i].p_vaddr, dyn,
+                            ndyn * sizeof(*dyn)) != 0)
+                goto out;
+        }
+    }
+
+    image = image_cached(id, id_len);
+
+    if (image != NULL)
+        goto out;
+
+    if (dyn == NULL) {
+        errno = ENOEXEC;
+        goto out;
+    }
+
+    /* Relocated in place by the dynamic linker on most targets. */
+#define DYN_ADDR(d) \
+    ((unsigned long)(d).d_un.d_ptr < bias \
+        ? bias + (unsigned long)(d).d_un.d_ptr \
+        : (unsigned long)(d).d_un.d_ptr)
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; ++i) {
+        switch (dyn[i].d_tag) {
+        case DT_SYMTAB:   symtab_addr = DYN_ADDR(dyn[i]);   break;
+        case DT_STRTAB:   strtab_addr = DYN_ADDR(dyn[i]);   break;
+        case DT_STRSZ:    strsz = dyn[i].d_un.d_val;         break;
+        case DT_HASH:     hash_addr = DYN_ADDR(dyn[i]);     break;
+        case DT_GNU_HASH: gnu_hash_addr = DYN_ADDR(dyn[i]); break;
+        case DT_JMPREL:   jmprel_addr = DYN_ADDR(dyn[i]);   break;
+        case DT_PLTRELSZ: jmprelsz = dyn[i].d_un.d_val;      break;
+        default:                                             break;
+        }
+    }
+
+#undef DYN_ADDR
+
+    if (symtab_addr == 0 || strtab_addr == 0 || strsz == 0) {
+        errno = ENOEXEC;
+        goto out;
+    }
+
+    if (hash_addr != 0) {
+        uint32_t hdr[2];
+
+        if (mem_read(fd, hash_addr, hdr, sizeof(hdr)) == 0)
+            nsyms = hdr[1];
+    }
+    else if (gnu_hash_addr != 0) {
+        nsyms = gnu_hash_nsyms(fd, gnu_hash_addr);
+    }
+
+    strtab = malloc(strsz + 1);
+    symtab = malloc((nsyms + 1) * sizeof(*symtab));
+
+    if (strtab == NULL || symtab == NULL
+            || mem_read(fd, strtab_addr, strtab, strsz) != 0
+            || mem_read(fd, symtab_addr, symtab,
+                    nsyms * sizeof(*symtab)) != 0)
+        goto out;
+
+    strtab[strsz] = '\0';
+
+    for (i = 0; i < nsyms; ++i) {
+        if (symtab[i].st_name >= strsz)
+            continue;
+
+        if (sym_array_add(&syms, strtab + symtab[i].st_name,
+                    &(symtab[i])) != 0)
+            goto out;
+    }
+
+    if (jmprel_addr != 0 && jmprelsz != 0) {
+#if __WORDSIZE == 64
+        typedef ElfW(Rela) plt_rel_t;
+#else
+        typedef ElfW(Rel) plt_rel_t;
+#endif
+        plt_rel_t *rel = malloc(jmprelsz);
+
+        if (rel != NULL && mem_read(fd, jmprel_addr, rel, jmprelsz) == 0) {
+            for (i = 0; i < jmprelsz / sizeof(*rel); ++i) {
+                size_t symi = ELF_R_SYM(rel[i].r_info);
+
+                if (symi == 0 || symi >= nsyms
+                        || symtab[symi].st_name >= strsz)
+                    continue;
+
+                if (plt_array_add(&plt, strtab + symtab[symi].st_name,
+                            (unsigned long)rel[i].r_offset) != 0)
+                    break;
+            }
+        }
+
+        free(rel);
+    }
+
+    image = image_new(path);
+
+    if (image == NULL)
+        goto out;
+
+    memcpy(image->build_id, id, id_len);
+    image->build_id_len = id_len;
+
+    if (image_finish(image, &syms, &plt) != 0) {
+        syms.syms = NULL;
+        plt.slots = NULL;
+        image_put(image);
+        image = NULL;
+        goto out;
+    }
+
+    syms.syms = NULL;
+    plt.slots = NULL;
+
+    image->blob = strtab;
+    image->blob_size = strsz + 1;
+    strtab = NULL;
+
+    if (id_len != 0)
+        list_add(&(image->node), &elf_images);
+
+out:
+    {
+        int oerrno = errno;
+
+        free(syms.syms);
+        free(plt.slots);
+        free(strtab);
+        free(symtab);
+        free(dyn);
+        free(phdr);
+        (void)close_pid_mem(fd);
+
+        errno = oerrno;
+    }
+
+    return image;
+}
+
+
+/* A file backed mapping from /proc/<pid>/maps. */
+struct map_file {
+    unsigned long start;
+    unsigned long end;
+    unsigned long offset;
+    int deleted;
+    char *path;
+};
+
+static int
+read_map_files(pid_t pid, struct map_file **out, size_t *out_count)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t line_len = 0;
+    size_t count = 0;
+    size_t alloc = 0;
+    char maps[64];
+    struct map_file *files = NULL;
+
+    snprintf(maps, sizeof(maps), "/proc/%d/maps", (int)pid);
+
+    fp = fopen(maps, "r");
+
+    if (fp == NULL)
+        return -1;
+
+    while (getline(&line, &line_len, fp) != -1) {
+        int pathpos = 0;
+        char *path;
+        char *nl;
+        size_t len;
+        struct map_file *mf;
+        unsigned long start;
+        unsigned long end;
+        unsigned long offset;
+
+        if (sscanf(line, "%lx-%lx %*s %lx %*s %*u %n",
+                    &start, &end, &offset, &pathpos) < 3 || pathpos == 0)
+            continue;
+
+        path = line + pathpos;
+
+        nl = strchr(path, '\n');
+
+        if (nl != NULL)
+            *nl = '\0';
+
+        if (path[0] != '/' && strcmp(path, "[vdso]") != 0)
+            continue;
+
+        if (count == alloc) {
+            struct map_file *tmp;
+
+            alloc = (alloc == 0) ? 64 : alloc * 2;
+            tmp = realloc(files, alloc * sizeof(*tmp));
+
+            if (tmp == NULL)
+                goto fail;
+
+            files = tmp;
+        }
+
+        mf = &(files[count]);
+        mf->start = start;
+        mf->end = end;
+        mf->offset = offset;
+        mf->deleted = 0;
+
+        len = strlen(path);
+
+        if (len > 10 && strcmp(path + len - 10, " (deleted)") == 0) {
+            path[len - 10] = '\0';
+            mf->deleted = 1;
+        }
+
+        mf->path = strdup(path);
+
+        if (mf->path == NULL)
+            goto fail;
+
+        count++;
+    }
+
+    free(line);
+    fclose(fp);
+
+    *out = files;
+    *out_count = count;
+
+    return 0;
+
+fail:
+    {
+        int oerrno = errno;
+
+        while (count > 0)
+            free(files[--count].path);
+
+        free(files);
+        free(line);
+        fclose(fp);
+
+        errno = oerrno;
+    }
+
+    return -1;
+}
+
+static struct elf_image *
+load_image(pid_t pid, const struct map_file *mf, unsigned long *load)
+{
+    char mapfile[96];
+    struct elf_image *image;
+
+    if (mf->path[0] == '/') {
+        if (!mf->deleted) {
+            image = image_open(mf->path, load);
+
+            if (image != NULL || errno == ENOEXEC)
+                return image;
+        }
+
+        /* Deleted, or in another mount namespace. */
+        snprintf(mapfile, sizeof(mapfile),
+            "/proc/%d/map_files/%lx-%lx", (int)pid, mf->start, mf->end);
+
+        image = image_open(mapfile, load);
+
+        if (image != NULL || errno == ENOEXEC)
+            return image;
+    }
+
+    return image_from_memory(pid, mf->path, mf->start, load);
+}
+
+static int
+module_add(struct elf_index *idx, size_t *alloc, const struct map_file *mf,
+    const struct map_file *files, size_t count, pid_t pid)
+{
+    size_t i;
+    unsigned long load = 0;
+    struct elf_module *mod;
+    struct elf_image *image;
+
+    image = load_image(pid, mf, &load);
+
+    /* Not an ELF object or unreadable; not an error for the index. */
+    if (image == NULL)
+        return 0;
+
+    if (idx->nmodules == *alloc) {
+        struct elf_module *tmp;
+
+        *alloc = (*alloc == 0) ? 32 : *alloc * 2;
+        tmp = realloc(idx->modules, *alloc * sizeof(*tmp));
+
+        if (tmp == NULL) {
+            image_put(image);
+            return -1;
+        }
+
+        idx->modules = tmp;
+    }
+
+    mod = &(idx->modules[ idx->nmodules++ ]);
+    mod->start = mf->start;
+    mod->end = mf->end;
+    mod->bias = mf->start - load;
+    mod->image = image;
+
+    /* Take in the other segments of the same file. */
+    for (i = (size_t)(mf - files) + 1; i < count; ++i) {
+        if (files[i].offset == 0 || strcmp(files[i].path, mf->path) != 0)
+            continue;
+
+        if (files[i].end > mod->end)
+            mod->end = files[i].end;
+    }
+
+    return 0;
+}
+
+static int
+globals_insert(struct elf_index *idx, uint32_t module,
+    const struct elf_symbol *sym)
+{
+    uint32_t hash = elf_name_hash(sym->name);
+    size_t pos = hash & (idx->nglobals - 1);
+
+    for (;;) {
+        struct elf_global_slot *slot = &(idx->globals[pos]);
+
+        if (slot->module == ELF_NAME_EMPTY) {
+            slot->hash = hash;
+            slot->module = module;
+            slot->sym = sym;
+            return 0;
+        }
+
+        /* First definition in load order wins. */
+        if (slot->hash == hash && strcmp(slot->sym->name, sym->name) == 0)
+            return 0;
+
+        pos = (pos + 1) & (idx->nglobals - 1);
+    }
+}
+
+static int
+build_globals(struct elf_index *idx)
+{
+    size_t i;
+    size_t j;
+    size_t total = 0;
+    int pass;
+
+    for (i = 0; i < idx->nmodules; ++i)
+        total += idx->modules[i].image->nsymbols;
+
+    idx->nglobals = round_pow2(total * 2);
+    idx->globals = malloc(idx->nglobals * sizeof(*(idx->globals)));
+
+    if (idx->globals == NULL)
+        return -1;
+
+    for (i = 0; i < idx->nglobals; ++i)
+        idx->globals[i].module = ELF_NAME_EMPTY;
+
+    /* Global and weak definitions first, then locals for what is left. */
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < idx->nmodules; ++i) {
+            const struct elf_image *image = idx->modules[i].image;
+
+            for (j = 0; j < image->nsymbols; ++j) {
+                const struct elf_symbol *sym = &(image->symbols[j]);
+
+                if ((sym->bind == STB_LOCAL) != (pass == 1))
+                    continue;
+
+                (void)globals_insert(idx, (uint32_t)i, sym);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Initialize an ELF index.
+ *
+ * @param idx - ELF index
+ */
+void
+elf_index_init(struct elf_index *idx)
+{
+    memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * Release an ELF index.
+ *
+ * Images stay cached for as long as another index uses them.
+ *
+ * @param idx - ELF index
+ */
+void
+elf_index_fini(struct elf_index *idx)
+{
+    size_t i;
+
+    for (i = 0; i < idx->nmodules; ++i)
+        image_put(idx->modules[i].image);
+
+    free(idx->modules);
+    free(idx->globals);
+
+    elf_index_init(idx);
+}
+
+/**
+ * Index the ELF objects currently mapped in a process.
+ *
+ * Replaces whatever the index held before; call again after the
+ * process loads or unloads libraries.
+ *
+ * @param idx - ELF index, initialized
+ * @param[in] pid - process id
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+elf_index_build(struct elf_index *idx, pid_t pid)
+{
+    size_t i;
+    size_t count = 0;
+    size_t alloc = 0;
+    int ret = 0;
+    struct map_file *files = NULL;
+
+    elf_index_fini(idx);
+    idx->pid = pid;
+
+    if (read_map_files(pid, &files, &count) != 0)
+        return 1;
+
+    for (i = 0; i < count; ++i) {
+        /* One module per object, found by its first segment. */
+        if (files[i].offset != 0)
+            continue;
+
+        if (module_add(idx, &alloc, &(files[i]), files, count, pid) != 0) {
+            ret = 1;
+            break;
+        }
+    }
+
+    if (ret == 0 && build_globals(idx) != 0)
+        ret = 1;
+
+    {
+        int oerrno = errno;
+
+        for (i = 0; i < count; ++i)
+            free(files[i].path);
+
+        free(files);
+
+        errno = oerrno;
+    }
+
+    return ret;
+}
+
+/**
+ * Find the address of a symbol in the process.
+ *
+ * Global definitions are searched in load order, as the dynamic
+ * linker would; a local symbol is only found if no object defines
+ * the name globally.
+ *
+ * @param[in] idx - ELF index
+ * @param[in] name - symbol name
+ * @param[out] out_addr - address in the process
+ *
+ * @return 0 on success
+ * @return not 0 if not found with error returned in errno
+ */
+int
+elf_index_lookup(const struct elf_index *idx, const char *name,
+    unsigned long *out_addr)
+{
+    size_t pos;
+    uint32_t hash;
+
+    if (idx->nglobals == 0) {
+        errno = ENOENT;
+        return 1;
+    }
+
+    hash = elf_name_hash(name);
+    pos = hash & (idx->nglobals - 1);
+
+    for (;;) {
+        const struct elf_global_slot *slot = &(idx->globals[pos]);
+
+        if (slot->module == ELF_NAME_EMPTY)
+            break;
+
+        if (slot->hash == hash && strcmp(slot->sym->name, name) == 0) {
+            *out_addr = idx->modules[ slot->module ].bias + slot->sym->value;
+            return 0;
+        }
+
+        pos = (pos + 1) & (idx->nglobals - 1);
+    }
+
+    errno = ENOENT;
+
+    return 1;
+}
+
+/**
+ * Find the module an address belongs to.
+ *
+ * @param[in] idx - ELF index
+ * @param[in] addr - address in the process
+ *
+ * @return the module or NULL if the address is in none
+ */
+const struct elf_module *
+elf_index_module(const struct elf_index *idx, unsigned long addr)
+{
+    size_t lo = 0;
+    size_t hi = idx->nmodules;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct elf_module *mod = &(idx->modules[mid]);
+
+        if (addr < mod->start)
+            hi = mid;
+        else if (addr >= mod->end)
+            lo = mid + 1;
+        else
+            return mod;
+    }
+
+    return NULL;
+}
+
+/**
+ * Find a module by path or file name.
+ *
+ * @param[in] idx - ELF index
+ * @param[in] name - full path, or the part after the last '/'
+ *
+ * @return the first module with that name or NULL
+ */
+const struct elf_module *
+elf_index_module_name(const struct elf_index *idx, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < idx->nmodules; ++i) {
+        const char *path = idx->modules[i].image->path;
+        const char *base = strrchr(path, '/');
+
+        base = (base == NULL) ? path : base + 1;
+
+        if (strcmp(path, name) == 0 || strcmp(base, name) == 0)
+            return &(idx->modules[i]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the symbol an address belongs to.
+ *
+ * @param[in] idx - ELF index
+ * @param[in] addr - address in the process
+ * @param[out] out_module - module of the symbol, may be NULL
+ * @param[out] out_offset - addr minus the symbol address, may be NULL
+ *
+ * @return the closest symbol at or below addr in the same module
+ * @return NULL if there is none
+ */
+const struct elf_symbol *
+elf_index_symbolize(const struct elf_index *idx, unsigned long addr,
+    const struct elf_module **out_module, unsigned long *out_offset)
+{
+    size_t lo = 0;
+    size_t hi;
+    unsigned long value;
+    const struct elf_image *image;
+    const struct elf_module *mod;
+
+    mod = elf_index_module(idx, addr);
+
+    if (mod == NULL)
+        return NULL;
+
+    image = mod->image;
+    value = addr - mod->bias;
+    hi = image->nsymbols;
+
+    /* Last symbol with ->value <= value. */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (image->symbols[mid].value <= value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    if (out_module != NULL)
+        *out_module = mod;
+
+    if (out_offset != NULL)
+        *out_offset = value - image->symbols[lo - 1].value;
+
+    return &(image->symbols[lo - 1]);
+}
+
+/**
+ * Find a symbol of one image by name.
+ *
+ * @param[in] image - ELF image
+ * @param[in] name - symbol name
+ *
+ * @return the symbol or NULL if not defined by the image
+ */
+const struct elf_symbol *
+elf_image_lookup(const struct elf_image *image, const char *name)
+{
+    size_t pos;
+    uint32_t hash = elf_name_hash(name);
+
+    pos = hash & (image->nnames - 1);
+
+    for (;;) {
+        const struct elf_name_slot *slot = &(image->names[pos]);
+        const struct elf_symbol *sym;
+
+        if (slot->index == ELF_NAME_EMPTY)
+            return NULL;
+
+        sym = &(image->symbols[ slot->index ]);
+
+        if (slot->hash == hash && strcmp(sym->name, name) == 0)
+            return sym;
+
+        pos = (pos + 1) & (image->nnames - 1);
+    }
+}
+
+/**
+ * Find the GOT slot a module calls an imported function through.
+ *
+ * @param[in] module - ELF module
+ * @param[in] name - name of the imported function
+ * @param[out] out_addr - address of the GOT slot in the process
+ *
+ * @return 0 on success
+ * @return not 0 if the module has no PLT entry for name
+ */
+int
+elf_module_got(const struct elf_module *module, const char *name,
+    unsigned long *out_addr)
+{
+    size_t i;
+    const struct elf_image *image = module->image;
+
+    for (i = 0; i < image->nplt; ++i) {
+        if (strcmp(image->plt[i].name, name) == 0) {
+            *out_addr = module->bias + image->plt[i].offset;
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+
+    return 1;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
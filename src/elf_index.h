@@ -0,0 +1,115 @@
+#ifndef H_ELF_INDEX
+#define H_ELF_INDEX
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/list.h"
+
+#define ELF_BUILD_ID_MAX  (64)
+
+/* A symbol of an ELF image.  value is the st_value from the file;
+ * add the module bias for the address in a process. */
+struct elf_symbol {
+    const char *name;
+    unsigned long value;
+    unsigned long size;
+    unsigned char type;       /* STT_* */
+    unsigned char bind;       /* STB_* */
+};
+
+/* A PLT relocation: the GOT slot which holds the address of name. */
+struct elf_plt_slot {
+    const char *name;
+    unsigned long offset;     /* r_offset from the file */
+};
+
+/* Name lookup table entry; open addressing, index into symbols. */
+struct elf_name_slot {
+    uint32_t hash;
+    uint32_t index;           /* UINT32_MAX if empty */
+};
+
+/* Everything read from one ELF file.  Shared between every process
+ * and every load of the same build-id. */
+struct elf_image {
+    struct list_head node;
+    unsigned long refs;
+
+    unsigned char build_id[ELF_BUILD_ID_MAX];
+    size_t build_id_len;
+
+    /* Backing for the strings, the file mapping or a copy. */
+    void *blob;
+    size_t blob_size;
+    int blob_mapped;
+
+    /* Sorted by value. */
+    struct elf_symbol *symbols;
+    size_t nsymbols;
+
+    struct elf_name_slot *names;
+    size_t nnames;            /* power of two */
+
+    struct elf_plt_slot *plt;
+    size_t nplt;
+
+    char path[1];
+};
+
+/* One ELF loaded in the process. */
+struct elf_module {
+    unsigned long start;
+    unsigned long end;
+    unsigned long bias;       /* add to symbol values */
+
+    struct elf_image *image;
+};
+
+/* Process wide name table entry. */
+struct elf_global_slot {
+    uint32_t hash;
+    uint32_t module;          /* UINT32_MAX if empty */
+    const struct elf_symbol *sym;
+};
+
+struct elf_index {
+    pid_t pid;
+
+    /* Sorted by start. */
+    struct elf_module *modules;
+    size_t nmodules;
+
+    struct elf_global_slot *globals;
+    size_t nglobals;          /* power of two */
+};
+
+extern void elf_index_init(struct elf_index *idx);
+extern void elf_index_fini(struct elf_index *idx);
+
+extern int elf_index_build(struct elf_index *idx, pid_t pid);
+
+extern int elf_index_lookup(const struct elf_index *idx, const char *name,
+                unsigned long *out_addr);
+
+extern const struct elf_symbol *
+elf_index_symbolize(const struct elf_index *idx, unsigned long addr,
+    const struct elf_module **out_module, unsigned long *out_offset);
+
+extern const struct elf_module *
+elf_index_module(const struct elf_index *idx, unsigned long addr);
+
+extern const struct elf_module *
+elf_index_module_name(const struct elf_index *idx, const char *name);
+
+extern const struct elf_symbol *
+elf_image_lookup(const struct elf_image *image, const char *name);
+
+extern int elf_module_got(const struct elf_module *module, const char *name,
+                unsigned long *out_addr);
+
+#endif /* H_ELF_INDEX */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
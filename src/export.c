@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/list.h"
+
+#include "export.h"
+#include "match.h"
+#include "match_internal.h"
+#include "stream.h"
+#include "wire.h"
+
+/**
+ * @file export.c
+ *
+ * Match lists handed to local clients in shared memory.
+ *
+ * An export is a memfd holding a wire_export and the list's records.
+ * It is sealed against resizing and against any write mapping made
+ * after the daemon's own, then passed over the socket; a client maps
+ * it read-only and reads the records in place.
+ *
+ * The daemon keeps its mapping so it can store the target's new
+ * generation in the header when the list changes.  A client holding
+ * the export sees the change without asking.
+ */
+
+#define EXPORT_SEALS \
+    (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)
+
+
+static void
+export_record(struct wire_export_record *rec, const struct match_object *obj)
+{
+    size_t width;
+
+    memset(rec, 0, sizeof(*rec));
+
+    rec->addr = obj->addr;
+    rec->type = stream_record_type(obj);
+
+    width = wire_type_width(rec->type);
+
+    if (width == sizeof(rec->value))
+        rec->value = obj->v.u64;
+    else
+        rec->value = obj->v.u64 & ((UINT64_C(1) << (8 * width)) - 1);
+}
+
+/**
+ * Export a match list, replacing the previous export.
+ *
+ * @param export - export
+ * @param[in] pid - pid recorded in the header
+ * @param[in] generation - generation of list
+ * @param[in] list - match list
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+export_create(struct export *export, pid_t pid, uint64_t generation,
+    const struct match_list *list)
+{
+    int fd;
+    int oerrno;
+    size_t size;
+    size_t count;
+    char *map = MAP_FAILED;
+    struct list_head *entry;
+    struct wire_export_record *rec;
+    struct wire_export *head;
+
+    count = match_list_count(list);
+    size = sizeof(*head) + (count * sizeof(*rec));
+
+    fd = memfd_create("wintermute-export", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, (off_t)size) != 0)
+        goto fail;
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+        goto fail;
+
+    head = (struct wire_export *)map;
+    rec = (struct wire_export_record *)(map + sizeof(*head));
+
+    head->magic = WIRE_EXPORT_MAGIC;
+    head->version = WIRE_EXPORT_VERSION;
+    head->record_size = sizeof(*rec);
+    head->pid = (uint32_t)pid;
+    head->generation = generation;
+    head->current = generation;
+    head->count = count;
+    head->offset = sizeof(*head);
+
+    list_for_each(entry, &(list->head)) {
+        unsigned long i;
+        struct match_chunk_header *chunk = match_chunk_entry(entry);
+
+        for (i = 0; i < chunk->used; ++i)
+            export_record(rec++, &(chunk->objects[i]));
+    }
+
+    /* Our mapping stays writable; nobody else's can be. */
+    if (fcntl(fd, F_ADD_SEALS, EXPORT_SEALS) != 0)
+        goto fail;
+
+    export_retire(export, generation);
+
+    export->fd = fd;
+    export->head = head;
+    export->size = size;
+
+    return 0;
+
+fail:
+
+    oerrno = errno;
+
+    if (map != MAP_FAILED)
+        (void)munmap(map, size);
+
+    close(fd);
+
+    errno = oerrno;
+
+    return -1;
+}
+
+/**
+ * Mark the export stale with the target's current generation and let
+ * it go.  Clients keep their mappings.
+ *
+ * @param export - export, possibly empty
+ * @param[in] current - generation of the list now
+ */
+void
+export_retire(struct export *export, uint64_t current)
+{
+    if (export->fd < 0)
+        return;
+
+    __atomic_store_n(&(export->head->current), current, __ATOMIC_RELEASE);
+
+    (void)munmap(export->head, export->size);
+    close(export->fd);
+
+    export_init(export);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,34 @@
+#ifndef H_EXPORT
+#define H_EXPORT
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "match.h"
+#include "wire.h"
+
+/* The latest export of a target's match list.  fd is -1 if there is
+ * none; the mapping is kept to mark the export stale later. */
+struct export {
+    int fd;
+    struct wire_export *head;
+    size_t size;
+};
+
+static inline void
+export_init(struct export *export)
+{
+    export->fd = -1;
+    export->head = NULL;
+    export->size = 0;
+}
+
+extern int export_create(struct export *export, pid_t pid,
+                uint64_t generation, const struct match_list *list);
+extern void export_retire(struct export *export, uint64_t current);
+
+#endif /* H_EXPORT */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
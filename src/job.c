@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/list.h"
+#include "shared/util.h"
+
+#include "buffer.h"
+#include "command.h"
+#include "job.h"
+#include "match.h"
+#include "target.h"
+
+/**
+ * @file job.c
+ *
+ * Background commands.
+ *
+ * A job wraps one command line, typically a search, filter or
+ * snapshot, which would otherwise hold up the client until it is
+ * done.  The server queues the job to its target's worker and answers
+ * with the job id straight away.  The command reports its progress
+ * through match_progress and can be cancelled between steps.
+ *
+ * The job commands look at the table on the server thread, so polling
+ * a job never waits for the worker running it.
+ */
+
+static const char *const state_names[] = {
+    [JOB_QUEUED]    = "queued",
+    [JOB_RUNNING]   = "running",
+    [JOB_DONE]      = "done",
+    [JOB_FAILED]    = "failed",
+    [JOB_CANCELLED] = "cancelled"
+};
+
+
+static inline int
+job_is_finished(const struct job *job)
+{
+    return job_state(job) >= JOB_DONE;
+}
+
+/**
+ * Initialize an empty job table.
+ *
+ * @param table - table to initialize
+ */
+void
+job_table_init(struct job_table *table)
+{
+    list_head_init(&(table->jobs));
+    table->finished = 0;
+    table->next_id = 1;
+}
+
+/**
+ * Free every job in a table.
+ *
+ * @param table - table, none of its jobs queued or running
+ */
+void
+job_table_fini(struct job_table *table)
+{
+    struct list_head *next;
+    struct list_head *entry;
+
+    list_for_each_safe(entry, next, &(table->jobs))
+        job_free(table, list_entry(entry, struct job, node));
+
+    job_table_init(table);
+}
+
+/**
+ * Create a queued job.
+ *
+ * @param table - job table
+ * @param[in] line - command line, need not be NUL terminated
+ * @param[in] length - length of line
+ *
+ * @return new job
+ * @return NULL on failure with error returned in errno
+ */
+struct job *
+job_new(struct job_table *table, const char *line, size_t length)
+{
+    struct job *job;
+
+    job = calloc(1, sizeof(*job) + length);
+
+    if (job == NULL)
+        return NULL;
+
+    memcpy(job->line, line, length);
+    job->line[length] = '\0';
+
+    /* 0 is never a job. */
+    if (table->next_id == 0)
+        table->next_id = 1;
+
+    job->id = table->next_id++;
+    job->state = JOB_QUEUED;
+    job->fd = -1;
+    buffer_init(&(job->out));
+
+    list_add_tail(&(job->node), &(table->jobs));
+
+    return job;
+}
+
+/**
+ * Find a job by id.
+ *
+ * @param table - job table
+ * @param[in] id - job id
+ *
+ * @return job or NULL if there is none
+ */
+struct job *
+job_find(struct job_table *table, uint32_t id)
+{
+    struct list_head *entry;
+
+    list_for_each(entry, &(table->jobs)) {
+        struct job *job = list_entry(entry, struct job, node);
+
+        if (job->id == id)
+            return job;
+    }
+
+    return NULL;
+}
+
+/**
+ * Remove a job from its table and free it.
+ *
+ * @param table - job table
+ * @param job - job, not queued or running
+ */
+void
+job_free(struct job_table *table, struct job *job)
+{
+    if (job_is_finished(job))
+        table->finished--;
+
+    list_del(&(job->node));
+    buffer_fini(&(job->out));
+    free(job);
+}
+
+/**
+ * Run a job's command.  Called on the target's worker.
+ *
+ * @param job - job
+ * @param commands - command table
+ */
+void
+job_run(struct job *job, struct command_list *commands)
+{
+    struct command_ctx ctx;
+
+    if (__atomic_load_n(&(job->progress.cancel), __ATOMIC_RELAXED)) {
+        job->status = -ECANCELED;
+        return;
+    }
+
+    __atomic_store_n(&(job->state), JOB_RUNNING, __ATOMIC_RELEASE);
+
+    ctx.out = &(job->out);
+    ctx.arena = &(job->target->arena);
+    ctx.target = job->target;
+    ctx.jobs = NULL;
+    ctx.stream = NULL;
+    ctx.pass_fd = -1;
+
+    match_progress_bind(&(job->progress));
+    if (job->script)
+        job->status = exec_script(commands, &ctx, job->line);
+    else
+        job->status = exec_line(commands, &ctx, job->line);
+    match_progress_bind(NULL);
+
+    /* Job results are text only. */
+    if (ctx.pass_fd >= 0)
+        close(ctx.pass_fd);
+}
+
+/**
+ * Record the end of a job handed back by the worker.
+ *
+ * @param table - job table
+ * @param job - job
+ */
+void
+job_finish(struct job_table *table, struct job *job)
+{
+    struct list_head *next;
+    struct list_head *entry;
+    int state;
+
+    if (job->status == 0)
+        state = JOB_DONE;
+    else if (job->status == -ECANCELED)
+        state = JOB_CANCELLED;
+    else
+        state = JOB_FAILED;
+
+    __atomic_store_n(&(job->state), state, __ATOMIC_RELEASE);
+
+    job->target = NULL;
+    table->finished++;
+
+    /* Results nobody fetched go oldest first. */
+    list_for_each_safe(entry, next, &(table->jobs)) {
+        struct job *old = list_entry(entry, struct job, node);
+
+        if (table->finished <= JOB_MAX_FINISHED)
+            break;
+
+        if (old != job && job_is_finished(old))
+            job_free(table, old);
+    }
+}
+
+/**
+ * Ask a job to stop.  A queued job does not start; a running search or
+ * filter stops at its next progress step.
+ *
+ * @param job - job
+ *
+ * @return 0 on success
+ * @return -EALREADY if the job has finished
+ */
+int
+job_cancel(struct job *job)
+{
+    if (job_is_finished(job))
+        return -EALREADY;
+
+    __atomic_store_n(&(job->progress.cancel), 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/**
+ * Current state of a job.
+ *
+ * @param[in] job - job
+ *
+ * @return enum job_state value
+ */
+enum job_state
+job_state(const struct job *job)
+{
+    return (enum job_state)__atomic_load_n(&(job->state), __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Name of a job state.
+ *
+ * @param[in] state - state
+ *
+ * @return static string
+ */
+const char *
+job_state_name(enum job_state state)
+{
+    if ((size_t)state >= ARRAY_SIZ(state_names))
+        return "unknown";
+
+    return state_names[state];
+}
+
+
+static int
+job_print(struct buffer *out, const struct job *job)
+{
+    return buffer_printf(out, "%u %s %lu %lu %s\n", job->id,
+                job_state_name(job_state(job)),
+                __atomic_load_n(&(job->progress.done), __ATOMIC_RELAXED),
+                __atomic_load_n(&(job->progress.total), __ATOMIC_RELAXED),
+                job->line);
+}
+
+static int
+job_arg(struct command_ctx *ctx, const char *arg, struct job **pjob)
+{
+    char *endptr = NULL;
+    unsigned long id;
+
+    errno = 0;
+    id = strtoul(arg, &endptr, 0);
+
+    if (errno != 0 || endptr == arg || *endptr != '\0' || id > UINT32_MAX)
+        return -EINVAL;
+
+    *pjob = job_find(ctx->jobs, (uint32_t)id);
+
+    if (*pjob == NULL)
+        return -ENOENT;
+
+    return 0;
+}
+
+static int
+cmd_job(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err;
+    struct job *job;
+    struct list_head *entry;
+
+    /* Only the server thread has the table. */
+    if (ctx->jobs == NULL)
+        return -EINVAL;
+
+    if (argc == 1 || (argc == 2 && strcmp(argv[1], "list") == 0)) {
+        list_for_each(entry, &(ctx->jobs->jobs)) {
+            if (job_print(ctx->out, list_entry(entry, struct job, node)) != 0)
+                return -ENOMEM;
+        }
+
+        return 0;
+    }
+
+    if (argc != 3)
+        return -EINVAL;
+
+    err = job_arg(ctx, argv[2], &job);
+
+    if (err != 0)
+        return err;
+
+    if (strcmp(argv[1], "status") == 0) {
+        if (job_print(ctx->out, job) != 0)
+            return -ENOMEM;
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "cancel") == 0)
+        return job_cancel(job);
+
+    if (strcmp(argv[1], "result") == 0 || strcmp(argv[1], "forget") == 0) {
+        if (!job_is_finished(job))
+            return -EBUSY;
+
+        if (argv[1][0] == 'r') {
+            err = job->status;
+
+            if (buffer_append(ctx->out, job->out.data, job->out.len) != 0)
+                return -ENOMEM;
+        }
+
+        job_free(ctx->jobs, job);
+
+        return err;
+    }
+
+    return -EINVAL;
+}
+
+/**
+ * Register the job command.
+ *
+ * @param list - command list
+ *
+ * @return 0 on success
+ * @return negative errno value on failure
+ */
+int
+register_job_commands(struct command_list *list)
+{
+    return register_command(list, "job", cmd_job,
+                "job [list] | job <status|cancel|result|forget> <id>",
+                NULL);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
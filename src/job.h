@@ -0,0 +1,80 @@
+#ifndef H_JOB
+#define H_JOB
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/list.h"
+
+#include "buffer.h"
+#include "match.h"
+#include "worker.h"
+
+/* Finished jobs kept for "job result" before the oldest is dropped. */
+#define JOB_MAX_FINISHED  (64)
+
+enum job_state {
+    JOB_QUEUED = 0,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+};
+
+struct command_list;
+struct target;
+
+/* A command run in the background on its target's worker.
+ *
+ * The job table and everything in a job except state and progress
+ * belong to the server thread.  The worker only runs the command into
+ * out and sets status before handing the job back. */
+struct job {
+    struct list_head node;
+    struct work work;
+
+    uint32_t id;
+    uint32_t pid;
+    struct target *target;      /* NULL once finished */
+
+    int state;                  /* enum job_state, atomic */
+    int script;                 /* line is a script, see exec_script() */
+    struct match_progress progress;
+
+    int status;
+    struct buffer out;
+
+    /* Connection sent events for the job, fd -1 for none. */
+    int fd;
+    uint64_t conn_id;
+    uint32_t request_id;
+
+    char line[1];
+};
+
+struct job_table {
+    struct list_head jobs;
+    size_t finished;
+    uint32_t next_id;
+};
+
+extern void job_table_init(struct job_table *table);
+extern void job_table_fini(struct job_table *table);
+
+extern struct job *job_new(struct job_table *table, const char *line,
+                size_t length);
+extern struct job *job_find(struct job_table *table, uint32_t id);
+extern void job_free(struct job_table *table, struct job *job);
+
+extern void job_run(struct job *job, struct command_list *commands);
+extern void job_finish(struct job_table *table, struct job *job);
+extern int job_cancel(struct job *job);
+
+extern enum job_state job_state(const struct job *job);
+extern const char *job_state_name(enum job_state state);
+
+extern int register_job_commands(struct command_list *list);
+
+#endif /* H_JOB */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -106,6 +106,23 @@ enum match_range_bound_flags {
     (SEARCH_OPT_UNALIGNED | SEARCH_OPT_ALIGNED)
 /* TODO: add static vs dynamic range options. */
 
+/* Progress of the search or match call running on a thread, for other
+ * threads to watch.  done and total count bytes for searches and
+ * matches for match calls.  Setting cancel makes the call give up
+ * with ECANCELED; a cancelled match call leaves the list only partly
+ * filtered.
+ *
+ * found, if set, is given the matches of a search as chunks fill up,
+ * in list order, each match once.  A search stops if it fails. */
+struct match_progress {
+    unsigned long done;
+    unsigned long total;
+    int cancel;
+
+    int (*found)(void *arg, const struct match_object *objs, size_t count);
+    void *found_arg;
+};
+
 /* Match list functions */
 
 #define match_list_is_empty(match_list) \
@@ -120,6 +137,9 @@ match_list_init(struct match_list *list)
 
 extern void match_list_clear(struct match_list *list);
 
+extern void match_progress_bind(struct match_progress *progress);
+extern size_t match_list_count(const struct match_list *list);
+
 /* Match needle functions */
 
 extern int match_needle_init(struct match_needle *needle,
@@ -152,6 +172,8 @@ extern int match_unchanged(pid_t pid, struct match_list *list);
 extern int match_decreased(pid_t pid, struct match_list *list);
 extern int match_increased(pid_t pid, struct match_list *list);
 
+extern int match_snapshot(pid_t pid, struct match_list *list);
+
 /* Search functions (initalize and create match objects) */
 
 extern int search_eq(pid_t pid, struct match_list *list,
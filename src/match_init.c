@@ -83,7 +83,7 @@ match_flags_set_floating(const char *value, union match_flags *flags)
 
     /* This would result in a parse falure for double as well
      * so just fail out. */
-    if (endptr != '\0')
+    if (*endptr != '\0')
         return false;
 
     if (errno == 0) {
@@ -99,7 +99,7 @@ match_flags_set_floating(const char *value, union match_flags *flags)
     d = strtod(value, &endptr);
     (void)d;
 
-    if ((errno != 0) && (*endptr != '\0'))
+    if ((errno != 0) || (*endptr != '\0'))
         return false;
 
     flags->f64 = 1;
@@ -140,7 +140,7 @@ match_needle_init(struct match_needle *needle, const char *value)
     if (errno == ERANGE)
         return -1;
 
-    if (endptr == '\0') {
+    if (*endptr == '\0') {
         /* Ignore regurn.  We already know it parses correctly. */
         (void)match_flags_set_integer(value, &(needle->obj.flags));
         needle->obj.v.u64 = ival;
@@ -149,12 +149,15 @@ match_needle_init(struct match_needle *needle, const char *value)
 
     /* Try parsing as a floating point. */
 
-    fval = (uint64_t)strtod(value, &endptr);
+    errno = 0;
+    endptr = NULL;
+
+    fval = strtod(value, &endptr);
 
     if (errno == ERANGE)
         return -1;
 
-    if (endptr == '\0') {
+    if (*endptr == '\0') {
         /* Ignore regurn.  We already know it parses correctly. */
         (void)match_flags_set_floating(value, &(needle->obj.flags));
         needle->obj.v.f64 = fval;
@@ -190,4 +193,39 @@ match_list_clear(struct match_list *list)
     match_list_init(list);
 }
 
+__thread struct match_progress *match_progress_current;
+
+/**
+ * Report the progress of the search and match calls made by the
+ * calling thread.
+ *
+ * @param progress - progress to update, NULL to stop
+ */
+void
+match_progress_bind(struct match_progress *progress)
+{
+    match_progress_current = progress;
+}
+
+/**
+ * Count the matches in a match list.
+ *
+ * list->size is the number of chunks, not of matches.
+ *
+ * @param[in] list - list to count
+ *
+ * @return number of matches
+ */
+size_t
+match_list_count(const struct match_list *list)
+{
+    size_t count = 0;
+    struct list_head *entry;
+
+    list_for_each(entry, &(list->head))
+        count += match_chunk_entry(entry)->used;
+
+    return count;
+}
+
 /* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "shared/list.h"
 #include "match.h"
@@ -27,6 +28,21 @@ match_list_del(struct match_list *list, struct match_chunk_header *entry)
     list->size--;
 }
 
+static inline struct match_chunk_header *
+match_chunk_new(unsigned long size)
+{
+    struct match_chunk_header *ret;
+
+    ret = calloc(1, sizeof(*ret) + ((size - 1) * sizeof(ret->objects[0])));
+
+    if (ret == NULL)
+        return NULL;
+
+    ret->count = size;
+
+    return ret;
+}
+
 /* Scan / Search types */
 
 struct process_ctx;
@@ -56,6 +72,45 @@ extern const struct process_ops * process_get_ops_ptrace(void);
 
 extern void set_match_flags(struct match_object *obj, size_t len);
 
+/* match_init.c */
+extern __thread struct match_progress *match_progress_current;
+
+static inline void
+match_progress_set(unsigned long done, unsigned long total)
+{
+    struct match_progress *progress = match_progress_current;
+
+    if (progress == NULL)
+        return;
+
+    __atomic_store_n(&(progress->total), total, __ATOMIC_RELAXED);
+    __atomic_store_n(&(progress->done), done, __ATOMIC_RELAXED);
+}
+
+static inline int
+match_progress_cancelled(void)
+{
+    struct match_progress *progress = match_progress_current;
+
+    if (progress == NULL)
+        return 0;
+
+    return __atomic_load_n(&(progress->cancel), __ATOMIC_RELAXED);
+}
+
+/* Hand matches to the found callback, if any.  Returns not 0 with error
+ * returned in errno if the callback failed. */
+static inline int
+match_progress_found(const struct match_object *objs, size_t count)
+{
+    struct match_progress *progress = match_progress_current;
+
+    if (progress == NULL || progress->found == NULL || count == 0)
+        return 0;
+
+    return progress->found(progress->found_arg, objs, count);
+}
+
 #endif /* H_MATCH_INTERNAL */
 
 /* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,97 @@
+#ifndef H_MATCH_KERNEL
+#define H_MATCH_KERNEL
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "match.h"
+
+/**
+ * @file match_kernel.h
+ *
+ * Search predicates shared by the in-daemon searches and the
+ * in-process agent (see agent/).  Everything here is static inline
+ * so both sides run the exact same code.
+ */
+
+typedef int(*search_match_fn)(const struct match_object *,
+    const struct match_needle *, const struct match_needle *);
+
+/* Identifies a predicate across processes. */
+enum match_kernel_id {
+    MATCH_KERNEL_EQ = 0,
+
+    MATCH_KERNEL_MAX
+};
+
+static inline void
+match_kernel_set_flags(struct match_object *obj, size_t size)
+{
+    memset(&(obj->flags), 0, sizeof(obj->flags));
+
+    if (size == 0)
+        size = sizeof(uint64_t);
+
+    /* Set integer and floating flags. */
+
+    if (size >= sizeof(uint64_t)) {
+        obj->flags.i64 = 1;
+        obj->flags.f64 = 1;
+    }
+
+    if (size >= sizeof(uint32_t)) {
+        obj->flags.i32 = 1;
+        obj->flags.f32 = 1;
+    }
+
+    if (size >= sizeof(uint16_t))
+        obj->flags.i16 = 1;
+
+    obj->flags.i8 = 1;
+}
+
+static inline int
+match_kernel_eq(const struct match_object *value,
+    const struct match_needle *needle, const struct match_needle *unused)
+{
+    (void)unused;
+
+    if (needle->obj.flags.i8) {
+        if (needle->obj.v.u8 == value->v.u8)
+            return 1;
+    }
+
+    if (needle->obj.flags.i16) {
+        if (needle->obj.v.u16 == value->v.u16)
+            return 1;
+    }
+
+    if (needle->obj.flags.i32 || needle->obj.flags.f32) {
+        if (needle->obj.v.u32 == value->v.u32)
+            return 1;
+    }
+
+    if (needle->obj.flags.i64 || needle->obj.flags.f64) {
+        if (needle->obj.v.u64 == value->v.u64)
+            return 1;
+    }
+
+   return 0;
+}
+
+static inline search_match_fn
+match_kernel_get(enum match_kernel_id id)
+{
+    switch (id) {
+    case MATCH_KERNEL_EQ:
+        return match_kernel_eq;
+
+    default:
+        return NULL;
+    }
+}
+
+#endif /* H_MATCH_KERNEL */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
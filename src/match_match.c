@@ -186,17 +186,24 @@ __match(pid_t pid, struct match_list *list,
     int fd;
     int err;
     int ret;
+    int cancelled = 0;
     struct list_head *next;
     struct list_head *entry;
 
     read_fn read_actor;
 
+    unsigned long done = 0;
+    unsigned long total;
+
     struct match_chunk_header *current_chunk = NULL;
 
 
     if (match_list_is_empty(list))
         return 0;
 
+    total = match_list_count(list);
+    match_progress_set(0, total);
+
     /* Determine which memory reading method to use. */
     err = can_read_pid_mem(pid);
 
@@ -223,6 +230,14 @@ __match(pid_t pid, struct match_list *list,
 
         header = match_chunk_entry(entry);
 
+        /* Keep what was filtered so far in order. */
+        if (match_progress_cancelled()) {
+            cancelled = 1;
+            break;
+        }
+
+        done += header->used;
+
         i = 0;
         while (i < header->used) {
             struct match_object tmp;
@@ -251,6 +266,8 @@ __match(pid_t pid, struct match_list *list,
         /* Remove emptied chunks. */
         if (header->used == 0)
             match_list_delete_entry(list, header);
+
+        match_progress_set(done, total);
     }
 
     /* Everything has been checked, now consolidate the chunks. */
@@ -319,6 +336,11 @@ __match(pid_t pid, struct match_list *list,
 
     ret = 0;
 
+    if (cancelled) {
+        errno = ECANCELED;
+        ret = -1;
+    }
+
 out:
 
     if (read_actor == __read_pid_mem) {
@@ -965,4 +987,36 @@ match_increased(pid_t pid, struct match_list *list)
     return __match(pid, list, NULL, NULL, __match_increased);
 }
 
+
+static int
+__match_snapshot(const struct match_object *orig,
+    const struct match_object *new,
+    const struct match_needle *unused_1, const struct match_needle *unused_2)
+{
+    (void)unused_1;
+    (void)unused_2;
+
+    /* orig is the entry in the list; keep its type flags. */
+    memcpy(((struct match_object *)orig)->v.bytes, new->v.bytes,
+        sizeof(new->v.bytes));
+
+    return 1;
+}
+
+/**
+ * Store the current value of every match, for later changed,
+ * unchanged, increased and decreased filters to compare against.
+ *
+ * @param[in] pid - process id these matches are for
+ * @param list - list to update
+ *
+ * @return 0 on success
+ * @return < 0 on failure with error returned in errno
+ */
+int
+match_snapshot(pid_t pid, struct match_list *list)
+{
+    return __match(pid, list, NULL, NULL, __match_snapshot);
+}
+
 /* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -11,8 +11,10 @@
 #include "shared/util.h"
 #include "ptracer/ptracer.h"
 
+#include "agent.h"
 #include "match.h"
 #include "match_internal.h"
+#include "match_kernel.h"
 #include "pid_mem.h"
 #include "region.h"
 
@@ -27,66 +29,38 @@
  * TODO: pretty sure some of the match functions are bullshit.
  */
 
-typedef int(*search_match_fn)(const struct match_object *,
-    const struct match_needle *, const struct match_needle *);
-
 void
 set_match_flags(struct match_object *obj, size_t size)
 {
-    memset(&(obj->flags), 0, sizeof(obj->flags));
-
-    if (size == 0)
-        size = sizeof(uint64_t);
-
-    /* Set integer and floating flags. */
-
-    if (size >= sizeof(uint64_t)) {
-        obj->flags.i64 = 1;
-        obj->flags.f64 = 1;
-    }
-
-    if (size >= sizeof(uint32_t)) {
-        obj->flags.i32 = 1;
-        obj->flags.f32 = 1;
-    }
-
-    if (size >= sizeof(uint16_t))
-        obj->flags.i16 = 1;
-
-    obj->flags.i8 = 1;
+    match_kernel_set_flags(obj, size);
 }
 
-static inline struct match_chunk_header *
-new_chunk(unsigned long size)
-{
-    struct match_chunk_header *ret;
-
-    ret = calloc(1, sizeof(*ret) + ((size - 1) * sizeof(ret->objects[0])));
-
-    if (ret == NULL)
-        return NULL;
-
-    ret->count = size;
-
-    return ret;
-}
 
+/* Values checked between progress updates. */
+#define SEARCH_PROGRESS_STEPS  (64 * 1024)
 
 static inline int
 process_region(struct process_ctx *ctx,
     struct match_list *list, const struct region *region,
     search_match_fn match, const struct match_needle *needle_1,
     const struct match_needle *needle_2,
-    struct match_chunk_header **pcurrent_chunk)
+    struct match_chunk_header **pcurrent_chunk,
+    unsigned long done, unsigned long total)
 {
     int err;
+    unsigned long steps = 0;
     struct match_chunk_header *current_chunk = *pcurrent_chunk;
 
-    if (current_chunk != NULL && (current_chunk->used >= current_chunk->count))
+    if (current_chunk != NULL && (current_chunk->used >= current_chunk->count)) {
+        if (match_progress_found(current_chunk->objects,
+                    current_chunk->used) != 0)
+            return -1;
+
         current_chunk = NULL;
+    }
 
     if (current_chunk == NULL) {
-        current_chunk = new_chunk(MATCH_CHUNK_SIZE_HUGE);
+        current_chunk = match_chunk_new(MATCH_CHUNK_SIZE_HUGE);
 
         if (current_chunk == NULL)
             return -1;
@@ -103,7 +77,13 @@ process_region(struct process_ctx *ctx,
         struct match_object *obj;
 
         if (current_chunk->used >= current_chunk->count) {
-            current_chunk = new_chunk(MATCH_CHUNK_SIZE_HUGE);
+            if (match_progress_found(current_chunk->objects,
+                        current_chunk->used) != 0) {
+                *pcurrent_chunk = current_chunk;
+                return -1;
+            }
+
+            current_chunk = match_chunk_new(MATCH_CHUNK_SIZE_HUGE);
 
             if (current_chunk == NULL)
                 return -1;
@@ -126,6 +106,16 @@ process_region(struct process_ctx *ctx,
         if (err > 0)
             goto out;
 
+        if ((++steps % SEARCH_PROGRESS_STEPS) == 0) {
+            match_progress_set(done + (obj->addr - region->start), total);
+
+            if (match_progress_cancelled()) {
+                *pcurrent_chunk = current_chunk;
+                errno = ECANCELED;
+                return -1;
+            }
+        }
+
         /* Verify match */
 
         /* match() return values:
@@ -149,18 +139,48 @@ __search(pid_t pid, struct match_list *list,
     const struct match_needle *needle_1,
     const struct match_needle *needle_2,
     const struct region_list *regions,
-    int options, search_match_fn match)
+    int options, enum match_kernel_id kernel)
 {
     int fd;
     int err;
-    int ret;
+    int ret = 0;
     int oerrno;
 
+    search_match_fn match;
+    struct agent *agent;
     struct process_ctx ctx;
     struct list_head *entry;
 
+    unsigned long done = 0;
+    unsigned long total = 0;
+
     struct match_chunk_header *current_chunk = NULL;
 
+    /* An agent in the process scans its memory directly. */
+    agent = agent_find(pid);
+
+    if (agent != NULL) {
+        if (agent_search(agent, list, kernel,
+                    needle_1, needle_2, regions, options) != 0)
+            return -1;
+
+        list_for_each(entry, &(list->head)) {
+            current_chunk = match_chunk_entry(entry);
+
+            if (match_progress_found(current_chunk->objects,
+                        current_chunk->used) != 0)
+                return -1;
+        }
+
+        return 0;
+    }
+
+    match = match_kernel_get(kernel);
+
+    if (match == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
 
     /* Determine which memory reading method to use. */
     err = can_read_pid_mem(pid);
@@ -189,6 +209,13 @@ __search(pid_t pid, struct match_list *list,
         goto out;
     }
 
+    list_for_each(entry, &(regions->head)) {
+        struct region *region = region_entry(entry);
+        total += region->end - region->start;
+    }
+
+    match_progress_set(0, total);
+
     list_for_each(entry, &(regions->head)) {
         struct region *region;
 
@@ -196,14 +223,23 @@ __search(pid_t pid, struct match_list *list,
 
         err = process_region(&ctx, list,
                 region, match, needle_1,
-                needle_2, &current_chunk);
+                needle_2, &current_chunk, done, total);
 
         if (err < 0) {
             ret = -1;
             goto out;
         }
+
+        done += region->end - region->start;
+        match_progress_set(done, total);
     }
 
+    /* The last chunk is only full if the last object filled it. */
+    if (current_chunk != NULL
+            && match_progress_found(current_chunk->objects,
+                    current_chunk->used) != 0)
+        ret = -1;
+
 out:
 
     if (ret != 0)
@@ -223,35 +259,6 @@ out:
 }
 
 
-static int
-__search_eq(const struct match_object *value,
-    const struct match_needle *needle, const struct match_needle *unused)
-{
-    (void)unused;
-
-    if (needle->obj.flags.i8) {
-        if (needle->obj.v.u8 == value->v.u8)
-            return 1;
-    }
-
-    if (needle->obj.flags.i16) {
-        if (needle->obj.v.u16 == value->v.u16)
-            return 1;
-    }
-
-    if (needle->obj.flags.i32 || needle->obj.flags.f32) {
-        if (needle->obj.v.u32 == value->v.u32)
-            return 1;
-    }
-
-    if (needle->obj.flags.i64 || needle->obj.flags.f64) {
-        if (needle->obj.v.u64 == value->v.u64)
-            return 1;
-    }
-
-   return 0;
-}
-
 /**
  * Find matches equal to a value in the match list.
  *
@@ -268,7 +275,8 @@ search_eq(pid_t pid, struct match_list *list,
     const struct region_list *regions,
     int options)
 {
-    return __search(pid, list, needle, NULL, regions, options, __search_eq);
+    return __search(pid, list, needle, NULL, regions, options,
+            MATCH_KERNEL_EQ);
 }
 
 
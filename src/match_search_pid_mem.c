@@ -28,6 +28,23 @@
 typedef int(*search_match_fn)(const struct match_object *,
     const struct match_needle *, const struct match_needle *);
 
+/* Bytes read from the region at a time. */
+#define WINDOW_SIZE  (64 * 1024)
+
+struct __process_pid_mem_data {
+    /* The last sizeof(uint64_t) - 1 bytes of a window are kept in
+     * front of the next one so values may straddle reads. */
+    unsigned char buf[WINDOW_SIZE + sizeof(uint64_t)];
+
+    size_t len;
+    size_t pos;
+
+    unsigned long base;      /* address of buf[0] */
+    unsigned long addr;      /* next address to read */
+    size_t remaining;
+};
+
+
 static int
 __process_pid_mem_init(struct process_ctx *ctx, int fd,
     pid_t pid, int aligned)
@@ -36,7 +53,10 @@ __process_pid_mem_init(struct process_ctx *ctx, int fd,
     ctx->pid = pid;
     ctx->aligned = aligned;
 
-    ctx->data = NULL;
+    ctx->data = calloc(1, sizeof(struct __process_pid_mem_data));
+
+    if (ctx->data == NULL)
+        return -1;
 
     return 0;
 }
@@ -50,18 +70,95 @@ __process_pid_mem_fini(struct process_ctx *ctx)
     }
 }
 
+static int
+refill(struct process_ctx *ctx, struct __process_pid_mem_data *data)
+{
+    size_t want;
+    ssize_t got;
+
+    /* Slide the unused tail down. */
+    memmove(data->buf, data->buf + data->pos, data->len - data->pos);
+    data->base += data->pos;
+    data->len -= data->pos;
+    data->pos = 0;
+
+    want = data->remaining;
+
+    if (want > WINDOW_SIZE)
+        want = WINDOW_SIZE;
+
+    got = read_pid_mem_loop_fd(ctx->fd, data->buf + data->len, want,
+                (off_t)data->addr);
+
+    /* Unmapped or unreadable pages end the region. */
+    if (got <= 0) {
+        data->remaining = 0;
+        return 0;
+    }
+
+    data->addr += (unsigned long)got;
+    data->remaining -= (size_t)got;
+    data->len += (size_t)got;
+
+    return 0;
+}
+
 static int
 __process_pid_mem_next(struct process_ctx *ctx, struct match_object *obj)
 {
-    (void)ctx; (void)obj;
-    return -1;
+    size_t avail;
+    struct __process_pid_mem_data *data = ctx->data;
+
+    if (data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (data->len - data->pos < sizeof(obj->v.bytes)
+            && data->remaining != 0) {
+        if (refill(ctx, data) != 0)
+            return -1;
+    }
+
+    if (data->pos >= data->len)
+        return 1;
+
+    avail = data->len - data->pos;
+
+    if (avail > sizeof(obj->v.bytes))
+        avail = sizeof(obj->v.bytes);
+
+    memset(obj->v.bytes, 0, sizeof(obj->v.bytes));
+    memcpy(obj->v.bytes, data->buf + data->pos, avail);
+
+    obj->addr = data->base + data->pos;
+
+    /* Same steps as the ptrace version. */
+    data->pos += ctx->aligned ? sizeof(unsigned long) : 1;
+
+    set_match_flags(obj, avail);
+
+    return 0;
 }
 
 static int
 __process_pid_mem_set(struct process_ctx *ctx, const struct region *region)
 {
-    (void)ctx; (void)region;
-    return -1;
+    struct __process_pid_mem_data *data = ctx->data;
+
+    if (data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    data->len = 0;
+    data->pos = 0;
+
+    data->base = region->start;
+    data->addr = region->start;
+    data->remaining = (size_t)(region->end - region->start);
+
+    return 0;
 }
 
 static const struct process_ops __process_ops_pid_mem = {
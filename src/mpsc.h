@@ -0,0 +1,92 @@
+#ifndef H_MPSC
+#define H_MPSC
+
+#include <stddef.h>
+
+/* Intrusive multi-producer single-consumer queue (D. Vyukov).
+ *
+ * Producers never wait: a push is one atomic exchange and a store.
+ * Only one thread may pop.  mpsc_pop() may return NULL while a push is
+ * half done; the item shows up once the producer finishes, so a
+ * consumer which knows an item is queued simply tries again.
+ */
+
+#define MPSC_CACHE_LINE  (64)
+
+struct mpsc_node {
+    struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+    /* Producers */
+    struct mpsc_node *head __attribute__((aligned(MPSC_CACHE_LINE)));
+
+    /* Consumer */
+    struct mpsc_node *tail __attribute__((aligned(MPSC_CACHE_LINE)));
+    struct mpsc_node stub;
+};
+
+static inline void
+mpsc_init(struct mpsc_queue *q)
+{
+    q->stub.next = NULL;
+    q->head = &(q->stub);
+    q->tail = &(q->stub);
+}
+
+static inline void
+mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+    struct mpsc_node *prev;
+
+    __atomic_store_n(&(node->next), NULL, __ATOMIC_RELAXED);
+
+    prev = __atomic_exchange_n(&(q->head), node, __ATOMIC_ACQ_REL);
+
+    /* The consumer cannot see node until this store. */
+    __atomic_store_n(&(prev->next), node, __ATOMIC_RELEASE);
+}
+
+static inline struct mpsc_node *
+mpsc_pop(struct mpsc_queue *q)
+{
+    struct mpsc_node *head;
+    struct mpsc_node *tail = q->tail;
+    struct mpsc_node *next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+
+    if (tail == &(q->stub)) {
+        if (next == NULL)
+            return NULL;
+
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&(next->next), __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    head = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+
+    /* A producer is between its exchange and its store. */
+    if (tail != head)
+        return NULL;
+
+    /* tail is the last item; put the stub behind it to take it. */
+    mpsc_push(q, &(q->stub));
+
+    next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+#endif /* H_MPSC */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
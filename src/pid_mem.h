@@ -3,6 +3,8 @@
 
 #include <sys/types.h>
 
+#include <unistd.h>
+
 #define PID_MEM_FLAGS_READ  (0x01)
 #define PID_MEM_FLAGS_WRITE (0x02)
 #define PID_MEM_FLAGS_MASK \
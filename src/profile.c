@@ -0,0 +1,695 @@
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shared/list.h"
+#include "ptracer/ptracer.h"
+
+#include "elf_index.h"
+#include "pid_mem.h"
+#include "profile.h"
+
+/**
+ * @file profile.c
+ *
+ * Sampling profiler.
+ *
+ * Every thread of the process is attached with PTRACE_SEIZE, which
+ * leaves it running.  A sampling round stops all threads at once with
+ * PTRACE_INTERRUPT, then for each thread in turn reads the registers,
+ * follows the frame pointer chain (if asked to) and resumes it right
+ * away, so a thread is stopped for one wait, one GETREGS and a few
+ * small reads.  The time every thread spends stopped is kept in the
+ * statistics.
+ *
+ * Samples are added up per function using the symbols of the loaded
+ * modules (elf_index.c); addresses in a module without a matching
+ * symbol are counted for the module, anything else as unknown.  Each
+ * function gets a self count (pc in it) and a total count (anywhere on
+ * the stack, once per sample).
+ *
+ * The stack walk trusts the frame pointer: code built without one
+ * gives short or wrong stacks but the self counts are always right.
+ *
+ * New threads are picked up by rescanning /proc/<pid>/task every
+ * PROFILE_RESCAN_ROUNDS rounds; modules loaded after profile_attach()
+ * show up as unknown.  A process can only have one tracer, so this
+ * cannot be used alongside a ptracer context on the same process.
+ */
+
+#define entry_hentry(list_node) \
+    list_entry(list_node, struct profile_entry, hnode)
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t
+entry_hash(unsigned long addr, size_t nbuckets)
+{
+    return (size_t)((addr * 0x9E3779B97F4A7C15ULL) >> 32) & (nbuckets - 1);
+}
+
+
+/* Aggregation table. */
+
+static int
+table_resize(struct profile *prof, size_t nbuckets)
+{
+    size_t i;
+    struct list_head *buckets;
+
+    buckets = malloc(nbuckets * sizeof(*buckets));
+
+    if (buckets == NULL)
+        return -1;
+
+    for (i = 0; i < nbuckets; ++i)
+        list_head_init(&(buckets[i]));
+
+    for (i = 0; i < prof->nbuckets; ++i) {
+        struct list_head *next;
+        struct list_head *entry;
+
+        list_for_each_safe(entry, next, &(prof->buckets[i])) {
+            struct profile_entry *e = entry_hentry(entry);
+
+            list_add(entry, &(buckets[ entry_hash(e->addr, nbuckets) ]));
+        }
+    }
+
+    free(prof->buckets);
+
+    prof->buckets = buckets;
+    prof->nbuckets = nbuckets;
+
+    return 0;
+}
+
+static struct profile_entry *
+table_get(struct profile *prof, unsigned long addr)
+{
+    struct list_head *entry;
+    struct list_head *head;
+    struct profile_entry *e;
+    const struct elf_module *mod = NULL;
+    const struct elf_symbol *sym;
+    unsigned long key = 0;
+
+    sym = elf_index_symbolize(&(prof->index), addr, &mod, NULL);
+
+    if (sym != NULL) {
+        key = mod->bias + sym->value;
+    }
+    else {
+        mod = elf_index_module(&(prof->index), addr);
+
+        if (mod != NULL)
+            key = mod->start;
+    }
+
+    head = &(prof->buckets[ entry_hash(key, prof->nbuckets) ]);
+
+    list_for_each(entry, head) {
+        e = entry_hentry(entry);
+
+        if (e->addr == key)
+            return e;
+    }
+
+    if (prof->count >= prof->nbuckets * 2) {
+        if (table_resize(prof, prof->nbuckets * 2) != 0)
+            return NULL;
+
+        head = &(prof->buckets[ entry_hash(key, prof->nbuckets) ]);
+    }
+
+    e = calloc(1, sizeof(*e));
+
+    if (e == NULL)
+        return NULL;
+
+    e->addr = key;
+    e->sym = sym;
+    e->module = mod;
+
+    list_add(&(e->hnode), head);
+    prof->count++;
+
+    return e;
+}
+
+static int
+record_sample(struct profile *prof, const unsigned long *pcs, size_t count)
+{
+    size_t i;
+    unsigned long seq = ++(prof->stats.samples);
+
+    for (i = 0; i < count; ++i) {
+        struct profile_entry *e = table_get(prof, pcs[i]);
+
+        if (e == NULL)
+            return -1;
+
+        if (i == 0)
+            e->self++;
+
+        /* Recursion counts once. */
+        if (e->seen != seq) {
+            e->seen = seq;
+            e->total++;
+        }
+    }
+
+    return 0;
+}
+
+/* Follow saved frame pointers.  Return addresses are moved back into
+ * the call instruction so they symbolize to the caller. */
+static size_t
+walk_stack(struct profile *prof, unsigned long fp, unsigned long *pcs,
+    size_t max)
+{
+    size_t n = 1;
+
+    while (n < max) {
+        unsigned long frame[2];
+
+        if (fp == 0 || (fp & (sizeof(fp) - 1)) != 0)
+            break;
+
+        if (read_pid_mem_fd(prof->mem_fd, frame, sizeof(frame),
+                    (off_t)fp) != (ssize_t)sizeof(frame))
+            break;
+
+        if (frame[1] == 0)
+            break;
+
+        pcs[n++] = frame[1] - 1;
+
+        /* The stack grows down; callers' frames are above. */
+        if (frame[0] <= fp)
+            break;
+
+        fp = frame[0];
+    }
+
+    return n;
+}
+
+
+/* Threads. */
+
+static int
+thread_add(struct profile *prof, pid_t tid)
+{
+    size_t i;
+
+    for (i = 0; i < prof->nthreads; ++i) {
+        if (prof->threads[i].tid == tid)
+            return 0;
+    }
+
+    if (prof->nthreads == prof->threads_alloc) {
+        size_t alloc;
+        struct profile_thread *tmp;
+
+        alloc = (prof->threads_alloc == 0) ? 16 : prof->threads_alloc * 2;
+        tmp = realloc(prof->threads, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        prof->threads = tmp;
+        prof->threads_alloc = alloc;
+    }
+
+    /* Gone already, or traced by someone else. */
+    if (ptrace_seize(tid, 0) != 0)
+        return (errno == ESRCH) ? 0 : -1;
+
+    prof->threads[prof->nthreads].tid = tid;
+    prof->threads[prof->nthreads].gone = 0;
+    prof->threads[prof->nthreads].since = 0;
+    prof->nthreads++;
+
+    return 0;
+}
+
+static int
+scan_threads(struct profile *prof)
+{
+    int ret = 0;
+    DIR *dir;
+    char path[64];
+    struct dirent *dent;
+
+    (void)snprintf(path, sizeof(path), "/proc/%u/task",
+        (unsigned int)prof->pid);
+
+    dir = opendir(path);
+
+    if (dir == NULL)
+        return -1;
+
+    while ((dent = readdir(dir)) != NULL) {
+        pid_t tid;
+
+        if (dent->d_name[0] < '0' || dent->d_name[0] > '9')
+            continue;
+
+        tid = (pid_t)strtoul(dent->d_name, NULL, 10);
+
+        if (thread_add(prof, tid) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+static void
+drop_gone_threads(struct profile *prof)
+{
+    size_t i;
+    size_t n = 0;
+
+    for (i = 0; i < prof->nthreads; ++i) {
+        if (!prof->threads[i].gone)
+            prof->threads[n++] = prof->threads[i];
+    }
+
+    prof->nthreads = n;
+}
+
+/* Wait for the stop caused by PTRACE_INTERRUPT.
+ * Returns 1 for the interrupt stop, 2 for a group-stop (must be left
+ * with PTRACE_LISTEN), 0 if the thread is gone and -1 on error. */
+static int
+wait_interrupted(pid_t tid)
+{
+    for (;;) {
+        int status;
+        int sig;
+
+        if (waitpid(tid, &status, __WALL) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            return (errno == ECHILD) ? 0 : -1;
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            return 0;
+
+        if (!WIFSTOPPED(status))
+            continue;
+
+        sig = WSTOPSIG(status);
+
+        if ((status >> 16) == PTRACE_EVENT_STOP)
+            return (sig == SIGTRAP) ? 1 : 2;
+
+        /* A signal arrived first: deliver it, the interrupt is still
+         * pending and stops the thread right after. */
+        if ((status >> 16) == 0) {
+            if (ptrace_cont_signal(tid, sig) != 0)
+                return (errno == ESRCH) ? 0 : -1;
+        }
+        else if (ptrace_cont_signal(tid, 0) != 0) {
+            return (errno == ESRCH) ? 0 : -1;
+        }
+    }
+}
+
+
+/**
+ * Initialize a profiler.
+ *
+ * @param prof - profiler
+ */
+void
+profile_init(struct profile *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+
+    prof->mem_fd = -1;
+    elf_index_init(&(prof->index));
+}
+
+/**
+ * Detach from the process and release everything held by a profiler.
+ *
+ * @param prof - profiler
+ */
+void
+profile_fini(struct profile *prof)
+{
+    size_t i;
+
+    profile_detach(prof);
+
+    for (i = 0; i < prof->nbuckets; ++i) {
+        struct list_head *next;
+        struct list_head *entry;
+
+        list_for_each_safe(entry, next, &(prof->buckets[i]))
+            free(entry_hentry(entry));
+    }
+
+    free(prof->buckets);
+    free(prof->threads);
+
+    elf_index_fini(&(prof->index));
+
+    profile_init(prof);
+}
+
+/**
+ * Seize every thread of a process and index its modules.
+ *
+ * The process keeps running.
+ *
+ * @param prof - profiler, initialized
+ * @param[in] pid - process id, must not be traced
+ * @param[in] depth - frames to follow per sample, 0 for the pc only
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+profile_attach(struct profile *prof, pid_t pid, unsigned int depth)
+{
+    int oerrno;
+
+    if (depth > PROFILE_MAX_DEPTH)
+        depth = PROFILE_MAX_DEPTH;
+
+    prof->pid = pid;
+    prof->depth = depth;
+
+    if (elf_index_build(&(prof->index), pid) != 0)
+        return 1;
+
+    if (prof->buckets == NULL && table_resize(prof, PROFILE_BUCKETS) != 0)
+        return 1;
+
+    if (depth != 0) {
+        prof->mem_fd = open_pid_mem(pid, PID_MEM_FLAGS_READ);
+
+        if (prof->mem_fd == -1)
+            return 1;
+    }
+
+    if (scan_threads(prof) != 0)
+        goto fail;
+
+    if (prof->nthreads == 0) {
+        errno = ESRCH;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+
+    oerrno = errno;
+    profile_detach(prof);
+    errno = oerrno;
+
+    return 1;
+}
+
+/**
+ * Let go of every thread.  The samples are kept.
+ *
+ * @param prof - profiler
+ */
+void
+profile_detach(struct profile *prof)
+{
+    size_t i;
+
+    /* PTRACE_DETACH needs the thread stopped. */
+    for (i = 0; i < prof->nthreads; ++i) {
+        if (ptrace_interrupt(prof->threads[i].tid) != 0)
+            prof->threads[i].gone = 1;
+    }
+
+    for (i = 0; i < prof->nthreads; ++i) {
+        if (prof->threads[i].gone)
+            continue;
+
+        if (wait_interrupted(prof->threads[i].tid) > 0)
+            (void)ptrace_detach(prof->threads[i].tid);
+    }
+
+    prof->nthreads = 0;
+
+    if (prof->mem_fd != -1) {
+        close_pid_mem(prof->mem_fd);
+        prof->mem_fd = -1;
+    }
+}
+
+/**
+ * Take one sample of every thread.
+ *
+ * @param prof - profiler, attached
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno (ESRCH once
+ *         every thread has exited)
+ */
+int
+profile_sample(struct profile *prof)
+{
+    size_t i;
+    unsigned long pcs[PROFILE_MAX_DEPTH + 1];
+
+    prof->stats.rounds++;
+
+    if ((prof->stats.rounds % PROFILE_RESCAN_ROUNDS) == 0)
+        (void)scan_threads(prof);
+
+    /* Stop everything first so the threads are sampled together. */
+    for (i = 0; i < prof->nthreads; ++i) {
+        struct profile_thread *t = &(prof->threads[i]);
+
+        t->since = now_ns();
+
+        if (ptrace_interrupt(t->tid) != 0)
+            t->gone = 1;
+    }
+
+    for (i = 0; i < prof->nthreads; ++i) {
+        int kind;
+        size_t n;
+        uint64_t pause;
+        struct user_regs_struct regs;
+        struct profile_thread *t = &(prof->threads[i]);
+
+        if (t->gone)
+            continue;
+
+        kind = wait_interrupted(t->tid);
+
+        if (kind <= 0) {
+            if (kind < 0)
+                prof->stats.lost++;
+
+            t->gone = 1;
+            continue;
+        }
+
+        if (ptrace_getregs(t->tid, &regs) == 0) {
+#if defined(__x86_64__)
+            pcs[0] = (unsigned long)regs.rip;
+            n = walk_stack(prof, (unsigned long)regs.rbp, pcs,
+                    prof->depth + 1);
+#else
+            pcs[0] = (unsigned long)regs.eip;
+            n = walk_stack(prof, (unsigned long)regs.ebp, pcs,
+                    prof->depth + 1);
+#endif
+        }
+        else {
+            n = 0;
+            prof->stats.lost++;
+        }
+
+        if (kind == 1)
+            (void)ptrace_cont_signal(t->tid, 0);
+        else
+            (void)ptrace_listen(t->tid);
+
+        pause = now_ns() - t->since;
+
+        prof->stats.pause_total_ns += pause;
+
+        if (pause > prof->stats.pause_max_ns)
+            prof->stats.pause_max_ns = pause;
+
+        if (n != 0 && record_sample(prof, pcs, n) != 0)
+            return 1;
+    }
+
+    drop_gone_threads(prof);
+
+    if (prof->nthreads == 0) {
+        errno = ESRCH;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sample at a fixed rate.
+ *
+ * @param prof - profiler, attached
+ * @param[in] hz - rounds per second
+ * @param[in] duration_ms - how long to run, 0 for no limit
+ * @param[in] stop - set to non-zero (e.g. from a signal handler) to
+ *                   return early, may be NULL
+ *
+ * @return 0 on success, including the process exiting
+ * @return not 0 on failure with error returned in errno
+ */
+int
+profile_run(struct profile *prof, unsigned int hz, unsigned int duration_ms,
+    volatile int *stop)
+{
+    uint64_t end;
+    uint64_t next;
+    uint64_t period;
+
+    if (hz == 0) {
+        errno = EINVAL;
+        return 1;
+    }
+
+    period = 1000000000ULL / hz;
+    next = now_ns();
+    end = next + ((uint64_t)duration_ms * 1000000ULL);
+
+    while (stop == NULL || *stop == 0) {
+        uint64_t now;
+
+        if (profile_sample(prof) != 0)
+            return (errno == ESRCH) ? 0 : 1;
+
+        next += period;
+        now = now_ns();
+
+        if (duration_ms != 0 && next >= end)
+            break;
+
+        if (now >= next) {
+            /* Do not try to catch up; that only makes it worse. */
+            prof->stats.late++;
+            next = now;
+            continue;
+        }
+
+        {
+            struct timespec ts;
+
+            ts.tv_sec = (time_t)(next / 1000000000ULL);
+            ts.tv_nsec = (long)(next % 1000000000ULL);
+
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                        &ts, NULL) == EINTR) {
+                if (stop != NULL && *stop != 0)
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+report_cmp(const void *a, const void *b)
+{
+    const struct profile_entry *x = *(struct profile_entry **)a;
+    const struct profile_entry *y = *(struct profile_entry **)b;
+
+    if (x->self != y->self)
+        return (x->self < y->self) - (x->self > y->self);
+
+    return (x->total < y->total) - (x->total > y->total);
+}
+
+/**
+ * List the sampled functions, most samples first.
+ *
+ * @param[in] prof - profiler
+ * @param[out] out - storage for the lines, may be NULL to count
+ * @param[in] max - number of lines out can hold
+ *
+ * @return number of functions sampled, which may be more than max;
+ *         (size_t)-1 on failure with error returned in errno
+ */
+size_t
+profile_report(const struct profile *prof, struct profile_report *out,
+    size_t max)
+{
+    size_t i;
+    size_t n = 0;
+    struct profile_entry **sorted;
+
+    if (out == NULL || max == 0 || prof->count == 0)
+        return prof->count;
+
+    sorted = malloc(prof->count * sizeof(*sorted));
+
+    if (sorted == NULL)
+        return (size_t)-1;
+
+    for (i = 0; i < prof->nbuckets; ++i) {
+        struct list_head *entry;
+
+        list_for_each(entry, &(prof->buckets[i]))
+            sorted[n++] = entry_hentry(entry);
+    }
+
+    qsort(sorted, n, sizeof(*sorted), report_cmp);
+
+    for (i = 0; i < n && i < max; ++i) {
+        const struct profile_entry *e = sorted[i];
+
+        out[i].name = (e->sym != NULL) ? e->sym->name : NULL;
+        out[i].module = (e->module != NULL) ? e->module->image->path : NULL;
+        out[i].addr = e->addr;
+        out[i].self = e->self;
+        out[i].total = e->total;
+    }
+
+    free(sorted);
+
+    return n;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,96 @@
+#ifndef H_PROFILE
+#define H_PROFILE
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/list.h"
+
+#include "elf_index.h"
+
+/* Frames followed through the frame pointer chain, 0 for none. */
+#define PROFILE_DEFAULT_DEPTH   (16)
+#define PROFILE_MAX_DEPTH       (128)
+
+/* Initial number of aggregation buckets.  Must be a power of two. */
+#define PROFILE_BUCKETS         (256)
+
+/* /proc/<pid>/task is scanned for new threads every this many rounds. */
+#define PROFILE_RESCAN_ROUNDS   (32)
+
+struct profile_thread {
+    pid_t tid;
+    int gone;                 /* exited, dropped after the round */
+    uint64_t since;           /* when it was interrupted */
+};
+
+/* Samples of one function (or module, or unknown address). */
+struct profile_entry {
+    struct list_head hnode;
+
+    unsigned long addr;       /* function start, module start or 0 */
+    const struct elf_symbol *sym;
+    const struct elf_module *module;
+
+    unsigned long self;       /* samples with the pc in it */
+    unsigned long total;      /* samples with it anywhere on the stack */
+    unsigned long seen;       /* sample number which last counted it */
+};
+
+struct profile_stats {
+    unsigned long rounds;
+    unsigned long samples;
+    unsigned long lost;        /* threads which could not be sampled */
+    unsigned long late;        /* rounds started after their deadline */
+
+    /* Time threads spent stopped by the profiler. */
+    uint64_t pause_total_ns;
+    uint64_t pause_max_ns;
+};
+
+struct profile {
+    pid_t pid;
+    int mem_fd;
+    unsigned int depth;
+
+    struct elf_index index;
+
+    struct profile_thread *threads;
+    size_t nthreads;
+    size_t threads_alloc;
+
+    struct list_head *buckets;
+    size_t nbuckets;
+    size_t count;
+
+    struct profile_stats stats;
+};
+
+/* One line of a report. */
+struct profile_report {
+    const char *name;         /* NULL if unknown */
+    const char *module;       /* NULL if unknown */
+    unsigned long addr;
+    unsigned long self;
+    unsigned long total;
+};
+
+extern void profile_init(struct profile *prof);
+extern void profile_fini(struct profile *prof);
+
+extern int profile_attach(struct profile *prof, pid_t pid,
+                unsigned int depth);
+extern void profile_detach(struct profile *prof);
+
+extern int profile_sample(struct profile *prof);
+extern int profile_run(struct profile *prof, unsigned int hz,
+                unsigned int duration_ms, volatile int *stop);
+
+extern size_t profile_report(const struct profile *prof,
+                struct profile_report *out, size_t max);
+
+#endif /* H_PROFILE */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
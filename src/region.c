@@ -202,7 +202,7 @@ static int
 regex_match(struct region *region, void *data)
 {
     const regex_t *regex = (const regex_t *)data;
-    return regexec(regex, region->pathname, 1, NULL, 0);
+    return regexec(regex, region->pathname, 0, NULL, 0);
 }
 
 static inline struct region_filter_list *
@@ -0,0 +1,405 @@
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "command.h"
+#include "pid_mem.h"
+#include "runner.h"
+#include "target.h"
+
+/**
+ * @file runner.c
+ *
+ * Script files run without a client round trip per line.
+ *
+ * The script is read in large blocks and split into lines in place.
+ * Lines are planned RUNNER_PLAN_LINES at a time before they run, so
+ * a run of "read <addr> <length>" lines over nearby memory becomes a
+ * single pread(2) on a /proc/<pid>/mem fd kept open for the whole
+ * script.  Other lines go through exec_line() as usual.
+ *
+ * Every command writes to one output buffer, written out in
+ * RUNNER_WRITE_SIZE pieces.  Output is the same as running the lines
+ * one by one: a merged read that comes up short runs that line alone.
+ * The script stops at the first line which fails, appending
+ * "! <line> <status>" like exec_script().
+ */
+
+struct runner_line {
+    char *text;
+    size_t no;                  /* from 1 */
+
+    /* Set for a plain read command, which may be merged. */
+    int read;
+    unsigned long addr;
+    unsigned long length;
+};
+
+struct runner {
+    struct command_list *list;
+    struct command_ctx *ctx;
+
+    int out_fd;
+    struct buffer out;
+
+    size_t line_no;
+    int mem_fd;                 /* -1 until the first merged read */
+    unsigned char *span;        /* RUNNER_SPAN_MAX bytes */
+
+    struct runner_line plan[RUNNER_PLAN_LINES];
+    size_t planned;
+};
+
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+    while (size != 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        data += n;
+        size -= (size_t)n;
+    }
+
+    return 0;
+}
+
+static int
+runner_flush(struct runner *runner)
+{
+    int err;
+
+    err = write_all(runner->out_fd, runner->out.data, runner->out.len);
+    buffer_reset(&(runner->out));
+
+    return err;
+}
+
+/* Parse a number the way the read command would; 0 on success. */
+static int
+parse_number(const char **p, unsigned long *value)
+{
+    char *endptr = NULL;
+    const char *s = *p;
+
+    while (isspace((unsigned char)*s))
+        ++s;
+
+    /* strtoul(3) takes a sign; leave those to the command. */
+    if (!isdigit((unsigned char)*s))
+        return -1;
+
+    errno = 0;
+    *value = strtoul(s, &endptr, 0);
+
+    if (errno != 0 || endptr == s
+            || (*endptr != '\0' && !isspace((unsigned char)*endptr)))
+        return -1;
+
+    *p = endptr;
+
+    return 0;
+}
+
+static void
+plan_line(struct runner *runner, char *text)
+{
+    const char *p = text;
+    struct runner_line *line = &(runner->plan[runner->planned++]);
+
+    line->text = text;
+    line->no = runner->line_no;
+    line->read = 0;
+
+    while (isspace((unsigned char)*p))
+        ++p;
+
+    if (strncmp(p, "read", 4) != 0 || !isspace((unsigned char)p[4]))
+        return;
+
+    p += 4;
+
+    if (parse_number(&p, &(line->addr)) != 0
+            || parse_number(&p, &(line->length)) != 0)
+        return;
+
+    while (isspace((unsigned char)*p))
+        ++p;
+
+    if (*p != '\0' || line->length == 0 || line->length > RUNNER_SPAN_MAX
+            || line->addr + line->length < line->addr)
+        return;
+
+    line->read = 1;
+}
+
+static int
+run_line(struct runner *runner, const struct runner_line *line)
+{
+    const char *p = line->text;
+
+    while (isspace((unsigned char)*p))
+        ++p;
+
+    if (*p == '#')
+        return 0;
+
+    return exec_line(runner->list, runner->ctx, line->text);
+}
+
+/*
+ * Run plan[first] and the reads after it which fit one span.  Returns
+ * the number of lines run in *ran.
+ */
+static int
+run_reads(struct runner *runner, size_t first, size_t *ran)
+{
+    int err;
+    size_t i;
+    size_t last;
+    ssize_t got;
+    unsigned long start = runner->plan[first].addr;
+    unsigned long end = start + runner->plan[first].length;
+
+    for (last = first + 1; last < runner->planned; ++last) {
+        const struct runner_line *next = &(runner->plan[last]);
+        unsigned long lo = (next->addr < start) ? next->addr : start;
+        unsigned long hi = (next->addr + next->length > end)
+                         ? next->addr + next->length : end;
+
+        if (!next->read)
+            break;
+
+        if (next->addr > end + RUNNER_SPAN_GAP
+                || next->addr + next->length + RUNNER_SPAN_GAP < start
+                || hi - lo > RUNNER_SPAN_MAX)
+            break;
+
+        start = lo;
+        end = hi;
+    }
+
+    *ran = last - first;
+
+    if (runner->mem_fd < 0) {
+        runner->mem_fd = open_pid_mem(runner->ctx->target->pid,
+                            PID_MEM_FLAGS_READ);
+    }
+
+    got = -1;
+
+    if (runner->mem_fd >= 0) {
+        got = read_pid_mem_fd(runner->mem_fd, runner->span, end - start,
+                    (off_t)start);
+    }
+
+    for (i = first; i < last; ++i) {
+        const struct runner_line *line = &(runner->plan[i]);
+        size_t offset = line->addr - start;
+
+        if (got < 0 || offset + line->length > (size_t)got) {
+            /* Let the command report it, short read and all. */
+            err = run_line(runner, line);
+        }
+        else if (buffer_put_hex(&(runner->out), runner->span + offset,
+                        line->length) != 0
+                    || buffer_append(&(runner->out), "\n", 1) != 0) {
+            err = -ENOMEM;
+        }
+        else {
+            err = 0;
+        }
+
+        if (err != 0) {
+            (void)buffer_printf(&(runner->out), "! %zu %d\n", line->no, err);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int
+run_plan(struct runner *runner)
+{
+    int err = 0;
+    size_t i;
+    size_t ran;
+
+    for (i = 0; i < runner->planned; i += ran) {
+        const struct runner_line *line = &(runner->plan[i]);
+
+        ran = 1;
+
+        if (line->read && runner->ctx->target != NULL) {
+            if ((err = run_reads(runner, i, &ran)) != 0)
+                break;
+
+            continue;
+        }
+
+        if ((err = run_line(runner, line)) != 0) {
+            (void)buffer_printf(&(runner->out), "! %zu %d\n", line->no, err);
+            break;
+        }
+    }
+
+    runner->planned = 0;
+
+    if (err == 0 && runner->out.len >= RUNNER_WRITE_SIZE)
+        err = runner_flush(runner);
+
+    return err;
+}
+
+/* Plan the whole lines in in, running full plans; returns the bytes
+ * used. */
+static int
+plan_lines(struct runner *runner, struct buffer *in, size_t *used)
+{
+    int err;
+    char *nl;
+    char *p = in->data;
+    char *end = in->data + in->len;
+
+    while ((nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        *nl = '\0';
+
+        if (nl != p && nl[-1] == '\r')
+            nl[-1] = '\0';
+
+        runner->line_no++;
+        plan_line(runner, p);
+        p = nl + 1;
+
+        if (runner->planned == RUNNER_PLAN_LINES
+                && (err = run_plan(runner)) != 0)
+            return err;
+    }
+
+    *used = (size_t)(p - in->data);
+
+    /* Lines point into in; run them before it moves. */
+    return run_plan(runner);
+}
+
+/**
+ * Run a script of command lines read from a file descriptor until its
+ * end, writing the output to another.  Lines are the same as those
+ * exec_line() takes; empty lines and lines starting with # are
+ * skipped.
+ *
+ * @param list - command list
+ * @param ctx - context every command runs with; ctx->out is not used
+ * @param[in] in_fd - script
+ * @param[in] out_fd - where output goes
+ *
+ * @return 0 on success
+ * @return negative errno value of the line which failed, or of reading
+ *         or writing
+ */
+int
+runner_run(struct command_list *list, struct command_ctx *ctx,
+    int in_fd, int out_fd)
+{
+    int err = 0;
+    int ferr;
+    size_t used;
+    struct buffer in;
+    struct runner *runner;
+    struct buffer *out = ctx->out;
+
+    runner = malloc(sizeof(*runner));
+
+    if (runner == NULL)
+        return -ENOMEM;
+
+    runner->list = list;
+    runner->ctx = ctx;
+    runner->out_fd = out_fd;
+    runner->line_no = 0;
+    runner->mem_fd = -1;
+    runner->planned = 0;
+    runner->span = malloc(RUNNER_SPAN_MAX);
+    buffer_init(&(runner->out));
+    buffer_init(&in);
+
+    if (runner->span == NULL) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    ctx->out = &(runner->out);
+
+    for (;;) {
+        ssize_t n;
+
+        if (buffer_reserve(&in, RUNNER_READ_SIZE) != 0) {
+            err = -ENOMEM;
+            break;
+        }
+
+        n = read(in_fd, in.data + in.len, RUNNER_READ_SIZE);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            err = -errno;
+            break;
+        }
+
+        if (n == 0) {
+            /* A last line with no newline. */
+            if (in.len != 0 && buffer_append(&in, "\n", 1) != 0)
+                err = -ENOMEM;
+            else if (in.len != 0)
+                err = plan_lines(runner, &in, &used);
+
+            break;
+        }
+
+        in.len += (size_t)n;
+
+        if ((err = plan_lines(runner, &in, &used)) != 0)
+            break;
+
+        buffer_consume(&in, used);
+    }
+
+    ctx->out = out;
+
+    /* The output up to a failure is still wanted. */
+    ferr = runner_flush(runner);
+
+    if (err == 0)
+        err = ferr;
+
+out:
+
+    if (runner->mem_fd >= 0)
+        (void)close_pid_mem(runner->mem_fd);
+
+    buffer_fini(&in);
+    buffer_fini(&(runner->out));
+    free(runner->span);
+    free(runner);
+
+    return err;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,26 @@
+#ifndef H_RUNNER
+#define H_RUNNER
+
+#include "command.h"
+
+/* Bytes read from the script at a time. */
+#define RUNNER_READ_SIZE   (64 * 1024)
+
+/* Output is written once this much is buffered. */
+#define RUNNER_WRITE_SIZE  (256 * 1024)
+
+/* Lines planned together. */
+#define RUNNER_PLAN_LINES  (256)
+
+/* Consecutive reads are merged into one pread(2) while the gap to the
+ * next is at most RUNNER_SPAN_GAP and the whole span at most
+ * RUNNER_SPAN_MAX bytes. */
+#define RUNNER_SPAN_GAP    (4096)
+#define RUNNER_SPAN_MAX    (64 * 1024)
+
+extern int runner_run(struct command_list *list, struct command_ctx *ctx,
+                int in_fd, int out_fd);
+
+#endif /* H_RUNNER */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -1,26 +1,118 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "shared/list.h"
+#include "shared/util.h"
+
+#include "buffer.h"
+#include "command.h"
+#include "job.h"
+#include "mpsc.h"
+#include "server.h"
+#include "stream.h"
+#include "target.h"
+#include "watch.h"
+#include "wire.h"
+#include "worker.h"
+
+/**
+ * @file server.c
+ *
+ * Daemon serving any number of clients over a unix socket.
+ *
+ * One thread owns every socket: an edge-triggered epoll loop accepts
+ * connections, reads whatever is available into the connection's input
+ * buffer, cuts complete frames out of it (see wire.h) and writes
+ * replies from the output buffer.  Sockets are non-blocking; nothing on
+ * this thread waits on a client or a command.
+ *
+ * Every target has a worker thread of its own, started with the first
+ * request naming it.  A command frame for a target is queued to that
+ * worker, so a long search on one process never holds up commands to
+ * another.  Commands naming no target only touch the daemon itself and
+ * are run right away on this thread.
+ *
+ * Workers hand finished requests back on a lock-free queue and bump
+ * the eventfd, once per batch; the loop then turns them into reply
+ * frames.  A reply for a connection which has gone away is dropped.
+ * No lock is taken on either path.
+ *
+ * Commands sent as jobs (WIRE_FLAG_JOB) are answered with a job id
+ * before they run; see job.c.  Jobs with WIRE_FLAG_EVENTS get progress
+ * events every SERVER_EVENT_MS while they run.
+ *
+ * Streamed requests (WIRE_FLAG_STREAM) get their matches as pages
+ * encoded on the worker; see stream.c.  A page is queued on the
+ * connection as a segment ahead of anything written after it, and
+ * sent from where the worker wrote it with sendmsg(2).
+ *
+ * A batch (WIRE_FLAG_BATCH) is a script run whole by the worker, so a
+ * loop of reads and writes costs one frame each way; see
+ * exec_script().
+ *
+ * A reply carrying a file descriptor (see export.c) is queued the same
+ * way; the fd goes out as SCM_RIGHTS on the sendmsg(2) starting it.
+ *
+ * While a target has subscribers (WIRE_SUBSCRIBE) its worker polls
+ * the watches every SERVER_WATCH_MS.  Changes go into the target's
+ * ring and each subscriber is sent what it has not seen yet; see
+ * watch.c.
+ */
+
+/* Epoll events taken per wait. */
+#define SERVER_EVENTS  (64)
+
+/* Segments sent per sendmsg(2). */
+#define SERVER_IOV     (64)
+
+struct request {
+    struct work work;
+
+    struct server *srv;
+
+    /* Connection the reply goes to. */
+    int fd;
+    uint64_t conn_id;
+
+    struct wire_header hdr;
+    struct target *target;
+    struct stream *stream;
+
+    int status;
+    struct buffer out;
+    int pass_fd;
+
+    char line[1];
+};
 
-#define SOCK_PATH_HEAD  "/tmp/.scnm_"
 
 static char *
 make_sock_path(pid_t pid)
 {
     char *path;
-    const size_t len = sizeof(SOCK_PATH_HEAD) + 8;
+    const size_t len = sizeof(SERVER_SOCK_PATH_HEAD) + 8;
 
     path = malloc(len);
 
     if (path == NULL)
         return NULL;
 
-    (void)snprintf(path, len, SOCK_PATH_HEAD "%08x", (unsigned int)pid);
+    (void)snprintf(path, len, SERVER_SOCK_PATH_HEAD "%08x",
+                (unsigned int)pid);
 
     return path;
 }
@@ -34,149 +126,1510 @@ init_unix_sockaddr(struct sockaddr_un *addr, const char *socket_path)
     strncpy(addr->sun_path, socket_path, sizeof(addr->sun_path) - 1);
 }
 
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-void
-server_loop(pid_t pid)
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+static void
+wake(struct server *srv)
 {
-    int err;
-    int fd_max;
+    uint64_t one = 1;
 
-    fd_set master;
+    /* Only fails if the counter would overflow; it is awake then. */
+    (void)!write(srv->wakefd, &one, sizeof(one));
+}
 
-    int fd;
-    int listener;
+/* Run fn on the server thread.  Called by the workers. */
+static void
+server_post(struct server *srv, struct work *work, work_fn_t fn)
+{
+    work->fn = fn;
+    mpsc_push(&(srv->done), &(work->node));
 
-    ssize_t nbytes;
-    char buf[512];
+    /* The first post since the last drain wakes the loop. */
+    if (__atomic_exchange_n(&(srv->wake_pending), 1, __ATOMIC_ACQ_REL) == 0)
+        wake(srv);
+}
 
-    struct sockaddr_un addr;
 
-    const char *socket_path = make_socket_path(pid);
+/* Connections */
 
-    if (socket_path == NULL)
-        return;
+static struct server_conn *
+conn_find(struct server *srv, int fd, uint64_t id)
+{
+    struct server_conn *conn;
 
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
+    if (fd < 0 || (size_t)fd >= srv->conns_alloc)
+        return NULL;
 
-    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    conn = srv->conns[fd];
 
-    if (listener < 0) {
-        free(socket_path);
-        return;
+    if (conn == NULL || conn->id != id)
+        return NULL;
+
+    return conn;
+}
+
+static int
+conn_add(struct server *srv, int fd)
+{
+    struct epoll_event ev;
+    struct server_conn *conn;
+
+    if ((size_t)fd >= srv->conns_alloc) {
+        size_t alloc;
+        struct server_conn **tmp;
+
+        alloc = (srv->conns_alloc == 0) ? 64 : srv->conns_alloc;
+
+        while (alloc <= (size_t)fd)
+            alloc *= 2;
+
+        tmp = realloc(srv->conns, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        memset(tmp + srv->conns_alloc, 0,
+            (alloc - srv->conns_alloc) * sizeof(*tmp));
+
+        srv->conns = tmp;
+        srv->conns_alloc = alloc;
     }
 
-    init_unix_sockaddr(&addr, socket_path);
+    conn = calloc(1, sizeof(*conn));
 
-    /* Always remove stale conenctions first. */
-    unlink(socket_path);
+    if (conn == NULL)
+        return -1;
 
-    free(socket_path);
+    conn->fd = fd;
+    conn->id = srv->next_conn_id++;
+    buffer_init(&(conn->in));
+    buffer_init(&(conn->out));
+    conn->segs = NULL;
+    conn->segs_tail = &(conn->segs);
 
-    err = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
 
-    if (err < 0) {
-        close(listener);
-        return;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        free(conn);
+        return -1;
     }
 
-    err = listen(listener, 10);
+    srv->conns[fd] = conn;
 
-    if (err == -1) {
-        close(listener);
-        return;
+    return 0;
+}
+
+static void
+seg_free(struct server_seg *seg)
+{
+    if (seg->fd >= 0)
+        close(seg->fd);
+
+    free(seg->mem);
+    free(seg);
+}
+
+static void
+conn_close(struct server *srv, struct server_conn *conn)
+{
+    struct list_head *entry;
+
+    (void)epoll_ctl(srv->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+
+    srv->conns[conn->fd] = NULL;
+
+    /* Nobody will grant these more credits. */
+    list_for_each(entry, &(srv->streams)) {
+        struct stream *stream = list_entry(entry, struct stream, node);
+
+        if (stream->fd == conn->fd && stream->conn_id == conn->id)
+            stream_cancel(stream);
     }
 
-    FD_SET(listener, &master);
+    while (conn->segs != NULL) {
+        struct server_seg *seg = conn->segs;
+
+        conn->segs = seg->next;
+        seg_free(seg);
+    }
 
-    fd_max = listener;
+    buffer_fini(&(conn->in));
+    buffer_fini(&(conn->out));
+    free(conn);
+}
 
-    for (;;) {
-        int i;
-        fd_set read_fds = master;
+/*
+ * Queue len bytes at data to go out after everything written so far.
+ * mem is freed and fd, unless -1, closed once they are sent.
+ *
+ * Returns -1 if out of memory.
+ */
+static int
+conn_queue(struct server_conn *conn, const char *data, size_t len,
+    void *mem, int fd)
+{
+    struct server_seg *seg;
+    struct server_seg *text = NULL;
+
+    seg = malloc(sizeof(*seg));
+
+    if (seg == NULL)
+        return -1;
+
+    /* Text already written goes first; hand over its memory. */
+    if (conn->out.len != 0) {
+        text = malloc(sizeof(*text));
+
+        if (text == NULL) {
+            free(seg);
+            return -1;
+        }
+
+        text->data = conn->out.data;
+        text->len = conn->out.len;
+        text->mem = conn->out.data;
+        text->fd = -1;
+        text->next = seg;
+
+        buffer_init(&(conn->out));
 
-        err = select(fd_max + 1, &read_fds, NULL, NULL, NULL);
+        *(conn->segs_tail) = text;
+    }
+    else {
+        *(conn->segs_tail) = seg;
+    }
+
+    seg->data = data;
+    seg->len = len;
+    seg->mem = mem;
+    seg->fd = fd;
+    seg->next = NULL;
+
+    conn->segs_tail = &(seg->next);
+
+    return 0;
+}
+
+/* Drop the first sent bytes of the connection's output. */
+static void
+conn_sent(struct server_conn *conn, size_t sent)
+{
+    while (sent != 0 && conn->segs != NULL) {
+        struct server_seg *seg = conn->segs;
 
-        if (err == -1) {
+        if (sent < seg->len) {
+            seg->data += sent;
+            seg->len -= sent;
             return;
         }
 
-        for (i = 0; i <= fd_max; ++i) {
-            int j;
+        sent -= seg->len;
+        conn->segs = seg->next;
 
-            if (!FD_ISSET(i, &read_fds))
-                continue;
+        seg_free(seg);
+    }
 
-            /* New connection */
-            if (i == listener) {
-                fd = accept(listener, NULL, NULL);
+    if (conn->segs == NULL)
+        conn->segs_tail = &(conn->segs);
+
+    buffer_consume(&(conn->out), sent);
+}
 
-                if (fd == -1) {
-                    /* accept failure */
-                    continue;
-                }
+/*
+ * Write out as much of the queued output as the socket takes.
+ *
+ * Returns -1 if the connection is broken.
+ */
+static int
+conn_flush(struct server_conn *conn)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
 
-                FD_SET(fd, &master);
+    for (;;) {
+        size_t n = 0;
+        ssize_t sent;
+        struct msghdr msg;
+        struct iovec iov[SERVER_IOV];
+        struct server_seg *seg;
+        struct server_seg *first = conn->segs;
 
-                if (fd > fd_max)
-                    fd_max = fd;
+        for (seg = first; seg != NULL && n < SERVER_IOV; seg = seg->next) {
+            /* An fd must start a message of its own. */
+            if (seg->fd >= 0 && seg != first)
+                break;
 
-                continue;
-            }
+            iov[n].iov_base = (void *)seg->data;
+            iov[n].iov_len = seg->len;
+            n++;
+        }
 
-            /* Old connection */
-            nbytes = read(i, buf, sizeof(buf));
+        if (seg == NULL && n < SERVER_IOV && conn->out.len != 0) {
+            iov[n].iov_base = conn->out.data;
+            iov[n].iov_len = conn->out.len;
+            n++;
+        }
 
-            if (nbytes <= 0) {
-                if (nbytes == 0)
-                    ; /* closed */
-                close(i);
-                FD_CLR(i, &master);
-                continue;
-            }
+        if (n == 0)
+            return 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        if (first != NULL && first->fd >= 0) {
+            struct cmsghdr *cmsg;
+
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &(first->fd), sizeof(int));
+        }
 
-            /* send back... */
-            err = write(i, buf, nbytes);
+        sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
 
-            if (err == -1)
+        if (sent < 0) {
+            if (errno == EINTR)
                 continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            return -1;
+        }
+
+        /* The client has its own copy now. */
+        if (first != NULL && first->fd >= 0) {
+            close(first->fd);
+            first->fd = -1;
         }
+
+        conn_sent(conn, (size_t)sent);
     }
 }
 
-void
-client(pid_t pid)
+
+/* Targets */
+
+static void
+target_exited(struct work *work)
 {
-    int err;
-    int sock;
+    struct list_head *next;
+    struct list_head *entry;
+    struct target *target = work_entry(work, struct target, exit);
 
-    struct sockaddr_un addr;
+    /* Nothing else is queued behind the exit; the thread is done. */
+    worker_join(&(target->worker));
+
+    list_for_each_safe(entry, next, &(target->subscribers)) {
+        list_del(entry);
+        free(list_entry(entry, struct server_sub, node));
+        target->server->subscribed--;
+    }
 
-    const char *socket_path = make_socket_path(pid);
+    list_del(&(target->node));
+    target_free(target);
+}
 
-    if (socket_path == NULL)
-        return;
+static void
+target_exit_run(struct work *work)
+{
+    struct target *target = work_entry(work, struct target, exit);
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    server_post(target->server, work, target_exited);
+}
 
-    if (sock == -1) {
-        free(socket_path);
+static void
+target_stop(struct target *target)
+{
+    if (target->stopping)
         return;
+
+    target->stopping = 1;
+    worker_submit_last(&(target->worker), &(target->exit), target_exit_run);
+}
+
+static struct target *
+target_get(struct server *srv, pid_t pid)
+{
+    struct target *target;
+    struct list_head *entry;
+
+    list_for_each(entry, &(srv->targets)) {
+        target = list_entry(entry, struct target, node);
+
+        if (target->pid == pid && !target->stopping)
+            return target;
     }
 
-    init_unix_sockaddr(&addr, socket_path);
-    free(socket_path);
+    target = target_new(pid);
+
+    if (target == NULL)
+        return NULL;
+
+    if (worker_start(&(target->worker)) != 0) {
+        int oerrno = errno;
+        target_free(target);
+        errno = oerrno;
+        return NULL;
+    }
+
+    target->server = srv;
+    list_add_tail(&(target->node), &(srv->targets));
+
+    return target;
+}
 
-    err = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
 
-    if (err == -1) {
-        close(sock);
+/* Streams */
+
+/* Runs on the server thread. */
+static void
+stream_page_done(struct work *work)
+{
+    struct server_conn *conn;
+    struct stream_page *page = work_entry(work, struct stream_page, work);
+    struct stream *stream = page->stream;
+    struct server *srv = stream->owner;
+
+    conn = conn_find(srv, stream->fd, stream->conn_id);
+
+    if (conn == NULL) {
+        free(page);
         return;
     }
 
-    /* write loop or something. */
+    if (conn_queue(conn, page->data, page->len, page, -1) != 0) {
+        free(page);
+        conn_close(srv, conn);
+        return;
+    }
+
+    if (conn_flush(conn) != 0)
+        conn_close(srv, conn);
+}
+
+/* Runs on the target's worker. */
+static void
+stream_page_post(struct stream *stream, struct stream_page *page)
+{
+    server_post(stream->owner, &(page->work), stream_page_done);
+}
+
+static struct stream *
+stream_new(struct server *srv, struct server_conn *conn,
+    const struct wire_header *hdr)
+{
+    struct stream *stream;
+
+    stream = malloc(sizeof(*stream));
+
+    if (stream == NULL)
+        return NULL;
+
+    if (stream_init(stream, hdr->id, hdr->target,
+                STREAM_DEFAULT_CREDITS) != 0) {
+        int oerrno = errno;
+        free(stream);
+        errno = oerrno;
+        return NULL;
+    }
+
+    stream->fd = conn->fd;
+    stream->conn_id = conn->id;
+    stream->post = stream_page_post;
+    stream->owner = srv;
+
+    list_add_tail(&(stream->node), &(srv->streams));
+
+    return stream;
+}
+
+static void
+stream_free(struct stream *stream)
+{
+    list_del(&(stream->node));
+    stream_fini(stream);
+    free(stream);
+}
+
+/* A WIRE_CREDIT frame.  Credits for a stream which has ended are
+ * dropped. */
+static int
+stream_credit(struct server *srv, struct server_conn *conn,
+    const struct wire_header *hdr, const char *payload)
+{
+    uint32_t credits;
+    struct list_head *entry;
+
+    if (hdr->length != sizeof(credits))
+        return -1;
+
+    memcpy(&credits, payload, sizeof(credits));
+
+    list_for_each(entry, &(srv->streams)) {
+        struct stream *stream = list_entry(entry, struct stream, node);
+
+        if (stream->id == hdr->id && stream->fd == conn->fd
+                && stream->conn_id == conn->id) {
+            stream_grant(stream, credits);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Requests */
+
+static void
+request_free(struct request *req)
+{
+    if (req->stream != NULL)
+        stream_free(req->stream);
+
+    if (req->pass_fd >= 0)
+        close(req->pass_fd);
+
+    buffer_fini(&(req->out));
+    free(req);
+}
+
+static void request_done(struct work *work);
+
+static void
+request_run(struct work *work)
+{
+    struct command_ctx ctx;
+    struct request *req = work_entry(work, struct request, work);
+
+    ctx.out = &(req->out);
+    ctx.arena = (req->target != NULL)
+        ? &(req->target->arena) : &(req->srv->arena);
+    ctx.target = req->target;
+    ctx.jobs = (req->target == NULL) ? &(req->srv->jobs) : NULL;
+    ctx.stream = req->stream;
+    ctx.pass_fd = -1;
+
+    if (req->hdr.flags & WIRE_FLAG_BATCH)
+        req->status = exec_script(req->srv->commands, &ctx, req->line);
+    else
+        req->status = exec_line(req->srv->commands, &ctx, req->line);
+    req->pass_fd = ctx.pass_fd;
+
+    /* Every stream ends with a last page, ahead of the reply. */
+    if (req->stream != NULL && stream_end(req->stream) != 0
+            && req->status == 0)
+        req->status = -errno;
+
+    server_post(req->srv, work, request_done);
+}
+
+static struct request *
+request_new(struct server *srv, struct server_conn *conn,
+    const struct wire_header *hdr, const char *payload)
+{
+    struct request *req;
+
+    req = malloc(sizeof(*req) + hdr->length);
+
+    if (req == NULL)
+        return NULL;
+
+    req->srv = srv;
+    req->fd = conn->fd;
+    req->conn_id = conn->id;
+    req->hdr = *hdr;
+    req->target = NULL;
+    req->stream = NULL;
+    req->status = 0;
+    req->pass_fd = -1;
+    buffer_init(&(req->out));
+
+    memcpy(req->line, payload, hdr->length);
+    req->line[hdr->length] = '\0';
+
+    return req;
+}
+
+static int
+request_submit(struct server *srv, struct server_conn *conn,
+    const struct wire_header *hdr, const char *payload)
+{
+    struct request *req;
+
+    req = request_new(srv, conn, hdr, payload);
+
+    if (req == NULL)
+        return -1;
+
+    /* Nothing to wait on; answer in place. */
+    if (hdr->target == 0) {
+        request_run(&(req->work));
+        return 0;
+    }
+
+    req->target = target_get(srv, (pid_t)hdr->target);
+
+    if (req->target != NULL && (hdr->flags & WIRE_FLAG_STREAM))
+        req->stream = stream_new(srv, conn, hdr);
+
+    if (req->target == NULL
+            || ((hdr->flags & WIRE_FLAG_STREAM) && req->stream == NULL)) {
+        int oerrno = errno;
+        request_free(req);
+        errno = oerrno;
+        return -1;
+    }
+
+    worker_submit(&(req->target->worker), &(req->work), request_run);
+
+    return 0;
+}
+
+static int
+reply_append(struct server_conn *conn, const struct wire_header *cmd,
+    int status, const struct buffer *text)
+{
+    struct wire_header hdr;
+    struct wire_reply reply;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.length = (uint32_t)(sizeof(reply) + text->len);
+    hdr.type = WIRE_REPLY;
+    hdr.id = cmd->id;
+    hdr.target = cmd->target;
+
+    reply.status = status;
+
+    if (buffer_reserve(&(conn->out),
+                sizeof(hdr) + sizeof(reply) + text->len) != 0)
+        return -1;
+
+    (void)buffer_append(&(conn->out), &hdr, sizeof(hdr));
+    (void)buffer_append(&(conn->out), &reply, sizeof(reply));
+    (void)buffer_append(&(conn->out), text->data, text->len);
+
+    return 0;
+}
+
+/* A reply passing fd, which is given up even on failure. */
+static int
+reply_queue_fd(struct server_conn *conn, const struct wire_header *cmd,
+    int status, const struct buffer *text, int fd)
+{
+    char *frame;
+    struct wire_header hdr;
+    struct wire_reply reply;
+    size_t len = sizeof(hdr) + sizeof(reply) + text->len;
+
+    frame = malloc(len);
+
+    if (frame == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.length = (uint32_t)(sizeof(reply) + text->len);
+    hdr.type = WIRE_REPLY;
+    hdr.flags = WIRE_REPLY_FD;
+    hdr.id = cmd->id;
+    hdr.target = cmd->target;
+
+    reply.status = status;
+
+    memcpy(frame, &hdr, sizeof(hdr));
+    memcpy(frame + sizeof(hdr), &reply, sizeof(reply));
+    memcpy(frame + sizeof(hdr) + sizeof(reply), text->data, text->len);
+
+    if (conn_queue(conn, frame, len, frame, fd) != 0) {
+        free(frame);
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Turn a finished request into a reply.  Runs on the server thread. */
+static void
+request_done(struct work *work)
+{
+    int err;
+    struct server_conn *conn;
+    struct request *req = work_entry(work, struct request, work);
+    struct server *srv = req->srv;
+
+    /* A detached target takes no more requests. */
+    if (req->target != NULL && req->target->detached)
+        target_stop(req->target);
+
+    conn = conn_find(srv, req->fd, req->conn_id);
+
+    if (conn != NULL) {
+        if (req->pass_fd >= 0) {
+            err = reply_queue_fd(conn, &(req->hdr), req->status,
+                        &(req->out), req->pass_fd);
+            req->pass_fd = -1;
+        }
+        else {
+            err = reply_append(conn, &(req->hdr), req->status, &(req->out));
+        }
+
+        if (err != 0 || conn_flush(conn) != 0)
+            conn_close(srv, conn);
+    }
+
+    request_free(req);
+}
+
+static void
+drain_done(struct server *srv)
+{
+    uint64_t count;
+    struct mpsc_node *node;
+
+    (void)!read(srv->wakefd, &count, sizeof(count));
+
+    /* Posts from here on wake the loop again, so a push still
+     * finishing when the queue looks empty is not lost. */
+    (void)__atomic_exchange_n(&(srv->wake_pending), 0, __ATOMIC_ACQ_REL);
+
+    while ((node = mpsc_pop(&(srv->done))) != NULL) {
+        struct work *work = work_entry(node, struct work, node);
+
+        work->fn(work);
+    }
+}
+
+
+/* Jobs */
+
+/* result is NULL for progress events; the worker may be writing it. */
+static int
+event_append(struct server_conn *conn, const struct job *job,
+    const struct buffer *result)
+{
+    struct wire_header hdr;
+    struct wire_event ev;
+    size_t text = (result != NULL) ? result->len : 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.length = (uint32_t)(sizeof(ev) + text);
+    hdr.type = WIRE_EVENT;
+    hdr.id = job->request_id;
+    hdr.target = job->pid;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.job = job->id;
+    ev.state = (uint16_t)job_state(job);
+    ev.flags = (result != NULL) ? WIRE_EVENT_FINAL : 0;
+    ev.status = (result != NULL) ? job->status : 0;
+    ev.done = __atomic_load_n(&(job->progress.done), __ATOMIC_RELAXED);
+    ev.total = __atomic_load_n(&(job->progress.total), __ATOMIC_RELAXED);
+
+    if (buffer_reserve(&(conn->out), sizeof(hdr) + sizeof(ev) + text) != 0)
+        return -1;
+
+    (void)buffer_append(&(conn->out), &hdr, sizeof(hdr));
+    (void)buffer_append(&(conn->out), &ev, sizeof(ev));
+    if (result != NULL)
+        (void)buffer_append(&(conn->out), result->data, text);
+
+    return 0;
+}
+
+/* The job's subscriber, dropping the subscription if it is gone. */
+static struct server_conn *
+job_conn(struct server *srv, struct job *job)
+{
+    struct server_conn *conn;
+
+    if (job->fd < 0)
+        return NULL;
+
+    conn = conn_find(srv, job->fd, job->conn_id);
+
+    if (conn == NULL) {
+        job->fd = -1;
+        srv->watched--;
+    }
+
+    return conn;
+}
+
+static void
+job_event(struct server *srv, struct job *job, const struct buffer *result)
+{
+    struct server_conn *conn = job_conn(srv, job);
+
+    if (conn == NULL)
+        return;
 
-    close(sock);
+    if (event_append(conn, job, result) != 0 || conn_flush(conn) != 0)
+        conn_close(srv, conn);
+}
+
+/* Runs on the server thread. */
+static void
+job_done(struct work *work)
+{
+    struct job *job = work_entry(work, struct job, work);
+    struct server *srv = job->target->server;
+
+    if (job->target->detached)
+        target_stop(job->target);
+
+    job_finish(&(srv->jobs), job);
+
+    if (job_conn(srv, job) == NULL)
+        return;
+
+    /* The final event carries the result; nothing is left to fetch. */
+    job_event(srv, job, &(job->out));
+    srv->watched--;
+    job_free(&(srv->jobs), job);
+}
+
+/* Runs on the target's worker. */
+static void
+job_work(struct work *work)
+{
+    struct job *job = work_entry(work, struct job, work);
+    struct server *srv = job->target->server;
+
+    job_run(job, srv->commands);
+    server_post(srv, work, job_done);
+}
+
+static int
+job_submit(struct server *srv, struct server_conn *conn,
+    const struct wire_header *hdr, const char *payload)
+{
+    struct job *job;
+    struct target *target;
+    struct buffer text;
+
+    if (hdr->target == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    target = target_get(srv, (pid_t)hdr->target);
+
+    if (target == NULL)
+        return -1;
+
+    job = job_new(&(srv->jobs), payload, hdr->length);
+
+    if (job == NULL)
+        return -1;
+
+    buffer_init(&text);
+
+    if (buffer_printf(&text, "job %u\n", job->id) != 0
+            || reply_append(conn, hdr, 0, &text) != 0) {
+        int oerrno = errno;
+        buffer_fini(&text);
+        job_free(&(srv->jobs), job);
+        errno = oerrno;
+        return -1;
+    }
+
+    buffer_fini(&text);
+
+    job->pid = hdr->target;
+    job->target = target;
+    job->script = (hdr->flags & WIRE_FLAG_BATCH) != 0;
+
+    if (hdr->flags & WIRE_FLAG_EVENTS) {
+        job->fd = conn->fd;
+        job->conn_id = conn->id;
+        job->request_id = hdr->id;
+
+        if (srv->watched++ == 0)
+            srv->next_tick = now_ms() + SERVER_EVENT_MS;
+    }
+
+    worker_submit(&(target->worker), &(job->work), job_work);
+
+    return 0;
+}
+
+static void
+jobs_tick(struct server *srv)
+{
+    struct list_head *next;
+    struct list_head *entry;
+    uint64_t now = now_ms();
+
+    if (srv->watched == 0 || now < srv->next_tick)
+        return;
+
+    srv->next_tick = now + SERVER_EVENT_MS;
+
+    list_for_each_safe(entry, next, &(srv->jobs.jobs)) {
+        struct job *job = list_entry(entry, struct job, node);
+
+        if (job->fd >= 0 && job_state(job) < JOB_DONE)
+            job_event(srv, job, NULL);
+    }
+}
+
+
+/* Watches */
+
+static size_t
+conn_pending(const struct server_conn *conn)
+{
+    size_t len = conn->out.len;
+    const struct server_seg *seg;
+
+    for (seg = conn->segs; seg != NULL; seg = seg->next)
+        len += seg->len;
+
+    return len;
+}
+
+static int
+changes_append(struct server_conn *conn, const struct target *target,
+    const struct server_sub *sub, const struct watch_batch *changes,
+    int overrun)
+{
+    size_t i;
+    struct wire_header hdr;
+    struct wire_changes head;
+    size_t len = sizeof(head) + (changes->count * sizeof(struct wire_change));
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.length = (uint32_t)len;
+    hdr.type = WIRE_CHANGES;
+    hdr.id = sub->id;
+    hdr.target = (uint32_t)target->pid;
+
+    memset(&head, 0, sizeof(head));
+    head.seq = target->ring.head;
+    head.count = (uint32_t)changes->count;
+    head.flags = overrun ? WIRE_CHANGES_OVERRUN : 0;
+
+    if (buffer_reserve(&(conn->out), sizeof(hdr) + len) != 0)
+        return -1;
+
+    (void)buffer_append(&(conn->out), &hdr, sizeof(hdr));
+    (void)buffer_append(&(conn->out), &head, sizeof(head));
+
+    for (i = 0; i < changes->count; ++i) {
+        struct wire_change rec;
+        const struct watch_change *change = &(changes->changes[i]);
+
+        rec.addr = change->addr;
+        rec.value = change->value;
+        rec.watch = change->id;
+        rec.size = change->size;
+
+        (void)buffer_append(&(conn->out), &rec, sizeof(rec));
+    }
+
+    return 0;
+}
+
+static void
+sub_free(struct server *srv, struct server_sub *sub)
+{
+    list_del(&(sub->node));
+    free(sub);
+    srv->subscribed--;
+}
+
+/*
+ * Send a subscriber the changes after its cursor, unless it is rate
+ * limited or has not read what it was sent.  Either way they wait, and
+ * go out conflated with whatever changes after them.
+ */
+static void
+sub_deliver(struct server *srv, struct target *target,
+    struct server_sub *sub, uint64_t now)
+{
+    int overrun;
+    struct server_conn *conn;
+
+    conn = conn_find(srv, sub->fd, sub->conn_id);
+
+    if (conn == NULL) {
+        sub_free(srv, sub);
+        return;
+    }
+
+    if (sub->cursor >= target->ring.head || now < sub->next_ms)
+        return;
+
+    if (conn_pending(conn) > SERVER_WATCH_BACKLOG)
+        return;
+
+    srv->changes.count = 0;
+
+    if (watch_ring_collect(&(target->ring), sub->cursor,
+                &(srv->changes), &overrun) != 0)
+        return;
+
+    if (changes_append(conn, target, sub, &(srv->changes), overrun) != 0
+            || conn_flush(conn) != 0) {
+        conn_close(srv, conn);
+        sub_free(srv, sub);
+        return;
+    }
+
+    sub->cursor = target->ring.head;
+    sub->next_ms = now + sub->interval_ms;
+}
+
+static void
+target_deliver(struct server *srv, struct target *target, uint64_t now)
+{
+    struct list_head *next;
+    struct list_head *entry;
+
+    list_for_each_safe(entry, next, &(target->subscribers))
+        sub_deliver(srv, target, list_entry(entry, struct server_sub, node),
+            now);
+}
+
+/* Runs on the server thread. */
+static void
+watch_poll_done(struct work *work)
+{
+    struct target *target = work_entry(work, struct target, poll);
+    struct server *srv = target->server;
+
+    target->polling = 0;
+
+    /* Out of memory drops the batch; the values are read again. */
+    (void)watch_ring_push(&(target->ring), target->batch.changes,
+                target->batch.count);
+    target->batch.count = 0;
+
+    target_deliver(srv, target, now_ms());
+}
+
+/* Runs on the target's worker. */
+static void
+watch_poll_run(struct work *work)
+{
+    struct target *target = work_entry(work, struct target, poll);
+
+    (void)watch_poll(&(target->watches), target->pid, &(target->batch));
+
+    server_post(target->server, work, watch_poll_done);
+}
+
+/* A WIRE_SUBSCRIBE frame. */
+static int
+watch_subscribe(struct server *srv, struct server_conn *conn,
+    const struct wire_header *hdr, const char *payload)
+{
+    struct target *target;
+    struct server_sub *sub = NULL;
+    struct wire_subscribe req;
+    struct list_head *entry;
+
+    if (hdr->length != sizeof(req) || hdr->target == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(&req, payload, sizeof(req));
+
+    target = target_get(srv, (pid_t)hdr->target);
+
+    if (target == NULL)
+        return -1;
+
+    list_for_each(entry, &(target->subscribers)) {
+        struct server_sub *tmp = list_entry(entry, struct server_sub, node);
+
+        if (tmp->fd == conn->fd && tmp->conn_id == conn->id) {
+            sub = tmp;
+            break;
+        }
+    }
+
+    if (req.flags & WIRE_SUBSCRIBE_OFF) {
+        if (sub == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        sub_free(srv, sub);
+        return 0;
+    }
+
+    if (sub == NULL) {
+        sub = calloc(1, sizeof(*sub));
+
+        if (sub == NULL)
+            return -1;
+
+        sub->fd = conn->fd;
+        sub->conn_id = conn->id;
+
+        /* Start with what the ring still holds. */
+        if (target->ring.head > WATCH_RING_SIZE)
+            sub->cursor = target->ring.head - WATCH_RING_SIZE;
+
+        list_add_tail(&(sub->node), &(target->subscribers));
+        srv->subscribed++;
+    }
+
+    sub->id = hdr->id;
+    sub->interval_ms = req.interval_ms;
+    sub->next_ms = 0;
+
+    return 0;
+}
+
+static void
+watch_tick(struct server *srv)
+{
+    struct list_head *entry;
+    uint64_t now;
+
+    if (srv->subscribed == 0)
+        return;
+
+    now = now_ms();
+
+    list_for_each(entry, &(srv->targets)) {
+        struct target *target = list_entry(entry, struct target, node);
+
+        if (list_is_empty(&(target->subscribers)) || target->stopping)
+            continue;
+
+        /* Subscribers held back by their rate limit. */
+        target_deliver(srv, target, now);
+
+        if (target->polling || now < target->next_poll)
+            continue;
+
+        target->polling = 1;
+        target->next_poll = now + SERVER_WATCH_MS;
+        worker_submit(&(target->worker), &(target->poll), watch_poll_run);
+    }
+}
+
+
+/* Socket events */
+
+/*
+ * Cut complete frames out of the input buffer and submit them.
+ *
+ * Returns -1 if the client broke the protocol.
+ */
+static int
+conn_parse(struct server *srv, struct server_conn *conn)
+{
+    int err;
+    size_t offset = 0;
+    int ret = 0;
+
+    while (conn->in.len - offset >= sizeof(struct wire_header)) {
+        struct wire_header hdr;
+
+        memcpy(&hdr, conn->in.data + offset, sizeof(hdr));
+
+        if ((hdr.type != WIRE_COMMAND && hdr.type != WIRE_CREDIT
+                    && hdr.type != WIRE_SUBSCRIBE)
+                || hdr.length > WIRE_MAX_PAYLOAD) {
+            ret = -1;
+            break;
+        }
+
+        if (conn->in.len - offset - sizeof(hdr) < hdr.length)
+            break;
+
+        offset += sizeof(hdr);
+
+        if (hdr.type == WIRE_CREDIT) {
+            if (stream_credit(srv, conn, &hdr,
+                        conn->in.data + offset) != 0) {
+                ret = -1;
+                break;
+            }
+
+            offset += hdr.length;
+            continue;
+        }
+
+        if (hdr.type == WIRE_SUBSCRIBE) {
+            struct buffer text;
+
+            buffer_init(&text);
+
+            err = watch_subscribe(srv, conn, &hdr, conn->in.data + offset);
+
+            if (reply_append(conn, &hdr, (err != 0) ? -errno : 0,
+                        &text) != 0) {
+                ret = -1;
+                break;
+            }
+
+            offset += hdr.length;
+            continue;
+        }
+
+        if (hdr.flags & WIRE_FLAG_JOB)
+            err = job_submit(srv, conn, &hdr, conn->in.data + offset);
+        else
+            err = request_submit(srv, conn, &hdr, conn->in.data + offset);
+
+        if (err != 0) {
+            struct buffer text;
+
+            /* Could not queue it; answer right away. */
+            buffer_init(&text);
+
+            if (reply_append(conn, &hdr, -errno, &text) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+
+        offset += hdr.length;
+    }
+
+    buffer_consume(&(conn->in), offset);
+
+    return ret;
+}
+
+/*
+ * Read until the socket is drained, as required with EPOLLET.
+ *
+ * Returns -1 if the connection should be closed.
+ */
+static int
+conn_read(struct server *srv, struct server_conn *conn)
+{
+    int eof = 0;
+
+    for (;;) {
+        ssize_t n;
+
+        if (buffer_reserve(&(conn->in), SERVER_READ_SIZE) != 0)
+            return -1;
+
+        n = read(conn->fd, conn->in.data + conn->in.len,
+                conn->in.alloc - conn->in.len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            return -1;
+        }
+
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+
+        conn->in.len += (size_t)n;
+    }
+
+    /* Frames are still run if the client only shut down writing. */
+    if (conn_parse(srv, conn) != 0)
+        return -1;
+
+    if (conn_flush(conn) != 0)
+        return -1;
+
+    return eof ? -1 : 0;
+}
+
+static void
+accept_all(struct server *srv)
+{
+    for (;;) {
+        int fd;
+
+        fd = accept4(srv->listener, NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* EAGAIN, or out of fds; try again on the next event. */
+            break;
+        }
+
+        if (conn_add(srv, fd) != 0)
+            close(fd);
+    }
+}
+
+static void
+conn_event(struct server *srv, int fd, uint32_t events)
+{
+    struct server_conn *conn;
+
+    if (fd < 0 || (size_t)fd >= srv->conns_alloc)
+        return;
+
+    conn = srv->conns[fd];
+
+    if (conn == NULL)
+        return;
+
+    if (events & EPOLLERR) {
+        conn_close(srv, conn);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        if (conn_read(srv, conn) != 0) {
+            conn_close(srv, conn);
+            return;
+        }
+    }
+    else if (events & EPOLLOUT) {
+        if (conn_flush(conn) != 0)
+            conn_close(srv, conn);
+    }
+}
+
+
+/**
+ * Create the daemon socket.
+ *
+ * @param srv - server to initialize
+ * @param[in] path - socket path, NULL for SERVER_SOCK_PATH_HEAD
+ *                   followed by our pid in hex
+ * @param[in] commands - commands clients may run
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+server_init(struct server *srv, const char *path,
+    struct command_list *commands)
+{
+    int oerrno;
+    struct epoll_event ev;
+    struct sockaddr_un addr;
+
+    memset(srv, 0, sizeof(*srv));
+
+    srv->epfd = -1;
+    srv->listener = -1;
+    srv->wakefd = -1;
+    srv->commands = commands;
+    srv->next_conn_id = 1;
+
+    list_head_init(&(srv->targets));
+    list_head_init(&(srv->streams));
+    watch_batch_init(&(srv->changes));
+    mpsc_init(&(srv->done));
+    job_table_init(&(srv->jobs));
+    command_arena_init(&(srv->arena));
+
+    if (path != NULL)
+        srv->path = strdup(path);
+    else
+        srv->path = make_sock_path(getpid());
+
+    if (srv->path == NULL)
+        goto fail;
+
+    srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    srv->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    srv->listener = socket(AF_UNIX,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (srv->epfd < 0 || srv->wakefd < 0 || srv->listener < 0)
+        goto fail;
+
+    init_unix_sockaddr(&addr, srv->path);
+
+    /* Always remove stale sockets first. */
+    unlink(srv->path);
+
+    if (bind(srv->listener, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        goto fail;
+
+    if (listen(srv->listener, SOMAXCONN) != 0)
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = srv->listener;
+
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->listener, &ev) != 0)
+        goto fail;
+
+    ev.data.fd = srv->wakefd;
+
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->wakefd, &ev) != 0)
+        goto fail;
+
+    return 0;
+
+fail:
+
+    oerrno = errno;
+
+    if (srv->listener >= 0) {
+        close(srv->listener);
+        unlink(srv->path);
+    }
+
+    if (srv->wakefd >= 0)
+        close(srv->wakefd);
+
+    if (srv->epfd >= 0)
+        close(srv->epfd);
+
+    free(srv->path);
+
+    srv->path = NULL;
+    srv->epfd = -1;
+    srv->listener = -1;
+    srv->wakefd = -1;
+
+    errno = oerrno;
+
+    return -1;
+}
+
+/**
+ * Stop the workers, close every connection and remove the socket.
+ *
+ * Requests still queued are run first; their replies are dropped.
+ *
+ * @param srv - server
+ */
+void
+server_fini(struct server *srv)
+{
+    size_t i;
+    struct list_head *entry;
+
+    for (i = 0; i < srv->conns_alloc; ++i) {
+        if (srv->conns[i] != NULL)
+            conn_close(srv, srv->conns[i]);
+    }
+
+    free(srv->conns);
+
+    srv->conns = NULL;
+    srv->conns_alloc = 0;
+
+    list_for_each(entry, &(srv->targets))
+        target_stop(list_entry(entry, struct target, node));
+
+    list_for_each(entry, &(srv->targets))
+        worker_join(&(list_entry(entry, struct target, node)->worker));
+
+    /* Every worker has exited; what they handed back drops the
+     * replies and frees the targets. */
+    drain_done(srv);
+    job_table_fini(&(srv->jobs));
+    watch_batch_fini(&(srv->changes));
+    command_arena_fini(&(srv->arena));
+
+    close(srv->listener);
+    close(srv->wakefd);
+    close(srv->epfd);
+
+    unlink(srv->path);
+    free(srv->path);
+
+    srv->path = NULL;
+}
+
+/**
+ * Serve clients until server_stop() is called.
+ *
+ * @param srv - server
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+server_run(struct server *srv)
+{
+    struct epoll_event events[SERVER_EVENTS];
+
+    while (!srv->stop) {
+        int i;
+        int n;
+        int timeout = -1;
+
+        if (srv->subscribed != 0)
+            timeout = SERVER_WATCH_MS;
+        else if (srv->watched != 0)
+            timeout = SERVER_EVENT_MS;
+
+        n = epoll_wait(srv->epfd, events, SERVER_EVENTS, timeout);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        for (i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == srv->listener)
+                accept_all(srv);
+            else if (fd == srv->wakefd)
+                drain_done(srv);
+            else
+                conn_event(srv, fd, events[i].events);
+        }
+
+        jobs_tick(srv);
+        watch_tick(srv);
+    }
+
+    return 0;
+}
+
+/**
+ * Make server_run() return.  Safe to call from a signal handler or
+ * another thread.
+ *
+ * @param srv - server
+ */
+void
+server_stop(struct server *srv)
+{
+    srv->stop = 1;
+    wake(srv);
 }
 
 /* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,116 @@
+#ifndef H_SERVER
+#define H_SERVER
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/list.h"
+
+#include "buffer.h"
+#include "command.h"
+#include "job.h"
+#include "mpsc.h"
+#include "watch.h"
+
+#define SERVER_SOCK_PATH_HEAD  "/tmp/.scnm_"
+
+/* Bytes asked of each read(2) on a connection. */
+#define SERVER_READ_SIZE        (64 * 1024)
+
+/* Interval of job progress events. */
+#define SERVER_EVENT_MS         (250)
+
+/* Interval of watch polls while a target has subscribers. */
+#define SERVER_WATCH_MS         (50)
+
+/* Changes wait while a subscriber has this much output unsent. */
+#define SERVER_WATCH_BACKLOG    (256 * 1024)
+
+struct command_list;
+
+/* Output queued ahead of server_conn.out, sent without copying. */
+struct server_seg {
+    struct server_seg *next;
+    const char *data;
+    size_t len;
+    void *mem;              /* freed once sent */
+    int fd;                 /* passed with the first byte, or -1 */
+};
+
+/* A connection following a target's watches. */
+struct server_sub {
+    struct list_head node;  /* in target->subscribers */
+
+    int fd;
+    uint64_t conn_id;
+    uint32_t id;            /* of the WIRE_SUBSCRIBE frame */
+
+    uint32_t interval_ms;
+    uint64_t next_ms;       /* rate limit */
+    uint64_t cursor;        /* next seq of target->ring to send */
+};
+
+/* One client connection. */
+struct server_conn {
+    int fd;
+    uint64_t id;            /* fds are reused; ids are not */
+
+    struct buffer in;
+
+    /* Output goes out in this order: segs, then out. */
+    struct server_seg *segs;
+    struct server_seg **segs_tail;
+    struct buffer out;
+};
+
+struct server {
+    int epfd;
+    int listener;
+    int wakefd;             /* eventfd: completions and server_stop() */
+
+    char *path;
+
+    struct command_list *commands;
+    struct command_arena arena;     /* for requests naming no target */
+
+    /* Indexed by fd. */
+    struct server_conn **conns;
+    size_t conns_alloc;
+    uint64_t next_conn_id;
+
+    /* Targets named by requests, each with its worker thread. */
+    struct list_head targets;
+
+    /* Work handed back by the workers, run on the server thread.
+     * wake_pending is set while the eventfd holds an unseen wakeup. */
+    struct mpsc_queue done;
+    int wake_pending;
+
+    /* Streamed requests not yet answered. */
+    struct list_head streams;
+
+    /* Background jobs; watched counts unfinished ones sending events. */
+    struct job_table jobs;
+    size_t watched;
+    uint64_t next_tick;
+
+    /* Watch subscriptions over all targets. */
+    size_t subscribed;
+    struct watch_batch changes;     /* scratch for deliveries */
+
+    volatile sig_atomic_t stop;
+};
+
+extern int server_init(struct server *srv, const char *path,
+                struct command_list *commands);
+extern void server_fini(struct server *srv);
+
+extern int server_run(struct server *srv);
+extern void server_stop(struct server *srv);
+
+#endif /* H_SERVER */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
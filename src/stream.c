@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "match.h"
+#include "stream.h"
+#include "wire.h"
+
+/**
+ * @file stream.c
+ *
+ * Match results sent as binary pages instead of text.
+ *
+ * The worker running a search or list encodes each match straight into
+ * a page laid out as a whole WIRE_STREAM frame, header included.  Full
+ * pages are handed to the server thread, which queues them on the
+ * connection as they are and frees them once sent; nothing is copied
+ * after encoding.
+ *
+ * Addresses are sent as deltas from the previous match in the page, so
+ * a page of nearby matches costs a few bytes per address.  Pages start
+ * over from 0 so each one decodes on its own.
+ */
+
+#define STREAM_HEADERS  (sizeof(struct wire_header) + sizeof(struct wire_stream))
+
+
+/* Returns the bytes written, at most WIRE_RECORD_MAX. */
+static size_t
+record_encode(uint8_t *out, unsigned long prev,
+    const struct match_object *obj)
+{
+    size_t i;
+    size_t len = 0;
+    size_t width;
+    uint8_t type = stream_record_type(obj);
+    uint64_t delta = (uint64_t)obj->addr - (uint64_t)prev;
+    uint64_t zz = (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+
+    out[len++] = type;
+
+    while (zz >= 0x80) {
+        out[len++] = (uint8_t)(zz | 0x80);
+        zz >>= 7;
+    }
+
+    out[len++] = (uint8_t)zz;
+
+    /* Values are kept in host order; the wire is little endian. */
+    width = wire_type_width(type);
+
+    for (i = 0; i < width; ++i)
+        out[len++] = (uint8_t)(obj->v.u64 >> (8 * i));
+
+    return len;
+}
+
+static struct stream_page *
+page_new(void)
+{
+    struct stream_page *page;
+
+    page = malloc(offsetof(struct stream_page, data) + STREAM_PAGE_SIZE);
+
+    if (page == NULL)
+        return NULL;
+
+    page->len = STREAM_HEADERS;
+
+    return page;
+}
+
+/*
+ * Fill in the page's headers and hand it to the server, once there is
+ * a credit for it.
+ */
+static int
+stream_flush(struct stream *stream, uint16_t flags)
+{
+    struct wire_header hdr;
+    struct wire_stream head;
+    struct stream_page *page = stream->page;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.length = (uint32_t)(page->len - sizeof(hdr));
+    hdr.type = WIRE_STREAM;
+    hdr.id = stream->id;
+    hdr.target = stream->target;
+
+    memset(&head, 0, sizeof(head));
+    head.seq = stream->seq;
+    head.count = stream->count;
+    head.flags = flags;
+
+    memcpy(page->data, &hdr, sizeof(hdr));
+    memcpy(page->data + sizeof(hdr), &head, sizeof(head));
+
+    if (__atomic_load_n(&(stream->cancel), __ATOMIC_ACQUIRE)) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    while (sem_wait(&(stream->credits)) != 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    if (__atomic_load_n(&(stream->cancel), __ATOMIC_ACQUIRE)) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    stream->page = NULL;
+    stream->seq++;
+    stream->count = 0;
+    stream->prev = 0;
+
+    page->stream = stream;
+    stream->post(stream, page);
+
+    return 0;
+}
+
+/**
+ * Initialize a stream.  The caller sets post and owner.
+ *
+ * @param stream - stream to initialize
+ * @param[in] id - id of the request, echoed in every page
+ * @param[in] target - pid of the request
+ * @param[in] credits - pages sent before any credit is granted
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+stream_init(struct stream *stream, uint32_t id, uint32_t target,
+    unsigned int credits)
+{
+    memset(stream, 0, sizeof(*stream));
+
+    stream->id = id;
+    stream->target = target;
+    stream->fd = -1;
+
+    return sem_init(&(stream->credits), 0, credits);
+}
+
+/**
+ * Release a stream.  Nothing may be writing to it.
+ *
+ * @param stream - stream
+ */
+void
+stream_fini(struct stream *stream)
+{
+    free(stream->page);
+    stream->page = NULL;
+
+    (void)sem_destroy(&(stream->credits));
+}
+
+/**
+ * Encode matches into the stream, sending pages as they fill.  Blocks
+ * while the stream is out of credits.
+ *
+ * @param stream - stream
+ * @param[in] objs - matches
+ * @param[in] count - number of matches
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno, ECANCELED if
+ *         the stream was cancelled
+ */
+int
+stream_write(struct stream *stream, const struct match_object *objs,
+    size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        struct stream_page *page = stream->page;
+
+        if (page != NULL && STREAM_PAGE_SIZE - page->len < WIRE_RECORD_MAX) {
+            if (stream_flush(stream, 0) != 0)
+                return -1;
+
+            page = NULL;
+        }
+
+        if (page == NULL) {
+            page = page_new();
+
+            if (page == NULL)
+                return -1;
+
+            stream->page = page;
+        }
+
+        page->len += record_encode((uint8_t *)page->data + page->len,
+                        stream->prev, &(objs[i]));
+
+        stream->prev = objs[i].addr;
+        stream->count++;
+    }
+
+    return 0;
+}
+
+/**
+ * Send the last page, flagged WIRE_STREAM_LAST.  It may hold no
+ * records.
+ *
+ * @param stream - stream
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+stream_end(struct stream *stream)
+{
+    if (stream->page == NULL) {
+        stream->page = page_new();
+
+        if (stream->page == NULL)
+            return -1;
+    }
+
+    return stream_flush(stream, WIRE_STREAM_LAST);
+}
+
+/**
+ * Allow the stream to send more pages.  Called by the server thread.
+ *
+ * @param stream - stream
+ * @param[in] credits - pages
+ */
+void
+stream_grant(struct stream *stream, unsigned int credits)
+{
+    if (credits > STREAM_MAX_GRANT)
+        credits = STREAM_MAX_GRANT;
+
+    while (credits-- != 0) {
+        /* EOVERFLOW: the client is far ahead; nothing is lost. */
+        if (sem_post(&(stream->credits)) != 0)
+            break;
+    }
+}
+
+/**
+ * Make the stream fail with ECANCELED at its next page, waking it if
+ * it waits for credits.  Called by the server thread.
+ *
+ * @param stream - stream
+ */
+void
+stream_cancel(struct stream *stream)
+{
+    __atomic_store_n(&(stream->cancel), 1, __ATOMIC_RELEASE);
+    (void)sem_post(&(stream->credits));
+}
+
+/**
+ * match_progress found callback writing the matches to a stream.
+ *
+ * @param stream - struct stream
+ * @param[in] objs - matches
+ * @param[in] count - number of matches
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+stream_found(void *stream, const struct match_object *objs, size_t count)
+{
+    return stream_write((struct stream *)stream, objs, count);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,102 @@
+#ifndef H_STREAM
+#define H_STREAM
+
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/list.h"
+
+#include "match.h"
+#include "wire.h"
+#include "worker.h"
+
+/* Encoded bytes per page, wire headers included. */
+#define STREAM_PAGE_SIZE        (64 * 1024)
+
+/* Pages a stream may send before the client grants more. */
+#define STREAM_DEFAULT_CREDITS  (8)
+
+/* Most credits taken from one grant. */
+#define STREAM_MAX_GRANT        (1024)
+
+struct stream;
+
+/* One WIRE_STREAM frame, ready to send as it is. */
+struct stream_page {
+    struct work work;
+    struct stream *stream;
+    size_t len;
+    char data[1];
+};
+
+typedef void (*stream_post_fn)(struct stream *, struct stream_page *);
+
+/* Binary match results for one request, encoded on the target's worker
+ * and sent by the server thread.
+ *
+ * Every page costs one credit.  The worker blocks when it runs out,
+ * which holds up a search producing the matches, until the client
+ * grants more or the stream is cancelled. */
+struct stream {
+    struct list_head node;      /* server thread only */
+
+    uint32_t id;                /* id of the request */
+    uint32_t target;
+
+    int fd;
+    uint64_t conn_id;
+
+    sem_t credits;
+    int cancel;
+
+    /* Hands a full page to the server thread. */
+    stream_post_fn post;
+    void *owner;
+
+    /* Worker side */
+    struct stream_page *page;
+    uint32_t seq;
+    uint32_t count;             /* records in page */
+    unsigned long prev;         /* last address in page */
+};
+
+/* WIRE_TYPE_* bits of a match. */
+static inline uint8_t
+stream_record_type(const struct match_object *obj)
+{
+    uint8_t type = 0;
+
+    if (obj->flags.i8)
+        type |= WIRE_TYPE_I8;
+    if (obj->flags.i16)
+        type |= WIRE_TYPE_I16;
+    if (obj->flags.i32)
+        type |= WIRE_TYPE_I32;
+    if (obj->flags.i64)
+        type |= WIRE_TYPE_I64;
+    if (obj->flags.f32)
+        type |= WIRE_TYPE_F32;
+    if (obj->flags.f64)
+        type |= WIRE_TYPE_F64;
+
+    return type;
+}
+
+extern int stream_init(struct stream *stream, uint32_t id, uint32_t target,
+                unsigned int credits);
+extern void stream_fini(struct stream *stream);
+
+extern int stream_write(struct stream *stream,
+                const struct match_object *objs, size_t count);
+extern int stream_end(struct stream *stream);
+
+extern void stream_grant(struct stream *stream, unsigned int credits);
+extern void stream_cancel(struct stream *stream);
+
+extern int stream_found(void *stream, const struct match_object *objs,
+                size_t count);
+
+#endif /* H_STREAM */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
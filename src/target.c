@@ -0,0 +1,146 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/list.h"
+
+#include "command.h"
+#include "export.h"
+#include "match.h"
+#include "pid_maps.h"
+#include "region.h"
+#include "target.h"
+#include "watch.h"
+
+/**
+ * @file target.c
+ *
+ * Per-process state kept by the daemon between commands.
+ */
+
+/**
+ * Create a target for a process.  Nothing is read from it yet.
+ *
+ * @param[in] pid - process id
+ *
+ * @return new target, freed with target_free()
+ * @return NULL on failure with error returned in errno
+ */
+struct target *
+target_new(pid_t pid)
+{
+    struct target *target;
+
+    if (pid <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    target = calloc(1, sizeof(*target));
+
+    if (target == NULL)
+        return NULL;
+
+    target->pid = pid;
+
+    list_head_init(&(target->node));
+    command_arena_init(&(target->arena));
+    region_list_init(&(target->regions));
+    match_list_init(&(target->matches));
+    export_init(&(target->export));
+    watch_set_init(&(target->watches));
+    watch_batch_init(&(target->batch));
+    watch_ring_init(&(target->ring));
+    list_head_init(&(target->subscribers));
+
+    target->generation = 1;
+
+    return target;
+}
+
+/**
+ * Free a target and its regions, matches and watches.
+ *
+ * @param target - target, its worker stopped and no subscribers left
+ */
+void
+target_free(struct target *target)
+{
+    if (target == NULL)
+        return;
+
+    /* Whatever a client still maps is stale now. */
+    export_retire(&(target->export), target->generation + 1);
+
+    match_list_clear(&(target->matches));
+    region_list_clear(&(target->regions));
+
+    watch_set_fini(&(target->watches));
+    watch_batch_fini(&(target->batch));
+    watch_ring_fini(&(target->ring));
+
+    command_arena_fini(&(target->arena));
+
+    free(target);
+}
+
+/**
+ * (Re)read the writable regions of a target.
+ *
+ * [vvar] and [vsyscall] are dropped; reading them fails or faults.
+ *
+ * @param target - target, on its worker thread
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+target_load_regions(struct target *target)
+{
+    struct list_head *next;
+    struct list_head *entry;
+    struct region_list regions;
+
+    if (process_pid_maps(target->pid, &regions) != 0)
+        return -1;
+
+    list_for_each_safe(entry, next, &(regions.head)) {
+        struct region *region = region_entry(entry);
+
+        if (strcmp(region->pathname, "[vvar]") == 0
+                || strcmp(region->pathname, "[vsyscall]") == 0) {
+            region_list_del(&regions, region);
+            free(region);
+        }
+    }
+
+    region_list_clear(&(target->regions));
+
+    /* Move the list over; the head itself cannot be copied. */
+    if (!region_list_is_empty(&regions))
+        list_replace(&(regions.head), &(target->regions.head));
+
+    target->regions.size = regions.size;
+    target->regions.next_id = regions.next_id;
+
+    target->loaded = 1;
+
+    return 0;
+}
+
+/**
+ * Note a change to the target's match list, retiring its export.
+ *
+ * @param target - target, on its worker thread
+ */
+void
+target_changed(struct target *target)
+{
+    target->generation++;
+    export_retire(&(target->export), target->generation);
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
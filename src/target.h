@@ -0,0 +1,75 @@
+#ifndef H_TARGET
+#define H_TARGET
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "shared/list.h"
+
+#include "command.h"
+#include "export.h"
+#include "match.h"
+#include "region.h"
+#include "watch.h"
+#include "worker.h"
+
+struct command_list;
+struct server;
+
+/* A process the daemon works on, with the state its commands share.
+ *
+ * Each target has its own worker thread.  Commands for the target run
+ * there one at a time, so the session state after the worker is only
+ * touched by that thread and is not locked. */
+struct target {
+    struct list_head node;      /* server thread only */
+
+    pid_t pid;
+
+    struct server *server;
+    int stopping;               /* server thread only */
+
+    struct worker worker;
+    struct work exit;           /* last item queued to the worker */
+
+    /* Command lines are tokenized here. */
+    struct command_arena arena;
+
+    /* Set by the detach command. */
+    int detached;
+
+    int loaded;
+    struct region_list regions;
+    struct match_list matches;
+
+    /* Bumped with target_changed() whenever matches changes. */
+    uint64_t generation;
+    struct export export;
+
+    struct watch_set watches;
+
+    /* Polling the watches for subscribers.  poll runs on the worker,
+     * filling batch, and comes back to the server thread, which owns
+     * the rest. */
+    struct work poll;
+    struct watch_batch batch;
+    int polling;
+    uint64_t next_poll;
+
+    struct watch_ring ring;
+    struct list_head subscribers;   /* struct server_sub */
+};
+
+extern struct target *target_new(pid_t pid);
+extern void target_free(struct target *target);
+
+extern int target_load_regions(struct target *target);
+extern void target_changed(struct target *target);
+
+/* target_cmds.c */
+extern int register_target_commands(struct command_list *list);
+
+#endif /* H_TARGET */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
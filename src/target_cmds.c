@@ -0,0 +1,843 @@
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared/list.h"
+#include "shared/util.h"
+
+#include "buffer.h"
+#include "command.h"
+#include "export.h"
+#include "match.h"
+#include "match_internal.h"
+#include "pid_mem.h"
+#include "region.h"
+#include "stream.h"
+#include "target.h"
+#include "watch.h"
+
+/**
+ * @file target_cmds.c
+ *
+ * Daemon commands working on the target named by a request.
+ *
+ * Handlers run on the target's worker thread and write their output
+ * as text lines to ctx->out.  search and list send their matches to
+ * ctx->stream instead when the client asked for a stream; export
+ * hands back a file descriptor in ctx->pass_fd.
+ */
+
+/* Bytes a single read or write command may move. */
+#define TARGET_IO_MAX   (1U << 20)
+
+/* Matches listed when no count is given. */
+#define TARGET_LIST_DEFAULT  (32)
+
+/* Matches "watch matches" adds when no count is given. */
+#define TARGET_WATCH_DEFAULT (1024)
+
+/* How long stop waits for the target to stop, in 1ms polls. */
+#define TARGET_STOP_POLLS    (1000)
+
+
+static int
+parse_ulong(const char *str, unsigned long *value)
+{
+    char *endptr = NULL;
+
+    errno = 0;
+    *value = strtoul(str, &endptr, 0);
+
+    if (errno != 0 || endptr == str || *endptr != '\0')
+        return -EINVAL;
+
+    return 0;
+}
+
+static int
+out_errno(int fallback)
+{
+    return (errno != 0) ? -errno : -fallback;
+}
+
+static int
+need_target(struct command_ctx *ctx)
+{
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (ctx->target->loaded)
+        return 0;
+
+    if (target_load_regions(ctx->target) != 0)
+        return out_errno(EIO);
+
+    return 0;
+}
+
+static int
+append_value(struct buffer *out, const struct match_object *obj)
+{
+    if (obj->flags.i64)
+        return buffer_printf(out, "%lld", (long long)obj->v.i64);
+
+    if (obj->flags.i32)
+        return buffer_printf(out, "%d", (int)obj->v.i32);
+
+    if (obj->flags.i16)
+        return buffer_printf(out, "%d", (int)obj->v.i16);
+
+    if (obj->flags.i8)
+        return buffer_printf(out, "%d", (int)obj->v.i8);
+
+    if (obj->flags.f64)
+        return buffer_printf(out, "%g", obj->v.f64);
+
+    if (obj->flags.f32)
+        return buffer_printf(out, "%g", (double)obj->v.f32);
+
+    return buffer_printf(out, "?");
+}
+
+
+static int
+cmd_ping(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (buffer_printf(ctx->out, "pong\n") != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_attach(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (target_load_regions(ctx->target) != 0)
+        return out_errno(EIO);
+
+    if (buffer_printf(ctx->out, "%zu regions\n",
+                ctx->target->regions.size) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_detach(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    match_list_clear(&(ctx->target->matches));
+    region_list_clear(&(ctx->target->regions));
+
+    ctx->target->loaded = 0;
+    ctx->target->detached = 1;
+
+    return 0;
+}
+
+static int
+cmd_regions(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err;
+    struct list_head *entry;
+
+    (void)argc;
+    (void)argv;
+
+    err = need_target(ctx);
+
+    if (err != 0)
+        return err;
+
+    list_for_each(entry, &(ctx->target->regions.head)) {
+        struct region *region = region_entry(entry);
+
+        if (buffer_printf(ctx->out, "%zu %lx-%lx %c%c%c%c %s\n",
+                    region->id, region->start, region->end,
+                    region->perms.read ? 'r' : '-',
+                    region->perms.write ? 'w' : '-',
+                    region->perms.exec ? 'x' : '-',
+                    region->perms.shared ? 's' : 'p',
+                    region->pathname) != 0)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int
+cmd_search(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err;
+    int options = SEARCH_OPT_ALIGNED;
+    struct match_needle needle;
+    struct match_progress local;
+    struct match_progress *progress = NULL;
+    struct target *target = ctx->target;
+
+    if (argc < 2 || argc > 3)
+        return -EINVAL;
+
+    if (argc == 3) {
+        if (strcmp(argv[2], "unaligned") == 0)
+            options = SEARCH_OPT_UNALIGNED;
+        else if (strcmp(argv[2], "aligned") != 0)
+            return -EINVAL;
+    }
+
+    err = need_target(ctx);
+
+    if (err != 0)
+        return err;
+
+    if (match_needle_init(&needle, argv[1]) != 0)
+        return out_errno(EINVAL);
+
+    match_list_clear(&(target->matches));
+
+    /* Matches go out while the search is still running. */
+    if (ctx->stream != NULL) {
+        progress = match_progress_current;
+
+        if (progress == NULL) {
+            memset(&local, 0, sizeof(local));
+            progress = &local;
+            match_progress_bind(progress);
+        }
+
+        progress->found = stream_found;
+        progress->found_arg = ctx->stream;
+    }
+
+    err = search_eq(target->pid, &(target->matches), &needle,
+                &(target->regions), options);
+
+    if (progress != NULL) {
+        progress->found = NULL;
+        progress->found_arg = NULL;
+
+        if (progress == &local)
+            match_progress_bind(NULL);
+    }
+
+    target_changed(target);
+
+    if (err != 0) {
+        err = out_errno(EIO);
+        match_list_clear(&(target->matches));
+        return err;
+    }
+
+    if (buffer_printf(ctx->out, "%zu\n",
+                match_list_count(&(target->matches))) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_filter(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err;
+    struct match_needle needle;
+    struct target *target = ctx->target;
+    struct match_list *list;
+    const char *op;
+
+    if (argc < 2 || argc > 3)
+        return -EINVAL;
+
+    if (target == NULL)
+        return -ESRCH;
+
+    op = argv[1];
+    list = &(target->matches);
+
+    if (argc == 3) {
+        if (match_needle_init(&needle, argv[2]) != 0)
+            return out_errno(EINVAL);
+
+        if (strcmp(op, "eq") == 0)
+            err = match_eq(target->pid, list, &needle);
+        else if (strcmp(op, "ne") == 0)
+            err = match_ne(target->pid, list, &needle);
+        else if (strcmp(op, "lt") == 0)
+            err = match_lt(target->pid, list, &needle);
+        else if (strcmp(op, "le") == 0)
+            err = match_le(target->pid, list, &needle);
+        else if (strcmp(op, "gt") == 0)
+            err = match_gt(target->pid, list, &needle);
+        else if (strcmp(op, "ge") == 0)
+            err = match_ge(target->pid, list, &needle);
+        else
+            return -EINVAL;
+    }
+    else {
+        if (strcmp(op, "changed") == 0)
+            err = match_changed(target->pid, list);
+        else if (strcmp(op, "unchanged") == 0)
+            err = match_unchanged(target->pid, list);
+        else if (strcmp(op, "increased") == 0)
+            err = match_increased(target->pid, list);
+        else if (strcmp(op, "decreased") == 0)
+            err = match_decreased(target->pid, list);
+        else
+            return -EINVAL;
+    }
+
+    /* Even a failed filter may have dropped some. */
+    target_changed(target);
+
+    if (err != 0)
+        return out_errno(EIO);
+
+    if (buffer_printf(ctx->out, "%zu\n", match_list_count(list)) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_snapshot(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err;
+    struct target *target = ctx->target;
+
+    (void)argv;
+
+    if (argc != 1)
+        return -EINVAL;
+
+    if (target == NULL)
+        return -ESRCH;
+
+    err = match_snapshot(target->pid, &(target->matches));
+    target_changed(target);
+
+    if (err != 0)
+        return out_errno(EIO);
+
+    if (buffer_printf(ctx->out, "%zu\n",
+                match_list_count(&(target->matches))) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_count(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (buffer_printf(ctx->out, "%zu\n",
+                match_list_count(&(ctx->target->matches))) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_list(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    unsigned long start = 0;
+    unsigned long count = TARGET_LIST_DEFAULT;
+    unsigned long index = 0;
+    struct list_head *entry;
+
+    if (argc > 3)
+        return -EINVAL;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (argc > 1 && parse_ulong(argv[1], &start) != 0)
+        return -EINVAL;
+
+    if (argc > 2 && parse_ulong(argv[2], &count) != 0)
+        return -EINVAL;
+
+    /* A stream has no reply to keep short. */
+    if (ctx->stream != NULL && argc < 3)
+        count = ULONG_MAX;
+
+    list_for_each(entry, &(ctx->target->matches.head)) {
+        unsigned long i;
+        struct match_chunk_header *chunk = match_chunk_entry(entry);
+
+        if (count == 0)
+            break;
+
+        /* Skip whole chunks before start. */
+        if (index + chunk->used <= start) {
+            index += chunk->used;
+            continue;
+        }
+
+        if (ctx->stream != NULL) {
+            unsigned long first = (index < start) ? start - index : 0;
+            unsigned long n = chunk->used - first;
+
+            if (n > count)
+                n = count;
+
+            if (stream_write(ctx->stream, &(chunk->objects[first]), n) != 0)
+                return out_errno(EIO);
+
+            index += chunk->used;
+            count -= n;
+            continue;
+        }
+
+        for (i = 0; i < chunk->used && count != 0; ++i, ++index) {
+            const struct match_object *obj = &(chunk->objects[i]);
+
+            if (index < start)
+                continue;
+
+            if (buffer_put_ulong(ctx->out, index) != 0
+                    || buffer_append(ctx->out, " ", 1) != 0
+                    || buffer_put_xlong(ctx->out, obj->addr) != 0
+                    || buffer_append(ctx->out, " ", 1) != 0
+                    || append_value(ctx->out, obj) != 0
+                    || buffer_append(ctx->out, "\n", 1) != 0)
+                return -ENOMEM;
+
+            count--;
+        }
+    }
+
+    return 0;
+}
+
+static int
+cmd_read(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err;
+    ssize_t got;
+    unsigned long addr;
+    unsigned long length;
+    unsigned char *bytes;
+
+    if (argc != 3)
+        return -EINVAL;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (parse_ulong(argv[1], &addr) != 0
+            || parse_ulong(argv[2], &length) != 0)
+        return -EINVAL;
+
+    if (length == 0 || length > TARGET_IO_MAX)
+        return -EINVAL;
+
+    bytes = malloc(length);
+
+    if (bytes == NULL)
+        return -ENOMEM;
+
+    got = read_pid_mem(ctx->target->pid, bytes, length, (off_t)addr);
+
+    if (got < 0) {
+        err = out_errno(EIO);
+        goto out;
+    }
+
+    err = 0;
+
+    if (buffer_put_hex(ctx->out, bytes, (size_t)got) != 0
+            || buffer_append(ctx->out, "\n", 1) != 0)
+        err = -ENOMEM;
+
+out:
+
+    free(bytes);
+
+    return err;
+}
+
+static int
+hex_nibble(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+
+    c = tolower(c);
+
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+
+    return -1;
+}
+
+static int
+cmd_write(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int err = 0;
+    size_t i;
+    size_t length;
+    ssize_t wrote;
+    unsigned long addr;
+    unsigned char *bytes;
+
+    if (argc != 3)
+        return -EINVAL;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (parse_ulong(argv[1], &addr) != 0)
+        return -EINVAL;
+
+    length = strlen(argv[2]);
+
+    if (length == 0 || (length % 2) != 0 || length / 2 > TARGET_IO_MAX)
+        return -EINVAL;
+
+    length /= 2;
+    bytes = malloc(length);
+
+    if (bytes == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < length; ++i) {
+        int hi = hex_nibble(argv[2][i * 2]);
+        int lo = hex_nibble(argv[2][(i * 2) + 1]);
+
+        if (hi < 0 || lo < 0) {
+            err = -EINVAL;
+            goto out;
+        }
+
+        bytes[i] = (unsigned char)((hi << 4) | lo);
+    }
+
+    wrote = write_pid_mem(ctx->target->pid, bytes, length, (off_t)addr);
+
+    if (wrote < 0)
+        err = out_errno(EIO);
+    else if ((size_t)wrote != length)
+        err = -EIO;
+
+out:
+
+    free(bytes);
+
+    return err;
+}
+
+static int
+cmd_reset(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    match_list_clear(&(ctx->target->matches));
+    target_changed(ctx->target);
+
+    return 0;
+}
+
+/* Returns the state letter from /proc/<pid>/stat, or 0. */
+static char
+target_state(pid_t pid)
+{
+    FILE *fp;
+    int ch;
+    char path[64];
+    char state = 0;
+
+    (void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+    fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return 0;
+
+    /* comm may hold anything, ')' included; the state follows the
+     * last one. */
+    while ((ch = fgetc(fp)) != EOF) {
+        if (ch == ')') {
+            if (fgetc(fp) == ' ')
+                state = (char)fgetc(fp);
+            else
+                state = 0;
+        }
+    }
+
+    fclose(fp);
+
+    return state;
+}
+
+static int
+cmd_stop(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    int i;
+    const struct timespec tick = { 0, 1000000 };
+
+    (void)argc;
+    (void)argv;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (kill(ctx->target->pid, SIGSTOP) != 0)
+        return out_errno(ESRCH);
+
+    /* SIGSTOP is asynchronous; writes after stop should not race the
+     * target. */
+    for (i = 0; i < TARGET_STOP_POLLS; ++i) {
+        char state = target_state(ctx->target->pid);
+
+        if (state == 'T' || state == 't')
+            return 0;
+
+        if (state == 0 || state == 'Z' || state == 'X')
+            return -ESRCH;
+
+        (void)nanosleep(&tick, NULL);
+    }
+
+    return -ETIMEDOUT;
+}
+
+static int
+cmd_cont(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (ctx->target == NULL)
+        return -ESRCH;
+
+    if (kill(ctx->target->pid, SIGCONT) != 0)
+        return out_errno(ESRCH);
+
+    return 0;
+}
+
+static int
+cmd_export(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    struct target *target = ctx->target;
+    struct export *export;
+
+    (void)argv;
+
+    if (argc != 1)
+        return -EINVAL;
+
+    if (target == NULL)
+        return -ESRCH;
+
+    export = &(target->export);
+
+    /* An unchanged list is passed again as it is. */
+    if (export->fd < 0 && export_create(export, target->pid,
+                target->generation, &(target->matches)) != 0)
+        return out_errno(ENOMEM);
+
+    /* The server closes its copy once sent; ours may be retired by
+     * then. */
+    ctx->pass_fd = fcntl(export->fd, F_DUPFD_CLOEXEC, 0);
+
+    if (ctx->pass_fd < 0)
+        return out_errno(EMFILE);
+
+    if (buffer_printf(ctx->out, "%llu %llu\n",
+                (unsigned long long)target->generation,
+                (unsigned long long)export->head->count) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+watch_print(struct buffer *out, const struct watch *watch)
+{
+    if (!watch->valid)
+        return buffer_printf(out, "%u 0x%lx %u -\n", watch->id,
+                    watch->addr, watch->size);
+
+    return buffer_printf(out, "%u 0x%lx %u %llu\n", watch->id, watch->addr,
+                watch->size, (unsigned long long)watch->value);
+}
+
+/* Watch up to count matches at the width of their widest type. */
+static int
+watch_matches(struct command_ctx *ctx, unsigned long count)
+{
+    unsigned long added = 0;
+    struct list_head *entry;
+    struct target *target = ctx->target;
+
+    list_for_each(entry, &(target->matches.head)) {
+        unsigned long i;
+        struct match_chunk_header *chunk = match_chunk_entry(entry);
+
+        for (i = 0; i < chunk->used && added < count; ++i, ++added) {
+            uint32_t id;
+            const struct match_object *obj = &(chunk->objects[i]);
+
+            if (watch_add(&(target->watches), obj->addr,
+                        (uint32_t)wire_type_width(stream_record_type(obj)),
+                        &id) != 0)
+                return out_errno(ENOMEM);
+        }
+    }
+
+    if (buffer_printf(ctx->out, "%lu\n", added) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int
+cmd_watch(struct command_ctx *ctx, size_t argc, char **argv)
+{
+    size_t i;
+    uint32_t id;
+    unsigned long addr;
+    unsigned long size;
+    struct target *target = ctx->target;
+
+    if (target == NULL)
+        return -ESRCH;
+
+    if (argc == 1) {
+        for (i = 0; i < target->watches.count; ++i) {
+            if (watch_print(ctx->out, &(target->watches.watches[i])) != 0)
+                return -ENOMEM;
+        }
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "add") == 0) {
+        if (argc != 4 || parse_ulong(argv[2], &addr) != 0
+                || parse_ulong(argv[3], &size) != 0 || size > 8)
+            return -EINVAL;
+
+        if (watch_add(&(target->watches), addr, (uint32_t)size, &id) != 0)
+            return out_errno(EINVAL);
+
+        if (buffer_printf(ctx->out, "%u\n", id) != 0)
+            return -ENOMEM;
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "del") == 0) {
+        if (argc != 3 || parse_ulong(argv[2], &addr) != 0
+                || addr > UINT32_MAX)
+            return -EINVAL;
+
+        if (watch_del(&(target->watches), (uint32_t)addr) != 0)
+            return -ENOENT;
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "clear") == 0 && argc == 2) {
+        watch_clear(&(target->watches));
+        return 0;
+    }
+
+    if (strcmp(argv[1], "matches") == 0 && argc <= 3) {
+        size = TARGET_WATCH_DEFAULT;
+
+        if (argc == 3 && parse_ulong(argv[2], &size) != 0)
+            return -EINVAL;
+
+        return watch_matches(ctx, size);
+    }
+
+    return -EINVAL;
+}
+
+
+static const struct {
+    const char *name;
+    command_fn_t handler;
+    const char *shortdoc;
+} target_commands[] = {
+    { "ping",    cmd_ping,    "ping" },
+    { "attach",  cmd_attach,  "attach - read the target's regions" },
+    { "detach",  cmd_detach,  "detach - drop the target and its matches" },
+    { "regions", cmd_regions, "regions - list writable regions" },
+    { "search",  cmd_search,  "search <value> [aligned|unaligned]" },
+    { "filter",  cmd_filter,  "filter <eq|ne|lt|le|gt|ge> <value> | "
+                              "filter <changed|unchanged|increased|decreased>" },
+    { "snapshot", cmd_snapshot, "snapshot - store the current values" },
+    { "count",   cmd_count,   "count - number of matches" },
+    { "list",    cmd_list,    "list [start [count]]" },
+    { "read",    cmd_read,    "read <addr> <length> - hex dump" },
+    { "write",   cmd_write,   "write <addr> <hex bytes>" },
+    { "reset",   cmd_reset,   "reset - drop the matches" },
+    { "stop",    cmd_stop,    "stop - stop the target with SIGSTOP" },
+    { "cont",    cmd_cont,    "cont - resume the target with SIGCONT" },
+    { "export",  cmd_export,  "export - pass the matches as a memfd" },
+    { "watch",   cmd_watch,   "watch [add <addr> <size> | del <id> | clear | "
+                              "matches [count]]" }
+};
+
+/**
+ * Register the target commands.
+ *
+ * @param list - command list
+ *
+ * @return 0 on success
+ * @return negative errno value on failure
+ */
+int
+register_target_commands(struct command_list *list)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZ(target_commands); ++i) {
+        int err;
+
+        err = register_command(list, target_commands[i].name,
+                    target_commands[i].handler,
+                    target_commands[i].shortdoc, NULL);
+
+        if (err != 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,468 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pid_mem.h"
+#include "watch.h"
+
+/**
+ * @file watch.c
+ *
+ * Values a client wants to hear about when they change.
+ *
+ * A target's worker polls its watch set, reading nearby watches with
+ * one pread(2) each, and hands back the changes it found.  The server
+ * thread appends them to the target's change ring.  Subscribers read
+ * the ring from their own cursors, so a change is stored once however
+ * many clients follow it.
+ *
+ * Collecting from a cursor coalesces: each watch is reported once,
+ * with its newest value.  A subscriber which falls behind, by rate
+ * limit or a full socket, gets only the last value of each watch when
+ * it catches up.
+ */
+
+#define WATCH_SEEN_SIZE  (2 * WATCH_RING_SIZE)
+
+
+static uint64_t
+value_load(const char *bytes, uint32_t size)
+{
+    union {
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+    } v;
+
+    memcpy(&v, bytes, size);
+
+    switch (size) {
+    case 1:
+        return v.u8;
+    case 2:
+        return v.u16;
+    case 4:
+        return v.u32;
+    default:
+        return v.u64;
+    }
+}
+
+static int
+batch_add(struct watch_batch *batch, const struct watch_change *change)
+{
+    if (batch->count == batch->alloc) {
+        size_t alloc = (batch->alloc == 0) ? 64 : batch->alloc * 2;
+        struct watch_change *tmp;
+
+        tmp = realloc(batch->changes, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        batch->changes = tmp;
+        batch->alloc = alloc;
+    }
+
+    batch->changes[batch->count++] = *change;
+
+    return 0;
+}
+
+/**
+ * Initialize an empty watch set.
+ *
+ * @param set - set to initialize
+ */
+void
+watch_set_init(struct watch_set *set)
+{
+    memset(set, 0, sizeof(*set));
+
+    set->next_id = 1;
+    set->mem_fd = -1;
+}
+
+/**
+ * Free a watch set.
+ *
+ * @param set - set
+ */
+void
+watch_set_fini(struct watch_set *set)
+{
+    if (set->mem_fd >= 0)
+        (void)close_pid_mem(set->mem_fd);
+
+    free(set->watches);
+    free(set->scratch);
+
+    watch_set_init(set);
+}
+
+/**
+ * Watch size bytes at addr.
+ *
+ * @param set - set
+ * @param[in] addr - address
+ * @param[in] size - 1, 2, 4 or 8
+ * @param[out] id - id of the new watch
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+watch_add(struct watch_set *set, unsigned long addr, uint32_t size,
+    uint32_t *id)
+{
+    size_t i;
+
+    if (size != 1 && size != 2 && size != 4 && size != 8) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (set->count == set->alloc) {
+        size_t alloc = (set->alloc == 0) ? 16 : set->alloc * 2;
+        struct watch *tmp;
+
+        tmp = realloc(set->watches, alloc * sizeof(*tmp));
+
+        if (tmp == NULL)
+            return -1;
+
+        set->watches = tmp;
+        set->alloc = alloc;
+    }
+
+    /* Kept sorted so a poll reads memory in order. */
+    for (i = set->count; i > 0 && set->watches[i - 1].addr > addr; --i)
+        set->watches[i] = set->watches[i - 1];
+
+    /* 0 is never a watch. */
+    if (set->next_id == 0)
+        set->next_id = 1;
+
+    memset(&(set->watches[i]), 0, sizeof(set->watches[i]));
+    set->watches[i].id = set->next_id++;
+    set->watches[i].size = size;
+    set->watches[i].addr = addr;
+
+    set->count++;
+
+    *id = set->watches[i].id;
+
+    return 0;
+}
+
+/**
+ * Stop watching a value.
+ *
+ * @param set - set
+ * @param[in] id - watch id
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+watch_del(struct watch_set *set, uint32_t id)
+{
+    size_t i;
+
+    for (i = 0; i < set->count; ++i) {
+        if (set->watches[i].id == id) {
+            memmove(&(set->watches[i]), &(set->watches[i + 1]),
+                (set->count - i - 1) * sizeof(set->watches[0]));
+            set->count--;
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+/**
+ * Drop every watch.
+ *
+ * @param set - set
+ */
+void
+watch_clear(struct watch_set *set)
+{
+    set->count = 0;
+}
+
+/**
+ * Read every watch and add those which changed to a batch.  A watch
+ * read for the first time counts as changed.  Watches which cannot be
+ * read are skipped.
+ *
+ * @param set - set, on the target's worker
+ * @param[in] pid - target
+ * @param batch - changes found are appended here
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+watch_poll(struct watch_set *set, pid_t pid, struct watch_batch *batch)
+{
+    size_t i;
+    size_t end;
+
+    if (set->count == 0)
+        return 0;
+
+    if (set->mem_fd < 0) {
+        set->mem_fd = open_pid_mem(pid, PID_MEM_FLAGS_READ);
+
+        if (set->mem_fd < 0)
+            return -1;
+    }
+
+    for (i = 0; i < set->count; i = end) {
+        size_t j;
+        ssize_t got;
+        unsigned long start = set->watches[i].addr;
+        unsigned long last = start + set->watches[i].size;
+
+        /* Gather the watches close enough to share a read. */
+        for (end = i + 1; end < set->count; ++end) {
+            const struct watch *next = &(set->watches[end]);
+
+            if (next->addr > last + WATCH_SPAN_GAP)
+                break;
+
+            if (next->addr + next->size > last)
+                last = next->addr + next->size;
+        }
+
+        if (last - start > set->scratch_alloc) {
+            char *tmp = realloc(set->scratch, last - start);
+
+            if (tmp == NULL)
+                return -1;
+
+            set->scratch = tmp;
+            set->scratch_alloc = last - start;
+        }
+
+        got = read_pid_mem_fd(set->mem_fd, set->scratch, last - start,
+                    (off_t)start);
+
+        for (j = i; j < end; ++j) {
+            uint64_t value;
+            struct watch_change change;
+            struct watch *watch = &(set->watches[j]);
+            size_t offset = watch->addr - start;
+
+            /* The span may cross into unmapped memory; try alone. */
+            if (got < 0 || offset + watch->size > (size_t)got) {
+                if (read_pid_mem_fd(set->mem_fd, set->scratch + offset,
+                            watch->size, (off_t)watch->addr)
+                        != (ssize_t)watch->size)
+                    continue;
+            }
+
+            value = value_load(set->scratch + offset, watch->size);
+
+            if (watch->valid && watch->value == value)
+                continue;
+
+            watch->value = value;
+            watch->valid = 1;
+
+            change.addr = watch->addr;
+            change.value = value;
+            change.id = watch->id;
+            change.size = watch->size;
+
+            if (batch_add(batch, &change) != 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Initialize an empty batch.
+ *
+ * @param batch - batch to initialize
+ */
+void
+watch_batch_init(struct watch_batch *batch)
+{
+    batch->changes = NULL;
+    batch->count = 0;
+    batch->alloc = 0;
+}
+
+/**
+ * Free a batch's changes.
+ *
+ * @param batch - batch
+ */
+void
+watch_batch_fini(struct watch_batch *batch)
+{
+    free(batch->changes);
+    watch_batch_init(batch);
+}
+
+/**
+ * Initialize an empty change ring.  Nothing is allocated until the
+ * first change.
+ *
+ * @param ring - ring to initialize
+ */
+void
+watch_ring_init(struct watch_ring *ring)
+{
+    ring->entries = NULL;
+    ring->head = 0;
+    ring->seen = NULL;
+    ring->mark = 0;
+}
+
+/**
+ * Free a change ring.
+ *
+ * @param ring - ring
+ */
+void
+watch_ring_fini(struct watch_ring *ring)
+{
+    free(ring->entries);
+    free(ring->seen);
+
+    watch_ring_init(ring);
+}
+
+/**
+ * Append changes to the ring, overwriting the oldest.
+ *
+ * @param ring - ring
+ * @param[in] changes - changes
+ * @param[in] count - number of changes
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+watch_ring_push(struct watch_ring *ring, const struct watch_change *changes,
+    size_t count)
+{
+    size_t i;
+
+    if (count == 0)
+        return 0;
+
+    if (ring->entries == NULL) {
+        ring->entries = malloc(WATCH_RING_SIZE * sizeof(*(ring->entries)));
+        ring->seen = calloc(WATCH_SEEN_SIZE, sizeof(*(ring->seen)));
+
+        if (ring->entries == NULL || ring->seen == NULL) {
+            watch_ring_fini(ring);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        ring->entries[ring->head % WATCH_RING_SIZE] = changes[i];
+        ring->head++;
+    }
+
+    return 0;
+}
+
+/* Returns 1 if id was already seen by this collect. */
+static int
+seen_test_and_set(struct watch_ring *ring, uint32_t id)
+{
+    size_t i = (id * 2654435761U) % WATCH_SEEN_SIZE;
+
+    for (;;) {
+        struct watch_seen *slot = &(ring->seen[i]);
+
+        if (slot->mark != ring->mark) {
+            slot->id = id;
+            slot->mark = ring->mark;
+            return 0;
+        }
+
+        if (slot->id == id)
+            return 1;
+
+        i = (i + 1) % WATCH_SEEN_SIZE;
+    }
+}
+
+/**
+ * Collect the changes after cursor, each watch once with its newest
+ * value, oldest first.
+ *
+ * @param ring - ring
+ * @param[in] cursor - seq of the first change not yet delivered
+ * @param out - changes are appended here
+ * @param[out] overrun - set if changes after cursor were overwritten
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+watch_ring_collect(struct watch_ring *ring, uint64_t cursor,
+    struct watch_batch *out, int *overrun)
+{
+    size_t lo;
+    size_t hi;
+    size_t first = out->count;
+    uint64_t seq;
+
+    *overrun = 0;
+
+    if (cursor >= ring->head)
+        return 0;
+
+    if (ring->head - cursor > WATCH_RING_SIZE) {
+        cursor = ring->head - WATCH_RING_SIZE;
+        *overrun = 1;
+    }
+
+    /* A new mark empties the seen table; 0 is what calloc left. */
+    if (++ring->mark == 0) {
+        memset(ring->seen, 0, WATCH_SEEN_SIZE * sizeof(*(ring->seen)));
+        ring->mark = 1;
+    }
+
+    /* Newest first, so the first change seen for a watch is its last. */
+    for (seq = ring->head; seq-- > cursor; ) {
+        const struct watch_change *change;
+
+        change = &(ring->entries[seq % WATCH_RING_SIZE]);
+
+        if (seen_test_and_set(ring, change->id))
+            continue;
+
+        if (batch_add(out, change) != 0)
+            return -1;
+    }
+
+    for (lo = first, hi = out->count; hi - lo > 1; ++lo, --hi) {
+        struct watch_change tmp = out->changes[lo];
+
+        out->changes[lo] = out->changes[hi - 1];
+        out->changes[hi - 1] = tmp;
+    }
+
+    return 0;
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,92 @@
+#ifndef H_WATCH
+#define H_WATCH
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Changes kept for subscribers.  Must be a power of two. */
+#define WATCH_RING_SIZE   (16384)
+
+/* Watches closer than this are read with one pread(2). */
+#define WATCH_SPAN_GAP    (256)
+
+/* One watched value. */
+struct watch {
+    uint32_t id;
+    uint32_t size;              /* 1, 2, 4 or 8 bytes */
+    unsigned long addr;
+    uint64_t value;
+    int valid;                  /* value has been read */
+};
+
+/* A target's watches, sorted by address.  Worker thread only. */
+struct watch_set {
+    struct watch *watches;
+    size_t count;
+    size_t alloc;
+    uint32_t next_id;
+
+    int mem_fd;                 /* opened by the first poll */
+    char *scratch;
+    size_t scratch_alloc;
+};
+
+struct watch_change {
+    uint64_t addr;
+    uint64_t value;
+    uint32_t id;
+    uint32_t size;
+};
+
+/* Changes found by one poll. */
+struct watch_batch {
+    struct watch_change *changes;
+    size_t count;
+    size_t alloc;
+};
+
+struct watch_seen {
+    uint32_t id;
+    uint32_t mark;
+};
+
+/* The last WATCH_RING_SIZE changes of a target, shared by all of its
+ * subscribers.  Each subscriber only keeps a cursor; entry seq lives
+ * at entries[seq % WATCH_RING_SIZE] while seq + WATCH_RING_SIZE >
+ * head.  Server thread only. */
+struct watch_ring {
+    struct watch_change *entries;
+    uint64_t head;              /* seq of the next change */
+
+    /* Ids seen by the current watch_ring_collect(). */
+    struct watch_seen *seen;
+    uint32_t mark;
+};
+
+extern void watch_set_init(struct watch_set *set);
+extern void watch_set_fini(struct watch_set *set);
+
+extern int watch_add(struct watch_set *set, unsigned long addr,
+                uint32_t size, uint32_t *id);
+extern int watch_del(struct watch_set *set, uint32_t id);
+extern void watch_clear(struct watch_set *set);
+
+extern int watch_poll(struct watch_set *set, pid_t pid,
+                struct watch_batch *batch);
+
+extern void watch_batch_init(struct watch_batch *batch);
+extern void watch_batch_fini(struct watch_batch *batch);
+
+extern void watch_ring_init(struct watch_ring *ring);
+extern void watch_ring_fini(struct watch_ring *ring);
+
+extern int watch_ring_push(struct watch_ring *ring,
+                const struct watch_change *changes, size_t count);
+extern int watch_ring_collect(struct watch_ring *ring, uint64_t cursor,
+                struct watch_batch *out, int *overrun);
+
+#endif /* H_WATCH */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,249 @@
+#ifndef H_WIRE
+#define H_WIRE
+
+#include <stdint.h>
+
+/* Daemon protocol.
+ *
+ * Every message in either direction is a frame: a wire_header followed
+ * by length bytes of payload.  Fields are in host byte order; the
+ * daemon only listens on a unix socket.
+ *
+ * A client sends WIRE_COMMAND frames holding one command line (no NUL
+ * needed).  target is the process the command works on, 0 for none.
+ * Each command gets exactly one WIRE_REPLY with the same id, which
+ * starts with a wire_reply.  Replies may come back in any order.
+ *
+ * A command sent with WIRE_FLAG_JOB runs as a background job on its
+ * target: the reply comes at once and reads "job <id>".  The job is
+ * then polled and fetched with the "job" command (target 0).  With
+ * WIRE_FLAG_EVENTS as well, the daemon pushes WIRE_EVENT frames with
+ * the command's id: progress while the job runs, then a final event
+ * carrying the result, after which the job is gone.
+ *
+ * A search or list sent with WIRE_FLAG_STREAM (not as a job) sends its
+ * matches as WIRE_STREAM frames with the command's id while it runs; a
+ * list with no count sends them all.  Any streamed command sends a
+ * frame flagged WIRE_STREAM_LAST, possibly empty, and then its reply.
+ * Each frame is a wire_stream and then count records:
+ *
+ *   type   1 byte, WIRE_TYPE_* bits of the match
+ *   delta  zigzag LEB128 varint, address minus the previous record's
+ *          (0 for the first record of a frame)
+ *   value  little endian, 8 bytes for i64/f64 matches, 4 for i32/f32,
+ *          2 for i16, else 1
+ *
+ * A stream may send STREAM_DEFAULT_CREDITS frames unasked; after that
+ * each frame needs a credit, granted with a WIRE_CREDIT frame carrying
+ * the stream's id and a uint32_t count.
+ *
+ * A command sent with WIRE_FLAG_BATCH holds a script instead: lines
+ * separated by '\n', with variables and loops (see exec_script()).
+ * The whole script runs on the target's worker and gets one reply
+ * holding the output of every line.  The script stops at the first
+ * line which fails; the reply then ends with "! <line> <status>" and
+ * carries that status.  It combines with WIRE_FLAG_JOB and
+ * WIRE_FLAG_STREAM.
+ *
+ * A reply flagged WIRE_REPLY_FD comes with a file descriptor, passed
+ * as SCM_RIGHTS along with the first byte of its header.  Clients must
+ * read with room for one fd of ancillary data, or the kernel drops it.
+ * The export command passes the match list this way: a sealed memfd
+ * holding a wire_export and count wire_export_records.
+ *
+ * A WIRE_SUBSCRIBE frame, carrying a wire_subscribe, subscribes the
+ * connection to changes of its target's watches (see the watch
+ * command) and is answered with a WIRE_REPLY.  The daemon then polls
+ * the watches and pushes WIRE_CHANGES frames with the subscription's
+ * id, at most one per interval_ms.  Each holds a wire_changes and
+ * count wire_change records, one per watch with its newest value;
+ * values which changed again before delivery are not sent.
+ */
+
+#define WIRE_MAX_PAYLOAD  (16U << 20)
+
+enum wire_type {
+    WIRE_COMMAND = 1,
+    WIRE_REPLY   = 2,
+    WIRE_EVENT   = 3,
+    WIRE_STREAM  = 4,
+    WIRE_CREDIT  = 5,
+    WIRE_SUBSCRIBE = 6,
+    WIRE_CHANGES = 7
+};
+
+/* wire_header.flags of a WIRE_COMMAND */
+#define WIRE_FLAG_JOB     (0x0001)
+#define WIRE_FLAG_EVENTS  (0x0002)
+#define WIRE_FLAG_STREAM  (0x0004)
+#define WIRE_FLAG_BATCH   (0x0008)
+
+struct wire_header {
+    uint32_t length;    /* payload bytes */
+    uint16_t type;      /* enum wire_type */
+    uint16_t flags;
+    uint32_t id;        /* chosen by the client, echoed in the reply */
+    uint32_t target;    /* pid */
+};
+
+/* wire_header.flags of a WIRE_REPLY */
+#define WIRE_REPLY_FD     (0x0001)
+
+/* Start of a WIRE_REPLY payload; text output follows. */
+struct wire_reply {
+    int32_t status;     /* 0 or a negative errno value */
+};
+
+/* Start of a WIRE_EVENT payload.  The final event of a job has
+ * WIRE_EVENT_FINAL set and the job's text output follows. */
+#define WIRE_EVENT_FINAL  (0x0001)
+
+struct wire_event {
+    uint32_t job;
+    uint16_t state;     /* enum job_state */
+    uint16_t flags;
+    int32_t status;     /* final events only */
+    uint32_t reserved;
+    uint64_t done;
+    uint64_t total;
+};
+
+/* Start of an exported match list.  The records never change.  The
+ * daemon sets current to the target's generation when its match list
+ * changes; once it differs from generation the export is stale. */
+#define WIRE_EXPORT_MAGIC    (0x584d4557)   /* "WEMX" */
+#define WIRE_EXPORT_VERSION  (1)
+
+struct wire_export {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t pid;
+    uint32_t reserved;
+    uint64_t generation;    /* of the records */
+    uint64_t current;       /* read with an atomic load */
+    uint64_t count;
+    uint64_t offset;        /* of the first record */
+    uint64_t reserved2[2];
+};
+
+struct wire_export_record {
+    uint64_t addr;
+    uint64_t value;         /* as in stream records, zero extended */
+    uint8_t type;           /* WIRE_TYPE_* */
+    uint8_t reserved[7];
+};
+
+/* Payload of a WIRE_SUBSCRIBE */
+#define WIRE_SUBSCRIBE_OFF   (0x0001)
+
+struct wire_subscribe {
+    uint32_t interval_ms;   /* least time between WIRE_CHANGES frames */
+    uint32_t flags;
+};
+
+/* Start of a WIRE_CHANGES payload.  WIRE_CHANGES_OVERRUN is set if
+ * changes were dropped before the subscriber read them; "watch" lists
+ * every value. */
+#define WIRE_CHANGES_OVERRUN (0x0001)
+
+struct wire_changes {
+    uint64_t seq;           /* changes seen so far on the target */
+    uint32_t count;
+    uint16_t flags;
+    uint16_t reserved;
+};
+
+struct wire_change {
+    uint64_t addr;
+    uint64_t value;         /* zero extended */
+    uint32_t watch;
+    uint32_t size;
+};
+
+/* Start of a WIRE_STREAM payload. */
+#define WIRE_STREAM_LAST  (0x0001)
+
+struct wire_stream {
+    uint32_t seq;       /* frame number, from 0 */
+    uint32_t count;     /* records */
+    uint16_t flags;
+    uint16_t reserved;
+    uint32_t reserved2;
+};
+
+/* Stream record type bits */
+#define WIRE_TYPE_I8   (0x01)
+#define WIRE_TYPE_I16  (0x02)
+#define WIRE_TYPE_I32  (0x04)
+#define WIRE_TYPE_I64  (0x08)
+#define WIRE_TYPE_F32  (0x10)
+#define WIRE_TYPE_F64  (0x20)
+
+/* Longest encoded record. */
+#define WIRE_RECORD_MAX  (1 + 10 + 8)
+
+static inline size_t
+wire_type_width(uint8_t type)
+{
+    if (type & (WIRE_TYPE_I64 | WIRE_TYPE_F64))
+        return 8;
+
+    if (type & (WIRE_TYPE_I32 | WIRE_TYPE_F32))
+        return 4;
+
+    if (type & WIRE_TYPE_I16)
+        return 2;
+
+    return 1;
+}
+
+/* Decode the record at *pos, advancing it.  *addr holds the previous
+ * address (0 at the start of a frame) and is updated.  Returns 0, or
+ * -1 if the record runs past end. */
+static inline int
+wire_record_decode(const uint8_t **pos, const uint8_t *end,
+    uint64_t *addr, uint8_t *type, uint64_t *value)
+{
+    size_t i;
+    size_t width;
+    unsigned int shift = 0;
+    uint64_t zz = 0;
+    const uint8_t *p = *pos;
+
+    if (p >= end)
+        return -1;
+
+    *type = *p++;
+
+    for (;;) {
+        if (p >= end || shift > 63)
+            return -1;
+
+        zz |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+
+        if ((*p++ & 0x80) == 0)
+            break;
+    }
+
+    *addr += (zz >> 1) ^ (0 - (zz & 1));
+
+    width = wire_type_width(*type);
+
+    if ((size_t)(end - p) < width)
+        return -1;
+
+    *value = 0;
+
+    for (i = 0; i < width; ++i)
+        *value |= (uint64_t)p[i] << (8 * i);
+
+    *pos = p + width;
+
+    return 0;
+}
+
+#endif /* H_WIRE */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mpsc.h"
+#include "worker.h"
+
+/**
+ * @file worker.c
+ *
+ * Single thread fed by a lock-free queue.
+ *
+ * Any thread may queue work; the worker runs it in queue order.  The
+ * only shared state is the MPSC queue and a semaphore counting the
+ * queued items, so submitting never takes a lock.
+ */
+
+static struct work *
+worker_take(struct worker *worker)
+{
+    struct mpsc_node *node;
+
+    while (sem_wait(&(worker->ready)) != 0)
+        ; /* EINTR */
+
+    /* An item is queued; the pop only fails while its push is
+     * finishing. */
+    while ((node = mpsc_pop(&(worker->queue))) == NULL)
+        sched_yield();
+
+    return work_entry(node, struct work, node);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *worker = arg;
+
+    for (;;) {
+        int last;
+        struct work *work = worker_take(worker);
+
+        /* fn may free or requeue the item. */
+        last = work->last;
+        work->fn(work);
+
+        if (last)
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Start a worker thread.
+ *
+ * The thread blocks every signal; signals are left to the thread
+ * which called this.
+ *
+ * @param worker - worker to initialize
+ *
+ * @return 0 on success
+ * @return not 0 on failure with error returned in errno
+ */
+int
+worker_start(struct worker *worker)
+{
+    int err;
+    sigset_t all;
+    sigset_t old;
+
+    memset(worker, 0, sizeof(*worker));
+    mpsc_init(&(worker->queue));
+
+    if (sem_init(&(worker->ready), 0, 0) != 0)
+        return -1;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    err = pthread_create(&(worker->thread), NULL, worker_main, worker);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        sem_destroy(&(worker->ready));
+        errno = err;
+        return -1;
+    }
+
+    worker->started = 1;
+
+    return 0;
+}
+
+/**
+ * Wait for a worker to finish its last item.
+ *
+ * @param worker - worker given a worker_submit_last() item
+ */
+void
+worker_join(struct worker *worker)
+{
+    if (!worker->started)
+        return;
+
+    pthread_join(worker->thread, NULL);
+    sem_destroy(&(worker->ready));
+
+    worker->started = 0;
+}
+
+/**
+ * Queue a work item.
+ *
+ * @param worker - worker
+ * @param work - work item, owned by fn from now on
+ * @param[in] fn - function to run on the worker thread
+ */
+void
+worker_submit(struct worker *worker, struct work *work, work_fn_t fn)
+{
+    work->fn = fn;
+    work->last = 0;
+
+    mpsc_push(&(worker->queue), &(work->node));
+    sem_post(&(worker->ready));
+}
+
+/**
+ * Queue the final work item; the thread exits after running it.
+ *
+ * @param worker - worker
+ * @param work - work item, owned by fn from now on
+ * @param[in] fn - function to run on the worker thread
+ */
+void
+worker_submit_last(struct worker *worker, struct work *work, work_fn_t fn)
+{
+    work->fn = fn;
+    work->last = 1;
+
+    mpsc_push(&(worker->queue), &(work->node));
+    sem_post(&(worker->ready));
+}
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */
@@ -0,0 +1,41 @@
+#ifndef H_WORKER
+#define H_WORKER
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+
+#include "mpsc.h"
+
+struct work;
+typedef void (*work_fn_t)(struct work *);
+
+/* Embedded in whatever the work item carries. */
+struct work {
+    struct mpsc_node node;
+    work_fn_t fn;
+    int last;
+};
+
+#define work_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* A thread running the work queued to it, in order. */
+struct worker {
+    pthread_t thread;
+    sem_t ready;                /* one post per queued item */
+    struct mpsc_queue queue;
+    int started;
+};
+
+extern int worker_start(struct worker *worker);
+extern void worker_join(struct worker *worker);
+
+extern void worker_submit(struct worker *worker, struct work *work,
+                work_fn_t fn);
+extern void worker_submit_last(struct worker *worker, struct work *work,
+                work_fn_t fn);
+
+#endif /* H_WORKER */
+
+/* vim: set et ts=4 sts=4 sw=4 syntax=c : */